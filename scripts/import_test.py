@@ -37,11 +37,14 @@ def test_imports():
     # Math ops.
     _ = tfq.math.inner_product
     _ = tfq.math.fidelity
+    _ = tfq.math.gram_matrix
 
     # Noisy simulation ops.
     _ = tfq.noise.expectation
     _ = tfq.noise.sampled_expectation
     _ = tfq.noise.samples
+    _ = tfq.noise.samples_packed
+    _ = tfq.noise.sample_counts
 
     # Util functions.
     _ = tfq.convert_to_tensor
@@ -131,8 +131,14 @@ def get_expectation_op(
     if op is not None:
         if quantum_concurrent is True:
             # Return an op that does not block graph level parallelism.
-            return lambda programs, symbol_names, symbol_values, pauli_sums: \
-                op(programs, symbol_names, symbol_values, pauli_sums)
+            def concurrent_op(programs, symbol_names, symbol_values,
+                              pauli_sums):
+                return op(programs, symbol_names, symbol_values, pauli_sums)
+
+            # Allows tfq.differentiators.Adjoint to swap in the fused
+            # expectation and Jacobian op, which runs the same simulator.
+            concurrent_op.native_simulator = backend is None
+            return concurrent_op
 
         # Return an op that does block graph level parallelism.
         return lambda programs, symbol_names, symbol_values, pauli_sums: \
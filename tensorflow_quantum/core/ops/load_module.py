@@ -14,12 +14,81 @@
 # ==============================================================================
 """Module to load python op libraries."""
 
+import ctypes
 import os
 from distutils.sysconfig import get_python_lib
 
 from tensorflow.python.framework import load_library
 from tensorflow.python.platform import resource_loader
 
+# Names of tfq::SimdBackend (see core/src/cpu_features.h) by value.
+_SIMD_BACKENDS = ("basic", "sse4", "avx2", "avx512")
+
+# Builds of the simulation op libraries next to the default one (see
+# tfq_simd.bzl), widest first.
+_SIMD_VARIANTS = ("avx512", "avx2")
+
+_active_simd_backend = None
+
+
+def _candidate_paths(name):
+    """Paths that the op library `name` may be found at, in order."""
+    return [
+        resource_loader.get_path_to_datafile(name),
+        os.path.join(get_python_lib(), "tensorflow_quantum/core/ops", name)
+    ]
+
+
+def get_simd_backend():
+    """Returns the widest SIMD backend that the op libraries may use.
+
+    This is what the CPU supports, or the value of the environment variable
+    TFQ_SIMD_BACKEND ("sse4", "avx2" or "avx512") if that is narrower.
+    Setting the variable before TensorFlow Quantum is imported makes it
+    possible to benchmark the narrower backends on one machine. "basic" is
+    only returned for CPUs without SSE4.1, since there is no build of the op
+    libraries without it next to the default one.
+
+    Returns:
+        One of "basic", "sse4", "avx2" or "avx512".
+
+    Raises:
+        ValueError: If TFQ_SIMD_BACKEND is set to "basic".
+    """
+    global _active_simd_backend
+    if _active_simd_backend is None:
+        if os.environ.get("TFQ_SIMD_BACKEND") == "basic":
+            raise ValueError(
+                "TFQ_SIMD_BACKEND=basic is not supported: the op libraries "
+                "are not built without SSE4.1. Use \"sse4\" for the "
+                "narrowest build.")
+        _active_simd_backend = "basic"
+        for path in _candidate_paths("_tfq_cpu_features.so"):
+            try:
+                library = ctypes.CDLL(path)
+            except OSError:
+                continue
+            level = library.TfqActiveSimdBackend()
+            if 0 <= level < len(_SIMD_BACKENDS):
+                _active_simd_backend = _SIMD_BACKENDS[level]
+            break
+    return _active_simd_backend
+
+
+def _simd_variant_path(name):
+    """Path of the widest build of `name` that this process may run."""
+    if not name.endswith(".so"):
+        return None
+    active = _SIMD_BACKENDS.index(get_simd_backend())
+    for variant in _SIMD_VARIANTS:
+        if _SIMD_BACKENDS.index(variant) > active:
+            continue
+        variant_name = "{}_{}.so".format(name[:-len(".so")], variant)
+        for path in _candidate_paths(variant_name):
+            if os.path.exists(path):
+                return path
+    return None
+
 
 def load_module(name):
     """Loads the module with the given name.
@@ -28,6 +97,10 @@ def load_module(name):
     using Bazel. If that fails, then it attempts to load the module as though
     it was installed in site-packages via PIP.
 
+    Op libraries that are built for several instruction sets are loaded in the
+    widest build that `get_simd_backend` allows. Only one build of a library
+    may be loaded per process since they all register the same ops.
+
     Args:
         name: The name of the module, e.g. "_tfq_simulate_ops.so"
 
@@ -37,6 +110,9 @@ def load_module(name):
     Raises:
         RuntimeError: If the library cannot be found.
     """
+    variant_path = _simd_variant_path(name)
+    if variant_path is not None:
+        return load_library.load_op_library(variant_path)
     try:
         path = resource_loader.get_path_to_datafile(name)
         return load_library.load_op_library(path)
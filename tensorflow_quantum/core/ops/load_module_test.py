@@ -0,0 +1,58 @@
+# Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ==============================================================================
+"""Tests for load_module."""
+import os
+from unittest import mock
+
+import tensorflow as tf
+
+from tensorflow_quantum.core.ops import load_module
+
+
+class LoadModuleTest(tf.test.TestCase):
+    """Tests the selection of SIMD builds of the op libraries."""
+
+    def test_get_simd_backend(self):
+        """The backend is one that the op libraries know about."""
+        self.assertIn(load_module.get_simd_backend(),
+                      ["basic", "sse4", "avx2", "avx512"])
+
+    def test_basic_backend_rejected(self):
+        """There is no basic build that TFQ_SIMD_BACKEND could select."""
+        with mock.patch.dict(os.environ, {"TFQ_SIMD_BACKEND": "basic"}), \
+                mock.patch.object(load_module, "_active_simd_backend", None):
+            with self.assertRaisesRegex(ValueError, "basic"):
+                load_module.get_simd_backend()
+
+    def test_simd_variant_path(self):
+        """The widest build that the backend allows is picked."""
+        backend = load_module.get_simd_backend()
+        path = load_module._simd_variant_path("_tfq_simulate_ops.so")
+        if backend in ("avx2", "avx512"):
+            self.assertIsNotNone(path)
+            self.assertTrue(os.path.exists(path))
+            self.assertTrue(path.endswith("_{}.so".format(backend)))
+        else:
+            self.assertIsNone(path)
+        self.assertIsNone(load_module._simd_variant_path("no_extension"))
+
+    def test_load_module(self):
+        """The op library that is picked registers its ops."""
+        module = load_module.load_module("_tfq_simulate_ops.so")
+        self.assertTrue(hasattr(module, "tfq_simulate_state"))
+
+
+if __name__ == "__main__":
+    tf.test.main()
@@ -16,3 +16,4 @@
 
 from tensorflow_quantum.core.ops.math_ops.inner_product_op import inner_product
 from tensorflow_quantum.core.ops.math_ops.fidelity_op import fidelity
+from tensorflow_quantum.core.ops.math_ops.gram_matrix_op import gram_matrix
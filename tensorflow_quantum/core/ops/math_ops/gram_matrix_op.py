@@ -0,0 +1,74 @@
+# Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ==============================================================================
+"""Module for tfq.math.gram_matrix op."""
+import tensorflow as tf
+from tensorflow_quantum.core.ops.math_ops.inner_product_op import \
+    MATH_OP_MODULE
+
+
+def gram_matrix(programs, symbol_names, symbol_values):
+    """Calculate the inner products between all pairs of circuits in a batch.
+
+    Computes the Gram matrix of the states prepared by a batch of circuits,
+    as used by quantum kernel methods. Every circuit is simulated once, so a
+    batch of N circuits needs N simulations and N * (N + 1) / 2 inner
+    products instead of the N^2 simulations of `tfq.math.inner_product`
+    with every circuit paired against every other one.
+
+    Calculates out[i][j] = $ \langle \psi_{\text{programs[i]}} \\
+     (\text{symbol\_values[i]}) | \psi_{\text{programs[j]}} \\
+     (\text{symbol\_values[j]}) \rangle $
+
+
+    >>> symbols = sympy.symbols('alpha beta')
+    >>> qubits = cirq.GridQubit.rect(1, 2)
+    >>> circuits = [
+    ...     cirq.Circuit(
+    ...         cirq.X(qubits[0]) ** symbols[0],
+    ...         cirq.Y(qubits[1]) ** symbols[1])
+    ... ] * 2
+    >>> circuit_tensor = tfq.convert_to_tensor(circuits)
+    >>> symbol_tensor = tf.convert_to_tensor([s.name for s in symbols])
+    >>> values_tensor = tf.convert_to_tensor([[0.0, 0.0], [1.0, 0.0]])
+    >>> tfq.math.gram_matrix(circuit_tensor, symbol_tensor, values_tensor)
+    tf.Tensor(
+        [[1.+0.j, 0.+0.j],
+         [0.+0.j, 1.+0.j]], shape=(2, 2), dtype=complex64)
+
+
+    Note: all non-empty circuits in `programs` must act on the same qubits.
+        Empty circuits prepare the all zeros state on these qubits.
+
+    Note: this op is not differentiable.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specificed by programs, following the ordering
+            dictated by `symbol_names`.
+    Returns:
+        `tf.Tensor` with shape [batch_size, batch_size] where `out[i][j]` is
+            equal to the inner product of `programs[i]` with
+            `symbol_values[i]` resolved in and `programs[j]` with
+            `symbol_values[j]` resolved in.
+    """
+    return MATH_OP_MODULE.tfq_gram_matrix(programs, symbol_names,
+                                          tf.cast(symbol_values, tf.float32))
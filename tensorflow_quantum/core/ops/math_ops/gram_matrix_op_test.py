@@ -0,0 +1,145 @@
+# Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ==============================================================================
+"""Tests that specifically target tfq_gram_matrix."""
+import numpy as np
+from absl.testing import parameterized
+import tensorflow as tf
+import cirq
+
+from tensorflow_quantum.core.ops.math_ops import gram_matrix_op
+from tensorflow_quantum.python import util
+
+
+class GramMatrixTest(tf.test.TestCase, parameterized.TestCase):
+    """Tests tfq_gram_matrix."""
+
+    def test_gram_matrix_inputs(self):
+        """Makes sure that gram_matrix fails gracefully on bad inputs."""
+        n_qubits = 5
+        batch_size = 5
+        symbol_names = ['alpha']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'programs must be rank 1'):
+            # Circuit tensor has too many dimensions.
+            gram_matrix_op.gram_matrix(util.convert_to_tensor([circuit_batch]),
+                                       symbol_names, symbol_values_array)
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'symbol_values must be rank 2.'):
+            # symbol_values_array tensor has too few dimensions.
+            gram_matrix_op.gram_matrix(util.convert_to_tensor(circuit_batch),
+                                       symbol_names, symbol_values_array[0])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'do not match'):
+            # batch programs has wrong batch size.
+            gram_matrix_op.gram_matrix(
+                util.convert_to_tensor(circuit_batch[:-1]), symbol_names,
+                symbol_values_array)
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'same qubits'):
+            # programs act on different qubits.
+            other_circuit = cirq.Circuit(
+                cirq.X.on_each(cirq.GridQubit.rect(1, n_qubits + 1)))
+            gram_matrix_op.gram_matrix(
+                util.convert_to_tensor(circuit_batch[:-1] + [other_circuit]),
+                symbol_names, symbol_values_array)
+
+    @parameterized.parameters([
+        {
+            'n_qubits': 5,
+            'batch_size': 1
+        },
+        {
+            'n_qubits': 5,
+            'batch_size': 10
+        },
+        {
+            'n_qubits': 12,
+            'batch_size': 3
+        },
+    ])
+    def test_correctness_with_symbols(self, n_qubits, batch_size):
+        """Tests that gram_matrix works with symbols."""
+        symbol_names = ['alpha', 'beta', 'gamma']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+        # Make sure that every circuit acts on all of the qubits.
+        circuit_batch = [
+            circuit + cirq.Circuit(cirq.I.on_each(qubits))
+            for circuit in circuit_batch
+        ]
+
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+
+        out = gram_matrix_op.gram_matrix(
+            util.convert_to_tensor(circuit_batch),
+            tf.convert_to_tensor(symbol_names, dtype=tf.dtypes.string),
+            tf.convert_to_tensor(symbol_values_array))
+
+        wfs = [
+            cirq.final_state_vector(
+                cirq.resolve_parameters(circuit, resolver),
+                qubit_order=qubits)
+            for circuit, resolver in zip(circuit_batch, resolver_batch)
+        ]
+        out_arr = np.array([[np.vdot(a, b) for b in wfs] for a in wfs])
+        self.assertAllClose(out, out_arr, atol=1e-5)
+
+    def test_correctness_empty(self):
+        """Tests the gram matrix with empty circuits."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        circuit = cirq.Circuit(cirq.H.on_each(qubits))
+        empty_symbols = tf.convert_to_tensor([], dtype=tf.dtypes.string)
+
+        out = gram_matrix_op.gram_matrix(
+            util.convert_to_tensor([cirq.Circuit(), circuit]), empty_symbols,
+            tf.convert_to_tensor([[], []]))
+        self.assertAllClose(out, [[1, 0.5], [0.5, 1]], atol=1e-5)
+
+        out = gram_matrix_op.gram_matrix(
+            util.convert_to_tensor([cirq.Circuit()] * 2), empty_symbols,
+            tf.convert_to_tensor([[], []]))
+        self.assertAllClose(out, np.ones((2, 2)), atol=1e-5)
+
+    def test_correctness_no_circuit(self):
+        """Test the gram matrix between no circuits."""
+        empty_circuit = tf.raw_ops.Empty(shape=(0,), dtype=tf.string)
+        empty_symbols = tf.raw_ops.Empty(shape=(0,), dtype=tf.string)
+        empty_values = tf.raw_ops.Empty(shape=(0, 0), dtype=tf.float32)
+
+        out = gram_matrix_op.gram_matrix(empty_circuit, empty_symbols,
+                                         empty_values)
+        self.assertShapeEqual(np.zeros((0, 0)), out)
+
+
+if __name__ == "__main__":
+    tf.test.main()
@@ -335,6 +335,49 @@ class InnerProductAdjGradTest(tf.test.TestCase, parameterized.TestCase):
                                                  symbol_values, other_programs,
                                                  prev_grad)
 
+    def test_cached_other_states(self):
+        """Tests repeated calls that reuse the cached other_programs states."""
+        symbol_names = ['alpha', 'beta', 'gamma']
+        batch_size = 4
+        inner_dim_size = 3
+        circuit_batch = []
+        other_batch = []
+        resolver_batch = []
+        # Rows of different sizes share the worker states of the largest.
+        for n_qubits in [2, 5, 3, 5]:
+            qubits = cirq.LineQubit.range(n_qubits)
+            circuits, resolvers = util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, 1)
+            circuit_batch += circuits
+            resolver_batch += resolvers
+            other_batch.append(
+                util.random_circuit_resolver_batch(qubits, inner_dim_size)[0])
+
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+        programs = util.convert_to_tensor(circuit_batch)
+        other_programs = util.convert_to_tensor(other_batch)
+        prev_grad = tf.cast(tf.random.normal((batch_size, inner_dim_size)),
+                            tf.complex64)
+
+        first = inner_product_op._inner_product_grad(programs, symbol_names,
+                                                     symbol_values_array,
+                                                     other_programs, prev_grad)
+        second = inner_product_op._inner_product_grad(programs, symbol_names,
+                                                      symbol_values_array,
+                                                      other_programs,
+                                                      prev_grad)
+        self.assertAllClose(first, second, atol=1e-5)
+
+        # Every row on its own, with states of exactly its size.
+        for i in range(batch_size):
+            row = inner_product_op._inner_product_grad(
+                programs[i:i + 1], symbol_names, symbol_values_array[i:i + 1],
+                other_programs[i:i + 1], prev_grad[i:i + 1])
+            self.assertAllClose(row, second[i:i + 1], atol=1e-5)
+
     def test_correctness_empty(self):
         """Tests the inner product adj grad between two empty circuits."""
         symbol_names = ['alpha', 'beta']
@@ -344,6 +344,43 @@ class InnerProductTest(tf.test.TestCase, parameterized.TestCase):
             inner_product_op.inner_product(non_empty_circuit, empty_symbols,
                                            empty_values, other_program)
 
+    def test_correctness_shared_gates(self):
+        """Tests other_programs that start and end with the same gates."""
+        n_qubits = 5
+        batch_size = 3
+        inner_dim_size = 4
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, _ = util.random_circuit_resolver_batch(
+            qubits, batch_size)
+        head, _ = util.random_circuit_resolver_batch(qubits, batch_size)
+        tail, _ = util.random_circuit_resolver_batch(qubits, batch_size)
+        middle = [
+            util.random_circuit_resolver_batch(qubits, inner_dim_size)[0]
+            for i in range(batch_size)
+        ]
+        other_batch = [[
+            head[i] + middle[i][j] + tail[i] for j in range(inner_dim_size)
+        ] for i in range(batch_size)]
+
+        programs = util.convert_to_tensor(circuit_batch)
+        other_programs = util.convert_to_tensor(other_batch)
+        symbol_names = tf.convert_to_tensor([], dtype=tf.dtypes.string)
+        symbol_values = tf.convert_to_tensor([[] for _ in range(batch_size)])
+
+        out = inner_product_op.inner_product(programs, symbol_names,
+                                             symbol_values, other_programs)
+
+        out_arr = np.empty((batch_size, inner_dim_size), dtype=np.complex64)
+        for i in range(batch_size):
+            final_wf = cirq.final_state_vector(circuit_batch[i],
+                                               qubit_order=qubits)
+            for j in range(inner_dim_size):
+                internal_wf = cirq.final_state_vector(other_batch[i][j],
+                                                      qubit_order=qubits)
+                out_arr[i][j] = np.vdot(final_wf, internal_wf)
+
+        self.assertAllClose(out, out_arr, atol=1e-5)
+
     @parameterized.parameters([
         {
             'n_qubits': 5,
@@ -0,0 +1,312 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include <algorithm>
+#include <complex>
+#include <numeric>
+#include <vector>
+
+#include "../qsim/lib/circuit.h"
+#include "../qsim/lib/gate_appl.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/seqfor.h"
+#include "../qsim/lib/simmux.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/proto/program.pb.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
+#include "tensorflow_quantum/core/src/program_resolution.h"
+#include "tensorflow_quantum/core/src/state_pool.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
+
+namespace tfq {
+
+using ::tensorflow::Status;
+using ::tfq::proto::Program;
+
+typedef qsim::Cirq::GateCirq<float> QsimGate;
+typedef qsim::Circuit<QsimGate> QsimCircuit;
+typedef std::vector<qsim::GateFused<QsimGate>> QsimFusedCircuit;
+
+namespace {
+
+// Resolves the qubits of all programs to one common ordering, so every
+// non empty program must act on the same qubits. num_qubits receives their
+// number of qubits for non empty programs and 0 for empty ones.
+Status ResolveCommonQubitIds(std::vector<Program>* programs,
+                             std::vector<int>* num_qubits) {
+  num_qubits->assign(programs->size(), 0);
+  std::vector<int> non_empty;
+  for (size_t i = 0; i < programs->size(); i++) {
+    if (!(*programs)[i].circuit().moments().empty()) {
+      non_empty.push_back(i);
+    }
+  }
+  if (non_empty.empty()) {
+    return Status::OK();
+  }
+
+  // The first non empty program is the reference for all others.
+  std::vector<Program> others(non_empty.size() - 1);
+  for (size_t k = 1; k < non_empty.size(); k++) {
+    others[k - 1].Swap(&(*programs)[non_empty[k]]);
+  }
+  unsigned int n = 0;
+  Status status = ResolveQubitIds(&(*programs)[non_empty[0]], &n, &others);
+  for (size_t k = 1; k < non_empty.size(); k++) {
+    others[k - 1].Swap(&(*programs)[non_empty[k]]);
+  }
+  if (!status.ok()) {
+    return tensorflow::errors::InvalidArgument(
+        absl::StrCat("All non empty programs must act on the same qubits. ",
+                     status.error_message()));
+  }
+  for (const int i : non_empty) {
+    (*num_qubits)[i] = n;
+  }
+  return Status::OK();
+}
+
+// Number of states, each of state_bytes bytes, that are held at once while
+// computing the Gram matrix of num_programs programs.
+int GramBlockSize(const int num_programs, const uint64_t state_bytes) {
+  const uint64_t fit = StatePool::Global()->budget() / 2 / state_bytes;
+  return static_cast<int>(
+      std::max<uint64_t>(1, std::min<uint64_t>(num_programs, fit)));
+}
+
+}  // namespace
+
+class TfqGramMatrixOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqGramMatrixOp(tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    const int num_inputs = context->num_inputs();
+    OP_REQUIRES(context, num_inputs == 3,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Expected 3 inputs, got ", num_inputs, " inputs.")));
+
+    std::vector<Program> programs;
+    OP_REQUIRES_OK(context, ParsePrograms(context, "programs", &programs));
+
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+
+    OP_REQUIRES(context, programs.size() == maps.size(),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Number of circuits and symbol_values do not match. Got ",
+                    programs.size(), " circuits and ", maps.size(),
+                    " symbol values.")));
+
+    std::vector<int> num_qubits;
+    OP_REQUIRES_OK(context, ResolveCommonQubitIds(&programs, &num_qubits));
+
+    // Create the output Tensor.
+    const int n = programs.size();
+    tensorflow::TensorShape output_shape;
+    output_shape.AddDim(n);
+    output_shape.AddDim(n);
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+    auto output_tensor = output->matrix<std::complex<float>>();
+
+    std::vector<const Program*> program_ptrs(n);
+    for (int i = 0; i < n; i++) {
+      program_ptrs[i] = &programs[i];
+    }
+    std::vector<QsimCircuit> qsim_circuits;
+    std::vector<QsimFusedCircuit> fused_circuits;
+    OP_REQUIRES_OK(context,
+                   GetQsimCircuits(context, program_ptrs, num_qubits, maps,
+                                   &qsim_circuits, &fused_circuits));
+
+    // Empty programs prepare |0...0> on the qubits of the others.
+    const int nq = n == 0 ? 0
+                          : *std::max_element(num_qubits.begin(),
+                                              num_qubits.end());
+    if (nq == 0) {
+      for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+          output_tensor(i, j) = std::complex<float>(1, 0);
+        }
+      }
+      return;
+    }
+
+    PhaseTrace trace(context, "simulate");
+    if (nq >= kMinWideQubits) {
+      ComputeLarge(nq, fused_circuits, context, &output_tensor);
+    } else {
+      ComputeSmall(nq, fused_circuits, context, &output_tensor);
+    }
+  }
+
+ private:
+  template <typename Simulator, typename StateSpace>
+  static void Simulate(const Simulator& sim, const StateSpace& ss,
+                       const QsimFusedCircuit& fused_circuit,
+                       typename StateSpace::State& state) {
+    ss.SetStateZero(state);
+    for (const auto& gate : fused_circuit) {
+      qsim::ApplyFusedGate(sim, gate, state);
+    }
+  }
+
+  static void SetEntry(
+      const int i, const int j, const std::complex<double>& result,
+      tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
+    (*output_tensor)(i, j) = std::complex<float>(
+        static_cast<float>(result.real()), static_cast<float>(result.imag()));
+    if (i != j) {
+      (*output_tensor)(j, i) = std::conj((*output_tensor)(i, j));
+    }
+  }
+
+  // Simulates one state at a time over the whole threadpool.
+  void ComputeLarge(
+      const int num_qubits, const std::vector<QsimFusedCircuit>& fused_circuits,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
+    const auto tfq_for = tfq::QsimFor(context);
+    using Simulator = qsim::Simulator<const tfq::QsimFor&>;
+    using StateSpace = Simulator::StateSpace;
+
+    Simulator sim = Simulator(tfq_for);
+    StateSpace ss = StateSpace(tfq_for);
+    StateArena<StateSpace> arena(ss);
+    const int n = fused_circuits.size();
+    const int block_size =
+        GramBlockSize(n, sizeof(float) * ss.MinSize(num_qubits));
+    std::vector<StateSpace::State> states;
+    auto scratch = arena.Create(1);
+
+    // The states of a block of rows are kept, later columns are simulated
+    // once per block.
+    for (int start = 0; start < n; start += block_size) {
+      const int end = std::min(n, start + block_size);
+      while (static_cast<int>(states.size()) < end - start) {
+        states.push_back(arena.Create(num_qubits));
+      }
+      for (int j = start; j < n; j++) {
+        StateSpace::State* column = &scratch;
+        if (j < end) {
+          column = &states[j - start];
+        } else if (scratch.num_qubits() != num_qubits) {
+          arena.Resize(num_qubits, &scratch);
+        }
+        Simulate(sim, ss, fused_circuits[j], *column);
+        for (int i = start; i < std::min(j + 1, end); i++) {
+          SetEntry(i, j, ss.InnerProduct(states[i - start], *column),
+                   output_tensor);
+        }
+      }
+    }
+  }
+
+  // Simulates states concurrently with one thread each.
+  void ComputeSmall(
+      const int num_qubits, const std::vector<QsimFusedCircuit>& fused_circuits,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
+    const auto tfq_for = qsim::SequentialFor(1);
+    using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
+    using StateSpace = Simulator::StateSpace;
+
+    StateSpace block_ss = StateSpace(tfq_for);
+    StateArena<StateSpace> block_arena(block_ss);
+    const int n = fused_circuits.size();
+    const int block_size =
+        GramBlockSize(n, sizeof(float) * block_ss.MinSize(num_qubits));
+    std::vector<StateSpace::State> states;
+
+    for (int start = 0; start < n; start += block_size) {
+      const int end = std::min(n, start + block_size);
+      while (static_cast<int>(states.size()) < end - start) {
+        states.push_back(block_arena.Create(num_qubits));
+      }
+      std::vector<int> rows(end - start);
+      std::iota(rows.begin(), rows.end(), start);
+      RunWorkQueue(context, rows, [&](WorkQueue& queue) {
+        Simulator sim = Simulator(tfq_for);
+        StateSpace ss = StateSpace(tfq_for);
+        int i;
+        while (queue.Next(&i)) {
+          Simulate(sim, ss, fused_circuits[i], states[i - start]);
+        }
+      });
+
+      // Inner products of the block with itself and every later column.
+      std::vector<int> columns(n - start);
+      std::iota(columns.begin(), columns.end(), start);
+      RunWorkQueue(context, columns, [&](WorkQueue& queue) {
+        Simulator sim = Simulator(tfq_for);
+        StateSpace ss = StateSpace(tfq_for);
+        StateArena<StateSpace> arena(ss);
+        auto scratch = arena.Create(1);
+        int j;
+        while (queue.Next(&j)) {
+          const StateSpace::State* column = &scratch;
+          if (j < end) {
+            column = &states[j - start];
+          } else {
+            if (scratch.num_qubits() != num_qubits) {
+              arena.Resize(num_qubits, &scratch);
+            }
+            Simulate(sim, ss, fused_circuits[j], scratch);
+          }
+          for (int i = start; i < std::min(j + 1, end); i++) {
+            SetEntry(i, j, ss.InnerProduct(states[i - start], *column),
+                     output_tensor);
+          }
+        }
+      });
+    }
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("TfqGramMatrix").Device(tensorflow::DEVICE_CPU),
+                        TfqGramMatrixOp);
+
+REGISTER_OP("TfqGramMatrix")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Output("gram_matrix: complex64")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::DimensionHandle output_dim =
+          c->Dim(programs_shape, 0);
+      c->set_output(0, c->Matrix(output_dim, output_dim));
+
+      return tensorflow::Status::OK();
+    });
+
+}  // namespace tfq
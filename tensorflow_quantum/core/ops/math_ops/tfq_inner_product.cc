@@ -14,6 +14,7 @@ limitations under the License.
 ==============================================================================*/
 
 #include <memory>
+#include <numeric>
 #include <vector>
 
 #include "../qsim/lib/circuit.h"
@@ -30,6 +31,8 @@ limitations under the License.
 #include "tensorflow/core/platform/mutex.h"
 #include "tensorflow_quantum/core/ops/parse_context.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
+#include "tensorflow_quantum/core/src/prefix_sharing.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
@@ -66,12 +69,13 @@ class TfqInnerProductOp : public tensorflow::OpKernel {
     auto output_tensor = output->matrix<std::complex<float>>();
 
     // Parse program protos.
-    std::vector<Program> programs;
+    ResolvedPrograms resolved;
     std::vector<int> num_qubits;
-    std::vector<std::vector<Program>> other_programs;
-    OP_REQUIRES_OK(context,
-                   GetProgramsAndNumQubits(context, &programs, &num_qubits,
-                                           &other_programs));
+    OP_REQUIRES_OK(context, GetProgramsAndOtherPrograms(context, &resolved,
+                                                        &num_qubits));
+    const std::vector<const Program*>& programs = resolved.programs;
+    const std::vector<std::vector<const Program*>>& other_programs =
+        resolved.other_programs;
 
     std::vector<SymbolMap> maps;
     OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
@@ -83,25 +87,14 @@ class TfqInnerProductOp : public tensorflow::OpKernel {
                     " symbol values.")));
 
     // Construct qsim circuits for programs.
-    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
-    std::vector<QsimFusedCircuit> fused_circuits(programs.size(),
-                                                 QsimFusedCircuit({}));
+    std::vector<QsimCircuit> qsim_circuits;
+    std::vector<QsimFusedCircuit> fused_circuits;
+    OP_REQUIRES_OK(context, GetQsimCircuits(context, programs, num_qubits, maps,
+                                            &qsim_circuits, &fused_circuits));
 
     Status parse_status = Status::OK();
     auto p_lock = tensorflow::mutex();
-    auto construct_f = [&](int start, int end) {
-      for (int i = start; i < end; i++) {
-        Status local =
-            QsimCircuitFromProgram(programs[i], maps[i], num_qubits[i],
-                                   &qsim_circuits[i], &fused_circuits[i]);
-        NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
-      }
-    };
-
     const int num_cycles = 1000;
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        output_dim_batch_size, num_cycles, construct_f);
-    OP_REQUIRES_OK(context, parse_status);
 
     // Construct qsim circuits for other_programs.
     std::vector<std::vector<QsimCircuit>> other_qsim_circuits(
@@ -117,7 +110,7 @@ class TfqInnerProductOp : public tensorflow::OpKernel {
         int ii = i / output_dim_internal_size;
         int jj = i % output_dim_internal_size;
         Status status = QsimCircuitFromProgram(
-            other_programs[ii][jj], {}, num_qubits[ii],
+            *other_programs[ii][jj], {}, num_qubits[ii],
             &other_qsim_circuits[ii][jj], &other_fused_circuits[ii][jj]);
         NESTED_FN_STATUS_SYNC(parse_status, status, p_lock);
       }
@@ -133,156 +126,198 @@ class TfqInnerProductOp : public tensorflow::OpKernel {
                          "No symbols are allowed in these circuits.")));
     }
 
-    int max_num_qubits = 0;
-    for (const int num : num_qubits) {
-      max_num_qubits = std::max(max_num_qubits, num);
+    // Gates at the start or the end of all other_programs[i] are simulated
+    // once per row, see ComputeRow.
+    std::vector<size_t> shared_prefix(output_dim_batch_size);
+    std::vector<size_t> shared_suffix(output_dim_batch_size);
+    for (int i = 0; i < output_dim_batch_size; i++) {
+      CommonFusedGates(other_fused_circuits[i], &shared_prefix[i],
+                       &shared_suffix[i]);
     }
 
-    // Cross reference with standard google cloud compute instances
-    // Memory ~= 2 * num_threads * (2 * 64 * 2 ** num_qubits in circuits)
-    // e2s2 = 2 CPU, 8GB -> Can safely do 25 since Memory = 4GB
-    // e2s4 = 4 CPU, 16GB -> Can safely do 25 since Memory = 8GB
-    // ...
-    if (max_num_qubits >= 26 || output_dim_batch_size == 1) {
-      ComputeLarge(num_qubits, fused_circuits, other_fused_circuits, context,
-                   &output_tensor);
-    } else {
-      ComputeSmall(num_qubits, max_num_qubits, fused_circuits,
-                   other_fused_circuits, context, &output_tensor);
+    // Every circuit prepares its own state once and the state of each of
+    // its other_programs.
+    std::vector<uint64_t> costs(fused_circuits.size());
+    for (size_t i = 0; i < fused_circuits.size(); i++) {
+      const size_t shared = shared_prefix[i] + shared_suffix[i];
+      uint64_t num_passes = fused_circuits[i].size() + shared;
+      for (const auto& other : other_fused_circuits[i]) {
+        num_passes += other.size() - shared + 1;
+      }
+      costs[i] = EstimateCircuitCost(num_qubits[i], num_passes);
     }
+    const int num_threads = context->device()
+                                ->tensorflow_cpu_worker_threads()
+                                ->workers->NumThreads();
+
+    // Repeated rows are computed once and copied afterwards.
+    std::vector<int> first_row;
+    OP_REQUIRES_OK(context,
+                   GetDuplicateRows(context, {"other_programs"}, &first_row));
+
+    PhaseTrace trace(context, "simulate");
+    // Large or expensive circuits are simulated one at a time over the
+    // whole threadpool, the rest concurrently with one thread each.
+    CircuitSchedule schedule;
+    ScheduleCircuits(num_qubits, costs, num_threads, 3,
+                     StatePool::Global()->budget(), &schedule);
+    SkipDuplicateRows(first_row, &schedule);
+    ComputeLarge(schedule.wide, num_qubits, fused_circuits,
+                 other_fused_circuits, shared_prefix, shared_suffix, context,
+                 &output_tensor);
+    ComputeSmall(schedule.narrow, num_qubits, fused_circuits,
+                 other_fused_circuits, shared_prefix, shared_suffix, context,
+                 &output_tensor);
+    CopyDuplicateRows(first_row, &output_tensor);
   }
 
  private:
   void ComputeLarge(
-      const std::vector<int>& num_qubits,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
       const std::vector<QsimFusedCircuit>& fused_circuits,
       const std::vector<std::vector<QsimFusedCircuit>>& other_fused_circuits,
+      const std::vector<size_t>& shared_prefix,
+      const std::vector<size_t>& shared_suffix,
       tensorflow::OpKernelContext* context,
       tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
+    if (batch_indices.empty()) {
+      return;
+    }
     // Instantiate qsim objects.
     const auto tfq_for = tfq::QsimFor(context);
     using Simulator = qsim::Simulator<const tfq::QsimFor&>;
     using StateSpace = Simulator::StateSpace;
 
     // Begin simulation.
-    int largest_nq = 1;
     Simulator sim = Simulator(tfq_for);
     StateSpace ss = StateSpace(tfq_for);
-    auto sv = ss.Create(largest_nq);
-    auto scratch = ss.Create(largest_nq);
+    StateArena<StateSpace> arena(ss);
+    auto sv = arena.Create(1);
+    auto base = arena.Create(1);
+    auto scratch = arena.Create(1);
 
     // Simulate programs one by one. Parallelizing over state vectors
-    // we no longer parallelize over circuits. Each time we encounter a
-    // a larger circuit we will grow the Statevector as necessary.
-    for (int i = 0; i < fused_circuits.size(); i++) {
-      int nq = num_qubits[i];
-      if (nq > largest_nq) {
-        // need to switch to larger statespace.
-        largest_nq = nq;
-        sv = ss.Create(largest_nq);
-        scratch = ss.Create(largest_nq);
-      }
-      // TODO: add heuristic here so that we do not always recompute
-      //  the state if there is a possibility that circuit[i] and
-      //  circuit[i + 1] produce the same state.
-      ss.SetStateZero(sv);
-      for (int j = 0; j < fused_circuits[i].size(); j++) {
-        qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
-      }
-      for (int j = 0; j < other_fused_circuits[i].size(); j++) {
-        // (#679) Just ignore empty program
-        if (fused_circuits[i].size() == 0) {
-          (*output_tensor)(i, j) = std::complex<float>(1, 0);
-          continue;
-        }
-
-        ss.SetStateZero(scratch);
-        for (int k = 0; k < other_fused_circuits[i][j].size(); k++) {
-          qsim::ApplyFusedGate(sim, other_fused_circuits[i][j][k], scratch);
-        }
-
-        std::complex<double> result = ss.InnerProduct(sv, scratch);
-        (*output_tensor)(i, j) =
-            std::complex<float>(static_cast<float>(result.real()),
-                                static_cast<float>(result.imag()));
-      }
-    }
+    // we no longer parallelize over circuits. Programs that start with the
+    // same gates resume from a checkpoint of their common prefix instead
+    // of recomputing it.
+    PrefixPlan plan;
+    PlanSharedPrefixes(batch_indices, num_qubits, fused_circuits, &plan);
+    RunSharedPrefixes(plan, 0, plan.order.size(), num_qubits, fused_circuits,
+                      sim, ss, arena, &sv, CheckpointBudget(1),
+                      [&](const int i) {
+                        ComputeRow(i, fused_circuits, other_fused_circuits,
+                                   shared_prefix, shared_suffix, sim, ss,
+                                   arena, sv, base, scratch, output_tensor);
+                      });
   }
 
   void ComputeSmall(
-      const std::vector<int>& num_qubits, const int max_num_qubits,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
       const std::vector<QsimFusedCircuit>& fused_circuits,
       const std::vector<std::vector<QsimFusedCircuit>>& other_fused_circuits,
+      const std::vector<size_t>& shared_prefix,
+      const std::vector<size_t>& shared_suffix,
       tensorflow::OpKernelContext* context,
       tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
     const auto tfq_for = qsim::SequentialFor(1);
     using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
     using StateSpace = Simulator::StateSpace;
 
-    const int output_dim_internal_size = output_tensor->dimension(1);
-
-    auto DoWork = [&](int start, int end) {
-      int old_batch_index = -2;
-      int cur_batch_index = -1;
-      int largest_nq = 1;
-      int cur_internal_index;
-
+    // Workers take whole chunks of the prefix sharing order so that each
+    // shared prefix is simulated by a single worker.
+    PrefixPlan plan;
+    PlanSharedPrefixes(batch_indices, num_qubits, fused_circuits, &plan);
+    const int num_threads =
+        context->device()->tensorflow_cpu_worker_threads()->num_threads;
+    std::vector<size_t> chunk_starts;
+    ChunkPrefixPlan(plan, 4 * num_threads, &chunk_starts);
+    std::vector<int> chunks(chunk_starts.size() - 1);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    const uint64_t checkpoint_bytes = CheckpointBudget(num_threads);
+
+    auto DoWork = [&](WorkQueue& queue) {
       Simulator sim = Simulator(tfq_for);
       StateSpace ss = StateSpace(tfq_for);
-      auto sv = ss.Create(largest_nq);
-      auto scratch = ss.Create(largest_nq);
-      for (int i = start; i < end; i++) {
-        cur_batch_index = i / output_dim_internal_size;
-        cur_internal_index = i % output_dim_internal_size;
-
-        const int nq = num_qubits[cur_batch_index];
-
-        // (#679) Just ignore empty program
-        if (fused_circuits[cur_batch_index].size() == 0) {
-          (*output_tensor)(cur_batch_index, cur_internal_index) =
-              std::complex<float>(1, 0);
-          continue;
-        }
-
-        if (cur_batch_index != old_batch_index) {
-          // We've run into a new state vector we must compute.
-          // Only compute a new state vector when we have to.
-          if (nq > largest_nq) {
-            largest_nq = nq;
-            sv = ss.Create(largest_nq);
-            scratch = ss.Create(largest_nq);
-          }
-          // no need to update scratch_state since ComputeExpectation
-          // will take care of things for us.
-          ss.SetStateZero(sv);
-          for (int j = 0; j < fused_circuits[cur_batch_index].size(); j++) {
-            qsim::ApplyFusedGate(sim, fused_circuits[cur_batch_index][j], sv);
-          }
-        }
+      StateArena<StateSpace> arena(ss);
+      auto sv = arena.Create(1);
+      auto base = arena.Create(1);
+      auto scratch = arena.Create(1);
+      int c;
+      while (queue.Next(&c)) {
+        RunSharedPrefixes(
+            plan, chunk_starts[c], chunk_starts[c + 1], num_qubits,
+            fused_circuits, sim, ss, arena, &sv, checkpoint_bytes,
+            [&](const int i) {
+              ComputeRow(i, fused_circuits, other_fused_circuits,
+                         shared_prefix, shared_suffix, sim, ss, arena, sv,
+                         base, scratch, output_tensor);
+            });
+      }
+    };
+
+    RunWorkQueue(context, chunks, DoWork);
+  }
+
+  // Writes <sv|phi_ij> into row i of output_tensor for the states phi_ij of
+  // all other_programs[i][j], with sv holding the state of programs[i]. The
+  // first shared_prefix[i] fused gates of the phi_ij are simulated once into
+  // base, and their last shared_suffix[i] gates are undone on sv instead,
+  // since <sv|U phi> = <U^dagger sv|phi>. sv is overwritten.
+  template <typename Simulator, typename StateSpace>
+  static void ComputeRow(
+      const int i, const std::vector<QsimFusedCircuit>& fused_circuits,
+      const std::vector<std::vector<QsimFusedCircuit>>& other_fused_circuits,
+      const std::vector<size_t>& shared_prefix,
+      const std::vector<size_t>& shared_suffix, const Simulator& sim,
+      const StateSpace& ss, StateArena<StateSpace>& arena,
+      typename StateSpace::State& sv, typename StateSpace::State& base,
+      typename StateSpace::State& scratch,
+      tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
+    const auto& others = other_fused_circuits[i];
+    // (#679) Just ignore empty program
+    if (fused_circuits[i].size() == 0) {
+      for (int j = 0; j < others.size(); j++) {
+        (*output_tensor)(i, j) = std::complex<float>(1, 0);
+      }
+      return;
+    }
+    if (others.empty()) {
+      return;
+    }
 
+    if (scratch.num_qubits() != sv.num_qubits()) {
+      arena.Resize(sv.num_qubits(), &scratch);
+    }
+    const size_t prefix = shared_prefix[i];
+    const size_t suffix = shared_suffix[i];
+    if (prefix > 0) {
+      if (base.num_qubits() != sv.num_qubits()) {
+        arena.Resize(sv.num_qubits(), &base);
+      }
+      ss.SetStateZero(base);
+      for (size_t k = 0; k < prefix; k++) {
+        qsim::ApplyFusedGate(sim, others[0][k], base);
+      }
+    }
+    for (size_t k = 1; k <= suffix; k++) {
+      qsim::ApplyFusedGateDagger(sim, others[0][others[0].size() - k], sv);
+    }
+
+    for (int j = 0; j < others.size(); j++) {
+      if (prefix > 0) {
+        ss.Copy(base, scratch);
+      } else {
         ss.SetStateZero(scratch);
-        for (int k = 0;
-             k <
-             other_fused_circuits[cur_batch_index][cur_internal_index].size();
-             k++) {
-          qsim::ApplyFusedGate(
-              sim, other_fused_circuits[cur_batch_index][cur_internal_index][k],
-              scratch);
-        }
-
-        std::complex<double> result = ss.InnerProduct(sv, scratch);
-        (*output_tensor)(cur_batch_index, cur_internal_index) =
-            std::complex<float>(static_cast<float>(result.real()),
-                                static_cast<float>(result.imag()));
-
-        old_batch_index = cur_batch_index;
       }
-    };
+      for (size_t k = prefix; k + suffix < others[j].size(); k++) {
+        qsim::ApplyFusedGate(sim, others[j][k], scratch);
+      }
 
-    const int64_t num_cycles =
-        200 * (int64_t(1) << static_cast<int64_t>(max_num_qubits));
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        fused_circuits.size() * output_dim_internal_size, num_cycles, DoWork);
+      std::complex<double> result = ss.InnerProduct(sv, scratch);
+      (*output_tensor)(i, j) =
+          std::complex<float>(static_cast<float>(result.real()),
+                              static_cast<float>(result.imag()));
+    }
   }
 };
 
@@ -14,6 +14,7 @@ limitations under the License.
 ==============================================================================*/
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "../qsim/lib/circuit.h"
@@ -31,6 +32,8 @@ limitations under the License.
 #include "tensorflow_quantum/core/ops/parse_context.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
 #include "tensorflow_quantum/core/src/adj_util.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
+#include "tensorflow_quantum/core/src/program_cache.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
@@ -43,6 +46,40 @@ typedef qsim::Cirq::GateCirq<float> QsimGate;
 typedef qsim::Circuit<QsimGate> QsimCircuit;
 typedef std::vector<qsim::GateFused<QsimGate>> QsimFusedCircuit;
 
+// other_programs are symbol free, so their states are the same on every
+// call. States of up to this many qubits are cached (16 qubits take 512KB).
+static const int kMaxCachedOtherStateQubits = 16;
+
+// Default number of other_programs states kept in the cache. Can be changed
+// with the TFQ_OTHER_STATE_CACHE_SIZE environment variable, 0 disables it.
+constexpr size_t kDefaultOtherStateCacheSize = 256;
+
+// Default number of bytes of amplitudes (and serialized programs) held by the
+// cache. Can be changed with the TFQ_OTHER_STATE_CACHE_BYTES environment
+// variable.
+constexpr size_t kDefaultOtherStateCacheBytes = size_t{64} << 20;
+
+// Raw amplitudes of simulated other_programs states, in the memory layout of
+// the float StateSpace. Keyed by the serialized program and other program,
+// which together fix the qubit order of the state.
+ProgramCache<std::vector<float>>* GetOtherStateCache() {
+  static ProgramCache<std::vector<float>>* cache =
+      new ProgramCache<std::vector<float>>(
+          CacheCapacityFromEnv("TFQ_OTHER_STATE_CACHE_SIZE",
+                               kDefaultOtherStateCacheSize),
+          CacheCapacityFromEnv("TFQ_OTHER_STATE_CACHE_BYTES",
+                               kDefaultOtherStateCacheBytes));
+  return cache;
+}
+
+// A state of other_programs[i][j]: either cached by an earlier call or
+// simulated from its fused circuit and then inserted under key.
+struct OtherState {
+  uint64_t key;
+  std::vector<absl::string_view> sources;
+  std::shared_ptr<const std::vector<float>> amplitudes;
+};
+
 class TfqInnerProductGradOp : public tensorflow::OpKernel {
  public:
   explicit TfqInnerProductGradOp(tensorflow::OpKernelConstruction* context)
@@ -72,12 +109,13 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
     auto output_tensor = output->matrix<std::complex<float>>();
 
     // Parse program protos.
-    std::vector<Program> programs;
+    ResolvedPrograms resolved;
     std::vector<int> num_qubits;
-    std::vector<std::vector<Program>> other_programs;
-    OP_REQUIRES_OK(context,
-                   GetProgramsAndNumQubits(context, &programs, &num_qubits,
-                                           &other_programs));
+    OP_REQUIRES_OK(context, GetProgramsAndOtherPrograms(context, &resolved,
+                                                        &num_qubits));
+    const std::vector<const Program*>& programs = resolved.programs;
+    const std::vector<std::vector<const Program*>>& other_programs =
+        resolved.other_programs;
 
     std::vector<SymbolMap> maps;
     OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
@@ -94,13 +132,12 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
                     " symbol values.")));
 
     // Construct qsim circuits for programs.
-    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
-    std::vector<QsimFusedCircuit> fused_circuits(programs.size(),
-                                                 QsimFusedCircuit({}));
-
-    // track metadata.
-    std::vector<std::vector<tfq::GateMetaData>> gate_meta(
-        programs.size(), std::vector<tfq::GateMetaData>({}));
+    std::vector<QsimCircuit> qsim_circuits;
+    std::vector<QsimFusedCircuit> fused_circuits;
+    std::vector<std::vector<tfq::GateMetaData>> gate_meta;
+    OP_REQUIRES_OK(context, GetQsimCircuits(context, programs, num_qubits, maps,
+                                            &qsim_circuits, &fused_circuits,
+                                            &gate_meta));
 
     // Construct qsim circuits.
     std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>
@@ -112,15 +149,8 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
     std::vector<std::vector<GradientOfGate>> gradient_gates(
         programs.size(), std::vector<GradientOfGate>({}));
 
-    Status parse_status = Status::OK();
-    auto p_lock = tensorflow::mutex();
     auto construct_f = [&](int start, int end) {
       for (int i = start; i < end; i++) {
-        Status local = QsimCircuitFromProgram(
-            programs[i], maps[i], num_qubits[i], &qsim_circuits[i],
-            &fused_circuits[i], &gate_meta[i]);
-        NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
-
         CreateGradientCircuit(qsim_circuits[i], gate_meta[i],
                               &partial_fused_circuits[i], &gradient_gates[i]);
       }
@@ -129,7 +159,20 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
     const int num_cycles = 1000;
     context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
         output_dim_batch_size, num_cycles, construct_f);
-    OP_REQUIRES_OK(context, parse_status);
+
+    Status parse_status = Status::OK();
+    auto p_lock = tensorflow::mutex();
+
+    // Look up the states of other_programs simulated by earlier calls. Every
+    // other program has been parsed above, but only those without a cached
+    // state are converted to qsim circuits and simulated.
+    const auto program_strings =
+        context->input(0).vec<tensorflow::tstring>();
+    const auto other_strings = context->input(3).matrix<tensorflow::tstring>();
+    ProgramCache<std::vector<float>>* cache = GetOtherStateCache();
+    std::vector<std::vector<OtherState>> other_states(
+        output_dim_batch_size,
+        std::vector<OtherState>(output_dim_internal_size));
 
     // Construct qsim circuits for other_programs.
     std::vector<std::vector<QsimCircuit>> other_qsim_circuits(
@@ -144,8 +187,21 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
       for (int i = start; i < end; i++) {
         int ii = i / output_dim_internal_size;
         int jj = i % output_dim_internal_size;
+        OtherState& other = other_states[ii][jj];
+        if (cache->capacity() > 0 &&
+            num_qubits[ii] <= kMaxCachedOtherStateQubits) {
+          other.sources = {absl::string_view(program_strings(ii).data(),
+                                             program_strings(ii).size()),
+                           absl::string_view(other_strings(ii, jj).data(),
+                                             other_strings(ii, jj).size())};
+          other.key = FingerprintSources(other.sources);
+          other.amplitudes = cache->Lookup(other.key, other.sources);
+          if (other.amplitudes != nullptr) {
+            continue;
+          }
+        }
         Status status = QsimCircuitFromProgram(
-            other_programs[ii][jj], {}, num_qubits[ii],
+            *other_programs[ii][jj], {}, num_qubits[ii],
             &other_qsim_circuits[ii][jj], &other_fused_circuits[ii][jj]);
         NESTED_FN_STATUS_SYNC(parse_status, status, p_lock);
       }
@@ -161,11 +217,6 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
                          "No symbols are allowed in these circuits.")));
     }
 
-    int max_num_qubits = 0;
-    for (const int num : num_qubits) {
-      max_num_qubits = std::max(max_num_qubits, num);
-    }
-
     // Get downstream gradients.
     std::vector<std::vector<float>> downstream_grads;
     OP_REQUIRES_OK(context, GetPrevGrads(context, &downstream_grads));
@@ -184,35 +235,101 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
 
     output_tensor.setZero();
 
-    // Cross reference with standard google cloud compute instances
-    // Memory ~= 2 * num_threads * (2 * 64 * 2 ** num_qubits in circuits)
-    // e2s2 = 2 CPU, 8GB -> Can safely do 23 since Memory = 4GB
-    // e2s4 = 4 CPU, 16GB -> Can safely do 23 since Memory = 8GB
-    // ...
-    if (max_num_qubits >= 24 || output_dim_batch_size == 1) {
-      ComputeLarge(num_qubits, maps, qsim_circuits, fused_circuits,
-                   partial_fused_circuits, gradient_gates, other_fused_circuits,
-                   downstream_grads, context, &output_tensor);
-    } else {
-      ComputeSmall(num_qubits, max_num_qubits, maps, qsim_circuits,
-                   fused_circuits, partial_fused_circuits, gradient_gates,
-                   other_fused_circuits, downstream_grads, context,
-                   &output_tensor);
+    // Every circuit prepares its own state and those of its other_programs,
+    // then sweeps both backwards with one gradient gate and inner product
+    // per gradient gate.
+    std::vector<uint64_t> costs(fused_circuits.size());
+    for (size_t i = 0; i < fused_circuits.size(); i++) {
+      uint64_t num_passes = fused_circuits[i].size();
+      for (const auto& other : other_fused_circuits[i]) {
+        // cached states are empty circuits and only cost the accumulation.
+        num_passes += other.size() + 1;
+      }
+      for (const auto& layer : partial_fused_circuits[i]) {
+        num_passes += 2 * layer.size();
+      }
+      for (const auto& gradient_gate : gradient_gates[i]) {
+        num_passes += 3 * gradient_gate.grad_gates.size();
+      }
+      costs[i] = EstimateCircuitCost(num_qubits[i], num_passes);
     }
+    const int num_threads = context->device()
+                                ->tensorflow_cpu_worker_threads()
+                                ->workers->NumThreads();
+
+    PhaseTrace trace(context, "simulate");
+    // This method creates 3 big state vectors per circuit.
+    CircuitSchedule schedule;
+    ScheduleCircuits(num_qubits, costs, num_threads, 3,
+                     StatePool::Global()->budget(), &schedule);
+    ComputeLarge(schedule.wide, num_qubits, maps, qsim_circuits, fused_circuits,
+                 partial_fused_circuits, gradient_gates, other_fused_circuits,
+                 other_states, downstream_grads, context, &output_tensor);
+    ComputeSmall(schedule.narrow, num_qubits, maps, qsim_circuits,
+                 fused_circuits, partial_fused_circuits, gradient_gates,
+                 other_fused_circuits, other_states, downstream_grads, context,
+                 &output_tensor);
   }
 
  private:
+  // dest = sum_j coefficients[j] |phi_j> like AccumulateFusedCircuits, where
+  // |phi_j> is copied out of other_states[j] when it is cached and simulated
+  // on scratch (and inserted into the cache) otherwise. scratch has garbage
+  // value afterwards.
+  // The states of a circuit on num_qubits qubits may be larger than that,
+  // with the extra qubits in |0>. Their first ss.MinSize(num_qubits) floats
+  // then have the layout of a num_qubits state and all others are zero, so
+  // only that prefix is cached.
+  template <typename SimT, typename StateSpaceT, typename StateT>
+  static void AccumulateOtherStates(
+      const std::vector<float>& coefficients,
+      const std::vector<QsimFusedCircuit>& fused_circuits,
+      const std::vector<OtherState>& other_states, const int num_qubits,
+      const SimT& sim, const StateSpaceT& ss, StateT& scratch, StateT& dest) {
+    ProgramCache<std::vector<float>>* cache = GetOtherStateCache();
+    const uint64_t size = ss.MinSize(num_qubits);
+    ss.SetAllZeros(dest);
+    for (size_t j = 0; j < fused_circuits.size(); j++) {
+      const OtherState& other = other_states[j];
+      if (other.amplitudes != nullptr) {
+        const float* p = other.amplitudes->data();
+        float* d = dest.get();
+        for (uint64_t k = 0; k < other.amplitudes->size(); k++) {
+          d[k] += coefficients[j] * p[k];
+        }
+        continue;
+      }
+      ss.SetStateZero(scratch);
+      for (const auto& fused_gate : fused_circuits[j]) {
+        qsim::ApplyFusedGate(sim, fused_gate, scratch);
+      }
+      if (!other.sources.empty()) {
+        cache->Insert(other.key, other.sources,
+                      std::make_shared<const std::vector<float>>(
+                          scratch.get(), scratch.get() + size),
+                      size * sizeof(float));
+      }
+      ss.Multiply(coefficients[j], scratch);
+      ss.Add(scratch, dest);
+    }
+  }
+
   void ComputeLarge(
-      const std::vector<int>& num_qubits, const std::vector<SymbolMap>& maps,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
+      const std::vector<SymbolMap>& maps,
       const std::vector<QsimCircuit>& qsim_circuits,
       const std::vector<QsimFusedCircuit>& fused_circuits,
       const std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>&
           partial_fused_circuits,
       const std::vector<std::vector<tfq::GradientOfGate>>& gradient_gates,
       const std::vector<std::vector<QsimFusedCircuit>>& other_fused_circuits,
+      const std::vector<std::vector<OtherState>>& other_states,
       const std::vector<std::vector<float>>& downstream_grads,
       tensorflow::OpKernelContext* context,
       tensorflow::TTypes<std::complex<float>>::Matrix* output_tensor) {
+    if (batch_indices.empty()) {
+      return;
+    }
     // Instantiate qsim objects.
     const auto tfq_for = tfq::QsimFor(context);
     using Simulator = qsim::Simulator<const tfq::QsimFor&>;
@@ -222,22 +339,22 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
     int largest_nq = 1;
     Simulator sim = Simulator(tfq_for);
     StateSpace ss = StateSpace(tfq_for);
-    auto sv = ss.Create(largest_nq);
-    auto scratch = ss.Create(largest_nq);
-    auto scratch2 = ss.Create(largest_nq);
+    StateArena<StateSpace> arena(ss);
+    auto sv = arena.Create(largest_nq);
+    auto scratch = arena.Create(largest_nq);
+    auto scratch2 = arena.Create(largest_nq);
 
     // Simulate programs one by one. Parallelizing over state vectors
     // we no longer parallelize over circuits. Each time we encounter a
     // a larger circuit we will grow the Statevector as necessary.
-    for (std::vector<std::vector<qsim::GateFused<QsimGate>>>::size_type i = 0;
-         i < fused_circuits.size(); i++) {
+    for (const int i : batch_indices) {
       int nq = num_qubits[i];
       if (nq > largest_nq) {
         // need to switch to larger statespace.
         largest_nq = nq;
-        sv = ss.Create(largest_nq);
-        scratch = ss.Create(largest_nq);
-        scratch2 = ss.Create(largest_nq);
+        arena.Resize(largest_nq, &sv);
+        arena.Resize(largest_nq, &scratch);
+        arena.Resize(largest_nq, &scratch2);
       }
       ss.SetStateZero(sv);
       for (std::vector<qsim::GateFused<QsimGate>>::size_type j = 0;
@@ -245,9 +362,8 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
         qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
       }
 
-      auto status =
-          AccumulateFusedCircuits(downstream_grads[i], other_fused_circuits[i],
-                                  sim, ss, scratch2, scratch);
+      AccumulateOtherStates(downstream_grads[i], other_fused_circuits[i],
+                            other_states[i], nq, sim, ss, scratch2, scratch);
 
       // now sv is |psi>
       // scratch contains sum_j downstream_grads[i][j]*|phi[i][j]>
@@ -310,7 +426,7 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
   }
 
   void ComputeSmall(
-      const std::vector<int>& num_qubits, const int max_num_qubits,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
       const std::vector<SymbolMap>& maps,
       const std::vector<QsimCircuit>& qsim_circuits,
       const std::vector<QsimFusedCircuit>& fused_circuits,
@@ -318,6 +434,7 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
           partial_fused_circuits,
       const std::vector<std::vector<tfq::GradientOfGate>>& gradient_gates,
       const std::vector<std::vector<QsimFusedCircuit>>& other_fused_circuits,
+      const std::vector<std::vector<OtherState>>& other_states,
       const std::vector<std::vector<float>>& downstream_grads,
       tensorflow::OpKernelContext* context,
       tensorflow::TTypes<std::complex<float>>::Matrix* output_tensor) {
@@ -325,63 +442,42 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
     using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
     using StateSpace = Simulator::StateSpace;
 
-    const int output_dim_internal_size = other_fused_circuits[0].size();
-
-    auto DoWork = [&](int start, int end) {
-      int old_batch_index = -2;
-      int cur_batch_index = -1;
+    // Each worker owns whole circuits, so rows of output_tensor are only
+    // ever written by one thread.
+    auto DoWork = [&](WorkQueue& queue) {
       int largest_nq = 1;
-      int cur_internal_index;
-
       Simulator sim = Simulator(tfq_for);
       StateSpace ss = StateSpace(tfq_for);
-      auto sv = ss.Create(largest_nq);
-      auto sv_adj = ss.Create(largest_nq);
-      auto scratch = ss.Create(largest_nq);
-      auto scratch2 = ss.Create(largest_nq);
-      for (int i = start; i < end; i++) {
-        cur_batch_index = i / output_dim_internal_size;
-        cur_internal_index = i % output_dim_internal_size;
-
-        const int nq = num_qubits[cur_batch_index];
-
-        if (cur_batch_index != old_batch_index) {
-          // We've run into a new state vector we must compute.
-          // Only compute a new state vector when we have to.
-          if (nq > largest_nq) {
-            largest_nq = nq;
-            sv = ss.Create(largest_nq);
-            sv_adj = ss.Create(largest_nq);
-            scratch = ss.Create(largest_nq);
-            scratch2 = ss.Create(largest_nq);
-          }
-          ss.SetStateZero(sv);
-          for (std::vector<qsim::GateFused<QsimGate>>::size_type j = 0;
-               j < fused_circuits[cur_batch_index].size(); j++) {
-            qsim::ApplyFusedGate(sim, fused_circuits[cur_batch_index][j], sv);
-          }
+      StateArena<StateSpace> arena(ss);
+      auto sv = arena.Create(largest_nq);
+      auto scratch = arena.Create(largest_nq);
+      auto scratch2 = arena.Create(largest_nq);
+      int i;
+      while (queue.Next(&i)) {
+        const int nq = num_qubits[i];
+        if (nq > largest_nq) {
+          largest_nq = nq;
+          arena.Resize(largest_nq, &sv);
+          arena.Resize(largest_nq, &scratch);
+          arena.Resize(largest_nq, &scratch2);
         }
-
-        ss.SetStateZero(scratch);
-        for (std::vector<qsim::GateFused<QsimGate>>::size_type k = 0;
-             k <
-             other_fused_circuits[cur_batch_index][cur_internal_index].size();
-             k++) {
-          qsim::ApplyFusedGate(
-              sim, other_fused_circuits[cur_batch_index][cur_internal_index][k],
-              scratch);
+        ss.SetStateZero(sv);
+        for (int j = 0; j < fused_circuits[i].size(); j++) {
+          qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
         }
-        // now sv is |psi>, scratch is |phi>
+
+        AccumulateOtherStates(downstream_grads[i], other_fused_circuits[i],
+                              other_states[i], nq, sim, ss, scratch2,
+                              scratch);
+
+        // now sv is |psi>
+        // scratch contains sum_j downstream_grads[i][j]*|phi[i][j]>
         // Start adjoint differentiation.
-        ss.Copy(sv, sv_adj);
-        for (int l = partial_fused_circuits[cur_batch_index].size() - 1; l >= 0;
-             l--) {
-          for (int k = partial_fused_circuits[cur_batch_index][l].size() - 1;
-               k >= 0; k--) {
-            ApplyFusedGateDagger(
-                sim, partial_fused_circuits[cur_batch_index][l][k], sv_adj);
-            ApplyFusedGateDagger(
-                sim, partial_fused_circuits[cur_batch_index][l][k], scratch);
+        for (int l = partial_fused_circuits[i].size() - 1; l >= 0; l--) {
+          for (int k = partial_fused_circuits[i][l].size() - 1; k >= 0; k--) {
+            ApplyFusedGateDagger(sim, partial_fused_circuits[i][l][k], sv);
+            ApplyFusedGateDagger(sim, partial_fused_circuits[i][l][k],
+                                 scratch);
           }
           if (l == 0) {
             // last layer will have no parametrized gates so can break.
@@ -391,9 +487,8 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
           // Hit a parameterized gate.
           // todo fix this copy.
           auto cur_gate =
-              qsim_circuits[cur_batch_index]
-                  .gates[gradient_gates[cur_batch_index][l - 1].index];
-          ApplyGateDagger(sim, cur_gate, sv_adj);
+              qsim_circuits[i].gates[gradient_gates[i][l - 1].index];
+          ApplyGateDagger(sim, cur_gate, sv);
 
           // if applicable compute control qubit mask and control value bits.
           uint64_t mask = 0;
@@ -404,25 +499,21 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
             cbits |= ((cur_gate.cmask >> k) & 1) << control_loc;
           }
 
-          for (int k = 0;
-               k < gradient_gates[cur_batch_index][l - 1].grad_gates.size();
-               k++) {
-            // Copy sv_adj onto scratch2 in anticipation of non-unitary
-            // "gradient gate".
-            ss.Copy(sv_adj, scratch2);
+          for (int k = 0; k < gradient_gates[i][l - 1].grad_gates.size(); k++) {
+            // Copy sv onto scratch2 in anticipation of non-unitary "gradient
+            // gate".
+            ss.Copy(sv, scratch2);
             if (!cur_gate.controlled_by.empty()) {
               // Gradient of controlled gates puts zeros on diagonal which is
               // the same as collapsing the state and then applying the
               // non-controlled version of the gradient gate.
               ss.BulkSetAmpl(scratch2, mask, cbits, 0, 0, true);
             }
-            qsim::ApplyGate(
-                sim, gradient_gates[cur_batch_index][l - 1].grad_gates[k],
-                scratch2);
+            qsim::ApplyGate(sim, gradient_gates[i][l - 1].grad_gates[k],
+                            scratch2);
 
             // don't need not-found check since this is done upstream already.
-            const auto it = maps[cur_batch_index].find(
-                gradient_gates[cur_batch_index][l - 1].params[k]);
+            const auto it = maps[i].find(gradient_gates[i][l - 1].params[k]);
             const int loc = it->second.first;
             // Apply finite differencing for adjoint gradients.
             // Finite differencing enables applying multiple `gradient_gate`
@@ -430,21 +521,16 @@ class TfqInnerProductGradOp : public tensorflow::OpKernel {
             // parameter-shift we need to apply a single `gradient_gate`
             // per a symbol.
             std::complex<double> result = ss.InnerProduct(scratch2, scratch);
-            (*output_tensor)(cur_batch_index, loc) +=
-                (downstream_grads[cur_batch_index][cur_internal_index] *
-                 std::complex<float>(static_cast<float>(result.real()),
-                                     static_cast<float>(result.imag())));
+            (*output_tensor)(i, loc) +=
+                std::complex<float>(static_cast<float>(result.real()),
+                                    static_cast<float>(result.imag()));
           }
           ApplyGateDagger(sim, cur_gate, scratch);
         }
-        old_batch_index = cur_batch_index;
       }
     };
 
-    const int64_t num_cycles =
-        200 * (int64_t(1) << static_cast<int64_t>(max_num_qubits));
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        fused_circuits.size() * output_dim_internal_size, num_cycles, DoWork);
+    RunWorkQueue(context, batch_indices, DoWork);
   }
 };
 
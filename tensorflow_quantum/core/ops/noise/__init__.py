@@ -17,4 +17,5 @@
 from tensorflow_quantum.core.ops.noise.noisy_expectation_op import expectation
 from tensorflow_quantum.core.ops.noise.noisy_sampled_expectation_op import \
 sampled_expectation
-from tensorflow_quantum.core.ops.noise.noisy_samples_op import samples
+from tensorflow_quantum.core.ops.noise.noisy_samples_op import (
+    samples, samples_packed, sample_counts)
@@ -303,6 +303,155 @@ class NoisyExpectationCalculationTest(tf.test.TestCase, parameterized.TestCase):
 
         self.assertAllClose(cirq_exps, op_exps, atol=5e-2, rtol=5e-2)
 
+    def test_gates_after_noise(self):
+        """Gates following the first channel must still be applied to every
+        trajectory after the shared noiseless prefix."""
+        batch_size = 3
+        n_qubits = 4
+        qubits = cirq.LineQubit.range(n_qubits)
+        prefixes, resolver_batch = util.random_circuit_resolver_batch(
+            qubits, batch_size, include_channels=False)
+        suffixes, _ = util.random_circuit_resolver_batch(
+            qubits, batch_size, include_channels=False)
+        circuit_batch = [
+            prefix + cirq.depolarize(0.05).on_each(*qubits) + suffix
+            for prefix, suffix in zip(prefixes, suffixes)
+        ]
+
+        pauli_sums = util.random_pauli_sums(qubits, 3, batch_size)
+        batch_pauli_sums = [[x] for x in pauli_sums]
+        op_exps = noisy_expectation_op.expectation(
+            util.convert_to_tensor(circuit_batch), [],
+            [[]] * batch_size, util.convert_to_tensor(batch_pauli_sums),
+            [[10000]] * batch_size)
+
+        cirq_exps = batch_util.batch_calculate_expectation(
+            circuit_batch, resolver_batch, batch_pauli_sums,
+            cirq.DensityMatrixSimulator())
+        self.assertAllClose(cirq_exps, op_exps, atol=5e-2, rtol=5e-2)
+
+    def test_seeded_expectation(self):
+        """Test that seeded expectations are reproducible."""
+        qubits = cirq.LineQubit.range(2)
+        circuits = util.convert_to_tensor([
+            cirq.Circuit(cirq.H.on_each(*qubits),
+                         cirq.depolarize(0.2).on_each(*qubits),
+                         cirq.CNOT(*qubits))
+        ] * 2)
+        pauli_sums = util.convert_to_tensor([[cirq.X(qubits[0])],
+                                             [cirq.Z(qubits[1])]])
+        # A different number of trajectories per op and per circuit.
+        n_samples = [[150], [70]]
+
+        tf.random.set_seed(1234)
+        first = noisy_expectation_op.expectation(circuits, [], [[]] * 2,
+                                                 pauli_sums, n_samples,
+                                                 seed=5)
+        second = noisy_expectation_op.expectation(circuits, [], [[]] * 2,
+                                                  pauli_sums, n_samples,
+                                                  seed=5)
+        tf.random.set_seed(1234)
+        repeated = noisy_expectation_op.expectation(circuits, [], [[]] * 2,
+                                                    pauli_sums, n_samples,
+                                                    seed=5)
+        self.assertAllEqual(first, repeated)
+        self.assertNotAllEqual(first, second)
+
+    def test_target_error(self):
+        """Test that trajectories stop once the target error is reached."""
+        qubit = cirq.LineQubit(0)
+        circuits = util.convert_to_tensor([
+            cirq.Circuit(cirq.H(qubit),
+                         cirq.depolarize(0.2)(qubit)),
+            cirq.Circuit(cirq.H(qubit))
+        ])
+        pauli_sums = util.convert_to_tensor([[cirq.X(qubit)],
+                                             [cirq.X(qubit)]])
+        n_samples = [[5000], [5000]]
+
+        exps, used, variances = noisy_expectation_op.expectation(
+            circuits, [], [[]] * 2,
+            pauli_sums,
+            n_samples,
+            target_error=0.02,
+            return_statistics=True)
+        self.assertAllClose(exps, [[1.0 - 0.8 / 3.0], [1.0]], atol=0.1)
+        # The noisy circuit needs roughly 1200 trajectories, the noiseless
+        # one stops after its first block.
+        self.assertLess(used[0][0], 5000)
+        self.assertLessEqual(variances[0][0] / used[0][0], 0.02**2)
+        self.assertEqual(used[1][0], 64)
+        self.assertAllClose(variances[1], [0.0])
+
+        _, used, _ = noisy_expectation_op.expectation(circuits, [], [[]] * 2,
+                                                      pauli_sums,
+                                                      n_samples,
+                                                      return_statistics=True)
+        self.assertAllEqual(used, n_samples)
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'target_error must be non-negative'):
+            noisy_expectation_op.expectation(circuits, [], [[]] * 2,
+                                             pauli_sums,
+                                             n_samples,
+                                             target_error=-1.0)
+
+    @parameterized.parameters([{
+        'channel': x
+    } for x in util.get_supported_channels()])
+    def test_density_matrix_backend(self, channel):
+        """Test exact expectations on density matrices."""
+        batch_size = 3
+        n_qubits = 4
+        qubits = cirq.LineQubit.range(n_qubits)
+        prefixes, resolver_batch = util.random_circuit_resolver_batch(
+            qubits, batch_size, include_channels=False)
+        suffixes, _ = util.random_circuit_resolver_batch(
+            qubits, batch_size, include_channels=False)
+        circuit_batch = [
+            prefix + channel.on_each(*qubits) + suffix
+            for prefix, suffix in zip(prefixes, suffixes)
+        ]
+
+        pauli_sums1 = util.random_pauli_sums(qubits, 3, batch_size)
+        pauli_sums2 = util.random_pauli_sums(qubits, 3, batch_size)
+        batch_pauli_sums = [[x, y] for x, y in zip(pauli_sums1, pauli_sums2)]
+        num_samples = [[100] * 2] * batch_size
+
+        op_exps, used, variances = noisy_expectation_op.expectation(
+            util.convert_to_tensor(circuit_batch), [], [[]] * batch_size,
+            util.convert_to_tensor(batch_pauli_sums),
+            num_samples,
+            return_statistics=True,
+            backend='density_matrix')
+
+        cirq_exps = batch_util.batch_calculate_expectation(
+            circuit_batch, resolver_batch, batch_pauli_sums,
+            cirq.DensityMatrixSimulator())
+        self.assertAllClose(cirq_exps, op_exps, atol=5e-4, rtol=5e-4)
+        self.assertAllEqual(used, np.zeros_like(num_samples))
+        self.assertAllClose(variances, np.zeros_like(num_samples))
+
+        # Few trajectories on few qubits are cheaper on density matrices.
+        auto_exps = noisy_expectation_op.expectation(
+            util.convert_to_tensor(circuit_batch), [], [[]] * batch_size,
+            util.convert_to_tensor(batch_pauli_sums),
+            [[10000] * 2] * batch_size,
+            backend='auto')
+        self.assertAllClose(cirq_exps, auto_exps, atol=5e-4, rtol=5e-4)
+
+    def test_density_matrix_backend_too_large(self):
+        """Test that the density_matrix backend rejects large circuits."""
+        qubits = cirq.GridQubit.rect(1, 13)
+        circuit = util.convert_to_tensor(
+            [cirq.Circuit(cirq.depolarize(0.1).on_each(*qubits))])
+        pauli_sums = util.convert_to_tensor([[cirq.Z(qubits[0])]])
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'supports at most 12 qubits'):
+            noisy_expectation_op.expectation(circuit, [], [[]],
+                                             pauli_sums, [[10]],
+                                             backend='density_matrix')
+
     def test_correctness_empty(self):
         """Test the expectation for empty circuits."""
         empty_circuit = util.convert_to_tensor([cirq.Circuit()])
@@ -332,6 +481,20 @@ class NoisyExpectationCalculationTest(tf.test.TestCase, parameterized.TestCase):
 
         self.assertShapeEqual(np.zeros((0, 0)), out)
 
+    def test_empty_circuit_with_observable(self):
+        """Empty circuits in a batch with observables are ignored."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        circuit_batch = [
+            cirq.Circuit(cirq.X(qubits[0]), cirq.X(qubits[1])),
+            cirq.Circuit()
+        ]
+        pauli_sums = util.convert_to_tensor(
+            [[cirq.Z(qubits[0]) + 0.5 * cirq.Z(qubits[1])]] * 2)
+        res = noisy_expectation_op.expectation(
+            util.convert_to_tensor(circuit_batch), [], [[]] * 2, pauli_sums,
+            [[100]] * 2)
+        self.assertAllClose(res, [[-1.5], [-2.0]])
+
 
 if __name__ == "__main__":
     tf.test.main()
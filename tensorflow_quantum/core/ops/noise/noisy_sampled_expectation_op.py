@@ -20,8 +20,13 @@ from tensorflow_quantum.core.ops.load_module import load_module
 NOISY_OP_MODULE = load_module(os.path.join("noise", "_tfq_noise_ops.so"))
 
 
-def sampled_expectation(programs, symbol_names, symbol_values, pauli_sums,
-                        num_samples):
+def sampled_expectation(programs,
+                        symbol_names,
+                        symbol_values,
+                        pauli_sums,
+                        num_samples,
+                        seed=None,
+                        backend='trajectory'):
     """Estimates (via sampling) expectation values using monte-carlo simulation.
 
     Simulate the final state of `programs` given `symbol_values` are placed
@@ -82,16 +87,29 @@ def sampled_expectation(programs, symbol_names, symbol_values, pauli_sums,
         num_samples: `tf.Tensor` with `num_samples[i][j]` is equal to the
             number of times `programs[i]` will be simulated to estimate
             `pauli_sums[i][j]`. Therefore, `num_samples` must have the same
-            shape as `pauli_sums`. Note: internally this quantity can get
-            rounded up to the nearest multiple of the number of available
-            threads to TensorFlow. For best performance ensure that the
-            quantities in `num_samples` are a multiple of the number of
-            available threads.
+            shape as `pauli_sums`.
+        seed: Optional Python integer. Together with the global seed of
+            `tf.random.set_seed` it makes the expectations reproducible, like
+            the seeds of the TensorFlow random ops. The expectations do not
+            depend on the number of threads.
+        backend: Python string, how the noisy circuits are simulated:
+            'trajectory' samples `num_samples` quantum trajectories,
+            'density_matrix' simulates the density matrix of every circuit
+            exactly (at most 12 qubits) and 'auto' picks the density
+            matrix for small circuits where it is estimated to be cheaper
+            than the trajectories.
     Returns:
         `tf.Tensor` with shape [batch_size, n_ops] that holds the
             expectation value for each circuit with each op applied to it
             (after resolving the corresponding parameters in).
     """
+    seed1, seed2 = tf.compat.v1.random.get_seed(seed)
     return NOISY_OP_MODULE.tfq_noisy_sampled_expectation(
-        programs, symbol_names, tf.cast(symbol_values, tf.float32), pauli_sums,
-        tf.cast(num_samples, dtype=tf.int32))
+        programs,
+        symbol_names,
+        tf.cast(symbol_values, tf.float32),
+        pauli_sums,
+        tf.cast(num_samples, dtype=tf.int32),
+        seed=seed1,
+        seed2=seed2,
+        backend=backend)
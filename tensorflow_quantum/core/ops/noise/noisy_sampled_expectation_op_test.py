@@ -332,6 +332,20 @@ class NoisyExpectationCalculationTest(tf.test.TestCase, parameterized.TestCase):
 
         self.assertShapeEqual(np.zeros((0, 0)), out)
 
+    def test_empty_circuit_with_observable(self):
+        """Empty circuits in a batch with observables are ignored."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        circuit_batch = [
+            cirq.Circuit(cirq.X(qubits[0]), cirq.X(qubits[1])),
+            cirq.Circuit()
+        ]
+        pauli_sums = util.convert_to_tensor(
+            [[cirq.Z(qubits[0]) + 0.5 * cirq.Z(qubits[1])]] * 2)
+        res = noisy_sampled_expectation_op.sampled_expectation(
+            util.convert_to_tensor(circuit_batch), [], [[]] * 2, pauli_sums,
+            [[100]] * 2)
+        self.assertAllClose(res, [[-1.5], [-2.0]])
+
 
 if __name__ == "__main__":
     tf.test.main()
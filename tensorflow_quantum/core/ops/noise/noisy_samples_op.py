@@ -21,7 +21,13 @@ from tensorflow_quantum.core.ops.load_module import load_module
 NOISY_OP_MODULE = load_module(os.path.join("noise", "_tfq_noise_ops.so"))
 
 
-def samples(programs, symbol_names, symbol_values, num_samples):
+def samples(programs,
+            symbol_names,
+            symbol_values,
+            num_samples,
+            seed=None,
+            shots_per_trajectory=0,
+            backend='trajectory'):
     """Generate samples using the C++ noisy trajectory simulator.
 
     Simulate the final state of `programs` given `symbol_values` are placed
@@ -62,10 +68,173 @@ def samples(programs, symbol_names, symbol_values, num_samples):
             dictated by `symbol_names`.
         num_samples: `tf.Tensor` with one element indicating the number of
             samples to draw for all circuits in the batch.
+        seed: Optional Python integer. Together with the global seed of
+            `tf.random.set_seed` it makes the samples reproducible, like
+            the seeds of the TensorFlow random ops. The samples do not
+            depend on the number of threads.
+        shots_per_trajectory: Optional Python integer. If positive, every
+            simulated trajectory yields this many samples instead of one,
+            which makes the samples of a trajectory correlated. Trajectories
+            of circuits whose channels are all mixtures of unitaries, like
+            depolarizing or bit flip noise, are grouped by the Kraus
+            operators they pick and every group is simulated once. Their
+            samples stay independent with `shots_per_trajectory=1`.
+        backend: Python string, how the noisy circuits are simulated:
+            'trajectory' samples quantum trajectories, 'density_matrix'
+            draws the samples from the exact density matrix of every
+            circuit (at most 12 qubits) and 'auto' picks the density
+            matrix for small circuits where it is estimated to be cheaper
+            than the trajectories.
     Returns:
         A `tf.Tensor` containing the samples taken from each circuit in
         `programs`.
     """
+    seed1, seed2 = tf.compat.v1.random.get_seed(seed)
     padded_samples = NOISY_OP_MODULE.tfq_noisy_samples(
-        programs, symbol_names, tf.cast(symbol_values, tf.float32), num_samples)
-    return tfq_utility_ops.padded_to_ragged(padded_samples)
\ No newline at end of file
+        programs,
+        symbol_names,
+        tf.cast(symbol_values, tf.float32),
+        num_samples,
+        seed=seed1,
+        seed2=seed2,
+        shots_per_trajectory=shots_per_trajectory,
+        backend=backend)
+    return tfq_utility_ops.padded_to_ragged(padded_samples)
+
+
+def samples_packed(programs,
+                   symbol_names,
+                   symbol_values,
+                   num_samples,
+                   seed=None,
+                   shots_per_trajectory=0,
+                   backend='trajectory'):
+    """Generate noisy samples as packed bitstrings with C++.
+
+    Same as `samples`, except that every sample is a single integer instead
+    of a row of bits. Bit `n_qubits - 1 - k` of a sample of a circuit on
+    `n_qubits` qubits holds the measurement of its k-th qubit.
+
+    >>> qubits = cirq.GridQubit.rect(1, 2)
+    >>> my_circuit_tensor = tfq.convert_to_tensor([
+    ...     cirq.Circuit(cirq.X(qubits[0]), cirq.depolarize(0.01)(qubits[1]))
+    ... ])
+    >>> tfq.noise.samples_packed(my_circuit_tensor, [], [[]], [4])
+    <tf.Tensor: shape=(1, 4), dtype=int64, numpy=array([[2, 2, 2, 2]])>
+
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specified by programs, following the ordering
+            dictated by `symbol_names`.
+        num_samples: `tf.Tensor` with one element indicating the number of
+            samples to draw for all circuits in the batch.
+        seed: Optional Python integer. Together with the global seed of
+            `tf.random.set_seed` it makes the samples reproducible, like
+            the seeds of the TensorFlow random ops. The samples do not
+            depend on the number of threads.
+        shots_per_trajectory: Optional Python integer. If positive, every
+            simulated trajectory yields this many samples instead of one,
+            which makes the samples of a trajectory correlated. Trajectories
+            of circuits whose channels are all mixtures of unitaries, like
+            depolarizing or bit flip noise, are grouped by the Kraus
+            operators they pick and every group is simulated once. Their
+            samples stay independent with `shots_per_trajectory=1`.
+        backend: Python string, how the noisy circuits are simulated:
+            'trajectory' samples quantum trajectories, 'density_matrix'
+            draws the samples from the exact density matrix of every
+            circuit (at most 12 qubits) and 'auto' picks the density
+            matrix for small circuits where it is estimated to be cheaper
+            than the trajectories.
+    Returns:
+        An int64 `tf.Tensor` with shape [batch_size, num_samples] containing
+        the samples taken from each circuit in `programs`.
+    """
+    seed1, seed2 = tf.compat.v1.random.get_seed(seed)
+    return NOISY_OP_MODULE.tfq_noisy_samples_packed(
+        programs,
+        symbol_names,
+        tf.cast(symbol_values, tf.float32),
+        num_samples,
+        seed=seed1,
+        seed2=seed2,
+        shots_per_trajectory=shots_per_trajectory,
+        backend=backend)
+
+
+def sample_counts(programs,
+                  symbol_names,
+                  symbol_values,
+                  num_samples,
+                  seed=None,
+                  shots_per_trajectory=0,
+                  backend='trajectory'):
+    """Count the bitstrings of noisy samples with C++.
+
+    Same as `samples`, except that the distinct bitstrings of each circuit
+    are returned along with the number of times each was sampled.
+
+    >>> qubits = cirq.GridQubit.rect(1, 2)
+    >>> my_circuit_tensor = tfq.convert_to_tensor([
+    ...     cirq.Circuit(cirq.X(qubits[0]), cirq.bit_flip(0.5)(qubits[1]))
+    ... ])
+    >>> bitstrings, counts = tfq.noise.sample_counts(
+    ...     my_circuit_tensor, [], [[]], [100])
+    >>> bitstrings
+    <tf.RaggedTensor [[2, 3]]>
+    >>> counts
+    <tf.RaggedTensor [[47, 53]]>
+
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specified by programs, following the ordering
+            dictated by `symbol_names`.
+        num_samples: `tf.Tensor` with one element indicating the number of
+            samples to draw for all circuits in the batch.
+        seed: Optional Python integer. Together with the global seed of
+            `tf.random.set_seed` it makes the samples reproducible, like
+            the seeds of the TensorFlow random ops. The samples do not
+            depend on the number of threads.
+        shots_per_trajectory: Optional Python integer. If positive, every
+            simulated trajectory yields this many samples instead of one,
+            which makes the samples of a trajectory correlated. Trajectories
+            of circuits whose channels are all mixtures of unitaries, like
+            depolarizing or bit flip noise, are grouped by the Kraus
+            operators they pick and every group is simulated once. Their
+            samples stay independent with `shots_per_trajectory=1`.
+        backend: Python string, how the noisy circuits are simulated:
+            'trajectory' samples quantum trajectories, 'density_matrix'
+            draws the samples from the exact density matrix of every
+            circuit (at most 12 qubits) and 'auto' picks the density
+            matrix for small circuits where it is estimated to be cheaper
+            than the trajectories.
+    Returns:
+        A pair of int64 `tf.RaggedTensor`s with shape [batch_size, None]
+        containing the distinct bitstrings sampled from each circuit in
+        `programs`, in increasing order and packed like the samples of
+        `samples_packed`, and the number of times each was sampled.
+    """
+    seed1, seed2 = tf.compat.v1.random.get_seed(seed)
+    bitstrings, counts, row_splits = NOISY_OP_MODULE.tfq_noisy_sample_counts(
+        programs, symbol_names, tf.cast(symbol_values, tf.float32), num_samples,
+        seed=seed1,
+        seed2=seed2,
+        shots_per_trajectory=shots_per_trajectory,
+        backend=backend)
+    return (tf.RaggedTensor.from_row_splits(bitstrings, row_splits),
+            tf.RaggedTensor.from_row_splits(counts, row_splits))
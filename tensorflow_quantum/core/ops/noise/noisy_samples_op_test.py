@@ -228,6 +228,128 @@ class NoisySamplingTest(tf.test.TestCase, parameterized.TestCase):
         for a, b in zip(op_hists, cirq_hists):
             self.assertLess(stats.entropy(a + 1e-8, b + 1e-8), 0.15)
 
+    @parameterized.parameters([
+        {
+            'channel': cirq.depolarize(0.05),
+            'shots_per_trajectory': 1
+        },  # Grouped, independent samples.
+        {
+            'channel': cirq.bit_flip(0.1),
+            'shots_per_trajectory': 20
+        },  # Grouped.
+        {
+            'channel': cirq.amplitude_damp(0.1),
+            'shots_per_trajectory': 20
+        },  # One simulation per trajectory.
+    ])
+    def test_shots_per_trajectory(self, channel, shots_per_trajectory):
+        """Test sampling several shots from every trajectory."""
+        batch_size = 3
+        n_qubits = 4
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        prefixes, resolver_batch = util.random_circuit_resolver_batch(
+            qubits, batch_size, include_channels=False)
+        suffixes, _ = util.random_circuit_resolver_batch(
+            qubits, batch_size, include_channels=False)
+        circuit_batch = [
+            prefix + channel.on_each(*qubits) + suffix
+            for prefix, suffix in zip(prefixes, suffixes)
+        ]
+
+        n_samples = (2**n_qubits) * 1000
+        op_samples = noisy_samples_op.samples(
+            util.convert_to_tensor(circuit_batch), [], [[]] * batch_size,
+            [n_samples],
+            shots_per_trajectory=shots_per_trajectory).to_list()
+        op_hists = self._compute_hists(op_samples, n_qubits)
+
+        cirq_samples = batch_util.batch_sample(circuit_batch, resolver_batch,
+                                               n_samples,
+                                               cirq.DensityMatrixSimulator())
+        cirq_hists = self._compute_hists(cirq_samples, n_qubits)
+        for a, b in zip(op_hists, cirq_hists):
+            self.assertLess(stats.entropy(a + 1e-8, b + 1e-8), 0.15)
+
+        # Seeded samples are reproducible.
+        tf.random.set_seed(1234)
+        first = noisy_samples_op.samples_packed(
+            util.convert_to_tensor(circuit_batch), [], [[]] * batch_size,
+            [n_samples],
+            seed=5,
+            shots_per_trajectory=shots_per_trajectory)
+        tf.random.set_seed(1234)
+        repeated = noisy_samples_op.samples_packed(
+            util.convert_to_tensor(circuit_batch), [], [[]] * batch_size,
+            [n_samples],
+            seed=5,
+            shots_per_trajectory=shots_per_trajectory)
+        self.assertAllEqual(first, repeated)
+
+    @parameterized.parameters([
+        {
+            'channel': cirq.depolarize(0.05)
+        },
+        {
+            'channel': cirq.amplitude_damp(0.1)
+        },
+    ])
+    def test_density_matrix_backend(self, channel):
+        """Test sampling from exact density matrices."""
+        batch_size = 3
+        n_qubits = 4
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        prefixes, resolver_batch = util.random_circuit_resolver_batch(
+            qubits, batch_size, include_channels=False)
+        suffixes, _ = util.random_circuit_resolver_batch(
+            qubits, batch_size, include_channels=False)
+        circuit_batch = [
+            prefix + channel.on_each(*qubits) + suffix
+            for prefix, suffix in zip(prefixes, suffixes)
+        ]
+
+        n_samples = (2**n_qubits) * 1000
+        op_samples = noisy_samples_op.samples(
+            util.convert_to_tensor(circuit_batch), [], [[]] * batch_size,
+            [n_samples],
+            backend='density_matrix').to_list()
+        op_hists = self._compute_hists(op_samples, n_qubits)
+
+        cirq_samples = batch_util.batch_sample(circuit_batch, resolver_batch,
+                                               n_samples,
+                                               cirq.DensityMatrixSimulator())
+        cirq_hists = self._compute_hists(cirq_samples, n_qubits)
+        for a, b in zip(op_hists, cirq_hists):
+            self.assertLess(stats.entropy(a + 1e-8, b + 1e-8), 0.15)
+
+        # Seeded samples are reproducible.
+        tf.random.set_seed(1234)
+        first = noisy_samples_op.samples_packed(
+            util.convert_to_tensor(circuit_batch), [], [[]] * batch_size,
+            [n_samples],
+            seed=5,
+            backend='density_matrix')
+        tf.random.set_seed(1234)
+        repeated = noisy_samples_op.samples_packed(
+            util.convert_to_tensor(circuit_batch), [], [[]] * batch_size,
+            [n_samples],
+            seed=5,
+            backend='density_matrix')
+        self.assertAllEqual(first, repeated)
+
+    def test_shots_per_trajectory_noiseless(self):
+        """Test that noiseless circuits are sampled from a single state."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        circuit = util.convert_to_tensor(
+            [cirq.Circuit(cirq.X(qubits[0]), cirq.I(qubits[1]))])
+        out = noisy_samples_op.samples_packed(circuit, [], [[]], [7],
+                                              shots_per_trajectory=3)
+        self.assertAllEqual(out, [[2] * 7])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'must be non-negative'):
+            noisy_samples_op.samples_packed(circuit, [], [[]], [7],
+                                            shots_per_trajectory=-1)
+
     def test_correct_padding(self):
         """Test the variable sized circuits are properly padded."""
         symbol_names = []
@@ -262,6 +384,141 @@ class NoisySamplingTest(tf.test.TestCase, parameterized.TestCase):
         self.assertEqual(a_reps.shape, (2, 10, 5))
         self.assertEqual(b_reps.shape, (2, 10, 6))
 
+    @parameterized.parameters([
+        {
+            'n_qubits': 5,
+            'batch_size': 10
+        },  # ComputeSmall.
+        {
+            'n_qubits': 8,
+            'batch_size': 1
+        }  # ComputeLarge.
+    ])
+    def test_packed_consistency(self, batch_size, n_qubits):
+        """Test packed samples against batch_util.py simulation."""
+        symbol_names = ['alpha', 'beta']
+        qubits = cirq.LineQubit.range(n_qubits)
+
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size, include_channels=True)
+
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+
+        n_samples = 10000
+        op_samples = noisy_samples_op.samples_packed(
+            util.convert_to_tensor(circuit_batch), symbol_names,
+            symbol_values_array, [n_samples])
+        self.assertEqual(op_samples.shape, (batch_size, n_samples))
+
+        op_hists = [
+            np.bincount(x, minlength=2**n_qubits) for x in op_samples.numpy()
+        ]
+
+        cirq_samples = batch_util.batch_sample(circuit_batch, resolver_batch,
+                                               n_samples,
+                                               cirq.DensityMatrixSimulator())
+
+        cirq_hists = self._compute_hists(cirq_samples, n_qubits)
+        for a, b in zip(op_hists, cirq_hists):
+            self.assertLess(stats.entropy(a + 1e-8, b + 1e-8), 1.5)
+
+    def test_packed_no_padding(self):
+        """Test packed samples of circuits with different sizes."""
+        circuits = [
+            cirq.Circuit(cirq.X(cirq.LineQubit(0))),
+            cirq.Circuit(cirq.X(cirq.LineQubit(1)),
+                         cirq.I(cirq.LineQubit(2))),
+        ]
+        out = noisy_samples_op.samples_packed(util.convert_to_tensor(circuits),
+                                              [], [[], []], [3])
+        self.assertAllEqual(out, [[1, 1, 1], [2, 2, 2]])
+
+    @parameterized.parameters([
+        {
+            'n_qubits': 5,
+            'batch_size': 10
+        },  # ComputeSmall.
+        {
+            'n_qubits': 8,
+            'batch_size': 1
+        }  # ComputeLarge.
+    ])
+    def test_sample_counts_consistency(self, batch_size, n_qubits):
+        """Test sample counts against batch_util.py simulation."""
+        symbol_names = ['alpha', 'beta']
+        qubits = cirq.LineQubit.range(n_qubits)
+
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size, include_channels=True)
+
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+
+        n_samples = 10000
+        bitstrings, counts = noisy_samples_op.sample_counts(
+            util.convert_to_tensor(circuit_batch), symbol_names,
+            symbol_values_array, [n_samples])
+
+        op_hists = []
+        for row_bits, row_counts in zip(bitstrings.to_list(),
+                                        counts.to_list()):
+            self.assertEqual(sorted(set(row_bits)), row_bits)
+            self.assertEqual(sum(row_counts), n_samples)
+            hist = np.zeros(2**n_qubits)
+            hist[row_bits] = row_counts
+            op_hists.append(hist)
+
+        cirq_samples = batch_util.batch_sample(circuit_batch, resolver_batch,
+                                               n_samples,
+                                               cirq.DensityMatrixSimulator())
+
+        cirq_hists = self._compute_hists(cirq_samples, n_qubits)
+        for a, b in zip(op_hists, cirq_hists):
+            self.assertLess(stats.entropy(a + 1e-8, b + 1e-8), 1.5)
+
+    def test_sample_counts_empty(self):
+        """Test sample counts of circuits without qubits."""
+        empty_circuit = util.convert_to_tensor([cirq.Circuit()] * 2)
+        bitstrings, counts = noisy_samples_op.sample_counts(
+            empty_circuit, [], [[], []], [5])
+        self.assertEqual(bitstrings.to_list(), [[0], [0]])
+        self.assertEqual(counts.to_list(), [[5], [5]])
+
+        bitstrings, counts = noisy_samples_op.sample_counts(
+            empty_circuit, [], [[], []], [0])
+        self.assertEqual(bitstrings.to_list(), [[], []])
+        self.assertEqual(counts.to_list(), [[], []])
+
+    def test_seeded_samples(self):
+        """Test that seeded samples are reproducible."""
+        qubits = cirq.LineQubit.range(3)
+        circuits = util.convert_to_tensor([
+            cirq.Circuit(cirq.H.on_each(*qubits),
+                         cirq.bit_flip(0.3).on_each(*qubits))
+        ] * 3)
+        # Several blocks of trajectories per circuit.
+        n_samples = [300]
+
+        tf.random.set_seed(1234)
+        first = noisy_samples_op.samples_packed(circuits, [], [[]] * 3,
+                                                n_samples, seed=5)
+        second = noisy_samples_op.samples_packed(circuits, [], [[]] * 3,
+                                                 n_samples, seed=5)
+        tf.random.set_seed(1234)
+        repeated = noisy_samples_op.samples_packed(circuits, [], [[]] * 3,
+                                                   n_samples, seed=5)
+        self.assertAllEqual(first, repeated)
+        self.assertNotAllEqual(first, second)
+        # Every circuit draws from its own streams.
+        self.assertNotAllEqual(first[0], first[1])
+
     def test_correctness_empty(self):
         """Test the expectation for empty circuits."""
         empty_circuit = util.convert_to_tensor([cirq.Circuit()])
@@ -13,6 +13,7 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
 #include <memory>
 #include <random>
 #include <vector>
@@ -37,10 +38,10 @@ limitations under the License.
 #include "tensorflow/core/lib/random/random.h"
 #include "tensorflow/core/lib/random/simple_philox.h"
 #include "tensorflow/core/platform/mutex.h"
-#include "tensorflow/core/util/guarded_philox_random.h"
 #include "tensorflow_quantum/core/ops/parse_context.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
@@ -52,11 +53,20 @@ using ::tfq::proto::Program;
 typedef qsim::Cirq::GateCirq<float> QsimGate;
 typedef qsim::Circuit<QsimGate> QsimCircuit;
 typedef qsim::NoisyCircuit<QsimGate> NoisyQsimCircuit;
+typedef std::vector<qsim::GateFused<QsimGate>> QsimFusedCircuit;
 
 class TfqNoisyExpectationOp : public tensorflow::OpKernel {
  public:
   explicit TfqNoisyExpectationOp(tensorflow::OpKernelConstruction* context)
-      : OpKernel(context) {}
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, streams_.Init(context));
+    OP_REQUIRES_OK(context, GetNoisyBackend(context, &backend_));
+    OP_REQUIRES_OK(context, context->GetAttr("target_error", &target_error_));
+    OP_REQUIRES(context, target_error_ >= 0,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "target_error must be non-negative, got ", target_error_,
+                    ".")));
+  }
 
   void Compute(tensorflow::OpKernelContext* context) override {
     // TODO (mbbrough): add more dimension checks for other inputs here.
@@ -75,12 +85,22 @@ class TfqNoisyExpectationOp : public tensorflow::OpKernel {
     tensorflow::Tensor* output = nullptr;
     OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
     auto output_tensor = output->matrix<float>();
-
-    std::vector<Program> programs;
+    tensorflow::Tensor* used_output = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(1, output_shape, &used_output));
+    auto used_tensor = used_output->matrix<int32_t>();
+    tensorflow::Tensor* variance_output = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(2, output_shape, &variance_output));
+    auto variance_tensor = variance_output->matrix<float>();
+
+    ResolvedPrograms resolved;
     std::vector<int> num_qubits;
-    std::vector<std::vector<PauliSum>> pauli_sums;
-    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &programs,
-                                                    &num_qubits, &pauli_sums));
+    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &resolved,
+                                                    &num_qubits, true));
+    const std::vector<const Program*>& programs = resolved.programs;
+    const std::vector<std::vector<const PauliSum*>>& pauli_sums =
+        resolved.p_sums;
 
     std::vector<SymbolMap> maps;
     OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
@@ -110,14 +130,21 @@ class TfqNoisyExpectationOp : public tensorflow::OpKernel {
     // Construct qsim circuits.
     std::vector<NoisyQsimCircuit> qsim_circuits(programs.size(),
                                                 NoisyQsimCircuit());
+    // The channels before the first noisy one are the same in every
+    // trajectory. They are simulated once per circuit and every trajectory
+    // starts from a copy of that state.
+    std::vector<QsimCircuit> prefixes(programs.size());
+    std::vector<QsimFusedCircuit> fused_prefixes(programs.size());
 
     Status parse_status = Status::OK();
     auto p_lock = tensorflow::mutex();
     auto construct_f = [&](int start, int end) {
       for (int i = start; i < end; i++) {
         Status local = NoisyQsimCircuitFromProgram(
-            programs[i], maps[i], num_qubits[i], false, &qsim_circuits[i]);
+            *programs[i], maps[i], num_qubits[i], false, &qsim_circuits[i]);
         NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
+        SplitNoisyCircuitPrefix(&qsim_circuits[i], &prefixes[i],
+                                &fused_prefixes[i]);
       }
     };
 
@@ -131,33 +158,160 @@ class TfqNoisyExpectationOp : public tensorflow::OpKernel {
       max_num_qubits = std::max(max_num_qubits, num);
     }
 
-    // Cross reference with standard google cloud compute instances
-    // Memory ~= 2 * num_threads * (2 * 64 * 2 ** num_qubits in circuits)
-    // e2s2 = 2 CPU, 8GB -> Can safely do 25 since Memory = 4GB
-    // e2s4 = 4 CPU, 16GB -> Can safely do 25 since Memory = 8GB
-    // ...
-    if (max_num_qubits >= 26) {
-      // If the number of qubits is lager than 24, we switch to an
-      // alternate parallelization scheme with runtime:
-      // O(n_circuits * max_j(num_samples[i])) with parallelization being
-      // multiple threads per wavefunction.
-      ComputeLarge(num_qubits, qsim_circuits, pauli_sums, num_samples, context,
-                   &output_tensor);
-    } else {
-      // Runtime: O(n_circuits * max_j(num_samples[i])) with parallelization
-      // being done over number of trials.
-      ComputeSmall(num_qubits, max_num_qubits, qsim_circuits, pauli_sums,
-                   num_samples, context, &output_tensor);
+    // Compiled observables.
+    std::vector<CompiledPauliSums> pauli_masks;
+    OP_REQUIRES_OK(context, GetPauliSumMasks(context, pauli_sums, num_qubits,
+                                             &pauli_masks));
+
+    // Trajectory r of circuit i is used by op j if r < num_samples[i][j].
+    // Trajectories run in blocks with their own random streams and the
+    // statistics of the blocks are merged in order, so the expectations only
+    // depend on the seeds and not on the number of threads.
+    const int num_ops = output_dim_op_size;
+    std::vector<int> num_trajectories(programs.size(), 0);
+    for (int i = 0; i < programs.size(); i++) {
+      // (#679) Just ignore empty program
+      if (qsim_circuits[i].channels.empty() && fused_prefixes[i].empty()) {
+        continue;
+      }
+      for (int j = 0; j < num_ops; j++) {
+        num_trajectories[i] = std::max(num_trajectories[i], num_samples[i][j]);
+      }
+    }
+    // Circuits simulated on density matrices get their exact expectations
+    // at the end and no trajectories.
+    std::vector<int> density_matrices;
+    OP_REQUIRES_OK(context,
+                   PlanDensityMatrices(backend_, num_qubits, qsim_circuits,
+                                       &num_trajectories, &density_matrices));
+    ShotBlocks blocks;
+    PlanShotBlocks(num_trajectories, &blocks);
+    const uint64_t call = streams_.NextCall();
+
+    // Op j of circuit i uses the first limits[i * num_ops + j] trajectories
+    // and stats holds their statistics. With a target error the blocks run
+    // in rounds that double the number of blocks of every circuit with an op
+    // still above the target. The new blocks are merged in order after each
+    // round and an op stops at the first block after which its standard
+    // error is within target_error_, or at num_samples. Later blocks of that
+    // round are simulated but not used.
+    std::vector<int> limits(programs.size() * num_ops, 0);
+    for (int i = 0; i < programs.size(); i++) {
+      if (num_trajectories[i] > 0) {
+        std::copy(num_samples[i].begin(), num_samples[i].end(),
+                  limits.begin() + i * num_ops);
+      }
+    }
+    const double squared_target = static_cast<double>(target_error_) *
+                                  static_cast<double>(target_error_);
+    std::vector<RunningStats> stats(programs.size() * num_ops);
+    std::vector<RunningStats> block_stats(blocks.circuits.size() * num_ops);
+    std::vector<int> num_merged(programs.size(), 0);
+    std::vector<int> tasks;
+    while (true) {
+      tasks.clear();
+      for (int i = 0; i < programs.size(); i++) {
+        const int num_blocks = blocks.offsets[i + 1] - blocks.offsets[i];
+        bool active = false;
+        for (int j = 0; j < num_ops; j++) {
+          active |= stats[i * num_ops + j].count < limits[i * num_ops + j];
+        }
+        if (!active || num_merged[i] == num_blocks) {
+          continue;
+        }
+        const int end =
+            target_error_ > 0
+                ? std::min(num_blocks, std::max(1, 2 * num_merged[i]))
+                : num_blocks;
+        for (int b = num_merged[i]; b < end; b++) {
+          tasks.push_back(blocks.offsets[i] + b);
+        }
+      }
+      if (tasks.empty()) {
+        break;
+      }
+
+      PhaseTrace trace(context, "simulate");
+      // Every thread of ComputeSmall holds kNoisyStatesPerThread states, wider
+      // circuits run one state at a time over the whole threadpool.
+      const int num_threads = context->device()
+                                  ->tensorflow_cpu_worker_threads()
+                                  ->workers->NumThreads();
+      if (max_num_qubits > MaxNarrowQubits(num_threads, kNoisyStatesPerThread,
+                                           StatePool::Global()->budget())) {
+        // If the circuits are too large for that, we switch to an
+        // alternate parallelization scheme with runtime:
+        // O(n_circuits * max_j(num_samples[i])) with parallelization being
+        // multiple threads per wavefunction.
+        ComputeLarge(num_qubits, qsim_circuits, fused_prefixes, pauli_masks,
+                     limits, blocks, tasks, call, context, &block_stats);
+      } else {
+        // Runtime: O(n_circuits * max_j(num_samples[i])) with
+        // parallelization being done over blocks of trajectories.
+        ComputeSmall(num_qubits, qsim_circuits, fused_prefixes, pauli_masks,
+                     limits, blocks, tasks, call, context, &block_stats);
+      }
+      if (!context->status().ok()) {
+        return;
+      }
+
+      for (const int t : tasks) {
+        const int i = blocks.circuits[t];
+        for (int j = 0; j < num_ops; j++) {
+          RunningStats& op_stats = stats[i * num_ops + j];
+          int& limit = limits[i * num_ops + j];
+          if (op_stats.count >= limit) {
+            continue;
+          }
+          op_stats.Merge(block_stats[t * num_ops + j]);
+          if (target_error_ > 0 && op_stats.count >= 2 &&
+              op_stats.SquaredError() <= squared_target) {
+            limit = op_stats.count;
+          }
+        }
+        num_merged[i]++;
+      }
+    }
+
+    for (int i = 0; i < programs.size(); i++) {
+      for (int j = 0; j < num_ops; j++) {
+        const RunningStats& op_stats = stats[i * num_ops + j];
+        output_tensor(i, j) =
+            num_trajectories[i] > 0 ? static_cast<float>(op_stats.mean) : -2.0;
+        used_tensor(i, j) = op_stats.count;
+        variance_tensor(i, j) = static_cast<float>(op_stats.Variance());
+      }
     }
+
+    auto exact_f = [&](const int i, const DensityMatrixSimulator& sim,
+                       const DensityMatrixStateSpace& ss, const int nq,
+                       DensityMatrixState& rho, DensityMatrixState& scratch) {
+      for (int j = 0; j < num_ops; j++) {
+        float exp_v = 0.0;
+        ComputeDensityMatrixExpectationMasks((*pauli_masks[i])[j], ss, nq, rho,
+                                             &exp_v);
+        output_tensor(i, j) = exp_v;
+      }
+      return Status::OK();
+    };
+    OP_REQUIRES_OK(context,
+                   RunDensityMatrices(context, density_matrices, num_qubits,
+                                      qsim_circuits, fused_prefixes, exact_f));
   }
 
  private:
+  RandomStreams streams_;
+  float target_error_;
+  NoisyBackend backend_;
+
   void ComputeLarge(const std::vector<int>& num_qubits,
                     const std::vector<NoisyQsimCircuit>& ncircuits,
-                    const std::vector<std::vector<PauliSum>>& pauli_sums,
-                    const std::vector<std::vector<int>>& num_samples,
+                    const std::vector<QsimFusedCircuit>& fused_prefixes,
+                    const std::vector<CompiledPauliSums>& pauli_masks,
+                    const std::vector<int>& limits, const ShotBlocks& blocks,
+                    const std::vector<int>& tasks, const uint64_t call,
                     tensorflow::OpKernelContext* context,
-                    tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+                    std::vector<RunningStats>* block_stats) {
     // Instantiate qsim objects.
     const auto tfq_for = tfq::QsimFor(context);
     using Simulator = qsim::Simulator<const tfq::QsimFor&>;
@@ -170,217 +324,167 @@ class TfqNoisyExpectationOp : public tensorflow::OpKernel {
     int largest_nq = 1;
     Simulator sim = Simulator(tfq_for);
     StateSpace ss = StateSpace(tfq_for);
-    auto sv = ss.Create(largest_nq);
-    auto scratch = ss.Create(largest_nq);
-
-    tensorflow::GuardedPhiloxRandom random_gen;
-    int max_n_shots = 1;
-    for (int i = 0; i < num_samples.size(); i++) {
-      for (int j = 0; j < num_samples[i].size(); j++) {
-        max_n_shots = std::max(max_n_shots, num_samples[i][j]);
-      }
-    }
-    random_gen.Init(tensorflow::random::New64(), tensorflow::random::New64());
-    auto local_gen =
-        random_gen.ReserveSamples128(ncircuits.size() * max_n_shots + 1);
-    tensorflow::random::SimplePhilox rand_source(&local_gen);
-
-    // Simulate programs one by one. Parallelizing over state vectors
+    StateArena<StateSpace> arena(ss);
+    auto sv = arena.Create(largest_nq);
+    auto scratch = arena.Create(largest_nq);
+    NoiselessPrefix<Simulator, StateSpace> prefix(sim, ss, &arena);
+
+    QTSimulator::Parameter param;
+    param.collect_kop_stat = false;
+    param.collect_mea_stat = false;
+    param.normalize_before_mea_gates = true;
+    std::vector<uint64_t> unused_stats;
+
+    // Simulate blocks one by one. Parallelizing over state vectors
     // we no longer parallelize over circuits. Each time we encounter a
     // a larger circuit we will grow the Statevector as necessary.
-    for (int i = 0; i < ncircuits.size(); i++) {
-      int nq = num_qubits[i];
-
-      // (#679) Just ignore empty program
-      if (ncircuits[i].channels.size() == 0) {
-        for (int j = 0; j < pauli_sums[i].size(); j++) {
-          (*output_tensor)(i, j) = -2.0;
+    int prefix_circuit = -1;
+    for (const int t : tasks) {
+      const int i = blocks.circuits[t];
+      if (i != prefix_circuit) {
+        const int nq = num_qubits[i];
+        if (nq > largest_nq) {
+          largest_nq = nq;
+          arena.Resize(largest_nq, &sv);
+          arena.Resize(largest_nq, &scratch);
         }
-        continue;
+        prefix.Set(fused_prefixes[i], largest_nq);
+        prefix_circuit = i;
       }
 
-      if (nq > largest_nq) {
-        largest_nq = nq;
-        sv = ss.Create(largest_nq);
-        scratch = ss.Create(largest_nq);
+      auto local_gen = streams_.Stream(call, i, blocks.blocks[t]);
+      tensorflow::random::SimplePhilox rand_source(&local_gen);
+      const int num_ops = pauli_masks[i]->size();
+      const int* op_limits = limits.data() + i * num_ops;
+      RunningStats* stats = block_stats->data() + t * num_ops;
+      // Trajectories past the limits of all ops are not needed.
+      int used = 0;
+      for (int j = 0; j < num_ops; j++) {
+        stats[j] = RunningStats();
+        used = std::max(used, op_limits[j]);
       }
-      QTSimulator::Parameter param;
-      param.collect_kop_stat = false;
-      param.collect_mea_stat = false;
-      param.normalize_before_mea_gates = true;
-      std::vector<uint64_t> unused_stats;
-      // Track op-wise stats.
-      std::vector<int> run_samples(num_samples[i].size(), 0);
-      std::vector<double> rolling_sums(num_samples[i].size(), 0.0);
-
-      while (1) {
-        ss.SetStateZero(sv);
-
-        QTSimulator::RunOnce(param, ncircuits[i], rand_source.Rand64(), ss, sim,
-                             scratch, sv, unused_stats);
+      const int first = blocks.blocks[t] * kShotsPerStream;
+      const int last = std::min(first + kShotsPerStream, used);
+      for (int r = first; r < last; r++) {
+        prefix.Start(sv);
+        if (!ncircuits[i].channels.empty()) {
+          QTSimulator::RunOnce(param, ncircuits[i], rand_source.Rand64(), ss,
+                               sim, scratch, sv, unused_stats);
+        }
 
         // Use this trajectory as a source for all expectation calculations.
-        for (int j = 0; j < pauli_sums[i].size(); j++) {
-          if (run_samples[j] >= num_samples[i][j]) {
+        for (int j = 0; j < num_ops; j++) {
+          if (r >= op_limits[j]) {
             continue;
           }
           float exp_v = 0.0;
           OP_REQUIRES_OK(context,
-                         ComputeExpectationQsim(pauli_sums[i][j], sim, ss, sv,
-                                                scratch, &exp_v));
-          rolling_sums[j] += static_cast<double>(exp_v);
-          run_samples[j]++;
-        }
-        bool break_loop = true;
-        for (int j = 0; j < num_samples[i].size(); j++) {
-          if (run_samples[j] < num_samples[i][j]) {
-            break_loop = false;
-            break;
-          }
-        }
-        if (break_loop) {
-          for (int j = 0; j < num_samples[i].size(); j++) {
-            rolling_sums[j] /= num_samples[i][j];
-            (*output_tensor)(i, j) = static_cast<float>(rolling_sums[j]);
-          }
-          break;
+                         ComputeExpectationMasks((*pauli_masks[i])[j], tfq_for,
+                                                 ss, sv, &exp_v));
+          stats[j].Add(exp_v);
         }
       }
     }
   }
 
   void ComputeSmall(const std::vector<int>& num_qubits,
-                    const int max_num_qubits,
                     const std::vector<NoisyQsimCircuit>& ncircuits,
-                    const std::vector<std::vector<PauliSum>>& pauli_sums,
-                    const std::vector<std::vector<int>>& num_samples,
+                    const std::vector<QsimFusedCircuit>& fused_prefixes,
+                    const std::vector<CompiledPauliSums>& pauli_masks,
+                    const std::vector<int>& limits, const ShotBlocks& blocks,
+                    const std::vector<int>& tasks, const uint64_t call,
                     tensorflow::OpKernelContext* context,
-                    tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+                    std::vector<RunningStats>* block_stats) {
     using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
     using StateSpace = Simulator::StateSpace;
     using QTSimulator =
         qsim::QuantumTrajectorySimulator<qsim::IO, QsimGate,
                                          qsim::MultiQubitGateFuser, Simulator>;
 
-    const int output_dim_batch_size = output_tensor->dimension(0);
-    std::vector<tensorflow::mutex> batch_locks(output_dim_batch_size,
-                                               tensorflow::mutex());
-
-    const int num_threads = context->device()
-                                ->tensorflow_cpu_worker_threads()
-                                ->workers->NumThreads();
-
-    // [num_threads, batch_size].
-    std::vector<std::vector<int>> rep_offsets(
-        num_threads, std::vector<int>(output_dim_batch_size, 0));
-
-    BalanceTrajectory(num_samples, num_threads, &rep_offsets);
-
-    output_tensor->setZero();
-
-    tensorflow::GuardedPhiloxRandom random_gen;
-    int max_n_shots = 1;
-    for (int i = 0; i < num_samples.size(); i++) {
-      for (int j = 0; j < num_samples[i].size(); j++) {
-        max_n_shots = std::max(max_n_shots, num_samples[i][j]);
-      }
-    }
-    random_gen.Init(tensorflow::random::New64(), tensorflow::random::New64());
+    // Workers pull blocks of trajectories, so circuits with more
+    // trajectories are spread over more threads. The most expensive blocks
+    // are handed out first.
+    std::vector<uint64_t> costs;
+    EstimateTrajectoryCosts(num_qubits, ncircuits, &costs);
+    std::vector<int> sorted_tasks(tasks);
+    SortShotBlocksByCost(blocks, costs, &sorted_tasks);
 
     Status compute_status = Status::OK();
     auto c_lock = tensorflow::mutex();
-    auto DoWork = [&](int start, int end) {
+    auto DoWork = [&](WorkQueue& queue) {
       // Begin simulation.
       const auto tfq_for = qsim::SequentialFor(1);
       int largest_nq = 1;
       Simulator sim = Simulator(tfq_for);
       StateSpace ss = StateSpace(tfq_for);
-      auto sv = ss.Create(largest_nq);
-      auto scratch = ss.Create(largest_nq);
+      StateArena<StateSpace> arena(ss);
+      auto sv = arena.Create(largest_nq);
+      auto scratch = arena.Create(largest_nq);
+      auto prefix_sv = arena.Create(largest_nq);
 
-      int n_rand = ncircuits.size() * max_n_shots + 1;
-      n_rand = (n_rand + num_threads) / num_threads;
-      auto local_gen =
-          random_gen.ReserveSamples128(ncircuits.size() * max_n_shots + 1);
-      tensorflow::random::SimplePhilox rand_source(&local_gen);
-
-      for (int i = 0; i < ncircuits.size(); i++) {
-        int nq = num_qubits[i];
-        int rep_offset = rep_offsets[start][i];
+      QTSimulator::Parameter param;
+      param.collect_kop_stat = false;
+      param.collect_mea_stat = false;
+      param.normalize_before_mea_gates = true;
+      std::vector<uint64_t> unused_stats;
 
-        // (#679) Just ignore empty program
-        if (ncircuits[i].channels.size() == 0) {
-          for (int j = 0; j < pauli_sums[i].size(); j++) {
-            (*output_tensor)(i, j) = -2.0;
+      int prefix_circuit = -1;
+      int t;
+      while (queue.Next(&t)) {
+        const int i = blocks.circuits[t];
+        if (i != prefix_circuit) {
+          const int nq = num_qubits[i];
+          if (nq > largest_nq) {
+            largest_nq = nq;
+            arena.Resize(largest_nq, &sv);
+            arena.Resize(largest_nq, &scratch);
+            arena.Resize(largest_nq, &prefix_sv);
           }
-          continue;
+          ss.SetStateZero(prefix_sv);
+          for (const auto& fused_gate : fused_prefixes[i]) {
+            qsim::ApplyFusedGate(sim, fused_gate, prefix_sv);
+          }
+          prefix_circuit = i;
         }
 
-        if (nq > largest_nq) {
-          largest_nq = nq;
-          sv = ss.Create(largest_nq);
-          scratch = ss.Create(largest_nq);
+        auto local_gen = streams_.Stream(call, i, blocks.blocks[t]);
+        tensorflow::random::SimplePhilox rand_source(&local_gen);
+        const int num_ops = pauli_masks[i]->size();
+        const int* op_limits = limits.data() + i * num_ops;
+        RunningStats* stats = block_stats->data() + t * num_ops;
+        // Trajectories past the limits of all ops are not needed.
+        int used = 0;
+        for (int j = 0; j < num_ops; j++) {
+          stats[j] = RunningStats();
+          used = std::max(used, op_limits[j]);
         }
-        QTSimulator::Parameter param;
-        param.collect_kop_stat = false;
-        param.collect_mea_stat = false;
-        param.normalize_before_mea_gates = true;
-        std::vector<uint64_t> unused_stats;
-        // Track op-wise stats.
-        std::vector<int> run_samples(num_samples[i].size(), 0);
-        std::vector<double> rolling_sums(num_samples[i].size(), 0.0);
-
-        while (1) {
-          ss.SetStateZero(sv);
-
-          QTSimulator::RunOnce(param, ncircuits[i], rand_source.Rand64(), ss,
-                               sim, scratch, sv, unused_stats);
+        const int first = blocks.blocks[t] * kShotsPerStream;
+        const int last = std::min(first + kShotsPerStream, used);
+        for (int r = first; r < last; r++) {
+          ss.Copy(prefix_sv, sv);
+          if (!ncircuits[i].channels.empty()) {
+            QTSimulator::RunOnce(param, ncircuits[i], rand_source.Rand64(), ss,
+                                 sim, scratch, sv, unused_stats);
+          }
 
           // Compute expectations across all ops using this trajectory.
-          for (int j = 0; j < pauli_sums[i].size(); j++) {
-            int p_reps = (num_samples[i][j] + num_threads - 1) / num_threads;
-            if (run_samples[j] >= p_reps + rep_offset) {
+          for (int j = 0; j < num_ops; j++) {
+            if (r >= op_limits[j]) {
               continue;
             }
             float exp_v = 0.0;
             NESTED_FN_STATUS_SYNC(
                 compute_status,
-                ComputeExpectationQsim(pauli_sums[i][j], sim, ss, sv, scratch,
-                                       &exp_v),
+                ComputeExpectationMasks((*pauli_masks[i])[j], tfq_for, ss, sv,
+                                        &exp_v),
                 c_lock);
-            rolling_sums[j] += static_cast<double>(exp_v);
-            run_samples[j]++;
-          }
-
-          // Check if we have run enough trajectories for all ops.
-          bool break_loop = true;
-          for (int j = 0; j < num_samples[i].size(); j++) {
-            int p_reps = (num_samples[i][j] + num_threads - 1) / num_threads;
-            if (run_samples[j] < p_reps + rep_offset) {
-              break_loop = false;
-              break;
-            }
-          }
-          if (break_loop) {
-            // Lock writing to this batch index in output_tensor.
-            batch_locks[i].lock();
-            for (int j = 0; j < num_samples[i].size(); j++) {
-              rolling_sums[j] /= num_samples[i][j];
-              (*output_tensor)(i, j) += static_cast<float>(rolling_sums[j]);
-            }
-            batch_locks[i].unlock();
-            break;
+            stats[j].Add(exp_v);
           }
         }
       }
     };
 
-    // block_size = 1.
-    tensorflow::thread::ThreadPool::SchedulingParams scheduling_params(
-        tensorflow::thread::ThreadPool::SchedulingStrategy::kFixedBlockSize,
-        absl::nullopt, 1);
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        num_threads, scheduling_params, DoWork);
+    RunWorkQueue(context, sorted_tasks, DoWork);
     OP_REQUIRES_OK(context, compute_status);
   }
 };
@@ -395,7 +499,13 @@ REGISTER_OP("TfqNoisyExpectation")
     .Input("symbol_values: float")
     .Input("pauli_sums: string")
     .Input("num_samples: int32")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Attr("target_error: float = 0")
+    .Attr("backend: {'trajectory', 'density_matrix', 'auto'} = 'trajectory'")
     .Output("expectations: float")
+    .Output("num_trajectories: int32")
+    .Output("variances: float")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
       TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
@@ -417,6 +527,8 @@ REGISTER_OP("TfqNoisyExpectation")
       tensorflow::shape_inference::DimensionHandle output_cols =
           c->Dim(pauli_sums_shape, 1);
       c->set_output(0, c->Matrix(output_rows, output_cols));
+      c->set_output(1, c->Matrix(output_rows, output_cols));
+      c->set_output(2, c->Matrix(output_rows, output_cols));
 
       return tensorflow::Status::OK();
     });
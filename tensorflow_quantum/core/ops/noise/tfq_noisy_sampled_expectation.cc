@@ -14,6 +14,7 @@ limitations under the License.
 ==============================================================================*/
 
 #include <memory>
+#include <numeric>
 #include <random>
 #include <vector>
 
@@ -37,10 +38,10 @@ limitations under the License.
 #include "tensorflow/core/lib/random/random.h"
 #include "tensorflow/core/lib/random/simple_philox.h"
 #include "tensorflow/core/platform/mutex.h"
-#include "tensorflow/core/util/guarded_philox_random.h"
 #include "tensorflow_quantum/core/ops/parse_context.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
@@ -52,12 +53,16 @@ using ::tfq::proto::Program;
 typedef qsim::Cirq::GateCirq<float> QsimGate;
 typedef qsim::Circuit<QsimGate> QsimCircuit;
 typedef qsim::NoisyCircuit<QsimGate> NoisyQsimCircuit;
+typedef std::vector<qsim::GateFused<QsimGate>> QsimFusedCircuit;
 
 class TfqNoisySampledExpectationOp : public tensorflow::OpKernel {
  public:
   explicit TfqNoisySampledExpectationOp(
       tensorflow::OpKernelConstruction* context)
-      : OpKernel(context) {}
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, streams_.Init(context));
+    OP_REQUIRES_OK(context, GetNoisyBackend(context, &backend_));
+  }
 
   void Compute(tensorflow::OpKernelContext* context) override {
     // TODO (mbbrough): add more dimension checks for other inputs here.
@@ -77,11 +82,13 @@ class TfqNoisySampledExpectationOp : public tensorflow::OpKernel {
     OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
     auto output_tensor = output->matrix<float>();
 
-    std::vector<Program> programs;
+    ResolvedPrograms resolved;
     std::vector<int> num_qubits;
-    std::vector<std::vector<PauliSum>> pauli_sums;
-    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &programs,
-                                                    &num_qubits, &pauli_sums));
+    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &resolved,
+                                                    &num_qubits, true));
+    const std::vector<const Program*>& programs = resolved.programs;
+    const std::vector<std::vector<const PauliSum*>>& pauli_sums =
+        resolved.p_sums;
 
     std::vector<SymbolMap> maps;
     OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
@@ -111,14 +118,21 @@ class TfqNoisySampledExpectationOp : public tensorflow::OpKernel {
     // Construct qsim circuits.
     std::vector<NoisyQsimCircuit> qsim_circuits(programs.size(),
                                                 NoisyQsimCircuit());
+    // The channels before the first noisy one are the same in every
+    // trajectory. They are simulated once per circuit and every trajectory
+    // starts from a copy of that state.
+    std::vector<QsimCircuit> prefixes(programs.size());
+    std::vector<QsimFusedCircuit> fused_prefixes(programs.size());
 
     Status parse_status = Status::OK();
     auto p_lock = tensorflow::mutex();
     auto construct_f = [&](int start, int end) {
       for (int i = start; i < end; i++) {
         Status local = NoisyQsimCircuitFromProgram(
-            programs[i], maps[i], num_qubits[i], false, &qsim_circuits[i]);
+            *programs[i], maps[i], num_qubits[i], false, &qsim_circuits[i]);
         NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
+        SplitNoisyCircuitPrefix(&qsim_circuits[i], &prefixes[i],
+                                &fused_prefixes[i]);
       }
     };
 
@@ -132,33 +146,105 @@ class TfqNoisySampledExpectationOp : public tensorflow::OpKernel {
       max_num_qubits = std::max(max_num_qubits, num);
     }
 
-    // Cross reference with standard google cloud compute instances
-    // Memory ~= 2 * num_threads * (2 * 64 * 2 ** num_qubits in circuits)
-    // e2s2 = 2 CPU, 8GB -> Can safely do 25 since Memory = 4GB
-    // e2s4 = 4 CPU, 16GB -> Can safely do 25 since Memory = 8GB
-    // ...
-    if (max_num_qubits >= 26) {
-      // If the number of qubits is lager than 25, we switch to an
+    // Compiled observables.
+    std::vector<CompiledPauliSums> pauli_masks;
+    OP_REQUIRES_OK(context, GetPauliSumMasks(context, pauli_sums, num_qubits,
+                                             &pauli_masks));
+
+    // Trajectory r of circuit i is used by op j if r < num_samples[i][j].
+    // Trajectories run in blocks with their own random streams and the sums
+    // of the blocks are added up in order, so the expectations only depend
+    // on the seeds and not on the number of threads.
+    const int num_ops = output_dim_op_size;
+    std::vector<int> num_trajectories(programs.size(), 0);
+    for (int i = 0; i < programs.size(); i++) {
+      // (#679) Just ignore empty program
+      if (qsim_circuits[i].channels.empty() && fused_prefixes[i].empty()) {
+        continue;
+      }
+      for (int j = 0; j < num_ops; j++) {
+        num_trajectories[i] = std::max(num_trajectories[i], num_samples[i][j]);
+      }
+    }
+    // Circuits simulated on density matrices sample their expectations from
+    // the exact distributions at the end and have no trajectories.
+    std::vector<int> density_matrices;
+    OP_REQUIRES_OK(context,
+                   PlanDensityMatrices(backend_, num_qubits, qsim_circuits,
+                                       &num_trajectories, &density_matrices));
+    ShotBlocks blocks;
+    PlanShotBlocks(num_trajectories, &blocks);
+    std::vector<double> block_sums(blocks.circuits.size() * num_ops, 0.0);
+    const uint64_t call = streams_.NextCall();
+
+    PhaseTrace trace(context, "simulate");
+    // Every thread of ComputeSmall holds kNoisyStatesPerThread states, wider
+    // circuits run one state at a time over the whole threadpool.
+    const int num_threads = context->device()
+                                ->tensorflow_cpu_worker_threads()
+                                ->workers->NumThreads();
+    if (max_num_qubits > MaxNarrowQubits(num_threads, kNoisyStatesPerThread,
+                                         StatePool::Global()->budget())) {
+      // If the circuits are too large for that, we switch to an
       // alternate parallelization scheme with runtime:
       // O(n_circuits * max_j(num_samples[i])) with parallelization being
       // multiple threads per wavefunction.
-      ComputeLarge(num_qubits, qsim_circuits, pauli_sums, num_samples, context,
-                   &output_tensor);
+      ComputeLarge(num_qubits, qsim_circuits, fused_prefixes, pauli_masks,
+                   num_samples, blocks, call, context, &block_sums);
     } else {
       // Runtime: O(n_circuits * max_j(num_samples[i])) with parallelization
-      // being done over number of trials.
-      ComputeSmall(num_qubits, max_num_qubits, qsim_circuits, pauli_sums,
-                   num_samples, context, &output_tensor);
+      // being done over blocks of trajectories.
+      ComputeSmall(num_qubits, qsim_circuits, fused_prefixes, pauli_masks,
+                   num_samples, blocks, call, context, &block_sums);
     }
+
+    for (int i = 0; i < programs.size(); i++) {
+      if (qsim_circuits[i].channels.empty() && fused_prefixes[i].empty()) {
+        for (int j = 0; j < num_ops; j++) {
+          output_tensor(i, j) = -2.0;
+        }
+        continue;
+      }
+      for (int j = 0; j < num_ops; j++) {
+        double sum = 0.0;
+        for (int t = blocks.offsets[i]; t < blocks.offsets[i + 1]; t++) {
+          sum += block_sums[t * num_ops + j];
+        }
+        output_tensor(i, j) = static_cast<float>(sum / num_samples[i][j]);
+      }
+    }
+
+    auto exact_f = [&](const int i, const DensityMatrixSimulator& sim,
+                       const DensityMatrixStateSpace& ss, const int nq,
+                       DensityMatrixState& rho, DensityMatrixState& scratch) {
+      auto local_gen = streams_.Stream(call, i, 0);
+      tensorflow::random::SimplePhilox rand_source(&local_gen);
+      for (int j = 0; j < num_ops; j++) {
+        float exp_v = 0.0;
+        ComputeDensityMatrixSampledExpectationMasks(
+            (*pauli_masks[i])[j], sim, ss, nq, rho, scratch, num_samples[i][j],
+            rand_source, &exp_v);
+        output_tensor(i, j) = exp_v;
+      }
+      return Status::OK();
+    };
+    OP_REQUIRES_OK(context,
+                   RunDensityMatrices(context, density_matrices, num_qubits,
+                                      qsim_circuits, fused_prefixes, exact_f));
   }
 
  private:
+  RandomStreams streams_;
+  NoisyBackend backend_;
+
   void ComputeLarge(const std::vector<int>& num_qubits,
                     const std::vector<NoisyQsimCircuit>& ncircuits,
-                    const std::vector<std::vector<PauliSum>>& pauli_sums,
+                    const std::vector<QsimFusedCircuit>& fused_prefixes,
+                    const std::vector<CompiledPauliSums>& pauli_masks,
                     const std::vector<std::vector<int>>& num_samples,
+                    const ShotBlocks& blocks, const uint64_t call,
                     tensorflow::OpKernelContext* context,
-                    tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+                    std::vector<double>* block_sums) {
     // Instantiate qsim objects.
     const auto tfq_for = tfq::QsimFor(context);
     using Simulator = qsim::Simulator<const tfq::QsimFor&>;
@@ -171,222 +257,155 @@ class TfqNoisySampledExpectationOp : public tensorflow::OpKernel {
     int largest_nq = 1;
     Simulator sim = Simulator(tfq_for);
     StateSpace ss = StateSpace(tfq_for);
-    auto sv = ss.Create(largest_nq);
-    auto scratch = ss.Create(largest_nq);
-
-    tensorflow::GuardedPhiloxRandom random_gen;
-    int max_psum_length = 1;
-    int max_n_shots = 1;
-    for (int i = 0; i < pauli_sums.size(); i++) {
-      for (int j = 0; j < pauli_sums[i].size(); j++) {
-        max_psum_length =
-            std::max(max_psum_length, pauli_sums[i][j].terms().size());
-        max_n_shots = std::max(max_n_shots, num_samples[i][j]);
-      }
-    }
-    random_gen.Init(tensorflow::random::New64(), tensorflow::random::New64());
-    auto local_gen = random_gen.ReserveSamples128(
-        ncircuits.size() * (1 + max_psum_length) * max_n_shots);
-    tensorflow::random::SimplePhilox rand_source(&local_gen);
-
-    // Simulate programs one by one. Parallelizing over state vectors
+    StateArena<StateSpace> arena(ss);
+    auto sv = arena.Create(largest_nq);
+    auto scratch = arena.Create(largest_nq);
+    NoiselessPrefix<Simulator, StateSpace> prefix(sim, ss, &arena);
+
+    QTSimulator::Parameter param;
+    param.collect_kop_stat = false;
+    param.collect_mea_stat = false;
+    param.normalize_before_mea_gates = true;
+    std::vector<uint64_t> unused_stats;
+
+    // Simulate blocks one by one. Parallelizing over state vectors
     // we no longer parallelize over circuits. Each time we encounter a
     // a larger circuit we will grow the Statevector as necessary.
-    for (int i = 0; i < ncircuits.size(); i++) {
-      int nq = num_qubits[i];
-
-      // (#679) Just ignore empty program
-      if (ncircuits[i].channels.empty()) {
-        for (int j = 0; j < pauli_sums[i].size(); j++) {
-          (*output_tensor)(i, j) = -2.0;
+    int prefix_circuit = -1;
+    for (int t = 0; t < blocks.circuits.size(); t++) {
+      const int i = blocks.circuits[t];
+      if (i != prefix_circuit) {
+        const int nq = num_qubits[i];
+        if (nq > largest_nq) {
+          largest_nq = nq;
+          arena.Resize(largest_nq, &sv);
+          arena.Resize(largest_nq, &scratch);
         }
-        continue;
+        prefix.Set(fused_prefixes[i], largest_nq);
+        prefix_circuit = i;
       }
 
-      if (nq > largest_nq) {
-        largest_nq = nq;
-        sv = ss.Create(largest_nq);
-        scratch = ss.Create(largest_nq);
-      }
-      QTSimulator::Parameter param;
-      param.collect_kop_stat = false;
-      param.collect_mea_stat = false;
-      param.normalize_before_mea_gates = true;
-      std::vector<uint64_t> unused_stats;
-      // Track op-wise stats.
-      std::vector<int> run_samples(num_samples[i].size(), 0);
-      std::vector<double> rolling_sums(num_samples[i].size(), 0.0);
-
-      while (1) {
-        ss.SetStateZero(sv);
-
-        QTSimulator::RunOnce(param, ncircuits[i], rand_source.Rand64(), ss, sim,
-                             scratch, sv, unused_stats);
+      auto local_gen = streams_.Stream(call, i, blocks.blocks[t]);
+      tensorflow::random::SimplePhilox rand_source(&local_gen);
+      const int num_ops = pauli_masks[i]->size();
+      double* sums = block_sums->data() + t * num_ops;
+      const int first = blocks.blocks[t] * kShotsPerStream;
+      const int last = std::min(first + kShotsPerStream, blocks.num_shots[i]);
+      for (int r = first; r < last; r++) {
+        prefix.Start(sv);
+        if (!ncircuits[i].channels.empty()) {
+          QTSimulator::RunOnce(param, ncircuits[i], rand_source.Rand64(), ss,
+                               sim, scratch, sv, unused_stats);
+        }
 
         // Use this trajectory as a source for all expectation calculations.
-        for (int j = 0; j < pauli_sums[i].size(); j++) {
-          if (run_samples[j] >= num_samples[i][j]) {
+        for (int j = 0; j < num_ops; j++) {
+          if (r >= num_samples[i][j]) {
             continue;
           }
           float exp_v = 0.0;
-          OP_REQUIRES_OK(context, ComputeSampledExpectationQsim(
-                                      pauli_sums[i][j], sim, ss, sv, scratch, 1,
-                                      rand_source, &exp_v));
-          rolling_sums[j] += static_cast<double>(exp_v);
-          run_samples[j]++;
-        }
-        bool break_loop = true;
-        for (int j = 0; j < num_samples[i].size(); j++) {
-          if (run_samples[j] < num_samples[i][j]) {
-            break_loop = false;
-            break;
-          }
-        }
-        if (break_loop) {
-          for (int j = 0; j < num_samples[i].size(); j++) {
-            rolling_sums[j] /= num_samples[i][j];
-            (*output_tensor)(i, j) = static_cast<float>(rolling_sums[j]);
-          }
-          break;
+          OP_REQUIRES_OK(context, ComputeSampledExpectationMasks(
+                                      (*pauli_masks[i])[j], sim, ss, sv,
+                                      scratch, 1, rand_source, &exp_v));
+          sums[j] += static_cast<double>(exp_v);
         }
       }
     }
   }
 
   void ComputeSmall(const std::vector<int>& num_qubits,
-                    const int max_num_qubits,
                     const std::vector<NoisyQsimCircuit>& ncircuits,
-                    const std::vector<std::vector<PauliSum>>& pauli_sums,
+                    const std::vector<QsimFusedCircuit>& fused_prefixes,
+                    const std::vector<CompiledPauliSums>& pauli_masks,
                     const std::vector<std::vector<int>>& num_samples,
+                    const ShotBlocks& blocks, const uint64_t call,
                     tensorflow::OpKernelContext* context,
-                    tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+                    std::vector<double>* block_sums) {
     using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
     using StateSpace = Simulator::StateSpace;
     using QTSimulator =
         qsim::QuantumTrajectorySimulator<qsim::IO, QsimGate,
                                          qsim::MultiQubitGateFuser, Simulator>;
 
-    const int output_dim_batch_size = output_tensor->dimension(0);
-    std::vector<tensorflow::mutex> batch_locks(output_dim_batch_size,
-                                               tensorflow::mutex());
-
-    const int num_threads = context->device()
-                                ->tensorflow_cpu_worker_threads()
-                                ->workers->NumThreads();
-
-    // [num_threads, batch_size].
-    std::vector<std::vector<int>> rep_offsets(
-        num_threads, std::vector<int>(output_dim_batch_size, 0));
-
-    BalanceTrajectory(num_samples, num_threads, &rep_offsets);
-
-    output_tensor->setZero();
-
-    tensorflow::GuardedPhiloxRandom random_gen;
-    int max_psum_length = 1;
-    int max_n_shots = 1;
-    for (int i = 0; i < pauli_sums.size(); i++) {
-      for (int j = 0; j < pauli_sums[i].size(); j++) {
-        max_psum_length =
-            std::max(max_psum_length, pauli_sums[i][j].terms().size());
-        max_n_shots = std::max(max_n_shots, num_samples[i][j]);
-      }
-    }
-    random_gen.Init(tensorflow::random::New64(), tensorflow::random::New64());
+    // Workers pull blocks of trajectories, so circuits with more
+    // trajectories are spread over more threads. The most expensive blocks
+    // are handed out first.
+    std::vector<int> tasks(blocks.circuits.size());
+    std::iota(tasks.begin(), tasks.end(), 0);
+    std::vector<uint64_t> costs;
+    EstimateTrajectoryCosts(num_qubits, ncircuits, &costs);
+    SortShotBlocksByCost(blocks, costs, &tasks);
 
     Status compute_status = Status::OK();
     auto c_lock = tensorflow::mutex();
-    auto DoWork = [&](int start, int end) {
+    auto DoWork = [&](WorkQueue& queue) {
       // Begin simulation.
       const auto tfq_for = qsim::SequentialFor(1);
       int largest_nq = 1;
       Simulator sim = Simulator(tfq_for);
       StateSpace ss = StateSpace(tfq_for);
-      auto sv = ss.Create(largest_nq);
-      auto scratch = ss.Create(largest_nq);
-
-      int num_rand = ncircuits.size() * (1 + max_psum_length) * max_n_shots;
-      num_rand = (num_rand + num_threads) / num_threads + 1;
-      auto local_gen = random_gen.ReserveSamples128(num_rand);
-      tensorflow::random::SimplePhilox rand_source(&local_gen);
+      StateArena<StateSpace> arena(ss);
+      auto sv = arena.Create(largest_nq);
+      auto scratch = arena.Create(largest_nq);
+      auto prefix_sv = arena.Create(largest_nq);
 
-      for (int i = 0; i < ncircuits.size(); i++) {
-        int nq = num_qubits[i];
-        int rep_offset = rep_offsets[start][i];
+      QTSimulator::Parameter param;
+      param.collect_kop_stat = false;
+      param.collect_mea_stat = false;
+      param.normalize_before_mea_gates = true;
+      std::vector<uint64_t> unused_stats;
 
-        // (#679) Just ignore empty program
-        if (ncircuits[i].channels.empty()) {
-          for (int j = 0; j < pauli_sums[i].size(); j++) {
-            (*output_tensor)(i, j) = -2.0;
+      int prefix_circuit = -1;
+      int t;
+      while (queue.Next(&t)) {
+        const int i = blocks.circuits[t];
+        if (i != prefix_circuit) {
+          const int nq = num_qubits[i];
+          if (nq > largest_nq) {
+            largest_nq = nq;
+            arena.Resize(largest_nq, &sv);
+            arena.Resize(largest_nq, &scratch);
+            arena.Resize(largest_nq, &prefix_sv);
           }
-          continue;
-        }
-
-        if (nq > largest_nq) {
-          largest_nq = nq;
-          sv = ss.Create(largest_nq);
-          scratch = ss.Create(largest_nq);
+          ss.SetStateZero(prefix_sv);
+          for (const auto& fused_gate : fused_prefixes[i]) {
+            qsim::ApplyFusedGate(sim, fused_gate, prefix_sv);
+          }
+          prefix_circuit = i;
         }
-        QTSimulator::Parameter param;
-        param.collect_kop_stat = false;
-        param.collect_mea_stat = false;
-        param.normalize_before_mea_gates = true;
-        std::vector<uint64_t> unused_stats;
-        // Track op-wise stats.
-        std::vector<int> run_samples(num_samples[i].size(), 0);
-        std::vector<double> rolling_sums(num_samples[i].size(), 0.0);
-
-        while (1) {
-          ss.SetStateZero(sv);
 
-          QTSimulator::RunOnce(param, ncircuits[i], rand_source.Rand64(), ss,
-                               sim, scratch, sv, unused_stats);
+        auto local_gen = streams_.Stream(call, i, blocks.blocks[t]);
+        tensorflow::random::SimplePhilox rand_source(&local_gen);
+        const int num_ops = pauli_masks[i]->size();
+        double* sums = block_sums->data() + t * num_ops;
+        const int first = blocks.blocks[t] * kShotsPerStream;
+        const int last = std::min(first + kShotsPerStream, blocks.num_shots[i]);
+        for (int r = first; r < last; r++) {
+          ss.Copy(prefix_sv, sv);
+          if (!ncircuits[i].channels.empty()) {
+            QTSimulator::RunOnce(param, ncircuits[i], rand_source.Rand64(), ss,
+                                 sim, scratch, sv, unused_stats);
+          }
 
           // Compute expectations across all ops using this trajectory.
-          for (int j = 0; j < pauli_sums[i].size(); j++) {
-            int p_reps = (num_samples[i][j] + num_threads - 1) / num_threads;
-            if (run_samples[j] >= p_reps + rep_offset) {
+          for (int j = 0; j < num_ops; j++) {
+            if (r >= num_samples[i][j]) {
               continue;
             }
             float exp_v = 0.0;
             NESTED_FN_STATUS_SYNC(
                 compute_status,
-                ComputeSampledExpectationQsim(pauli_sums[i][j], sim, ss, sv,
-                                              scratch, 1, rand_source, &exp_v),
+                ComputeSampledExpectationMasks((*pauli_masks[i])[j], sim, ss,
+                                               sv, scratch, 1, rand_source,
+                                               &exp_v),
                 c_lock);
-            rolling_sums[j] += static_cast<double>(exp_v);
-            run_samples[j]++;
-          }
-
-          // Check if we have run enough trajectories for all ops.
-          bool break_loop = true;
-          for (int j = 0; j < num_samples[i].size(); j++) {
-            int p_reps = (num_samples[i][j] + num_threads - 1) / num_threads;
-            if (run_samples[j] < p_reps + rep_offset) {
-              break_loop = false;
-              break;
-            }
-          }
-          if (break_loop) {
-            // Lock writing to this batch index in output_tensor.
-            batch_locks[i].lock();
-            for (int j = 0; j < num_samples[i].size(); j++) {
-              rolling_sums[j] /= num_samples[i][j];
-              (*output_tensor)(i, j) += static_cast<float>(rolling_sums[j]);
-            }
-            batch_locks[i].unlock();
-            break;
+            sums[j] += static_cast<double>(exp_v);
           }
         }
       }
     };
 
-    // block_size = 1.
-    tensorflow::thread::ThreadPool::SchedulingParams scheduling_params(
-        tensorflow::thread::ThreadPool::SchedulingStrategy::kFixedBlockSize,
-        absl::nullopt, 1);
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        num_threads, scheduling_params, DoWork);
+    RunWorkQueue(context, tasks, DoWork);
     OP_REQUIRES_OK(context, compute_status);
   }
 };
@@ -401,6 +420,9 @@ REGISTER_OP("TfqNoisySampledExpectation")
     .Input("symbol_values: float")
     .Input("pauli_sums: string")
     .Input("num_samples: int32")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Attr("backend: {'trajectory', 'density_matrix', 'auto'} = 'trajectory'")
     .Output("expectations: float")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
@@ -15,7 +15,11 @@ limitations under the License.
 
 #include <stdlib.h>
 
+#include <algorithm>
+#include <map>
+#include <numeric>
 #include <string>
+#include <vector>
 
 #include "../qsim/lib/channel.h"
 #include "../qsim/lib/channels_cirq.h"
@@ -36,10 +40,12 @@ limitations under the License.
 #include "tensorflow/core/lib/core/threadpool.h"
 #include "tensorflow/core/lib/random/random.h"
 #include "tensorflow/core/lib/random/simple_philox.h"
-#include "tensorflow/core/util/guarded_philox_random.h"
 #include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/ops/tfq_simulate_utils.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
 #include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
+#include "tensorflow_quantum/core/src/sample_counts.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
@@ -50,21 +56,33 @@ using ::tfq::proto::Program;
 typedef qsim::Cirq::GateCirq<float> QsimGate;
 typedef qsim::Circuit<QsimGate> QsimCircuit;
 typedef qsim::NoisyCircuit<QsimGate> NoisyQsimCircuit;
+typedef std::vector<qsim::GateFused<QsimGate>> QsimFusedCircuit;
 
 class TfqNoisySamplesOp : public tensorflow::OpKernel {
  public:
-  explicit TfqNoisySamplesOp(tensorflow::OpKernelConstruction* context)
-      : OpKernel(context) {}
+  explicit TfqNoisySamplesOp(tensorflow::OpKernelConstruction* context,
+                             const SampleFormat format = kSampleBits)
+      : OpKernel(context), format_(format) {
+    OP_REQUIRES_OK(context, streams_.Init(context));
+    OP_REQUIRES_OK(context, GetNoisyBackend(context, &backend_));
+    OP_REQUIRES_OK(context, context->GetAttr("shots_per_trajectory",
+                                             &shots_per_trajectory_));
+    OP_REQUIRES(context, shots_per_trajectory_ >= 0,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "shots_per_trajectory must be non-negative, got ",
+                    shots_per_trajectory_, ".")));
+  }
 
   void Compute(tensorflow::OpKernelContext* context) override {
     // TODO (mbbrough): add more dimension checks for other inputs here.
     DCHECK_EQ(4, context->num_inputs());
 
     // Parse to Program Proto and num_qubits.
-    std::vector<Program> programs;
+    ResolvedPrograms resolved;
     std::vector<int> num_qubits;
     OP_REQUIRES_OK(context,
-                   GetProgramsAndNumQubits(context, &programs, &num_qubits));
+                   GetProgramsAndNumQubits(context, &resolved, &num_qubits));
+    const std::vector<const Program*>& programs = resolved.programs;
 
     // Parse symbol maps for parameter resolution in the circuits.
     std::vector<SymbolMap> maps;
@@ -81,14 +99,25 @@ class TfqNoisySamplesOp : public tensorflow::OpKernel {
     // Construct qsim circuits.
     std::vector<NoisyQsimCircuit> qsim_circuits(programs.size(),
                                                 NoisyQsimCircuit());
+    // The channels before the first noisy one are the same in every
+    // trajectory. They are simulated once per circuit and every trajectory
+    // starts from a copy of that state.
+    std::vector<QsimCircuit> prefixes(programs.size());
+    std::vector<QsimFusedCircuit> fused_prefixes(programs.size());
 
     Status parse_status = Status::OK();
     auto p_lock = tensorflow::mutex();
     auto construct_f = [&](int start, int end) {
       for (int i = start; i < end; i++) {
-        auto r = NoisyQsimCircuitFromProgram(
-            programs[i], maps[i], num_qubits[i], true, &qsim_circuits[i]);
+        // Several shots per trajectory are sampled from the final state
+        // instead of a terminal measurement.
+        auto r = NoisyQsimCircuitFromProgram(*programs[i], maps[i],
+                                             num_qubits[i],
+                                             shots_per_trajectory_ == 0,
+                                             &qsim_circuits[i]);
         NESTED_FN_STATUS_SYNC(parse_status, r, p_lock);
+        SplitNoisyCircuitPrefix(&qsim_circuits[i], &prefixes[i],
+                                &fused_prefixes[i]);
       }
     };
 
@@ -103,39 +132,263 @@ class TfqNoisySamplesOp : public tensorflow::OpKernel {
     }
 
     const int output_dim_size = maps.size();
-    tensorflow::TensorShape output_shape;
-    output_shape.AddDim(output_dim_size);
-    output_shape.AddDim(num_samples);
-    output_shape.AddDim(max_num_qubits);
-
-    tensorflow::Tensor* output = nullptr;
-    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
-    auto output_tensor = output->tensor<int8_t, 3>();
+    // Every trajectory yields one sample, so counts are taken from packed
+    // samples in a temporary tensor.
+    SampleWriter writer;
+    tensorflow::Tensor samples;
+    if (format_ == kSampleCounts) {
+      OP_REQUIRES_OK(context, SampleWriter::AllocateTemp(
+                                  context, output_dim_size, num_samples,
+                                  max_num_qubits, &samples, &writer));
+    } else {
+      OP_REQUIRES_OK(context, SampleWriter::Allocate(
+                                  context, format_ == kSamplePacked,
+                                  output_dim_size, num_samples,
+                                  max_num_qubits, &writer));
+    }
 
     if (num_samples == 0 || output_dim_size == 0 || max_num_qubits == 0) {
+      if (format_ == kSampleCounts) {
+        // Circuits without qubits always measure the empty bitstring.
+        std::vector<BitstringCounts> counts(output_dim_size);
+        for (auto& circuit_counts : counts) {
+          if (num_samples > 0) {
+            circuit_counts.push_back({0, static_cast<uint64_t>(num_samples)});
+          }
+        }
+        OP_REQUIRES_OK(context, OutputSampleCounts(context, counts));
+      }
       return;  // bug in qsim dependency we can't control.
     }
 
-    // Cross reference with standard google cloud compute instances
-    // Memory ~= 2 * num_threads * (2 * 64 * 2 ** num_qubits in circuits)
-    // e2s2 = 2 CPU, 8GB -> Can safely do 25 since Memory = 4GB
-    // e2s4 = 4 CPU, 16GB -> Can safely do 25 since Memory = 8GB
-    // ...
-    if (max_num_qubits >= 26) {
-      ComputeLarge(num_qubits, max_num_qubits, num_samples, qsim_circuits,
-                   context, &output_tensor);
+    // Trajectory r of circuit i yields samples [r * shots, (r + 1) * shots)
+    // for shots = max(1, shots_per_trajectory_) and is drawn from the random
+    // stream of its block. The trajectories of circuits whose channels are
+    // all mixtures of unitaries are instead grouped by their Kraus operators,
+    // see SampleGroupedTrajectories. Circuits simulated on density matrices
+    // have no trajectories, all their samples are drawn from the exact
+    // distribution at the end.
+    const int shots = std::max(1, shots_per_trajectory_);
+    const int num_trajectories = (num_samples + shots - 1) / shots;
+    std::vector<int> grouped;
+    std::vector<int> trajectories(output_dim_size, num_trajectories);
+    std::vector<int> density_matrices;
+    OP_REQUIRES_OK(context,
+                   PlanDensityMatrices(backend_, num_qubits, qsim_circuits,
+                                       &trajectories, &density_matrices));
+    for (int i = 0; i < output_dim_size; i++) {
+      if (trajectories[i] > 0 && shots_per_trajectory_ > 0 &&
+          IsUnitaryMixture(qsim_circuits[i])) {
+        grouped.push_back(i);
+        trajectories[i] = 0;
+      }
+    }
+    ShotBlocks blocks;
+    PlanShotBlocks(trajectories, &blocks);
+    const uint64_t call = streams_.NextCall();
+
+    PhaseTrace trace(context, "simulate");
+    // Every thread of ComputeSmall holds kNoisyStatesPerThread states, wider
+    // circuits run one state at a time over the whole threadpool.
+    const int num_threads = context->device()
+                                ->tensorflow_cpu_worker_threads()
+                                ->workers->NumThreads();
+    if (max_num_qubits > MaxNarrowQubits(num_threads, kNoisyStatesPerThread,
+                                         StatePool::Global()->budget())) {
+      ComputeLarge(num_qubits, num_samples, qsim_circuits, fused_prefixes,
+                   blocks, grouped, call, context, writer);
     } else {
-      ComputeSmall(num_qubits, max_num_qubits, num_samples, qsim_circuits,
-                   context, &output_tensor);
+      ComputeSmall(num_qubits, num_samples, qsim_circuits, fused_prefixes,
+                   blocks, grouped, call, context, writer);
+    }
+
+    auto exact_f = [&](const int i, const DensityMatrixSimulator& sim,
+                       const DensityMatrixStateSpace& ss, const int nq,
+                       DensityMatrixState& rho, DensityMatrixState& scratch) {
+      auto local_gen = streams_.Stream(call, i, 0);
+      tensorflow::random::SimplePhilox rand_source(&local_gen);
+      std::vector<double> probabilities;
+      std::vector<uint64_t> samples;
+      DensityMatrixDiagonal(ss, nq, rho, &probabilities);
+      SampleProbabilities(probabilities, num_samples, &rand_source, &samples);
+      writer.Write(i, 0, nq, samples.data(), num_samples);
+      return Status::OK();
+    };
+    OP_REQUIRES_OK(context,
+                   RunDensityMatrices(context, density_matrices, num_qubits,
+                                      qsim_circuits, fused_prefixes, exact_f));
+
+    if (format_ == kSampleCounts) {
+      std::vector<BitstringCounts> counts(output_dim_size);
+      auto count_f = [&](int start, int end) {
+        for (int i = start; i < end; i++) {
+          tensorflow::int64* row =
+              samples.flat<tensorflow::int64>().data() +
+              static_cast<int64_t>(i) * num_samples;
+          CountSamples(row, row + num_samples, &counts[i]);
+        }
+      };
+      context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+          output_dim_size, num_samples, count_f);
+      OP_REQUIRES_OK(context, OutputSampleCounts(context, counts));
     }
   }
 
  private:
-  void ComputeLarge(const std::vector<int>& num_qubits,
-                    const int max_num_qubits, const int num_samples,
+  const SampleFormat format_;
+  RandomStreams streams_;
+  int shots_per_trajectory_;
+  NoisyBackend backend_;
+
+  // True if every channel of ncircuit picks one of its unitary Kraus
+  // operators with a fixed probability, independent of the state.
+  static bool IsUnitaryMixture(const NoisyQsimCircuit& ncircuit) {
+    for (const auto& channel : ncircuit.channels) {
+      for (const auto& kop : channel) {
+        if (!kop.unitary ||
+            kop.kind == qsim::KrausOperator<QsimGate>::kMeasurement) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Kraus operator of channel picked by the uniform value r in [0, 1).
+  static int ChooseKrausOperator(const qsim::Channel<QsimGate>& channel,
+                                 const double r) {
+    double cp = 0;
+    for (int k = 0; k + 1 < channel.size(); k++) {
+      cp += channel[k].prob;
+      if (r < cp) {
+        return k;
+      }
+    }
+    return channel.size() - 1;
+  }
+
+  // Draws count samples of the nq qubit state in sv and writes them in
+  // random order: qsim returns samples sorted by bitstring.
+  template <typename StateSpaceT>
+  static void DrawSamples(const StateSpaceT& ss,
+                          const typename StateSpaceT::State& sv,
+                          const int count,
+                          tensorflow::random::SimplePhilox* rng,
+                          std::vector<uint64_t>* samples) {
+    *samples = ss.Sample(sv, count, rng->Rand32());
+    for (size_t s = samples->size(); s > 1; s--) {
+      std::swap((*samples)[s - 1], (*samples)[rng->Uniform(s)]);
+    }
+  }
+
+  // Runs trajectory r of circuit i from the noiseless prefix state copied
+  // into sv and writes its samples.
+  template <typename QTSimulator, typename SimT, typename StateSpaceT,
+            typename StateT>
+  void SampleTrajectory(const int i, const int r, const int nq,
+                        const int num_samples,
+                        const NoisyQsimCircuit& ncircuit,
+                        const typename QTSimulator::Parameter& param,
+                        const SimT& sim, const StateSpaceT& ss,
+                        tensorflow::random::SimplePhilox* rand_source,
+                        StateT& scratch, StateT& sv,
+                        std::vector<uint64_t>* samples,
+                        const SampleWriter& writer) const {
+    if (shots_per_trajectory_ == 0) {
+      QTSimulator::RunOnce(param, ncircuit, rand_source->Rand64(), ss, sim,
+                           scratch, sv, *samples);
+      writer.Write(i, r, nq, (*samples)[0]);
+      return;
+    }
+    if (!ncircuit.channels.empty()) {
+      QTSimulator::RunOnce(param, ncircuit, rand_source->Rand64(), ss, sim,
+                           scratch, sv, *samples);
+    }
+    const int first = r * shots_per_trajectory_;
+    const int count = std::min(shots_per_trajectory_, num_samples - first);
+    DrawSamples(ss, sv, count, rand_source, samples);
+    writer.Write(i, first, nq, samples->data(), samples->size());
+  }
+
+  // Draws the samples of circuit i, whose channels are all mixtures of
+  // unitaries (see IsUnitaryMixture). The Kraus operators of every
+  // trajectory are picked up front, from the random stream of its block,
+  // and the trajectories with the same picks are simulated once, starting
+  // from the noiseless prefix state that start puts into sv. The samples of
+  // all trajectories of a group are drawn together from its final state.
+  template <typename SimT, typename StateSpaceT, typename StateT,
+            typename StartT>
+  void SampleGroupedTrajectories(const int i, const int nq,
+                                 const int num_samples,
+                                 const NoisyQsimCircuit& ncircuit,
+                                 const uint64_t call, const SimT& sim,
+                                 const StateSpaceT& ss, const StartT& start,
+                                 StateT& sv, const SampleWriter& writer) const {
+    const int shots = shots_per_trajectory_;
+    const int num_trajectories = (num_samples + shots - 1) / shots;
+    const int num_blocks =
+        (num_trajectories + kShotsPerStream - 1) / kShotsPerStream;
+
+    // Groups in the order of their first trajectory.
+    std::map<std::vector<int>, int> group_ids;
+    std::vector<const std::vector<int>*> group_picks;
+    std::vector<std::vector<int>> group_trajectories;
+    std::vector<int> picks;
+    for (int b = 0; b < num_blocks; b++) {
+      auto local_gen = streams_.Stream(call, i, b);
+      tensorflow::random::SimplePhilox rand_source(&local_gen);
+      const int last = std::min((b + 1) * kShotsPerStream, num_trajectories);
+      for (int r = b * kShotsPerStream; r < last; r++) {
+        picks.clear();
+        for (const auto& channel : ncircuit.channels) {
+          if (channel.size() > 1) {
+            picks.push_back(
+                ChooseKrausOperator(channel, rand_source.RandDouble()));
+          }
+        }
+        auto inserted = group_ids.emplace(picks, group_trajectories.size());
+        if (inserted.second) {
+          group_picks.push_back(&inserted.first->first);
+          group_trajectories.emplace_back();
+        }
+        group_trajectories[inserted.first->second].push_back(r);
+      }
+    }
+
+    std::vector<uint64_t> samples;
+    for (int g = 0; g < group_trajectories.size(); g++) {
+      start(sv);
+      int m = 0;
+      for (const auto& channel : ncircuit.channels) {
+        const int k = channel.size() > 1 ? (*group_picks[g])[m++] : 0;
+        for (const auto& op : channel[k].ops) {
+          qsim::ApplyGate(sim, op, sv);
+        }
+      }
+
+      int count = 0;
+      for (const int r : group_trajectories[g]) {
+        count += std::min(shots, num_samples - r * shots);
+      }
+      // Streams past the trajectory blocks are used for the samples.
+      auto local_gen = streams_.Stream(call, i, num_blocks + g);
+      tensorflow::random::SimplePhilox rand_source(&local_gen);
+      DrawSamples(ss, sv, count, &rand_source, &samples);
+      int s = 0;
+      for (const int r : group_trajectories[g]) {
+        const int n = std::min(shots, num_samples - r * shots);
+        writer.Write(i, r * shots, nq, samples.data() + s, n);
+        s += n;
+      }
+    }
+  }
+
+  void ComputeLarge(const std::vector<int>& num_qubits, const int num_samples,
                     const std::vector<NoisyQsimCircuit>& ncircuits,
-                    tensorflow::OpKernelContext* context,
-                    tensorflow::TTypes<int8_t, 3>::Tensor* output_tensor) {
+                    const std::vector<QsimFusedCircuit>& fused_prefixes,
+                    const ShotBlocks& blocks, const std::vector<int>& grouped,
+                    const uint64_t call, tensorflow::OpKernelContext* context,
+                    const SampleWriter& writer) {
     // Instantiate qsim objects.
     const auto tfq_for = tfq::QsimFor(context);
     using Simulator = qsim::Simulator<const tfq::QsimFor&>;
@@ -148,184 +401,180 @@ class TfqNoisySamplesOp : public tensorflow::OpKernel {
     int largest_nq = 1;
     Simulator sim = Simulator(tfq_for);
     StateSpace ss = StateSpace(tfq_for);
-    auto sv = ss.Create(largest_nq);
-    auto scratch = ss.Create(largest_nq);
-
-    tensorflow::GuardedPhiloxRandom random_gen;
-    random_gen.Init(tensorflow::random::New64(), tensorflow::random::New64());
-    auto local_gen =
-        random_gen.ReserveSamples32(2 * num_samples * ncircuits.size() + 2);
-    tensorflow::random::SimplePhilox rand_source(&local_gen);
-
-    // Simulate programs one by one. Parallelizing over state vectors
-    // we no longer parallelize over circuits. Each time we encounter a
-    // a larger circuit we will grow the Statevector as nescessary.
-    for (int i = 0; i < ncircuits.size(); i++) {
-      int nq = num_qubits[i];
-
+    StateArena<StateSpace> arena(ss);
+    auto sv = arena.Create(largest_nq);
+    auto scratch = arena.Create(largest_nq);
+    NoiselessPrefix<Simulator, StateSpace> prefix(sim, ss, &arena);
+
+    QTSimulator::Parameter param;
+    param.collect_kop_stat = false;
+    param.collect_mea_stat = true;
+    param.normalize_before_mea_gates = true;
+    std::vector<uint64_t> gathered_samples;
+
+    auto simulate_prefix = [&](const int i) {
+      const int nq = num_qubits[i];
       if (nq > largest_nq) {
         // need to switch to larger statespace.
         largest_nq = nq;
-        sv = ss.Create(largest_nq);
-        scratch = ss.Create(largest_nq);
+        arena.Resize(largest_nq, &sv);
+        arena.Resize(largest_nq, &scratch);
       }
+      prefix.Set(fused_prefixes[i], largest_nq);
+    };
 
-      QTSimulator::Parameter param;
-      param.collect_kop_stat = false;
-      param.collect_mea_stat = true;
-      param.normalize_before_mea_gates = true;
-
-      // Track op-wise stats.
-      std::vector<uint64_t> gathered_samples;
+    // Simulate blocks one by one. Parallelizing over state vectors
+    // we no longer parallelize over circuits. Each time we encounter a
+    // a larger circuit we will grow the Statevector as nescessary.
+    int prefix_circuit = -1;
+    for (int t = 0; t < blocks.circuits.size(); t++) {
+      const int i = blocks.circuits[t];
+      if (i != prefix_circuit) {
+        simulate_prefix(i);
+        prefix_circuit = i;
+      }
 
-      for (int j = 0; j < num_samples; j++) {
-        ss.SetStateZero(sv);
-
-        QTSimulator::RunOnce(param, ncircuits[i], rand_source.Rand64(), ss, sim,
-                             scratch, sv, gathered_samples);
-        uint64_t q_ind = 0;
-        uint64_t mask = 1;
-        bool val = 0;
-        while (q_ind < nq) {
-          val = gathered_samples[0] & mask;
-          (*output_tensor)(
-              i, j, static_cast<ptrdiff_t>(max_num_qubits - q_ind - 1)) = val;
-          q_ind++;
-          mask <<= 1;
-        }
-        while (q_ind < max_num_qubits) {
-          (*output_tensor)(
-              i, j, static_cast<ptrdiff_t>(max_num_qubits - q_ind - 1)) = -2;
-          q_ind++;
-        }
+      auto local_gen = streams_.Stream(call, i, blocks.blocks[t]);
+      tensorflow::random::SimplePhilox rand_source(&local_gen);
+      const int first = blocks.blocks[t] * kShotsPerStream;
+      const int last = std::min(first + kShotsPerStream, blocks.num_shots[i]);
+      for (int r = first; r < last; r++) {
+        prefix.Start(sv);
+        SampleTrajectory<QTSimulator>(i, r, num_qubits[i], num_samples,
+                                      ncircuits[i], param, sim, ss,
+                                      &rand_source, scratch, sv,
+                                      &gathered_samples, writer);
       }
     }
+
+    for (const int i : grouped) {
+      simulate_prefix(i);
+      SampleGroupedTrajectories(
+          i, num_qubits[i], num_samples, ncircuits[i], call, sim, ss,
+          [&prefix](StateSpace::State& state) { prefix.Start(state); }, sv,
+          writer);
+    }
   }
 
-  void ComputeSmall(const std::vector<int>& num_qubits,
-                    const int max_num_qubits, const int num_samples,
+  void ComputeSmall(const std::vector<int>& num_qubits, const int num_samples,
                     const std::vector<NoisyQsimCircuit>& ncircuits,
-                    tensorflow::OpKernelContext* context,
-                    tensorflow::TTypes<int8_t, 3>::Tensor* output_tensor) {
+                    const std::vector<QsimFusedCircuit>& fused_prefixes,
+                    const ShotBlocks& blocks, const std::vector<int>& grouped,
+                    const uint64_t call, tensorflow::OpKernelContext* context,
+                    const SampleWriter& writer) {
     using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
     using StateSpace = Simulator::StateSpace;
     using QTSimulator =
         qsim::QuantumTrajectorySimulator<qsim::IO, QsimGate,
                                          qsim::MultiQubitGateFuser, Simulator>;
 
-    const int output_dim_batch_size = output_tensor->dimension(0);
-    const int num_threads = context->device()
-                                ->tensorflow_cpu_worker_threads()
-                                ->workers->NumThreads();
-
-    // [num_threads, batch_size].
-    std::vector<std::vector<int>> rep_offsets(
-        num_threads, std::vector<int>(output_dim_batch_size, 0));
-    BalanceTrajectory(num_samples, num_threads, &rep_offsets);
-
-    // [num_threads, batch_size] stores the number of
-    // samples written by thread range [0, i].
-    std::vector<std::vector<long>> offset_prefix_sum(
-        num_threads, std::vector<long>(output_dim_batch_size, 0));
-
-    for (int i = 0; i < output_dim_batch_size; i++) {
-      int p_reps = (num_samples + num_threads - 1) / num_threads;
-      offset_prefix_sum[0][i] = rep_offsets[0][i] + p_reps;
-      for (int j = 1; j < num_threads; j++) {
-        offset_prefix_sum[j][i] += offset_prefix_sum[j - 1][i];
-        offset_prefix_sum[j][i] += rep_offsets[j][i] + p_reps;
-      }
-    }
-
-    tensorflow::GuardedPhiloxRandom random_gen;
-    random_gen.Init(tensorflow::random::New64(), tensorflow::random::New64());
-
-    auto DoWork = [&](int start, int end) {
+    // Workers pull blocks of trajectories, every block writes its own
+    // samples. Grouped circuits are one task each, numbered after the
+    // blocks. They can not be split and go first, followed by the blocks
+    // from the most to the least expensive.
+    const int num_blocks = blocks.circuits.size();
+    std::vector<int> tasks(num_blocks);
+    std::iota(tasks.begin(), tasks.end(), 0);
+    std::vector<uint64_t> costs;
+    EstimateTrajectoryCosts(num_qubits, ncircuits, &costs);
+    SortShotBlocksByCost(blocks, costs, &tasks);
+    std::vector<int> grouped_tasks(grouped.size());
+    std::iota(grouped_tasks.begin(), grouped_tasks.end(), num_blocks);
+    tasks.insert(tasks.begin(), grouped_tasks.begin(), grouped_tasks.end());
+
+    auto DoWork = [&](WorkQueue& queue) {
       // Begin simulation.
       const auto tfq_for = qsim::SequentialFor(1);
       int largest_nq = 1;
       Simulator sim = Simulator(tfq_for);
       StateSpace ss = StateSpace(tfq_for);
-      auto sv = ss.Create(largest_nq);
-      auto scratch = ss.Create(largest_nq);
+      StateArena<StateSpace> arena(ss);
+      auto sv = arena.Create(largest_nq);
+      auto scratch = arena.Create(largest_nq);
+      auto prefix_sv = arena.Create(largest_nq);
 
-      int needed_random =
-          4 * (num_samples * ncircuits.size() + num_threads) / num_threads;
-      needed_random += 4;
-      auto local_gen = random_gen.ReserveSamples32(needed_random);
-      tensorflow::random::SimplePhilox rand_source(&local_gen);
-
-      for (int i = 0; i < ncircuits.size(); i++) {
-        int nq = num_qubits[i];
-        int j = start > 0 ? offset_prefix_sum[start - 1][i] : 0;
-        int needed_samples = offset_prefix_sum[start][i] - j;
-        if (needed_samples <= 0) {
-          continue;
-        }
+      QTSimulator::Parameter param;
+      param.collect_kop_stat = false;
+      param.collect_mea_stat = true;
+      param.normalize_before_mea_gates = true;
+      std::vector<uint64_t> gathered_samples;
 
-        if (nq > largest_nq) {
-          largest_nq = nq;
-          sv = ss.Create(largest_nq);
-          scratch = ss.Create(largest_nq);
-        }
-        QTSimulator::Parameter param;
-        param.collect_kop_stat = false;
-        param.collect_mea_stat = true;
-        param.normalize_before_mea_gates = true;
-
-        // Track op-wise stats.
-        std::vector<uint64_t> gathered_samples;
-        int run_samples = 0;
-
-        while (1) {
-          ss.SetStateZero(sv);
-          QTSimulator::RunOnce(param, ncircuits[i], rand_source.Rand64(), ss,
-                               sim, scratch, sv, gathered_samples);
-
-          uint64_t q_ind = 0;
-          uint64_t mask = 1;
-          bool val = 0;
-          while (q_ind < nq) {
-            val = gathered_samples[0] & mask;
-            (*output_tensor)(
-                i, j, static_cast<ptrdiff_t>(max_num_qubits - q_ind - 1)) = val;
-            q_ind++;
-            mask <<= 1;
+      int prefix_circuit = -1;
+      int t;
+      while (queue.Next(&t)) {
+        const int i =
+            t < num_blocks ? blocks.circuits[t] : grouped[t - num_blocks];
+        const int nq = num_qubits[i];
+        if (i != prefix_circuit) {
+          if (nq > largest_nq) {
+            largest_nq = nq;
+            arena.Resize(largest_nq, &sv);
+            arena.Resize(largest_nq, &scratch);
+            arena.Resize(largest_nq, &prefix_sv);
           }
-          while (q_ind < max_num_qubits) {
-            (*output_tensor)(
-                i, j, static_cast<ptrdiff_t>(max_num_qubits - q_ind - 1)) = -2;
-            q_ind++;
+          ss.SetStateZero(prefix_sv);
+          for (const auto& fused_gate : fused_prefixes[i]) {
+            qsim::ApplyFusedGate(sim, fused_gate, prefix_sv);
           }
+          prefix_circuit = i;
+        }
 
-          j++;
-          run_samples++;
-
-          // Check if we have gathered enough samples.
-          if (run_samples >= needed_samples) {
-            break;
-          }
+        if (t >= num_blocks) {
+          SampleGroupedTrajectories(
+              i, nq, num_samples, ncircuits[i], call, sim, ss,
+              [&](StateSpace::State& state) { ss.Copy(prefix_sv, state); },
+              sv, writer);
+          continue;
+        }
+        auto local_gen = streams_.Stream(call, i, blocks.blocks[t]);
+        tensorflow::random::SimplePhilox rand_source(&local_gen);
+        const int first = blocks.blocks[t] * kShotsPerStream;
+        const int last = std::min(first + kShotsPerStream, blocks.num_shots[i]);
+        for (int r = first; r < last; r++) {
+          ss.Copy(prefix_sv, sv);
+          SampleTrajectory<QTSimulator>(i, r, nq, num_samples, ncircuits[i],
+                                        param, sim, ss, &rand_source, scratch,
+                                        sv, &gathered_samples, writer);
         }
       }
     };
 
-    // block_size = 1.
-    tensorflow::thread::ThreadPool::SchedulingParams scheduling_params(
-        tensorflow::thread::ThreadPool::SchedulingStrategy::kFixedBlockSize,
-        absl::nullopt, 1);
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        num_threads, scheduling_params, DoWork);
+    RunWorkQueue(context, tasks, DoWork);
   }
 };
 
+class TfqNoisySamplesPackedOp : public TfqNoisySamplesOp {
+ public:
+  explicit TfqNoisySamplesPackedOp(tensorflow::OpKernelConstruction* context)
+      : TfqNoisySamplesOp(context, kSamplePacked) {}
+};
+
+class TfqNoisySampleCountsOp : public TfqNoisySamplesOp {
+ public:
+  explicit TfqNoisySampleCountsOp(tensorflow::OpKernelConstruction* context)
+      : TfqNoisySamplesOp(context, kSampleCounts) {}
+};
+
 REGISTER_KERNEL_BUILDER(Name("TfqNoisySamples").Device(tensorflow::DEVICE_CPU),
                         TfqNoisySamplesOp);
 
+REGISTER_KERNEL_BUILDER(
+    Name("TfqNoisySamplesPacked").Device(tensorflow::DEVICE_CPU),
+    TfqNoisySamplesPackedOp);
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqNoisySampleCounts").Device(tensorflow::DEVICE_CPU),
+    TfqNoisySampleCountsOp);
+
 REGISTER_OP("TfqNoisySamples")
     .Input("programs: string")
     .Input("symbol_names: string")
     .Input("symbol_values: float")
     .Input("num_samples: int32")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Attr("shots_per_trajectory: int = 0")
+    .Attr("backend: {'trajectory', 'density_matrix', 'auto'} = 'trajectory'")
     .Output("samples: int8")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
@@ -350,4 +599,71 @@ REGISTER_OP("TfqNoisySamples")
       return tensorflow::Status::OK();
     });
 
+REGISTER_OP("TfqNoisySamplesPacked")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("num_samples: int32")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Attr("shots_per_trajectory: int = 0")
+    .Attr("backend: {'trajectory', 'density_matrix', 'auto'} = 'trajectory'")
+    .Output("samples: int64")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle num_samples_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 1, &num_samples_shape));
+
+      // [batch_size, n_samples]
+      c->set_output(
+          0, c->MakeShape(
+                 {c->Dim(programs_shape, 0),
+                  tensorflow::shape_inference::InferenceContext::kUnknownDim}));
+
+      return tensorflow::Status::OK();
+    });
+
+REGISTER_OP("TfqNoisySampleCounts")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("num_samples: int32")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Attr("shots_per_trajectory: int = 0")
+    .Attr("backend: {'trajectory', 'density_matrix', 'auto'} = 'trajectory'")
+    .Output("bitstrings: int64")
+    .Output("counts: int64")
+    .Output("row_splits: int64")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle num_samples_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 1, &num_samples_shape));
+
+      // [n_distinct], [n_distinct], [batch_size + 1]
+      tensorflow::shape_inference::DimensionHandle num_splits;
+      TF_RETURN_IF_ERROR(c->Add(c->Dim(programs_shape, 0), 1, &num_splits));
+      c->set_output(0, c->Vector(c->UnknownDim()));
+      c->set_output(1, c->Vector(c->UnknownDim()));
+      c->set_output(2, c->Vector(num_splits));
+
+      return tensorflow::Status::OK();
+    });
+
 }  // namespace tfq
@@ -15,19 +15,30 @@ limitations under the License.
 
 #include "tensorflow_quantum/core/ops/parse_context.h"
 
+#include <google/protobuf/arena.h>
 #include <google/protobuf/text_format.h>
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/lib/core/error_codes.pb.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/util/env_var.h"
 #include "tensorflow_quantum/core/ops/tfq_simulate_utils.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
+#include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
+#include "tensorflow_quantum/core/src/program_cache.h"
 #include "tensorflow_quantum/core/src/program_resolution.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
 namespace {
@@ -38,20 +49,180 @@ using ::tensorflow::Tensor;
 using ::tfq::proto::PauliSum;
 using ::tfq::proto::Program;
 
+inline absl::string_view ToStringView(const tensorflow::tstring& s) {
+  return absl::string_view(s.data(), s.size());
+}
+
+// Whether inputs that are not binary protos are parsed as text format
+// protos, as set by the TFQ_PARSE_TEXT_PROTOS environment variable. Off by
+// default since trying the text parser on bad input is very slow.
+bool ParseTextProtos() {
+  static const bool enabled = [] {
+    bool value;
+    Status status =
+        tensorflow::ReadBoolFromEnvVar("TFQ_PARSE_TEXT_PROTOS", false, &value);
+    return status.ok() && value;
+  }();
+  return enabled;
+}
+
 template <typename T>
-Status ParseProto(const std::string& text, T* proto) {
-  // First attempt to parse from the binary representation.
-  if (proto->ParseFromString(text)) {
+Status ParseProto(const tensorflow::tstring& text, T* proto) {
+  // First attempt to parse from the binary representation, straight from
+  // the tensor's bytes.
+  if (proto->ParseFromArray(text.data(), text.size())) {
     return Status::OK();
   }
 
   // If that fails, then try to parse from the human readable representation.
-  if (google::protobuf::TextFormat::ParseFromString(text, proto)) {
+  const std::string text_string(text.data(), text.size());
+  if (ParseTextProtos() &&
+      google::protobuf::TextFormat::ParseFromString(text_string, proto)) {
     return Status::OK();
   }
 
   return Status(tensorflow::error::INVALID_ARGUMENT,
-                "Unparseable proto: " + text);
+                "Unparseable proto: " + text_string);
+}
+
+// Fetches the input tensor `input_name` and checks that it has rank `rank`.
+Status GetRankedInput(OpKernelContext* context, const std::string& input_name,
+                      int rank, const Tensor** input) {
+  Status status = context->input(input_name, input);
+  if (!status.ok()) {
+    return status;
+  }
+
+  if ((*input)->dims() != rank) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  absl::StrCat(input_name, " must be rank ", rank,
+                               ". Got rank ", (*input)->dims(), "."));
+  }
+  return Status::OK();
+}
+
+// Parsed and qubit-resolved form of one batch row. The messages live on the
+// row's own arena, so parsing a row takes a few arena blocks rather than an
+// allocation for every message and string, and evicting it frees them all
+// at once.
+struct ResolvedRow {
+  google::protobuf::Arena arena;
+  Program* program = nullptr;
+  unsigned int num_qubits = 0;
+  std::vector<PauliSum*> p_sums;
+  std::vector<Program*> other_programs;
+};
+
+// Default number of batch rows kept by each resolution cache. Can be changed
+// with the TFQ_PROGRAM_CACHE_SIZE environment variable, zero disables caching.
+constexpr size_t kDefaultProgramCacheSize = 4096;
+
+// Default number of bytes held by each resolution cache, so that a few very
+// large programs cannot pin unbounded memory. Can be changed with the
+// TFQ_PROGRAM_CACHE_BYTES environment variable.
+constexpr size_t kDefaultProgramCacheBytes = size_t{256} << 20;
+
+size_t ProgramCacheBytes() {
+  return CacheCapacityFromEnv("TFQ_PROGRAM_CACHE_BYTES",
+                              kDefaultProgramCacheBytes);
+}
+
+// Approximate heap bytes held by a compiled circuit template.
+template <typename fp_type>
+size_t TemplateBytes(const QsimCircuitTemplateT<fp_type>& circuit_template) {
+  size_t bytes =
+      circuit_template.circuit.gates.capacity() *
+          sizeof(qsim::Cirq::GateCirq<fp_type>) +
+      circuit_template.fused_circuit.capacity() *
+          sizeof(qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>) +
+      circuit_template.metadata.capacity() * sizeof(GateMetaDataT<fp_type>);
+  for (const auto& op : circuit_template.symbolic_ops) {
+    bytes += op.SpaceUsedLong();
+  }
+  return bytes;
+}
+
+// Approximate heap bytes held by the compiled PauliSums of one row.
+size_t MasksBytes(const std::vector<PauliSumMasks>& row) {
+  size_t bytes = row.capacity() * sizeof(PauliSumMasks);
+  for (const auto& m : row) {
+    bytes += (m.x_masks.capacity() + m.z_masks.capacity() +
+              m.basis_x_masks.capacity() + m.basis_z_masks.capacity()) *
+                 sizeof(uint64_t) +
+             (m.coeffs_real.capacity() + m.coeffs_imag.capacity()) *
+                 sizeof(float) +
+             (m.group_offsets.capacity() + m.basis_offsets.capacity() +
+              m.basis_groups.capacity() + m.basis_terms.capacity()) *
+                 sizeof(int);
+  }
+  return bytes;
+}
+
+// Cache for rows of (programs, pauli_sums) inputs.
+ProgramCache<ResolvedRow>* GetPauliSumRowCache() {
+  static ProgramCache<ResolvedRow>* cache = new ProgramCache<ResolvedRow>(
+      CacheCapacityFromEnv("TFQ_PROGRAM_CACHE_SIZE", kDefaultProgramCacheSize),
+      ProgramCacheBytes());
+  return cache;
+}
+
+// Cache for rows of (programs, other_programs) inputs.
+ProgramCache<ResolvedRow>* GetOtherProgramsRowCache() {
+  static ProgramCache<ResolvedRow>* cache = new ProgramCache<ResolvedRow>(
+      CacheCapacityFromEnv("TFQ_PROGRAM_CACHE_SIZE", kDefaultProgramCacheSize),
+      ProgramCacheBytes());
+  return cache;
+}
+
+// Cache for compiled circuits of each precision, keyed by the serialized
+// program alone.
+template <typename fp_type>
+ProgramCache<QsimCircuitTemplateT<fp_type>>* GetCircuitTemplateCache() {
+  static ProgramCache<QsimCircuitTemplateT<fp_type>>* cache =
+      new ProgramCache<QsimCircuitTemplateT<fp_type>>(
+          CacheCapacityFromEnv("TFQ_PROGRAM_CACHE_SIZE",
+                               kDefaultProgramCacheSize),
+          ProgramCacheBytes());
+  return cache;
+}
+
+// Looks up the compiled circuit of program in GetCircuitTemplateCache, keyed
+// by its serialized program_string. On a miss the template is built,
+// inserted and templates_built is incremented.
+template <typename fp_type>
+Status LookupOrBuildTemplate(
+    absl::string_view program_string, const Program& program,
+    const SymbolMap& map, const int num_qubits,
+    std::atomic<int>* templates_built,
+    std::shared_ptr<const QsimCircuitTemplateT<fp_type>>* circuit_template) {
+  ProgramCache<QsimCircuitTemplateT<fp_type>>* cache =
+      GetCircuitTemplateCache<fp_type>();
+  const std::vector<absl::string_view> sources = {program_string};
+  const uint64_t key = FingerprintSources(sources);
+  *circuit_template = cache->Lookup(key, sources);
+  if (*circuit_template != nullptr) {
+    return Status::OK();
+  }
+  (*templates_built)++;
+  auto compiled = std::make_shared<QsimCircuitTemplateT<fp_type>>();
+  Status status =
+      BuildQsimCircuitTemplate(program, map, num_qubits, compiled.get());
+  if (!status.ok()) {
+    return status;
+  }
+  cache->Insert(key, sources, compiled, TemplateBytes(*compiled));
+  *circuit_template = std::move(compiled);
+  return Status::OK();
+}
+
+// Cache for PauliSumMasks of rows of (programs, pauli_sums) inputs.
+ProgramCache<std::vector<PauliSumMasks>>* GetPauliSumMasksCache() {
+  static ProgramCache<std::vector<PauliSumMasks>>* cache =
+      new ProgramCache<std::vector<PauliSumMasks>>(
+          CacheCapacityFromEnv("TFQ_PROGRAM_CACHE_SIZE",
+                               kDefaultProgramCacheSize),
+          ProgramCacheBytes());
+  return cache;
 }
 
 }  // namespace
@@ -147,98 +318,406 @@ Status GetProgramsAndProgramsToAppend(
   return Status::OK();
 }
 
-Status GetProgramsAndNumQubits(
-    OpKernelContext* context, std::vector<Program>* programs,
-    std::vector<int>* num_qubits,
-    std::vector<std::vector<PauliSum>>* p_sums /*=nullptr*/) {
+Status GetProgramsAndNumQubits(OpKernelContext* context,
+                               ResolvedPrograms* resolved,
+                               std::vector<int>* num_qubits,
+                               bool resolve_pauli_sums /*=false*/) {
   // 1. Parse input programs
   // 2. (Optional) Parse input PauliSums
   // 3. Convert GridQubit locations to integers.
-  Status status = ParsePrograms(context, "programs", programs);
+  // Rows whose serialized inputs have been resolved by an earlier call are
+  // taken from the process-wide cache instead, without copying them.
+  PhaseTrace trace(context, "parse");
+  const Tensor* program_input;
+  Status status = GetRankedInput(context, "programs", 1, &program_input);
   if (!status.ok()) {
     return status;
   }
+  const auto program_strings = program_input->vec<tensorflow::tstring>();
+  const int num_programs = program_strings.dimension(0);
 
-  if (p_sums) {
-    status = GetPauliSums(context, p_sums);
+  const Tensor* sum_input;
+  const tensorflow::tstring* sum_strings = nullptr;
+  int op_dim = 0;
+  if (resolve_pauli_sums) {
+    status = GetRankedInput(context, "pauli_sums", 2, &sum_input);
     if (!status.ok()) {
       return status;
     }
-    if (programs->size() != p_sums->size()) {
+    if (num_programs != sum_input->dim_size(0)) {
       return Status(
           tensorflow::error::INVALID_ARGUMENT,
           absl::StrCat("Number of circuits and PauliSums do not match. Got ",
-                       programs->size(), " circuits and ", p_sums->size(),
+                       num_programs, " circuits and ", sum_input->dim_size(0),
                        " paulisums."));
     }
+    op_dim = sum_input->dim_size(1);
+    sum_strings = sum_input->flat<tensorflow::tstring>().data();
   }
 
-  // Resolve qubit ID's in parallel.
-  num_qubits->assign(programs->size(), -1);
+  resolved->programs.assign(num_programs, nullptr);
+  resolved->p_sums.assign(num_programs, {});
+  resolved->other_programs.clear();
+  resolved->rows.assign(num_programs, nullptr);
+  num_qubits->assign(num_programs, -1);
+  ProgramCache<ResolvedRow>* cache = GetPauliSumRowCache();
+  std::atomic<int> cache_misses(0);
   auto DoWork = [&](int start, int end) {
+    std::vector<absl::string_view> sources;
     for (int i = start; i < end; i++) {
-      Program& program = (*programs)[i];
-      unsigned int this_num_qubits;
-      if (p_sums) {
-        OP_REQUIRES_OK(context, ResolveQubitIds(&program, &this_num_qubits,
-                                                &(p_sums->at(i))));
-      } else {
-        OP_REQUIRES_OK(context, ResolveQubitIds(&program, &this_num_qubits));
+      sources.clear();
+      sources.push_back(ToStringView(program_strings(i)));
+      for (int j = 0; j < op_dim; j++) {
+        sources.push_back(ToStringView(sum_strings[i * op_dim + j]));
+      }
+      const uint64_t key = FingerprintSources(sources);
+      std::shared_ptr<const ResolvedRow> row = cache->Lookup(key, sources);
+      if (row == nullptr) {
+        cache_misses++;
+        auto parsed = std::make_shared<ResolvedRow>();
+        google::protobuf::Arena* arena = &parsed->arena;
+        parsed->program =
+            google::protobuf::Arena::CreateMessage<Program>(arena);
+        OP_REQUIRES_OK(context,
+                       ParseProto(program_strings(i), parsed->program));
+        for (int j = 0; j < op_dim; j++) {
+          parsed->p_sums.push_back(
+              google::protobuf::Arena::CreateMessage<PauliSum>(arena));
+          OP_REQUIRES_OK(context, ParseProto(sum_strings[i * op_dim + j],
+                                             parsed->p_sums[j]));
+        }
+        OP_REQUIRES_OK(context,
+                       ResolveQubitIds(parsed->program, &parsed->num_qubits,
+                                       parsed->p_sums));
+        cache->Insert(key, sources, parsed, parsed->arena.SpaceAllocated());
+        row = std::move(parsed);
       }
-      (*num_qubits)[i] = this_num_qubits;
+      resolved->programs[i] = row->program;
+      resolved->p_sums[i].assign(row->p_sums.begin(), row->p_sums.end());
+      (*num_qubits)[i] = row->num_qubits;
+      resolved->rows[i] = std::move(row);
     }
   };
 
   // TODO(mbbrough): Determine if this is a good cycle estimate.
   const int cycle_estimate = 1000;
   context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-      num_qubits->size(), cycle_estimate, DoWork);
+      num_programs, cycle_estimate, DoWork);
 
-  return Status::OK();
+  trace.Count("programs", num_programs);
+  trace.Count("cache_misses", cache_misses);
+  // Rows that failed to parse have no messages to hand out.
+  return context->status();
 }
 
-tensorflow::Status GetProgramsAndNumQubits(
-    OpKernelContext* context, std::vector<Program>* programs,
-    std::vector<int>* num_qubits,
-    std::vector<std::vector<Program>>* other_programs) {
+tensorflow::Status GetProgramsAndOtherPrograms(OpKernelContext* context,
+                                               ResolvedPrograms* resolved,
+                                               std::vector<int>* num_qubits) {
   // 1. Parse input programs
   // 2. Parse other_programs
   // 3. Convert GridQubit locations to integers and ensure exact matching.
-  Status status = ParsePrograms(context, "programs", programs);
+  // Rows whose serialized inputs have been resolved by an earlier call are
+  // taken from the process-wide cache instead, without copying them.
+  PhaseTrace trace(context, "parse");
+  const Tensor* program_input;
+  Status status = GetRankedInput(context, "programs", 1, &program_input);
   if (!status.ok()) {
     return status;
   }
+  const auto program_strings = program_input->vec<tensorflow::tstring>();
+  const int num_programs = program_strings.dimension(0);
 
-  status = ParsePrograms2D(context, "other_programs", other_programs);
+  const Tensor* other_input;
+  status = GetRankedInput(context, "other_programs", 2, &other_input);
   if (!status.ok()) {
     return status;
   }
+  const auto other_strings = other_input->matrix<tensorflow::tstring>();
+  const int num_entries = other_strings.dimension(1);
 
-  if (programs->size() != other_programs->size()) {
+  if (num_programs != other_strings.dimension(0)) {
     return Status(tensorflow::error::INVALID_ARGUMENT,
                   absl::StrCat("programs and other_programs batch dimension",
-                               " do not match. Foud: ", programs->size(),
-                               " and ", other_programs->size()));
+                               " do not match. Foud: ", num_programs, " and ",
+                               other_strings.dimension(0)));
   }
 
-  // Resolve qubit ID's in parallel.
-  num_qubits->assign(programs->size(), -1);
+  resolved->programs.assign(num_programs, nullptr);
+  resolved->p_sums.clear();
+  resolved->other_programs.assign(num_programs, {});
+  resolved->rows.assign(num_programs, nullptr);
+  num_qubits->assign(num_programs, -1);
+  ProgramCache<ResolvedRow>* cache = GetOtherProgramsRowCache();
+  std::atomic<int> cache_misses(0);
   auto DoWork = [&](int start, int end) {
+    std::vector<absl::string_view> sources;
     for (int i = start; i < end; i++) {
-      Program& program = (*programs)[i];
-      unsigned int this_num_qubits;
-      OP_REQUIRES_OK(context, ResolveQubitIds(&program, &this_num_qubits,
-                                              &(*other_programs)[i]));
-      (*num_qubits)[i] = this_num_qubits;
+      sources.clear();
+      sources.push_back(ToStringView(program_strings(i)));
+      for (int j = 0; j < num_entries; j++) {
+        sources.push_back(ToStringView(other_strings(i, j)));
+      }
+      const uint64_t key = FingerprintSources(sources);
+      std::shared_ptr<const ResolvedRow> row = cache->Lookup(key, sources);
+      if (row == nullptr) {
+        cache_misses++;
+        auto parsed = std::make_shared<ResolvedRow>();
+        google::protobuf::Arena* arena = &parsed->arena;
+        parsed->program =
+            google::protobuf::Arena::CreateMessage<Program>(arena);
+        OP_REQUIRES_OK(context,
+                       ParseProto(program_strings(i), parsed->program));
+        for (int j = 0; j < num_entries; j++) {
+          parsed->other_programs.push_back(
+              google::protobuf::Arena::CreateMessage<Program>(arena));
+          OP_REQUIRES_OK(context, ParseProto(other_strings(i, j),
+                                             parsed->other_programs[j]));
+        }
+        OP_REQUIRES_OK(context,
+                       ResolveQubitIds(parsed->program, &parsed->num_qubits,
+                                       parsed->other_programs));
+        cache->Insert(key, sources, parsed, parsed->arena.SpaceAllocated());
+        row = std::move(parsed);
+      }
+      resolved->programs[i] = row->program;
+      resolved->other_programs[i].assign(row->other_programs.begin(),
+                                         row->other_programs.end());
+      (*num_qubits)[i] = row->num_qubits;
+      resolved->rows[i] = std::move(row);
     }
   };
 
   // TODO(mbbrough): Determine if this is a good cycle estimate.
   const int cycle_estimate = 1000;
   context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-      num_qubits->size(), cycle_estimate, DoWork);
+      num_programs, cycle_estimate, DoWork);
 
-  return Status::OK();
+  trace.Count("programs", num_programs);
+  trace.Count("cache_misses", cache_misses);
+  // Rows that failed to parse have no messages to hand out.
+  return context->status();
+}
+
+template <typename fp_type>
+Status GetQsimCircuits(
+    OpKernelContext* context, const std::vector<const Program*>& programs,
+    const std::vector<int>& num_qubits, const std::vector<SymbolMap>& maps,
+    std::vector<qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>>* qsim_circuits,
+    std::vector<std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>>*
+        fused_circuits,
+    std::vector<std::vector<GateMetaDataT<fp_type>>>* metadata /*=nullptr*/) {
+  typedef qsim::Cirq::GateCirq<fp_type> Gate;
+  PhaseTrace trace(context, "build_circuits");
+  const Tensor* program_input;
+  Status status = GetRankedInput(context, "programs", 1, &program_input);
+  if (!status.ok()) {
+    return status;
+  }
+  const auto program_strings = program_input->vec<tensorflow::tstring>();
+  const int num_programs = programs.size();
+  if (program_strings.dimension(0) != num_programs) {
+    return Status(tensorflow::error::INTERNAL,
+                  "programs do not match the programs input tensor.");
+  }
+
+  qsim_circuits->assign(num_programs, qsim::Circuit<Gate>());
+  fused_circuits->assign(num_programs, std::vector<qsim::GateFused<Gate>>({}));
+  if (metadata != nullptr) {
+    metadata->assign(num_programs, std::vector<GateMetaDataT<fp_type>>({}));
+  }
+
+  Status parse_status = Status::OK();
+  auto p_lock = tensorflow::mutex();
+  std::atomic<int> templates_built(0);
+  auto construct_f = [&](int start, int end) {
+    for (int i = start; i < end; i++) {
+      std::shared_ptr<const QsimCircuitTemplateT<fp_type>> circuit_template;
+      Status local = LookupOrBuildTemplate<fp_type>(
+          ToStringView(program_strings(i)), *programs[i], maps[i],
+          num_qubits[i], &templates_built, &circuit_template);
+      NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
+      local = BindQsimCircuitTemplate(
+          *circuit_template, maps[i], &(*qsim_circuits)[i],
+          &(*fused_circuits)[i],
+          metadata != nullptr ? &(*metadata)[i] : nullptr);
+      NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
+    }
+  };
+
+  const int num_cycles = 1000;
+  context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+      num_programs, num_cycles, construct_f);
+
+  trace.Count("circuits", num_programs);
+  trace.Count("templates_built", templates_built);
+  return parse_status;
+}
+
+template Status GetQsimCircuits<float>(
+    OpKernelContext* context, const std::vector<const Program*>& programs,
+    const std::vector<int>& num_qubits, const std::vector<SymbolMap>& maps,
+    std::vector<QsimCircuit>* qsim_circuits,
+    std::vector<QsimFusedCircuit>* fused_circuits,
+    std::vector<std::vector<GateMetaData>>* metadata);
+
+template Status GetQsimCircuits<double>(
+    OpKernelContext* context, const std::vector<const Program*>& programs,
+    const std::vector<int>& num_qubits, const std::vector<SymbolMap>& maps,
+    std::vector<qsim::Circuit<qsim::Cirq::GateCirq<double>>>* qsim_circuits,
+    std::vector<std::vector<qsim::GateFused<qsim::Cirq::GateCirq<double>>>>*
+        fused_circuits,
+    std::vector<std::vector<GateMetaDataT<double>>>* metadata);
+
+template <typename fp_type>
+Status GetShiftedQsimCircuits(
+    OpKernelContext* context, const std::vector<const Program*>& programs,
+    const std::vector<int>& num_qubits, const std::vector<SymbolMap>& maps,
+    const std::vector<int>& shifted_programs,
+    const std::vector<GateShift>& shifts,
+    std::vector<qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>>* qsim_circuits,
+    std::vector<std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>>*
+        fused_circuits) {
+  typedef qsim::Cirq::GateCirq<fp_type> Gate;
+  PhaseTrace trace(context, "build_circuits");
+  const Tensor* program_input;
+  Status status = GetRankedInput(context, "programs", 1, &program_input);
+  if (!status.ok()) {
+    return status;
+  }
+  const auto program_strings = program_input->vec<tensorflow::tstring>();
+  const int num_programs = programs.size();
+  if (program_strings.dimension(0) != num_programs) {
+    return Status(tensorflow::error::INTERNAL,
+                  "programs do not match the programs input tensor.");
+  }
+
+  // Look up every template once before binding its shifted circuits.
+  std::vector<std::shared_ptr<const QsimCircuitTemplateT<fp_type>>> templates(
+      num_programs);
+  Status parse_status = Status::OK();
+  auto p_lock = tensorflow::mutex();
+  std::atomic<int> templates_built(0);
+  auto template_f = [&](int start, int end) {
+    for (int i = start; i < end; i++) {
+      Status local = LookupOrBuildTemplate<fp_type>(
+          ToStringView(program_strings(i)), *programs[i], maps[i],
+          num_qubits[i], &templates_built, &templates[i]);
+      NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
+    }
+  };
+
+  const int num_cycles = 1000;
+  context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+      num_programs, num_cycles, template_f);
+  if (!parse_status.ok()) {
+    return parse_status;
+  }
+
+  const int num_shifted = shifted_programs.size();
+  qsim_circuits->assign(num_shifted, qsim::Circuit<Gate>());
+  fused_circuits->assign(num_shifted, std::vector<qsim::GateFused<Gate>>({}));
+  auto bind_f = [&](int start, int end) {
+    for (int m = start; m < end; m++) {
+      const int i = shifted_programs[m];
+      Status local = BindShiftedQsimCircuitTemplate(
+          *templates[i], maps[i], shifts[m], &(*qsim_circuits)[m],
+          &(*fused_circuits)[m]);
+      NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
+    }
+  };
+
+  context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+      num_shifted, num_cycles, bind_f);
+
+  trace.Count("circuits", num_shifted);
+  trace.Count("templates_built", templates_built);
+  return parse_status;
+}
+
+template Status GetShiftedQsimCircuits<float>(
+    OpKernelContext* context, const std::vector<const Program*>& programs,
+    const std::vector<int>& num_qubits, const std::vector<SymbolMap>& maps,
+    const std::vector<int>& shifted_programs,
+    const std::vector<GateShift>& shifts,
+    std::vector<QsimCircuit>* qsim_circuits,
+    std::vector<QsimFusedCircuit>* fused_circuits);
+
+template Status GetShiftedQsimCircuits<double>(
+    OpKernelContext* context, const std::vector<const Program*>& programs,
+    const std::vector<int>& num_qubits, const std::vector<SymbolMap>& maps,
+    const std::vector<int>& shifted_programs,
+    const std::vector<GateShift>& shifts,
+    std::vector<qsim::Circuit<qsim::Cirq::GateCirq<double>>>* qsim_circuits,
+    std::vector<std::vector<qsim::GateFused<qsim::Cirq::GateCirq<double>>>>*
+        fused_circuits);
+
+Status GetPauliSumMasks(
+    OpKernelContext* context,
+    const std::vector<std::vector<const PauliSum*>>& p_sums,
+    const std::vector<int>& num_qubits, std::vector<CompiledPauliSums>* masks) {
+  PhaseTrace trace(context, "compile_observables");
+  const Tensor* program_input;
+  Status status = GetRankedInput(context, "programs", 1, &program_input);
+  if (!status.ok()) {
+    return status;
+  }
+  const Tensor* sum_input;
+  status = GetRankedInput(context, "pauli_sums", 2, &sum_input);
+  if (!status.ok()) {
+    return status;
+  }
+  const auto program_strings = program_input->vec<tensorflow::tstring>();
+  const auto sum_strings = sum_input->matrix<tensorflow::tstring>();
+  const int num_rows = p_sums.size();
+  const int op_dim = sum_input->dim_size(1);
+  if (program_strings.dimension(0) != num_rows ||
+      sum_input->dim_size(0) != num_rows ||
+      num_qubits.size() != p_sums.size()) {
+    return Status(tensorflow::error::INTERNAL,
+                  "pauli_sums do not match the pauli_sums input tensor.");
+  }
+
+  masks->assign(num_rows, nullptr);
+  ProgramCache<std::vector<PauliSumMasks>>* cache = GetPauliSumMasksCache();
+  Status compile_status = Status::OK();
+  auto c_lock = tensorflow::mutex();
+  std::atomic<int> cache_misses(0);
+  auto DoWork = [&](int start, int end) {
+    std::vector<absl::string_view> sources(op_dim + 1);
+    for (int i = start; i < end; i++) {
+      sources[0] = ToStringView(program_strings(i));
+      for (int j = 0; j < op_dim; j++) {
+        sources[j + 1] = ToStringView(sum_strings(i, j));
+      }
+      const uint64_t key = FingerprintSources(sources);
+      CompiledPauliSums row = cache->Lookup(key, sources);
+      if (row == nullptr) {
+        cache_misses++;
+        auto compiled =
+            std::make_shared<std::vector<PauliSumMasks>>(p_sums[i].size());
+        // The qubit ids of empty programs are never resolved and their
+        // expectations are never computed, so they get empty masks.
+        const PauliSum empty_sum;
+        for (int j = 0; j < p_sums[i].size(); j++) {
+          const PauliSum& p_sum =
+              num_qubits[i] == 0 ? empty_sum : *p_sums[i][j];
+          Status local = PauliSumToMasks(p_sum, num_qubits[i], &(*compiled)[j]);
+          NESTED_FN_STATUS_SYNC(compile_status, local, c_lock);
+        }
+        cache->Insert(key, sources, compiled, MasksBytes(*compiled));
+        row = std::move(compiled);
+      }
+      (*masks)[i] = std::move(row);
+    }
+  };
+
+  const int cycle_estimate = 1000;
+  context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+      num_rows, cycle_estimate, DoWork);
+
+  trace.Count("observables", num_rows * op_dim);
+  trace.Count("cache_misses", cache_misses);
+  return compile_status;
 }
 
 Status GetPauliSums(OpKernelContext* context,
@@ -264,9 +743,7 @@ Status GetPauliSums(OpKernelContext* context,
     for (int ii = start; ii < end; ii++) {
       const int i = ii / op_dim;
       const int j = ii % op_dim;
-      PauliSum p;
-      OP_REQUIRES_OK(context, ParseProto(sum_specs(i, j), &p));
-      (*p_sums)[i][j] = p;
+      OP_REQUIRES_OK(context, ParseProto(sum_specs(i, j), &(*p_sums)[i][j]));
     }
   };
 
@@ -333,7 +810,94 @@ Status GetSymbolMaps(OpKernelContext* context, std::vector<SymbolMap>* maps) {
   return Status::OK();
 }
 
-tensorflow::Status GetNumSamples(
+tensorflow::Status GetDuplicateRows(OpKernelContext* context,
+                                    const std::vector<std::string>& row_inputs,
+                                    std::vector<int>* first_row) {
+  const Tensor* program_input;
+  Status status = GetRankedInput(context, "programs", 1, &program_input);
+  if (!status.ok()) {
+    return status;
+  }
+  const Tensor* value_input;
+  status = GetRankedInput(context, "symbol_values", 2, &value_input);
+  if (!status.ok()) {
+    return status;
+  }
+  const int num_rows = program_input->dim_size(0);
+  std::vector<const Tensor*> inputs;
+  for (const std::string& name : row_inputs) {
+    const Tensor* input;
+    status = GetRankedInput(context, name, 2, &input);
+    if (!status.ok()) {
+      return status;
+    }
+    if (input->dim_size(0) != num_rows) {
+      return Status(tensorflow::error::INVALID_ARGUMENT,
+                    absl::StrCat(name, " and programs do not match."));
+    }
+    inputs.push_back(input);
+  }
+  if (value_input->dim_size(0) != num_rows) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  "symbol_values and programs do not match.");
+  }
+
+  const auto program_strings = program_input->vec<tensorflow::tstring>();
+  const auto values = value_input->matrix<float>();
+  const int num_values = value_input->dim_size(1);
+  auto RowSources = [&](const int i, std::vector<absl::string_view>* sources) {
+    sources->clear();
+    sources->push_back(ToStringView(program_strings(i)));
+    sources->push_back(
+        absl::string_view(reinterpret_cast<const char*>(values.data()) +
+                              sizeof(float) * num_values * i,
+                          sizeof(float) * num_values));
+    for (const Tensor* input : inputs) {
+      const auto strings = input->matrix<tensorflow::tstring>();
+      for (int j = 0; j < input->dim_size(1); j++) {
+        sources->push_back(ToStringView(strings(i, j)));
+      }
+    }
+  };
+
+  std::vector<uint64_t> keys(num_rows);
+  auto DoWork = [&](int start, int end) {
+    std::vector<absl::string_view> sources;
+    for (int i = start; i < end; i++) {
+      RowSources(i, &sources);
+      keys[i] = FingerprintSources(sources);
+    }
+  };
+  const int cycle_estimate = 1000;
+  context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+      num_rows, cycle_estimate, DoWork);
+
+  // Rows are only merged when their inputs are equal, not just their keys.
+  first_row->resize(num_rows);
+  absl::flat_hash_map<uint64_t, std::vector<int>> rows_by_key;
+  std::vector<absl::string_view> sources;
+  std::vector<absl::string_view> other;
+  for (int i = 0; i < num_rows; i++) {
+    (*first_row)[i] = i;
+    std::vector<int>& candidates = rows_by_key[keys[i]];
+    if (!candidates.empty()) {
+      RowSources(i, &sources);
+      for (const int c : candidates) {
+        RowSources(c, &other);
+        if (sources == other) {
+          (*first_row)[i] = c;
+          break;
+        }
+      }
+    }
+    if ((*first_row)[i] == i) {
+      candidates.push_back(i);
+    }
+  }
+  return Status::OK();
+}
+
+Status GetNumSamples(
     tensorflow::OpKernelContext* context,
     std::vector<std::vector<int>>* parsed_num_samples) {
   const Tensor* input_num_samples;
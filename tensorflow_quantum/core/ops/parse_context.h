@@ -25,6 +25,7 @@ limitations under the License.
     return;                                                             \
   }
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -33,10 +34,14 @@ limitations under the License.
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
+#include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
 
-// Simplest Program proto parsing
+// Simplest Program proto parsing. Like every parser here it reads binary
+// serialized protos, text format protos are only accepted when the
+// TFQ_PARSE_TEXT_PROTOS environment variable is set to true.
 tensorflow::Status ParsePrograms(tensorflow::OpKernelContext* context,
                                  const std::string& input_name,
                                  std::vector<tfq::proto::Program>* programs);
@@ -57,23 +62,80 @@ tensorflow::Status GetProgramsAndProgramsToAppend(
 // of the parameter (for forward computation).
 typedef absl::flat_hash_map<std::string, std::pair<int, float>> SymbolMap;
 
+// Batch rows resolved by GetProgramsAndNumQubits or
+// GetProgramsAndOtherPrograms. The messages live on the arenas of rows shared
+// with the process-wide resolution cache and are never copied out of it. rows
+// keeps them alive until the ResolvedPrograms is destroyed, even if the cache
+// evicts them in the meantime.
+struct ResolvedPrograms {
+  std::vector<const tfq::proto::Program*> programs;
+  // Filled when the PauliSums of the rows are resolved, [batch_size, n_ops].
+  std::vector<std::vector<const tfq::proto::PauliSum*>> p_sums;
+  // Filled by GetProgramsAndOtherPrograms, [batch_size, n_others].
+  std::vector<std::vector<const tfq::proto::Program*>> other_programs;
+  std::vector<std::shared_ptr<const void>> rows;
+};
+
 // Parses Cirq Program protos out of the 'circuit_specs' input Tensor. Also
 // resolves the QubitIds inside of the Program. Optionally will resolve the
-// QubitIds found in programs into PauliSums such that they are consistent
-// and correct with the original programs.
+// QubitIds found in programs into the 'pauli_sums' PauliSums such that they
+// are consistent and correct with the original programs. Resolved rows are
+// cached across calls, bounded by TFQ_PROGRAM_CACHE_SIZE rows and
+// TFQ_PROGRAM_CACHE_BYTES bytes. A cache hit skips parsing and resolution
+// and hands out the cached messages themselves.
 tensorflow::Status GetProgramsAndNumQubits(
-    tensorflow::OpKernelContext* context,
-    std::vector<tfq::proto::Program>* programs, std::vector<int>* num_qubits,
-    std::vector<std::vector<tfq::proto::PauliSum>>* p_sums = nullptr);
+    tensorflow::OpKernelContext* context, ResolvedPrograms* resolved,
+    std::vector<int>* num_qubits, bool resolve_pauli_sums = false);
 
 // Parses Cirq Program protos out of the 'circuit_specs' input Tensor. Also
-// resolves the QubitIds inside of the Program. This override also parses and
+// resolves the QubitIds inside of the Program. This version also parses and
 // resolves other_programs. Ensuring all qubits found in programs[i] are also
-// found in all programs[i][j] for all j.
-tensorflow::Status GetProgramsAndNumQubits(
+// found in all programs[i][j] for all j. Cached and shared like the rows of
+// GetProgramsAndNumQubits.
+tensorflow::Status GetProgramsAndOtherPrograms(
+    tensorflow::OpKernelContext* context, ResolvedPrograms* resolved,
+    std::vector<int>* num_qubits);
+
+// Constructs the qsim circuit, fused circuit and (optionally) gate metadata
+// for every program returned by GetProgramsAndNumQubits. Rows with the same
+// serialized program in the 'programs' input share one QsimCircuitTemplate,
+// which is cached across calls, so only their symbolic gates are rebuilt.
+// Available for single (fp_type = float) and double (fp_type = double)
+// precision gates, each with its own cache.
+template <typename fp_type>
+tensorflow::Status GetQsimCircuits(
     tensorflow::OpKernelContext* context,
-    std::vector<tfq::proto::Program>* programs, std::vector<int>* num_qubits,
-    std::vector<std::vector<tfq::proto::Program>>* other_programs);
+    const std::vector<const tfq::proto::Program*>& programs,
+    const std::vector<int>& num_qubits, const std::vector<SymbolMap>& maps,
+    std::vector<qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>>* qsim_circuits,
+    std::vector<std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>>*
+        fused_circuits,
+    std::vector<std::vector<GateMetaDataT<fp_type>>>* metadata = nullptr);
+
+// Constructs the qsim circuit and fused circuit of shifted_programs.size()
+// parameter shifted circuits. Circuit m is programs[shifted_programs[m]]
+// resolved under its symbol map with shifts[m] applied, see
+// BindShiftedQsimCircuitTemplate. The templates are shared with
+// GetQsimCircuits, so every program is parsed at most once.
+template <typename fp_type>
+tensorflow::Status GetShiftedQsimCircuits(
+    tensorflow::OpKernelContext* context,
+    const std::vector<const tfq::proto::Program*>& programs,
+    const std::vector<int>& num_qubits, const std::vector<SymbolMap>& maps,
+    const std::vector<int>& shifted_programs,
+    const std::vector<GateShift>& shifts,
+    std::vector<qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>>* qsim_circuits,
+    std::vector<std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>>*
+        fused_circuits);
+
+// Compiles the PauliSums returned by GetProgramsAndNumQubits into
+// PauliSumMasks, one vector of masks per batch row. Rows are cached across
+// calls by their serialized program and pauli_sums, so in steady state no
+// observable is compiled again.
+tensorflow::Status GetPauliSumMasks(
+    tensorflow::OpKernelContext* context,
+    const std::vector<std::vector<const tfq::proto::PauliSum*>>& p_sums,
+    const std::vector<int>& num_qubits, std::vector<CompiledPauliSums>* masks);
 
 // Parses PauliSum protos out of the 'pauli_sums' input tensor. Note this
 // function does NOT resolve QubitID's as any paulisum needs a reference
@@ -93,6 +155,15 @@ tensorflow::Status GetPauliSums(
 tensorflow::Status GetSymbolMaps(tensorflow::OpKernelContext* context,
                                  std::vector<SymbolMap>* maps);
 
+// Finds the batch rows that repeat an earlier row, i.e. have the same
+// serialized program, the same symbol values and the same entries in every
+// input named in row_inputs (each of shape [batch_size, n]). first_row[i] is
+// the first row equal to row i, so rows with first_row[i] == i have to be
+// simulated and the others can copy their results.
+tensorflow::Status GetDuplicateRows(tensorflow::OpKernelContext* context,
+                                    const std::vector<std::string>& row_inputs,
+                                    std::vector<int>* first_row);
+
 // Parses the number of samples from the 'num_samples' input tensor.
 tensorflow::Status GetNumSamples(
     tensorflow::OpKernelContext* context,
@@ -13,7 +13,9 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "../qsim/lib/circuit.h"
@@ -32,6 +34,7 @@ limitations under the License.
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
 #include "tensorflow_quantum/core/src/adj_util.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
@@ -40,13 +43,84 @@ using ::tensorflow::Status;
 using ::tfq::proto::PauliSum;
 using ::tfq::proto::Program;
 
-typedef qsim::Cirq::GateCirq<float> QsimGate;
-typedef qsim::Circuit<QsimGate> QsimCircuit;
+template <typename fp_type>
+using QsimGateT = qsim::Cirq::GateCirq<fp_type>;
+template <typename fp_type>
+using QsimCircuitT = qsim::Circuit<QsimGateT<fp_type>>;
+template <typename fp_type>
+using QsimFusedCircuitT = std::vector<qsim::GateFused<QsimGateT<fp_type>>>;
+
+// State vectors needed per segment of a segmented backward pass: the state
+// and adjoint state checkpoints plus two working states.
+static const int kStatesPerAdjointSegment = 4;
+
+// Runs the backward pass of the adjoint method over the layers hi, hi - 1,
+// ..., lo of a circuit. On entry sv holds the state after layer hi and
+// scratch the observable weighted adjoint state at the same point. The
+// gradient of symbol loc is added to grads[loc].
+template <typename fp_type, typename SimT, typename StateSpaceT, typename ForT>
+void AdjointBackwardLayers(
+    const SimT& sim, const StateSpaceT& ss, const ForT& for_, const int hi,
+    const int lo, const QsimCircuitT<fp_type>& circuit, const SymbolMap& map,
+    const std::vector<QsimFusedCircuitT<fp_type>>& layers,
+    const std::vector<GradientOfGateT<fp_type>>& gradient_gates,
+    typename StateSpaceT::State& sv, typename StateSpaceT::State& scratch,
+    float* grads) {
+  for (int j = hi; j >= lo; j--) {
+    for (int k = layers[j].size() - 1; k >= 0; k--) {
+      ApplyFusedGateDagger(sim, layers[j][k], sv);
+      ApplyFusedGateDagger(sim, layers[j][k], scratch);
+    }
+    if (j == 0) {
+      // last layer will have no parametrized gates so can break.
+      break;
+    }
+
+    // Hit a parameterized gate.
+    // todo fix this copy.
+    auto cur_gate = circuit.gates[gradient_gates[j - 1].index];
+    ApplyGateDagger(sim, cur_gate, sv);
+
+    // if applicable compute control qubit mask and control value bits.
+    uint64_t mask = 0;
+    uint64_t cbits = 0;
+    for (int k = 0; k < cur_gate.controlled_by.size(); k++) {
+      uint64_t control_loc = cur_gate.controlled_by[k];
+      mask |= uint64_t{1} << control_loc;
+      cbits |= ((cur_gate.cmask >> k) & 1) << control_loc;
+    }
+
+    for (int k = 0; k < gradient_gates[j - 1].grad_gates.size(); k++) {
+      // Gradient of controlled gates puts zeros on diagonal which is
+      // the same as collapsing the state and then applying the
+      // non-controlled version of the gradient gate. Both happen on the
+      // fly while taking the inner product with scratch.
+      const double grad = GradientGateInnerProduct(
+          gradient_gates[j - 1].grad_gates[k], mask, cbits, for_, ss,
+          scratch, sv);
+
+      // don't need not-found check since this is done upstream already.
+      const auto it = map.find(gradient_gates[j - 1].params[k]);
+      const int loc = it->second.first;
+      // Apply finite differencing for adjoint gradients.
+      // Finite differencing enables applying multiple `gradient_gate`
+      // of a symbol at the same circuit. For analytic methods like
+      // parameter-shift we need to apply a single `gradient_gate`
+      // per a symbol.
+      grads[loc] += 2 * grad;
+    }
+    ApplyGateDagger(sim, cur_gate, scratch);
+  }
+}
 
 class TfqAdjointGradientOp : public tensorflow::OpKernel {
  public:
   explicit TfqAdjointGradientOp(tensorflow::OpKernelConstruction* context)
-      : OpKernel(context) {}
+      : OpKernel(context) {
+    std::string precision;
+    OP_REQUIRES_OK(context, context->GetAttr("precision", &precision));
+    double_precision_ = precision == "double";
+  }
 
   void Compute(tensorflow::OpKernelContext* context) override {
     // TODO (mbbrough): add more dimension checks for other inputs here.
@@ -67,11 +141,13 @@ class TfqAdjointGradientOp : public tensorflow::OpKernel {
     auto output_tensor = output->matrix<float>();
 
     // Parse program protos.
-    std::vector<Program> programs;
+    ResolvedPrograms resolved;
     std::vector<int> num_qubits;
-    std::vector<std::vector<PauliSum>> pauli_sums;
-    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &programs,
-                                                    &num_qubits, &pauli_sums));
+    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &resolved,
+                                                    &num_qubits, true));
+    const std::vector<const Program*>& programs = resolved.programs;
+    const std::vector<std::vector<const PauliSum*>>& pauli_sums =
+        resolved.p_sums;
 
     std::vector<SymbolMap> maps;
     OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
@@ -82,40 +158,10 @@ class TfqAdjointGradientOp : public tensorflow::OpKernel {
                     programs.size(), " circuits and ", maps.size(),
                     " symbol values.")));
 
-    // Construct qsim circuits.
-    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
-    std::vector<std::vector<qsim::GateFused<QsimGate>>> full_fuse(
-        programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
-    std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>
-        partial_fused_circuits(
-            programs.size(),
-            std::vector<std::vector<qsim::GateFused<QsimGate>>>({}));
-
-    // track metadata.
-    std::vector<std::vector<tfq::GateMetaData>> gate_meta(
-        programs.size(), std::vector<tfq::GateMetaData>({}));
-
-    // track gradients
-    std::vector<std::vector<GradientOfGate>> gradient_gates(
-        programs.size(), std::vector<GradientOfGate>({}));
-
-    Status parse_status = Status::OK();
-    auto p_lock = tensorflow::mutex();
-    auto construct_f = [&](int start, int end) {
-      for (int i = start; i < end; i++) {
-        Status local = QsimCircuitFromProgram(programs[i], maps[i],
-                                              num_qubits[i], &qsim_circuits[i],
-                                              &full_fuse[i], &gate_meta[i]);
-        NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
-        CreateGradientCircuit(qsim_circuits[i], gate_meta[i],
-                              &partial_fused_circuits[i], &gradient_gates[i]);
-      }
-    };
-
-    const int num_cycles = 1000;
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        programs.size(), num_cycles, construct_f);
-    OP_REQUIRES_OK(context, parse_status);
+    // Compiled observables.
+    std::vector<CompiledPauliSums> pauli_masks;
+    OP_REQUIRES_OK(context, GetPauliSumMasks(context, pauli_sums, num_qubits,
+                                             &pauli_masks));
 
     // Get downstream gradients.
     std::vector<std::vector<float>> downstream_grads;
@@ -134,66 +180,128 @@ class TfqAdjointGradientOp : public tensorflow::OpKernel {
             context->input(4).dim_size(1), " gradient entries and ",
             context->input(3).dim_size(1), " paulis per circuit.")));
 
-    int max_num_qubits = 0;
-    for (const int num : num_qubits) {
-      max_num_qubits = std::max(max_num_qubits, num);
-    }
-
     output_tensor.setZero();
 
-    // Cross reference with standard google cloud compute instances
-    // Memory ~= 2 * num_threads * (2 * 64 * 2 ** num_qubits in circuits)
-    // e2s2 = 2 CPU, 8GB -> Can safely do 25 since Memory = 4GB
-    // e2s4 = 4 CPU, 16GB -> Can safely do 25 since Memory = 8GB
-    // ...
-    // This method creates 3 big state vectors per thread so reducing size
-    // here slightly.
-    if (max_num_qubits >= 25 || programs.size() == 1) {
-      ComputeLarge(num_qubits, qsim_circuits, maps, full_fuse,
-                   partial_fused_circuits, pauli_sums, gradient_gates,
-                   downstream_grads, context, &output_tensor);
+    if (double_precision_) {
+      Simulate<double>(programs, num_qubits, maps, pauli_masks,
+                       downstream_grads, context, &output_tensor);
     } else {
-      ComputeSmall(num_qubits, max_num_qubits, qsim_circuits, maps, full_fuse,
-                   partial_fused_circuits, pauli_sums, gradient_gates,
-                   downstream_grads, context, &output_tensor);
+      Simulate<float>(programs, num_qubits, maps, pauli_masks,
+                      downstream_grads, context, &output_tensor);
     }
   }
 
  private:
+  bool double_precision_;
+
+  // Builds the circuits and gradient gates with fp_type gates and runs the
+  // adjoint method with fp_type amplitudes.
+  template <typename fp_type>
+  void Simulate(const std::vector<const Program*>& programs,
+                const std::vector<int>& num_qubits,
+                const std::vector<SymbolMap>& maps,
+                const std::vector<CompiledPauliSums>& pauli_masks,
+                const std::vector<std::vector<float>>& downstream_grads,
+                tensorflow::OpKernelContext* context,
+                tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+    // Construct qsim circuits.
+    std::vector<QsimCircuitT<fp_type>> qsim_circuits;
+    std::vector<QsimFusedCircuitT<fp_type>> full_fuse;
+    std::vector<std::vector<tfq::GateMetaDataT<fp_type>>> gate_meta;
+    OP_REQUIRES_OK(context,
+                   GetQsimCircuits(context, programs, num_qubits, maps,
+                                   &qsim_circuits, &full_fuse, &gate_meta));
+
+    std::vector<std::vector<QsimFusedCircuitT<fp_type>>>
+        partial_fused_circuits(programs.size(),
+                               std::vector<QsimFusedCircuitT<fp_type>>({}));
+
+    // track gradients
+    std::vector<std::vector<GradientOfGateT<fp_type>>> gradient_gates(
+        programs.size(), std::vector<GradientOfGateT<fp_type>>({}));
+
+    auto construct_f = [&](int start, int end) {
+      for (int i = start; i < end; i++) {
+        CreateGradientCircuit(qsim_circuits[i], gate_meta[i],
+                              &partial_fused_circuits[i], &gradient_gates[i]);
+      }
+    };
+
+    const int num_cycles = 1000;
+    {
+      PhaseTrace trace(context, "gradient_circuits");
+      context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+          programs.size(), num_cycles, construct_f);
+    }
+
+    // Every circuit sweeps its state forward once and backward twice, plus
+    // one fused gradient gate inner product per gradient gate.
+    std::vector<uint64_t> costs(qsim_circuits.size());
+    for (size_t i = 0; i < qsim_circuits.size(); i++) {
+      uint64_t num_passes = full_fuse[i].size();
+      for (const auto& layer : partial_fused_circuits[i]) {
+        num_passes += 2 * layer.size();
+      }
+      for (const auto& gradient_gate : gradient_gates[i]) {
+        num_passes += gradient_gate.grad_gates.size();
+      }
+      costs[i] = EstimateCircuitCost(num_qubits[i], num_passes);
+    }
+    const int num_threads = context->device()
+                                ->tensorflow_cpu_worker_threads()
+                                ->workers->NumThreads();
+
+    PhaseTrace trace(context, "simulate");
+    // This method creates 2 big state vectors per thread.
+    CircuitSchedule schedule;
+    ScheduleCircuits(num_qubits, costs, num_threads, 2,
+                     StatePool::Global()->budget(), &schedule);
+    ComputeLarge(schedule.wide, num_qubits, qsim_circuits, maps, full_fuse,
+                 partial_fused_circuits, pauli_masks, gradient_gates,
+                 downstream_grads, context, output_tensor);
+    ComputeSmall(schedule.narrow, num_qubits, qsim_circuits, maps, full_fuse,
+                 partial_fused_circuits, pauli_masks, gradient_gates,
+                 downstream_grads, context, output_tensor);
+  }
+
+  template <typename fp_type>
   void ComputeSmall(
-      const std::vector<int>& num_qubits, const int max_num_qubits,
-      const std::vector<QsimCircuit>& qsim_circuits,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
+      const std::vector<QsimCircuitT<fp_type>>& qsim_circuits,
       const std::vector<SymbolMap>& maps,
-      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& full_fuse,
-      const std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>&
+      const std::vector<QsimFusedCircuitT<fp_type>>& full_fuse,
+      const std::vector<std::vector<QsimFusedCircuitT<fp_type>>>&
           partial_fused_circuits,
-      const std::vector<std::vector<PauliSum>>& pauli_sums,
-      const std::vector<std::vector<tfq::GradientOfGate>>& gradient_gates,
+      const std::vector<CompiledPauliSums>& pauli_masks,
+      const std::vector<std::vector<GradientOfGateT<fp_type>>>& gradient_gates,
       const std::vector<std::vector<float>>& downstream_grads,
       tensorflow::OpKernelContext* context,
       tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
     // Instantiate qsim objects.
     const auto tfq_for = qsim::SequentialFor(1);
-    using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
-    using StateSpace = Simulator::StateSpace;
+    using Simulator =
+        typename QsimSimulator<const qsim::SequentialFor&, fp_type>::type;
+    using StateSpace = typename Simulator::StateSpace;
 
-    auto DoWork = [&](int start, int end) {
+    Status compute_status = Status::OK();
+    auto c_lock = tensorflow::mutex();
+    auto DoWork = [&](WorkQueue& queue) {
       // Begin simulation.
       int largest_nq = 1;
       Simulator sim = Simulator(tfq_for);
       StateSpace ss = StateSpace(tfq_for);
-      auto sv = ss.Create(largest_nq);
-      auto scratch = ss.Create(largest_nq);
-      auto scratch2 = ss.Create(largest_nq);
+      StateArena<StateSpace> arena(ss);
+      auto sv = arena.Create(largest_nq);
+      auto scratch = arena.Create(largest_nq);
 
-      for (int i = start; i < end; i++) {
+      int i;
+      while (queue.Next(&i)) {
         int nq = num_qubits[i];
         if (nq > largest_nq) {
           // need to switch to larger statespace.
           largest_nq = nq;
-          sv = ss.Create(largest_nq);
-          scratch = ss.Create(largest_nq);
-          scratch2 = ss.Create(largest_nq);
+          arena.Resize(largest_nq, &sv);
+          arena.Resize(largest_nq, &scratch);
         }
 
         // (#679) Just ignore empty program
@@ -208,104 +316,60 @@ class TfqAdjointGradientOp : public tensorflow::OpKernel {
 
         // sv now contains psi
         // scratch contains (sum_j paulis_sums[i][j] * downstream_grads[j])|psi>
-        // scratch2 now contains psi as well.
-        Status unused = AccumulateOperators(pauli_sums[i], downstream_grads[i],
-                                            sim, ss, sv, scratch2, scratch);
-
-        for (int j = partial_fused_circuits[i].size() - 1; j >= 0; j--) {
-          for (int k = partial_fused_circuits[i][j].size() - 1; k >= 0; k--) {
-            ApplyFusedGateDagger(sim, partial_fused_circuits[i][j][k], sv);
-            ApplyFusedGateDagger(sim, partial_fused_circuits[i][j][k], scratch);
-          }
-          if (j == 0) {
-            // last layer will have no parametrized gates so can break.
-            break;
-          }
-
-          // Hit a parameterized gate.
-          auto cur_gate =
-              qsim_circuits[i].gates[gradient_gates[i][j - 1].index];
-
-          ApplyGateDagger(sim, cur_gate, sv);
-
-          // if applicable compute control qubit mask and control value bits.
-          uint64_t mask = 0;
-          uint64_t cbits = 0;
-          for (int k = 0; k < cur_gate.controlled_by.size(); k++) {
-            uint64_t control_loc = cur_gate.controlled_by[k];
-            mask |= uint64_t{1} << control_loc;
-            cbits |= ((cur_gate.cmask >> k) & 1) << control_loc;
-          }
-
-          for (int k = 0; k < gradient_gates[i][j - 1].grad_gates.size(); k++) {
-            // Copy sv onto scratch2 in anticipation of non-unitary "gradient
-            // gate".
-            ss.Copy(sv, scratch2);
-            if (!cur_gate.controlled_by.empty()) {
-              // Gradient of controlled gates puts zeros on diagonal which is
-              // the same as collapsing the state and then applying the
-              // non-controlled version of the gradient gate.
-              ss.BulkSetAmpl(scratch2, mask, cbits, 0, 0, true);
-            }
-            qsim::ApplyGate(sim, gradient_gates[i][j - 1].grad_gates[k],
-                            scratch2);
-
-            // don't need not-found check since this is done upstream already.
-            const auto it = maps[i].find(gradient_gates[i][j - 1].params[k]);
-            const int loc = it->second.first;
-            // Apply finite differencing for adjoint gradients.
-            // Finite differencing enables applying multiple `gradient_gate`
-            // of a symbol at the same circuit. For analytic methods like
-            // parameter-shift we need to apply a single `gradient_gate`
-            // per a symbol.
-            (*output_tensor)(i, loc) += ss.RealInnerProduct(scratch2, scratch) +
-                                        ss.RealInnerProduct(scratch, scratch2);
-          }
-          ApplyGateDagger(sim, cur_gate, scratch);
-        }
+        Status local = AccumulateOperatorMasks(
+            *pauli_masks[i], downstream_grads[i], tfq_for, ss, sv, scratch);
+        NESTED_FN_STATUS_SYNC(compute_status, local, c_lock);
+
+        AdjointBackwardLayers(
+            sim, ss, tfq_for, partial_fused_circuits[i].size() - 1, 0,
+            qsim_circuits[i], maps[i], partial_fused_circuits[i],
+            gradient_gates[i], sv, scratch,
+            output_tensor->data() + i * output_tensor->dimension(1));
       }
     };
 
-    const int64_t num_cycles =
-        200 * (int64_t(1) << static_cast<int64_t>(max_num_qubits));
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        qsim_circuits.size(), num_cycles, DoWork);
+    RunWorkQueue(context, batch_indices, DoWork);
+    OP_REQUIRES_OK(context, compute_status);
   }
 
+  template <typename fp_type>
   void ComputeLarge(
-      const std::vector<int>& num_qubits,
-      const std::vector<QsimCircuit>& qsim_circuits,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
+      const std::vector<QsimCircuitT<fp_type>>& qsim_circuits,
       const std::vector<SymbolMap>& maps,
-      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& full_fuse,
-      const std::vector<std::vector<std::vector<qsim::GateFused<QsimGate>>>>&
+      const std::vector<QsimFusedCircuitT<fp_type>>& full_fuse,
+      const std::vector<std::vector<QsimFusedCircuitT<fp_type>>>&
           partial_fused_circuits,
-      const std::vector<std::vector<PauliSum>>& pauli_sums,
-      const std::vector<std::vector<tfq::GradientOfGate>>& gradient_gates,
+      const std::vector<CompiledPauliSums>& pauli_masks,
+      const std::vector<std::vector<GradientOfGateT<fp_type>>>& gradient_gates,
       const std::vector<std::vector<float>>& downstream_grads,
       tensorflow::OpKernelContext* context,
       tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+    if (batch_indices.empty()) {
+      return;
+    }
     // Instantiate qsim objects.
     const auto tfq_for = tfq::QsimFor(context);
-    using Simulator = qsim::Simulator<const tfq::QsimFor&>;
-    using StateSpace = Simulator::StateSpace;
+    using Simulator =
+        typename QsimSimulator<const tfq::QsimFor&, fp_type>::type;
+    using StateSpace = typename Simulator::StateSpace;
 
     // Begin simulation.
     int largest_nq = 1;
     Simulator sim = Simulator(tfq_for);
     StateSpace ss = StateSpace(tfq_for);
-    auto sv = ss.Create(largest_nq);
-    auto scratch = ss.Create(largest_nq);
-    auto scratch2 = ss.Create(largest_nq);
+    StateArena<StateSpace> arena(ss);
+    auto sv = arena.Create(largest_nq);
+    auto scratch = arena.Create(largest_nq);
 
-    for (int i = 0; i < partial_fused_circuits.size(); i++) {
+    for (const int i : batch_indices) {
       int nq = num_qubits[i];
 
       if (nq > largest_nq) {
         // need to switch to larger statespace.
         largest_nq = nq;
-        sv = ss.Create(largest_nq);
-        scratch = ss.Create(largest_nq);
-        scratch2 = ss.Create(largest_nq);
+        arena.Resize(largest_nq, &sv);
+        arena.Resize(largest_nq, &scratch);
       }
 
       // (#679) Just ignore empty program
@@ -313,6 +377,19 @@ class TfqAdjointGradientOp : public tensorflow::OpKernel {
         continue;
       }
 
+      std::vector<int> tops;
+      PlanAdjointSegments(context, ss, largest_nq, partial_fused_circuits[i],
+                          gradient_gates[i], &tops);
+      if (tops.size() > 1) {
+        ComputeSegmented(i, tops, qsim_circuits, maps, partial_fused_circuits,
+                         pauli_masks, gradient_gates, downstream_grads, sim,
+                         ss, tfq_for, sv, scratch, context, output_tensor);
+        if (!context->status().ok()) {
+          return;
+        }
+        continue;
+      }
+
       ss.SetStateZero(sv);
       for (int j = 0; j < full_fuse[i].size(); j++) {
         qsim::ApplyFusedGate(sim, full_fuse[i][j], sv);
@@ -320,59 +397,174 @@ class TfqAdjointGradientOp : public tensorflow::OpKernel {
 
       // sv now contains psi
       // scratch contains (sum_j paulis_sums[i][j] * downstream_grads[j])|psi>
-      // scratch2 now contains psi as well.
-      Status unused = AccumulateOperators(pauli_sums[i], downstream_grads[i],
-                                          sim, ss, sv, scratch2, scratch);
-
-      for (int j = partial_fused_circuits[i].size() - 1; j >= 0; j--) {
-        for (int k = partial_fused_circuits[i][j].size() - 1; k >= 0; k--) {
-          ApplyFusedGateDagger(sim, partial_fused_circuits[i][j][k], sv);
-          ApplyFusedGateDagger(sim, partial_fused_circuits[i][j][k], scratch);
-        }
-        if (j == 0) {
-          // last layer will have no parametrized gates so can break.
-          break;
-        }
+      OP_REQUIRES_OK(context, AccumulateOperatorMasks(
+                                  *pauli_masks[i], downstream_grads[i],
+                                  tfq_for, ss, sv, scratch));
+
+      AdjointBackwardLayers(
+          sim, ss, tfq_for, partial_fused_circuits[i].size() - 1, 0,
+          qsim_circuits[i], maps[i], partial_fused_circuits[i],
+          gradient_gates[i], sv, scratch,
+          output_tensor->data() + i * output_tensor->dimension(1));
+    }
+  }
 
-        // Hit a parameterized gate.
-        // todo fix this copy.
-        auto cur_gate = qsim_circuits[i].gates[gradient_gates[i][j - 1].index];
-        ApplyGateDagger(sim, cur_gate, sv);
-
-        // if applicable compute control qubit mask and control value bits.
-        uint64_t mask = 0;
-        uint64_t cbits = 0;
-        for (int k = 0; k < cur_gate.controlled_by.size(); k++) {
-          uint64_t control_loc = cur_gate.controlled_by[k];
-          mask |= uint64_t{1} << control_loc;
-          cbits |= ((cur_gate.cmask >> k) & 1) << control_loc;
-        }
+  // Splits the backward pass of a wide circuit into segments of layers that
+  // can run concurrently, each on its own thread. tops receives the first
+  // (highest) layer of every segment in decreasing order, or a single entry
+  // when the circuit should run on the whole threadpool instead. Every
+  // segment costs kStatesPerAdjointSegment state vectors (two checkpoints
+  // plus the working states of its thread), which have to fit the StatePool
+  // budget next to the two states of the sequential path.
+  template <typename fp_type, typename StateSpaceT>
+  static void PlanAdjointSegments(
+      tensorflow::OpKernelContext* context, const StateSpaceT& ss,
+      const int nq,
+      const std::vector<QsimFusedCircuitT<fp_type>>& layers,
+      const std::vector<GradientOfGateT<fp_type>>& gradient_gates,
+      std::vector<int>* tops) {
+    const int num_layers = layers.size();
+    tops->assign(1, num_layers - 1);
+
+    const uint64_t state_bytes =
+        sizeof(typename StateSpaceT::fp_type) * ss.MinSize(nq);
+    const uint64_t num_states = StatePool::Global()->budget() / state_bytes;
+    if (num_states < 2 + 2 * kStatesPerAdjointSegment) {
+      return;
+    }
+    const int num_threads = context->device()
+                                ->tensorflow_cpu_worker_threads()
+                                ->workers->NumThreads();
+    const int num_segments = std::min<uint64_t>(
+        std::min(num_threads, num_layers - 1),
+        (num_states - 2) / kStatesPerAdjointSegment);
+    if (num_segments < 2) {
+      return;
+    }
 
-        for (int k = 0; k < gradient_gates[i][j - 1].grad_gates.size(); k++) {
-          // Copy sv onto scratch2 in anticipation of non-unitary "gradient
-          // gate".
-          ss.Copy(sv, scratch2);
-          if (!cur_gate.controlled_by.empty()) {
-            // Gradient of controlled gates puts zeros on diagonal which is
-            // the same as collapsing the state and then applying the
-            // non-controlled version of the gradient gate.
-            ss.BulkSetAmpl(scratch2, mask, cbits, 0, 0, true);
-          }
-          qsim::ApplyGate(sim, gradient_gates[i][j - 1].grad_gates[k],
-                          scratch2);
-
-          // don't need not-found check since this is done upstream already.
-          const auto it = maps[i].find(gradient_gates[i][j - 1].params[k]);
-          const int loc = it->second.first;
-          // Apply finite differencing for adjoint gradients.
-          // Finite differencing enables applying multiple `gradient_gate`
-          // of a symbol at the same circuit. For analytic methods like
-          // parameter-shift we need to apply a single `gradient_gate`
-          // per a symbol.
-          (*output_tensor)(i, loc) += ss.RealInnerProduct(scratch2, scratch) +
-                                      ss.RealInnerProduct(scratch, scratch2);
-        }
-        ApplyGateDagger(sim, cur_gate, scratch);
+    // Balance the segments by the number of state passes of each layer.
+    std::vector<uint64_t> costs(num_layers);
+    uint64_t total = 0;
+    for (int j = 0; j < num_layers; j++) {
+      costs[j] = 2 * layers[j].size();
+      if (j > 0) {
+        costs[j] += 2 + gradient_gates[j - 1].grad_gates.size();
+      }
+      total += costs[j];
+    }
+    uint64_t done = costs[num_layers - 1];
+    for (int j = num_layers - 2; j >= 0; j--) {
+      if (static_cast<int>(tops->size()) < num_segments &&
+          done >= tops->size() * total / num_segments) {
+        tops->push_back(j);
+      }
+      done += costs[j];
+    }
+  }
+
+  // Adjoint gradient of circuit i with the backward pass split at the layers
+  // in tops (see PlanAdjointSegments). One forward and one backward sweep
+  // over the whole threadpool store the state and the adjoint state at the
+  // top of every segment, then the segments run concurrently with one
+  // thread each and their gradients are summed.
+  template <typename fp_type, typename SimT, typename StateSpaceT,
+            typename ForT>
+  void ComputeSegmented(
+      const int i, const std::vector<int>& tops,
+      const std::vector<QsimCircuitT<fp_type>>& qsim_circuits,
+      const std::vector<SymbolMap>& maps,
+      const std::vector<std::vector<QsimFusedCircuitT<fp_type>>>&
+          partial_fused_circuits,
+      const std::vector<CompiledPauliSums>& pauli_masks,
+      const std::vector<std::vector<GradientOfGateT<fp_type>>>& gradient_gates,
+      const std::vector<std::vector<float>>& downstream_grads,
+      const SimT& sim, const StateSpaceT& ss, const ForT& tfq_for,
+      typename StateSpaceT::State& sv, typename StateSpaceT::State& scratch,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+    const auto& layers = partial_fused_circuits[i];
+    const auto& circuit = qsim_circuits[i];
+    const int nq = sv.num_qubits();
+    const int num_segments = tops.size();
+    std::vector<int> segment_of(layers.size(), -1);
+    for (int s = 0; s < num_segments; s++) {
+      segment_of[tops[s]] = s;
+    }
+
+    StateArena<StateSpaceT> checkpoints(ss);
+    std::vector<typename StateSpaceT::State> psi;
+    std::vector<typename StateSpaceT::State> lambda;
+    for (int s = 0; s < num_segments; s++) {
+      psi.push_back(checkpoints.Create(nq));
+      lambda.push_back(checkpoints.Create(nq));
+    }
+
+    // Forward sweep, checkpointing the state at every segment top.
+    ss.SetStateZero(sv);
+    for (int j = 0; j < layers.size(); j++) {
+      if (j > 0) {
+        qsim::ApplyGate(sim, circuit.gates[gradient_gates[i][j - 1].index],
+                        sv);
+      }
+      for (const auto& gate : layers[j]) {
+        qsim::ApplyFusedGate(sim, gate, sv);
+      }
+      if (segment_of[j] >= 0) {
+        ss.Copy(sv, psi[segment_of[j]]);
+      }
+    }
+
+    // Backward sweep of the adjoint state alone down to the last top.
+    OP_REQUIRES_OK(context,
+                   AccumulateOperatorMasks(*pauli_masks[i], downstream_grads[i],
+                                           tfq_for, ss, sv, scratch));
+    for (int j = layers.size() - 1; j >= tops.back(); j--) {
+      if (segment_of[j] >= 0) {
+        ss.Copy(scratch, lambda[segment_of[j]]);
+      }
+      if (j == tops.back()) {
+        break;
+      }
+      for (int k = layers[j].size() - 1; k >= 0; k--) {
+        ApplyFusedGateDagger(sim, layers[j][k], scratch);
+      }
+      ApplyGateDagger(sim, circuit.gates[gradient_gates[i][j - 1].index],
+                      scratch);
+    }
+
+    const int num_symbols = output_tensor->dimension(1);
+    std::vector<std::vector<float>> grads(num_segments,
+                                          std::vector<float>(num_symbols, 0));
+    std::vector<int> segments(num_segments);
+    for (int s = 0; s < num_segments; s++) {
+      segments[s] = s;
+    }
+
+    const auto seq_for = qsim::SequentialFor(1);
+    using SeqSimulator =
+        typename QsimSimulator<const qsim::SequentialFor&, fp_type>::type;
+    using SeqStateSpace = typename SeqSimulator::StateSpace;
+    auto DoWork = [&](WorkQueue& queue) {
+      SeqSimulator seq_sim = SeqSimulator(seq_for);
+      SeqStateSpace seq_ss = SeqStateSpace(seq_for);
+      StateArena<SeqStateSpace> arena(seq_ss);
+      auto seg_sv = arena.Create(nq);
+      auto seg_scratch = arena.Create(nq);
+      int s;
+      while (queue.Next(&s)) {
+        seq_ss.Copy(seq_ss.Create(psi[s].get(), nq), seg_sv);
+        seq_ss.Copy(seq_ss.Create(lambda[s].get(), nq), seg_scratch);
+        const int lo = s + 1 < num_segments ? tops[s + 1] + 1 : 0;
+        AdjointBackwardLayers(seq_sim, seq_ss, seq_for, tops[s], lo, circuit,
+                              maps[i], layers, gradient_gates[i], seg_sv,
+                              seg_scratch, grads[s].data());
+      }
+    };
+    RunWorkQueue(context, segments, DoWork);
+
+    for (int s = 0; s < num_segments; s++) {
+      for (int k = 0; k < num_symbols; k++) {
+        (*output_tensor)(i, k) += grads[s][k];
       }
     }
   }
@@ -389,6 +581,7 @@ REGISTER_OP("TfqAdjointGradient")
     .Input("pauli_sums: string")
     .Input("downstream_grads: float")
     .Output("grads: float")
+    .Attr("precision: {'single', 'double'} = 'single'")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
       TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
@@ -414,4 +607,350 @@ REGISTER_OP("TfqAdjointGradient")
       return tensorflow::Status::OK();
     });
 
+// Expectations and their full Jacobian with respect to the symbols in one
+// invocation. Every circuit is parsed and simulated forward once, the
+// expectations are read from the forward state and the adjoint method then
+// runs one backward pass per pauli sum from a copy of that state. The
+// gradient of a differentiable expectation is the contraction of the
+// Jacobian with the downstream gradients, so training does not need to run
+// TfqAdjointGradient (and its extra parse and forward pass) afterwards.
+// Since the whole Jacobian is computed on every call, with one backward pass
+// per pauli sum, this only pays off with a single pauli sum per circuit;
+// TfqAdjointGradient contracts all of them in one weighted backward pass.
+class TfqExpectationAndJacobianOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqExpectationAndJacobianOp(
+      tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {
+    std::string precision;
+    OP_REQUIRES_OK(context, context->GetAttr("precision", &precision));
+    double_precision_ = precision == "double";
+  }
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    const int num_inputs = context->num_inputs();
+    OP_REQUIRES(context, num_inputs == 4,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Expected 4 inputs, got ", num_inputs, " inputs.")));
+
+    // Create the output Tensors.
+    const int output_dim_batch_size = context->input(0).dim_size(0);
+    const int output_dim_op_size = context->input(3).dim_size(1);
+    const int output_dim_param_size = context->input(2).dim_size(1);
+    tensorflow::TensorShape output_shape;
+    output_shape.AddDim(output_dim_batch_size);
+    output_shape.AddDim(output_dim_op_size);
+    tensorflow::TensorShape jacobian_shape = output_shape;
+    jacobian_shape.AddDim(output_dim_param_size);
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+    auto output_tensor = output->matrix<float>();
+    tensorflow::Tensor* jacobian = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(1, jacobian_shape, &jacobian));
+    auto jacobian_tensor = jacobian->tensor<float, 3>();
+
+    // Parse program protos.
+    ResolvedPrograms resolved;
+    std::vector<int> num_qubits;
+    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &resolved,
+                                                    &num_qubits, true));
+    const std::vector<const Program*>& programs = resolved.programs;
+    const std::vector<std::vector<const PauliSum*>>& pauli_sums =
+        resolved.p_sums;
+
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+
+    OP_REQUIRES(context, programs.size() == maps.size(),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Number of circuits and symbol_values do not match. Got ",
+                    programs.size(), " circuits and ", maps.size(),
+                    " symbol values.")));
+
+    // Compiled observables.
+    std::vector<CompiledPauliSums> pauli_masks;
+    OP_REQUIRES_OK(context, GetPauliSumMasks(context, pauli_sums, num_qubits,
+                                             &pauli_masks));
+
+    jacobian_tensor.setZero();
+
+    if (double_precision_) {
+      Simulate<double>(programs, num_qubits, maps, pauli_masks, context,
+                       &output_tensor, &jacobian_tensor);
+    } else {
+      Simulate<float>(programs, num_qubits, maps, pauli_masks, context,
+                      &output_tensor, &jacobian_tensor);
+    }
+  }
+
+ private:
+  bool double_precision_;
+
+  template <typename fp_type>
+  void Simulate(const std::vector<const Program*>& programs,
+                const std::vector<int>& num_qubits,
+                const std::vector<SymbolMap>& maps,
+                const std::vector<CompiledPauliSums>& pauli_masks,
+                tensorflow::OpKernelContext* context,
+                tensorflow::TTypes<float, 1>::Matrix* output_tensor,
+                tensorflow::TTypes<float, 3>::Tensor* jacobian_tensor) {
+    // Construct qsim circuits.
+    std::vector<QsimCircuitT<fp_type>> qsim_circuits;
+    std::vector<QsimFusedCircuitT<fp_type>> full_fuse;
+    std::vector<std::vector<tfq::GateMetaDataT<fp_type>>> gate_meta;
+    OP_REQUIRES_OK(context,
+                   GetQsimCircuits(context, programs, num_qubits, maps,
+                                   &qsim_circuits, &full_fuse, &gate_meta));
+
+    std::vector<std::vector<QsimFusedCircuitT<fp_type>>>
+        partial_fused_circuits(programs.size(),
+                               std::vector<QsimFusedCircuitT<fp_type>>({}));
+    std::vector<std::vector<GradientOfGateT<fp_type>>> gradient_gates(
+        programs.size(), std::vector<GradientOfGateT<fp_type>>({}));
+
+    auto construct_f = [&](int start, int end) {
+      for (int i = start; i < end; i++) {
+        CreateGradientCircuit(qsim_circuits[i], gate_meta[i],
+                              &partial_fused_circuits[i], &gradient_gates[i]);
+      }
+    };
+
+    const int num_cycles = 1000;
+    {
+      PhaseTrace trace(context, "gradient_circuits");
+      context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
+          programs.size(), num_cycles, construct_f);
+    }
+
+    // Every circuit sweeps its state forward once, then every pauli sum
+    // sweeps the state and its adjoint state backward and takes one inner
+    // product per gradient gate.
+    std::vector<uint64_t> costs(qsim_circuits.size());
+    for (size_t i = 0; i < qsim_circuits.size(); i++) {
+      uint64_t backward_passes = 0;
+      for (const auto& layer : partial_fused_circuits[i]) {
+        backward_passes += 2 * layer.size();
+      }
+      for (const auto& gradient_gate : gradient_gates[i]) {
+        backward_passes += gradient_gate.grad_gates.size();
+      }
+      costs[i] = EstimateCircuitCost(
+          num_qubits[i],
+          full_fuse[i].size() + pauli_masks[i]->size() * backward_passes);
+    }
+    const int num_threads = context->device()
+                                ->tensorflow_cpu_worker_threads()
+                                ->workers->NumThreads();
+
+    PhaseTrace trace(context, "simulate");
+    // This method creates 3 big state vectors per thread.
+    CircuitSchedule schedule;
+    ScheduleCircuits(num_qubits, costs, num_threads, 3,
+                     StatePool::Global()->budget(), &schedule);
+    ComputeLarge(schedule.wide, num_qubits, qsim_circuits, maps, full_fuse,
+                 partial_fused_circuits, pauli_masks, gradient_gates, context,
+                 output_tensor, jacobian_tensor);
+    ComputeSmall(schedule.narrow, num_qubits, qsim_circuits, maps, full_fuse,
+                 partial_fused_circuits, pauli_masks, gradient_gates, context,
+                 output_tensor, jacobian_tensor);
+  }
+
+  // Expectations and Jacobian rows of circuit i. psi receives the forward
+  // state, sv and scratch are the working states of the backward passes.
+  template <typename fp_type, typename SimT, typename StateSpaceT,
+            typename ForT>
+  static Status ComputeCircuit(
+      const int i, const QsimCircuitT<fp_type>& circuit, const SymbolMap& map,
+      const QsimFusedCircuitT<fp_type>& full_fuse,
+      const std::vector<QsimFusedCircuitT<fp_type>>& layers,
+      const std::vector<PauliSumMasks>& masks,
+      const std::vector<GradientOfGateT<fp_type>>& gradient_gates,
+      const SimT& sim, const StateSpaceT& ss, const ForT& for_,
+      typename StateSpaceT::State& psi, typename StateSpaceT::State& sv,
+      typename StateSpaceT::State& scratch,
+      tensorflow::TTypes<float, 1>::Matrix* output_tensor,
+      tensorflow::TTypes<float, 3>::Tensor* jacobian_tensor) {
+    const int num_ops = masks.size();
+    // (#679) Just ignore empty program
+    if (circuit.gates.size() == 0) {
+      for (int j = 0; j < num_ops; j++) {
+        (*output_tensor)(i, j) = -2.0;
+      }
+      return Status::OK();
+    }
+
+    ss.SetStateZero(psi);
+    for (const auto& fused_gate : full_fuse) {
+      qsim::ApplyFusedGate(sim, fused_gate, psi);
+    }
+
+    const int num_symbols = jacobian_tensor->dimension(2);
+    std::vector<float> weights(num_ops, 0);
+    for (int j = 0; j < num_ops; j++) {
+      float exp_v = 0.0;
+      Status status = ComputeExpectationMasks(masks[j], for_, ss, psi, &exp_v);
+      if (!status.ok()) {
+        return status;
+      }
+      (*output_tensor)(i, j) = exp_v;
+
+      // sv contains psi, scratch contains paulis_sums[i][j]|psi>.
+      weights[j] = 1;
+      ss.Copy(psi, sv);
+      status = AccumulateOperatorMasks(masks, weights, for_, ss, sv, scratch);
+      if (!status.ok()) {
+        return status;
+      }
+      weights[j] = 0;
+      AdjointBackwardLayers(
+          sim, ss, for_, layers.size() - 1, 0, circuit, map, layers,
+          gradient_gates, sv, scratch,
+          jacobian_tensor->data() + (i * num_ops + j) * num_symbols);
+    }
+    return Status::OK();
+  }
+
+  template <typename fp_type>
+  void ComputeSmall(
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
+      const std::vector<QsimCircuitT<fp_type>>& qsim_circuits,
+      const std::vector<SymbolMap>& maps,
+      const std::vector<QsimFusedCircuitT<fp_type>>& full_fuse,
+      const std::vector<std::vector<QsimFusedCircuitT<fp_type>>>&
+          partial_fused_circuits,
+      const std::vector<CompiledPauliSums>& pauli_masks,
+      const std::vector<std::vector<GradientOfGateT<fp_type>>>& gradient_gates,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 1>::Matrix* output_tensor,
+      tensorflow::TTypes<float, 3>::Tensor* jacobian_tensor) {
+    // Instantiate qsim objects.
+    const auto tfq_for = qsim::SequentialFor(1);
+    using Simulator =
+        typename QsimSimulator<const qsim::SequentialFor&, fp_type>::type;
+    using StateSpace = typename Simulator::StateSpace;
+
+    Status compute_status = Status::OK();
+    auto c_lock = tensorflow::mutex();
+    auto DoWork = [&](WorkQueue& queue) {
+      // Begin simulation.
+      int largest_nq = 1;
+      Simulator sim = Simulator(tfq_for);
+      StateSpace ss = StateSpace(tfq_for);
+      StateArena<StateSpace> arena(ss);
+      auto psi = arena.Create(largest_nq);
+      auto sv = arena.Create(largest_nq);
+      auto scratch = arena.Create(largest_nq);
+
+      int i;
+      while (queue.Next(&i)) {
+        int nq = num_qubits[i];
+        if (nq > largest_nq) {
+          // need to switch to larger statespace.
+          largest_nq = nq;
+          arena.Resize(largest_nq, &psi);
+          arena.Resize(largest_nq, &sv);
+          arena.Resize(largest_nq, &scratch);
+        }
+        Status local =
+            ComputeCircuit(i, qsim_circuits[i], maps[i], full_fuse[i],
+                           partial_fused_circuits[i], *pauli_masks[i],
+                           gradient_gates[i], sim, ss, tfq_for, psi, sv,
+                           scratch, output_tensor, jacobian_tensor);
+        NESTED_FN_STATUS_SYNC(compute_status, local, c_lock);
+      }
+    };
+
+    RunWorkQueue(context, batch_indices, DoWork);
+    OP_REQUIRES_OK(context, compute_status);
+  }
+
+  template <typename fp_type>
+  void ComputeLarge(
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
+      const std::vector<QsimCircuitT<fp_type>>& qsim_circuits,
+      const std::vector<SymbolMap>& maps,
+      const std::vector<QsimFusedCircuitT<fp_type>>& full_fuse,
+      const std::vector<std::vector<QsimFusedCircuitT<fp_type>>>&
+          partial_fused_circuits,
+      const std::vector<CompiledPauliSums>& pauli_masks,
+      const std::vector<std::vector<GradientOfGateT<fp_type>>>& gradient_gates,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 1>::Matrix* output_tensor,
+      tensorflow::TTypes<float, 3>::Tensor* jacobian_tensor) {
+    if (batch_indices.empty()) {
+      return;
+    }
+    // Instantiate qsim objects.
+    const auto tfq_for = tfq::QsimFor(context);
+    using Simulator =
+        typename QsimSimulator<const tfq::QsimFor&, fp_type>::type;
+    using StateSpace = typename Simulator::StateSpace;
+
+    // Begin simulation.
+    int largest_nq = 1;
+    Simulator sim = Simulator(tfq_for);
+    StateSpace ss = StateSpace(tfq_for);
+    StateArena<StateSpace> arena(ss);
+    auto psi = arena.Create(largest_nq);
+    auto sv = arena.Create(largest_nq);
+    auto scratch = arena.Create(largest_nq);
+
+    for (const int i : batch_indices) {
+      int nq = num_qubits[i];
+      if (nq > largest_nq) {
+        // need to switch to larger statespace.
+        largest_nq = nq;
+        arena.Resize(largest_nq, &psi);
+        arena.Resize(largest_nq, &sv);
+        arena.Resize(largest_nq, &scratch);
+      }
+      OP_REQUIRES_OK(
+          context,
+          ComputeCircuit(i, qsim_circuits[i], maps[i], full_fuse[i],
+                         partial_fused_circuits[i], *pauli_masks[i],
+                         gradient_gates[i], sim, ss, tfq_for, psi, sv, scratch,
+                         output_tensor, jacobian_tensor));
+    }
+  }
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqExpectationAndJacobian").Device(tensorflow::DEVICE_CPU),
+    TfqExpectationAndJacobianOp);
+
+REGISTER_OP("TfqExpectationAndJacobian")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("pauli_sums: string")
+    .Output("expectations: float")
+    .Output("jacobian: float")
+    .Attr("precision: {'single', 'double'} = 'single'")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle pauli_sums_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &pauli_sums_shape));
+
+      tensorflow::shape_inference::DimensionHandle output_rows =
+          c->Dim(programs_shape, 0);
+      tensorflow::shape_inference::DimensionHandle output_cols =
+          c->Dim(pauli_sums_shape, 1);
+      tensorflow::shape_inference::DimensionHandle num_symbols =
+          c->Dim(symbol_names_shape, 0);
+      c->set_output(0, c->Matrix(output_rows, output_cols));
+      c->set_output(1, c->MakeShape({output_rows, output_cols, num_symbols}));
+
+      return tensorflow::Status::OK();
+    });
+
 }  // namespace tfq
@@ -19,7 +19,13 @@ from tensorflow_quantum.core.ops.load_module import load_module
 SIM_OP_MODULE = load_module("_tfq_adj_grad.so")
 
 
-def tfq_adj_grad(programs, symbol_names, symbol_values, pauli_sums, prev_grad):
+def tfq_adj_grad(programs,
+                 symbol_names,
+                 symbol_values,
+                 pauli_sums,
+                 prev_grad,
+                 *,
+                 precision='single'):
     """Calculate gradient of expectation value of circuits wrt some operator(s).
 
     Args:
@@ -38,6 +44,9 @@ def tfq_adj_grad(programs, symbol_names, symbol_values, pauli_sums, prev_grad):
             be used on all of the circuits in the expectation calculations.
         prev_grad: `tf.Tensor` of real numbers with shape [batch_size, n_ops]
             backprop of values from downstream in the compute graph.
+        precision: Python `str`, either 'single' or 'double'. Floating
+            point type of the forward and adjoint states. The gradients are
+            returned as float32 in both cases.
     Returns:
         `tf.Tensor` with shape [batch_size, n_params] that holds the gradient of
             expectation value for each circuit with each op applied to it
@@ -45,4 +54,48 @@ def tfq_adj_grad(programs, symbol_names, symbol_values, pauli_sums, prev_grad):
     """
     return SIM_OP_MODULE.tfq_adjoint_gradient(
         programs, symbol_names, tf.cast(symbol_values, tf.float32), pauli_sums,
-        tf.cast(prev_grad, tf.float32))
+        tf.cast(prev_grad, tf.float32), precision=precision)
+
+
+def tfq_expectation_and_jacobian(programs,
+                                 symbol_names,
+                                 symbol_values,
+                                 pauli_sums,
+                                 *,
+                                 precision='single'):
+    """Calculate expectation values and their Jacobian in a single op.
+
+    Every circuit is parsed and simulated once. The expectations are read
+    from the final state and the adjoint method then runs one backward pass
+    per op from that state.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specificed by programs, following the ordering
+            dictated by `symbol_names`.
+        pauli_sums: `tf.Tensor` of strings with shape [batch_size, n_ops]
+            containing the string representation of the operators that will
+            be used on all of the circuits in the expectation calculations.
+        precision: Python `str`, either 'single' or 'double'. Floating
+            point type of the forward and adjoint states. The outputs are
+            returned as float32 in both cases.
+    Returns:
+        A tuple of a `tf.Tensor` with shape [batch_size, n_ops] that holds
+            the expectation value for each circuit with each op applied to it
+            and a `tf.Tensor` with shape [batch_size, n_ops, n_params] that
+            holds the derivative of every expectation value with respect to
+            every symbol.
+    """
+    return SIM_OP_MODULE.tfq_expectation_and_jacobian(
+        programs,
+        symbol_names,
+        tf.cast(symbol_values, tf.float32),
+        pauli_sums,
+        precision=precision)
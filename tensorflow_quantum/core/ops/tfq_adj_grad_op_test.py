@@ -20,6 +20,7 @@ import cirq
 import sympy
 
 from tensorflow_quantum.python import util
+from tensorflow_quantum.core.ops import batch_util
 from tensorflow_quantum.core.ops import tfq_adj_grad_op
 
 
@@ -284,6 +285,29 @@ class ADJGradTest(tf.test.TestCase, parameterized.TestCase):
 
         self.assertAllClose(out, np.array([[-1.18392, 0.43281]]), atol=1e-3)
 
+    def test_calculate_adj_grad_double_precision(self):
+        """The double precision adjoint gradient matches the single one."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        circuit_batch = [
+            cirq.Circuit(
+                cirq.X(qubits[0])**sympy.Symbol('alpha'),
+                cirq.Y(qubits[1])**sympy.Symbol('beta'),
+                cirq.CNOT(qubits[0], qubits[1]))
+        ]
+        op_batch = [[cirq.Z(qubits[0]), cirq.X(qubits[1])]]
+        prev_grads = tf.ones([1, 2])
+
+        out = tfq_adj_grad_op.tfq_adj_grad(
+            util.convert_to_tensor(circuit_batch),
+            tf.convert_to_tensor(['alpha', 'beta']),
+            tf.convert_to_tensor([[0.123, 0.456]]),
+            util.convert_to_tensor(op_batch),
+            prev_grads,
+            precision='double')
+
+        self.assertDTypeEqual(out, np.float32)
+        self.assertAllClose(out, np.array([[-1.18392, 0.43281]]), atol=1e-3)
+
     def test_calculate_adj_grad_simple_case2(self):
         """Make sure the adjoint gradient works on another simple input case."""
         n_qubits = 2
@@ -388,6 +412,88 @@ class ADJGradTest(tf.test.TestCase, parameterized.TestCase):
 
         self.assertAllClose(out, np.array([[1.2993, 0, 0]]), atol=1e-3)
 
+    @parameterized.parameters([{
+        'precision': 'single'
+    }, {
+        'precision': 'double'
+    }])
+    def test_expectation_and_jacobian(self, precision):
+        """The fused op matches the expectation and adjoint gradient ops."""
+        n_qubits = 4
+        batch_size = 3
+        symbol_names = ['alpha', 'beta']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+        pauli_sums1 = util.random_pauli_sums(qubits, 3, batch_size)
+        pauli_sums2 = util.random_pauli_sums(qubits, 3, batch_size)
+        batch_pauli_sums = [[x, y] for x, y in zip(pauli_sums1, pauli_sums2)]
+
+        programs = util.convert_to_tensor(circuit_batch)
+        ops = util.convert_to_tensor(batch_pauli_sums)
+        exps, jacobian = tfq_adj_grad_op.tfq_expectation_and_jacobian(
+            programs,
+            tf.convert_to_tensor(symbol_names),
+            tf.convert_to_tensor(symbol_values_array),
+            ops,
+            precision=precision)
+        self.assertShapeEqual(np.zeros((batch_size, 2, 2)), jacobian)
+
+        cirq_exps = batch_util.batch_calculate_expectation(
+            circuit_batch, resolver_batch, batch_pauli_sums, cirq.Simulator())
+        self.assertAllClose(exps, cirq_exps, atol=1e-4)
+        for j in range(2):
+            prev_grads = np.zeros((batch_size, 2), dtype=np.float32)
+            prev_grads[:, j] = 1
+            row = tfq_adj_grad_op.tfq_adj_grad(
+                programs, tf.convert_to_tensor(symbol_names),
+                tf.convert_to_tensor(symbol_values_array), ops,
+                tf.convert_to_tensor(prev_grads))
+            self.assertAllClose(jacobian[:, j, :], row, atol=1e-4)
+
+    def test_expectation_and_jacobian_empty(self):
+        """Verify that the empty case is handled gracefully."""
+        exps, jacobian = tfq_adj_grad_op.tfq_expectation_and_jacobian(
+            util.convert_to_tensor([cirq.Circuit()]),
+            tf.convert_to_tensor([], dtype=tf.dtypes.string),
+            tf.convert_to_tensor([[]]),
+            tf.convert_to_tensor([[]], dtype=tf.dtypes.string))
+        self.assertShapeEqual(np.zeros((1, 0)), exps)
+        self.assertShapeEqual(np.zeros((1, 0, 0)), jacobian)
+
+    def test_empty_circuit_with_observable(self):
+        """Empty circuits in a batch with observables are ignored."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        circuit_batch = [
+            cirq.Circuit(
+                cirq.X(qubits[0])**sympy.Symbol('alpha'), cirq.X(qubits[1])),
+            cirq.Circuit()
+        ]
+        programs = util.convert_to_tensor(circuit_batch)
+        symbol_names = tf.convert_to_tensor(['alpha'])
+        symbol_values = tf.convert_to_tensor([[0.25], [0.25]])
+        pauli_sums = util.convert_to_tensor(
+            [[cirq.Z(qubits[0]) + 0.5 * cirq.Z(qubits[1])]] * 2)
+
+        grads = tfq_adj_grad_op.tfq_adj_grad(programs, symbol_names,
+                                             symbol_values, pauli_sums,
+                                             tf.ones([2, 1]))
+        expected = tfq_adj_grad_op.tfq_adj_grad(programs[:1], symbol_names,
+                                                symbol_values[:1],
+                                                pauli_sums[:1], tf.ones([1, 1]))
+        self.assertAllClose(grads, [expected[0], [0.0]], atol=1e-5)
+
+        exps, jacobian = tfq_adj_grad_op.tfq_expectation_and_jacobian(
+            programs, symbol_names, symbol_values, pauli_sums)
+        self.assertAllClose(exps[1], [-2.0])
+        self.assertAllClose(jacobian[0], [expected[0]], atol=1e-5)
+        self.assertAllClose(jacobian[1], [[0.0]])
+
 
 if __name__ == "__main__":
     tf.test.main()
@@ -13,11 +13,16 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
+#include <complex>
 #include <string>
+#include <vector>
 
 #include "../qsim/lib/circuit.h"
 #include "../qsim/lib/gate_appl.h"
 #include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/seqfor.h"
+#include "../qsim/lib/simmux.h"
 #include "../qsim/lib/umux.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/shape_inference.h"
@@ -29,6 +34,8 @@ limitations under the License.
 #include "tensorflow_quantum/core/ops/parse_context.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
 #include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
+#include "tensorflow_quantum/core/src/state_pool.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
@@ -41,18 +48,20 @@ typedef qsim::Circuit<QsimGate> QsimCircuit;
 
 class TfqCalculateUnitaryOp : public tensorflow::OpKernel {
  public:
-  explicit TfqCalculateUnitaryOp(tensorflow::OpKernelConstruction *context)
-      : OpKernel(context) {}
+  explicit TfqCalculateUnitaryOp(tensorflow::OpKernelConstruction *context,
+                                 const bool ragged = false)
+      : OpKernel(context), ragged_(ragged) {}
 
   void Compute(tensorflow::OpKernelContext *context) override {
     // TODO (mbbrough): add more dimension checks for other inputs here.
     DCHECK_EQ(3, context->num_inputs());
 
     // Parse to Program Proto and num_qubits.
-    std::vector<Program> programs;
+    ResolvedPrograms resolved;
     std::vector<int> num_qubits;
     OP_REQUIRES_OK(context,
-                   GetProgramsAndNumQubits(context, &programs, &num_qubits));
+                   GetProgramsAndNumQubits(context, &resolved, &num_qubits));
+    const std::vector<const Program*>& programs = resolved.programs;
 
     // Parse symbol maps for parameter resolution in the circuits.
     std::vector<SymbolMap> maps;
@@ -64,45 +73,119 @@ class TfqCalculateUnitaryOp : public tensorflow::OpKernel {
             " circuits and ", maps.size(), " values.")));
 
     // Construct qsim circuits.
-    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
-    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
-        programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
-
-    Status parse_status = Status::OK();
-    auto p_lock = tensorflow::mutex();
-    auto construct_f = [&](int start, int end) {
-      for (int i = start; i < end; i++) {
-        Status local =
-            QsimCircuitFromProgram(programs[i], maps[i], num_qubits[i],
-                                   &qsim_circuits[i], &fused_circuits[i]);
-        NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
-      }
-    };
-
-    const int num_cycles = 1000;
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        programs.size(), num_cycles, construct_f);
-    OP_REQUIRES_OK(context, parse_status);
+    std::vector<QsimCircuit> qsim_circuits;
+    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits;
+    OP_REQUIRES_OK(context, GetQsimCircuits(context, programs, num_qubits, maps,
+                                            &qsim_circuits, &fused_circuits));
 
-    // Find largest circuit for tensor size padding and allocate
-    // the output tensor.
     int max_num_qubits = 0;
     for (const int num : num_qubits) {
       max_num_qubits = std::max(max_num_qubits, num);
     }
 
-    // TODO(pmassey): Investigate creating a matrix that isn't just the maximum
-    // required size.
+    // Ragged outputs hold the row major unitaries of every circuit back to
+    // back, padded outputs one matrix of the size of the largest circuit
+    // per circuit, padded with -2.
     const int output_dim_size = maps.size();
-    tensorflow::TensorShape output_shape;
-    output_shape.AddDim(output_dim_size);
-    output_shape.AddDim(1 << max_num_qubits);
-    output_shape.AddDim(1 << max_num_qubits);
-
+    std::vector<uint64_t> offsets(output_dim_size);
+    std::vector<uint64_t> row_sizes(output_dim_size);
     tensorflow::Tensor *output = nullptr;
-    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
-    auto output_tensor = output->tensor<std::complex<float>, 3>();
+    if (ragged_) {
+      uint64_t total_size = 0;
+      for (int i = 0; i < output_dim_size; i++) {
+        offsets[i] = total_size;
+        row_sizes[i] = uint64_t(1) << num_qubits[i];
+        total_size += row_sizes[i] * row_sizes[i];
+      }
+      const tensorflow::int64 output_size = total_size;
+      OP_REQUIRES_OK(context,
+                     context->allocate_output(
+                         0, tensorflow::TensorShape({output_size}), &output));
+      tensorflow::Tensor *dims = nullptr;
+      OP_REQUIRES_OK(context,
+                     context->allocate_output(
+                         1, tensorflow::TensorShape({output_dim_size}), &dims));
+      auto dims_vec = dims->vec<int32_t>();
+      for (int i = 0; i < output_dim_size; i++) {
+        dims_vec(i) = row_sizes[i];
+      }
+    } else {
+      const uint64_t max_dim = uint64_t(1) << max_num_qubits;
+      tensorflow::TensorShape output_shape;
+      output_shape.AddDim(output_dim_size);
+      output_shape.AddDim(max_dim);
+      output_shape.AddDim(max_dim);
+      OP_REQUIRES_OK(context,
+                     context->allocate_output(0, output_shape, &output));
+      for (int i = 0; i < output_dim_size; i++) {
+        offsets[i] = i * max_dim * max_dim;
+        row_sizes[i] = max_dim;
+      }
+    }
+    std::complex<float> *output_data =
+        output->flat<std::complex<float>>().data();
 
+    // The unitary of a circuit on n qubits is as large as the state vector
+    // of 2n qubits, so circuits are scheduled like those.
+    std::vector<int> unitary_qubits(output_dim_size);
+    std::vector<uint64_t> costs(output_dim_size);
+    for (int i = 0; i < output_dim_size; i++) {
+      unitary_qubits[i] = 2 * num_qubits[i];
+      costs[i] =
+          EstimateCircuitCost(unitary_qubits[i], fused_circuits[i].size());
+    }
+    PhaseTrace trace(context, "simulate");
+    CircuitSchedule schedule;
+    ScheduleCircuits(unitary_qubits, costs,
+                     context->device()
+                         ->tensorflow_cpu_worker_threads()
+                         ->workers->NumThreads(),
+                     1, StatePool::Global()->budget(), &schedule);
+
+    ComputeLarge(schedule.wide, num_qubits, fused_circuits, offsets,
+                 row_sizes, context, output_data);
+    ComputeSmall(schedule.narrow, num_qubits, fused_circuits, offsets,
+                 row_sizes, context, output_data);
+  }
+
+ private:
+  // Output the unitaries of every circuit at their own size.
+  const bool ragged_;
+
+  // Writes rows [start, end) of the unitary u of a circuit on nq qubits to
+  // the row major matrix at out with row_size entries per row, padding the
+  // rows and columns beyond the circuit with -2.
+  template <typename UnitarySpaceT>
+  static void WriteUnitary(const UnitarySpaceT &us,
+                           const typename UnitarySpaceT::Unitary &u,
+                           const int nq, const uint64_t row_size,
+                           const uint64_t start, const uint64_t end,
+                           std::complex<float> *out) {
+    const uint64_t dim = uint64_t(1) << nq;
+    const std::complex<float> padding(-2, 0);
+    for (uint64_t j = start; j < end; j++) {
+      std::complex<float> *row = out + j * row_size;
+      if (j >= dim) {
+        std::fill(row, row + row_size, padding);
+        continue;
+      }
+      // qsim stores the transpose of the unitary.
+      for (uint64_t k = 0; k < dim; k++) {
+        row[k] = us.GetEntry(u, k, j);
+      }
+      std::fill(row + dim, row + row_size, padding);
+    }
+  }
+
+  void ComputeLarge(
+      const std::vector<int> &batch_indices, const std::vector<int> &num_qubits,
+      const std::vector<std::vector<qsim::GateFused<QsimGate>>> &fused_circuits,
+      const std::vector<uint64_t> &offsets,
+      const std::vector<uint64_t> &row_sizes,
+      tensorflow::OpKernelContext *context, std::complex<float> *output_data) {
+    if (batch_indices.empty()) {
+      return;
+    }
     // Instantiate qsim objects.
     const auto tfq_for = tfq::QsimFor(context);
     using UCalculator = qsim::unitary::UnitaryCalculator<const tfq::QsimFor &>;
@@ -111,56 +194,333 @@ class TfqCalculateUnitaryOp : public tensorflow::OpKernel {
 
     // Begin simulation.
     int largest_nq = 1;
-    Unitary u = UnitarySpace(tfq_for).CreateUnitary(largest_nq);
+    UCalculator sim = UCalculator(tfq_for);
+    UnitarySpace us = UnitarySpace(tfq_for);
+    Unitary u = us.CreateUnitary(largest_nq);
 
-    // Simulate programs one by one. Parallelizing over state vectors
+    // Simulate programs one by one. Parallelizing over unitaries
     // we no longer parallelize over circuits. Each time we encounter a
     // a larger circuit we will grow the unitary as nescessary.
-    for (int i = 0; i < fused_circuits.size(); i++) {
-      int nq = num_qubits[i];
-      UCalculator sim = UCalculator(tfq_for);
-      UnitarySpace us = UnitarySpace(tfq_for);
+    for (const int i : batch_indices) {
+      const int nq = num_qubits[i];
       if (nq > largest_nq) {
         // need to switch to larger unitaryspace.
         largest_nq = nq;
         u = us.CreateUnitary(nq);
       }
       us.SetIdentity(u);
-      for (int j = 0; j < fused_circuits[i].size(); j++) {
+      for (size_t j = 0; j < fused_circuits[i].size(); j++) {
         qsim::ApplyFusedGate(sim, fused_circuits[i][j], u);
       }
 
-      // Parallel copy unitary information from qsim into tensorflow
-      // tensors.
-      auto copy_f = [i, nq, max_num_qubits, &output_tensor, &us, &u](
-                        uint64_t start, uint64_t end) {
-        uint64_t crossover = uint64_t(1) << nq;
-
-        for (uint64_t l = start; l < end; l++) {
-          uint64_t j = l / (1 << max_num_qubits);
-          uint64_t k = l % (1 << max_num_qubits);
-          if (k < crossover && j < crossover) {
-            output_tensor(static_cast<ptrdiff_t>(i), static_cast<ptrdiff_t>(j),
-                          static_cast<ptrdiff_t>(k)) = us.GetEntry(u, k, j);
-          } else {
-            output_tensor(static_cast<ptrdiff_t>(i), static_cast<ptrdiff_t>(j),
-                          static_cast<ptrdiff_t>(k)) =
-                std::complex<float>(-2, 0);
-          }
-        }
+      // Parallel copy of the rows of the unitary into the output.
+      auto copy_f = [&](uint64_t start, uint64_t end) {
+        WriteUnitary(us, u, nq, row_sizes[i], start, end,
+                     output_data + offsets[i]);
       };
-      const uint64_t num_cycles_copy = 10 * (1 << max_num_qubits);
+      const uint64_t num_cycles_copy = 10 * row_sizes[i];
       context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-          (uint64_t(1) << max_num_qubits) * (uint64_t(1) << max_num_qubits),
-          num_cycles_copy, copy_f);
+          row_sizes[i], num_cycles_copy, copy_f);
     }
   }
+
+  void ComputeSmall(
+      const std::vector<int> &batch_indices, const std::vector<int> &num_qubits,
+      const std::vector<std::vector<qsim::GateFused<QsimGate>>> &fused_circuits,
+      const std::vector<uint64_t> &offsets,
+      const std::vector<uint64_t> &row_sizes,
+      tensorflow::OpKernelContext *context, std::complex<float> *output_data) {
+    const auto tfq_for = qsim::SequentialFor(1);
+    using UCalculator =
+        qsim::unitary::UnitaryCalculator<const qsim::SequentialFor &>;
+    using UnitarySpace = UCalculator::UnitarySpace;
+    using Unitary = UnitarySpace::Unitary;
+
+    // Every worker builds whole unitaries on its own thread and writes them
+    // to the output directly.
+    auto DoWork = [&](WorkQueue &queue) {
+      int largest_nq = 1;
+      UCalculator sim = UCalculator(tfq_for);
+      UnitarySpace us = UnitarySpace(tfq_for);
+      Unitary u = us.CreateUnitary(largest_nq);
+
+      int i;
+      while (queue.Next(&i)) {
+        const int nq = num_qubits[i];
+        if (nq > largest_nq) {
+          largest_nq = nq;
+          u = us.CreateUnitary(nq);
+        }
+        us.SetIdentity(u);
+        for (size_t j = 0; j < fused_circuits[i].size(); j++) {
+          qsim::ApplyFusedGate(sim, fused_circuits[i][j], u);
+        }
+        WriteUnitary(us, u, nq, row_sizes[i], 0, row_sizes[i],
+                     output_data + offsets[i]);
+      }
+    };
+
+    RunWorkQueue(context, batch_indices, DoWork);
+  }
+};
+
+class TfqCalculateUnitaryRaggedOp : public TfqCalculateUnitaryOp {
+ public:
+  explicit TfqCalculateUnitaryRaggedOp(
+      tensorflow::OpKernelConstruction *context)
+      : TfqCalculateUnitaryOp(context, true) {}
+};
+
+// Applies the unitaries of circuits to k columns at a time: either the
+// basis states listed in an int32 columns input of shape [batch_size, k] or
+// the columns of a complex64 matrix input of shape
+// [batch_size, 2 ** max_num_qubits, k]. Column slot s of circuit i is held
+// in the amplitudes (s << nq) | row of a single state vector of
+// nq + ceil(log2(k)) qubits. The gates only act on the low nq qubits, so
+// that one simulation evolves all columns, fusing and setting up every gate
+// matrix once and sweeping the columns in the same vectorized passes. The
+// output of shape [batch_size, 2 ** max_num_qubits, k] is padded with -2.
+class TfqCalculateUnitaryColumnsOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqCalculateUnitaryColumnsOp(
+      tensorflow::OpKernelConstruction *context, const bool dense = false)
+      : OpKernel(context), dense_(dense) {}
+
+  void Compute(tensorflow::OpKernelContext *context) override {
+    const int num_inputs = context->num_inputs();
+    OP_REQUIRES(context, num_inputs == 4,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Expected 4 inputs, got ", num_inputs, " inputs.")));
+
+    // Parse to Program Proto and num_qubits.
+    ResolvedPrograms resolved;
+    std::vector<int> num_qubits;
+    OP_REQUIRES_OK(context,
+                   GetProgramsAndNumQubits(context, &resolved, &num_qubits));
+    const std::vector<const Program*>& programs = resolved.programs;
+
+    // Parse symbol maps for parameter resolution in the circuits.
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+    OP_REQUIRES(
+        context, maps.size() == programs.size(),
+        tensorflow::errors::InvalidArgument(absl::StrCat(
+            "Number of circuits and values do not match. Got ", programs.size(),
+            " circuits and ", maps.size(), " values.")));
+
+    int max_num_qubits = 0;
+    for (const int num : num_qubits) {
+      max_num_qubits = std::max(max_num_qubits, num);
+    }
+    const int output_dim_size = maps.size();
+    const uint64_t max_dim = uint64_t(1) << max_num_qubits;
+
+    const tensorflow::Tensor *input = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->input(dense_ ? "matrix" : "columns", &input));
+    const int input_rank = dense_ ? 3 : 2;
+    OP_REQUIRES(context, input->dims() == input_rank,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    dense_ ? "matrix" : "columns", " must be rank ",
+                    input_rank, ". Got rank ", input->dims(), ".")));
+    OP_REQUIRES(context, input->dim_size(0) == output_dim_size,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Number of circuits and ", dense_ ? "matrices" : "columns",
+                    " do not match. Got ", output_dim_size, " circuits and ",
+                    input->dim_size(0), ".")));
+    if (dense_) {
+      OP_REQUIRES(context, uint64_t(input->dim_size(1)) == max_dim,
+                  tensorflow::errors::InvalidArgument(absl::StrCat(
+                      "matrix must have 2 ** max_num_qubits = ", max_dim,
+                      " rows. Got ", input->dim_size(1), ".")));
+    } else {
+      // Every requested column widens the simulated state, more of them
+      // than there are basis states can only repeat columns.
+      OP_REQUIRES(context, uint64_t(input->dim_size(1)) <= max_dim,
+                  tensorflow::errors::InvalidArgument(absl::StrCat(
+                      "columns must have at most 2 ** max_num_qubits = ",
+                      max_dim, " entries per circuit. Got ",
+                      input->dim_size(1), ".")));
+      const auto columns = input->matrix<int32_t>();
+      for (int i = 0; i < output_dim_size; i++) {
+        for (int s = 0; s < columns.dimension(1); s++) {
+          OP_REQUIRES(
+              context,
+              columns(i, s) >= 0 &&
+                  uint64_t(columns(i, s)) < (uint64_t(1) << num_qubits[i]),
+              tensorflow::errors::InvalidArgument(absl::StrCat(
+                  "Column ", columns(i, s), " is not a basis state of ",
+                  "circuit ", i, " on ", num_qubits[i], " qubits.")));
+        }
+      }
+    }
+    const int num_columns = input->dim_size(input_rank - 1);
+
+    // Construct qsim circuits.
+    std::vector<QsimCircuit> qsim_circuits;
+    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits;
+    OP_REQUIRES_OK(context, GetQsimCircuits(context, programs, num_qubits, maps,
+                                            &qsim_circuits, &fused_circuits));
+
+    tensorflow::TensorShape output_shape;
+    output_shape.AddDim(output_dim_size);
+    output_shape.AddDim(max_dim);
+    output_shape.AddDim(num_columns);
+    tensorflow::Tensor *output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+    auto output_tensor = output->tensor<std::complex<float>, 3>();
+    if (output_dim_size == 0 || num_columns == 0) {
+      return;
+    }
+
+    int column_qubits = 0;
+    while ((1 << column_qubits) < num_columns) {
+      column_qubits++;
+    }
+    std::vector<int> state_qubits(output_dim_size);
+    std::vector<uint64_t> costs(output_dim_size);
+    for (int i = 0; i < output_dim_size; i++) {
+      state_qubits[i] = num_qubits[i] + column_qubits;
+      costs[i] = EstimateCircuitCost(state_qubits[i], fused_circuits[i].size());
+    }
+    PhaseTrace trace(context, "simulate");
+    CircuitSchedule schedule;
+    ScheduleCircuits(state_qubits, costs,
+                     context->device()
+                         ->tensorflow_cpu_worker_threads()
+                         ->workers->NumThreads(),
+                     1, StatePool::Global()->budget(), &schedule);
+
+    ComputeLarge(schedule.wide, num_qubits, state_qubits, fused_circuits,
+                 *input, context, &output_tensor);
+    ComputeSmall(schedule.narrow, num_qubits, state_qubits, fused_circuits,
+                 *input, context, &output_tensor);
+  }
+
+ private:
+  // Read the columns from a dense matrix instead of basis state indices.
+  const bool dense_;
+
+  // Evolves the columns of circuit i in *sv and writes them to row i of
+  // output_tensor.
+  template <typename SimT, typename StateSpaceT>
+  void EvolveColumns(
+      const int i, const int nq, const int total_qubits,
+      const std::vector<qsim::GateFused<QsimGate>> &fused_circuit,
+      const tensorflow::Tensor &input, const SimT &sim, const StateSpaceT &ss,
+      StateArena<StateSpaceT> &arena, typename StateSpaceT::State *sv,
+      tensorflow::TTypes<std::complex<float>, 3>::Tensor *output_tensor) const {
+    const uint64_t dim = uint64_t(1) << nq;
+    const int num_columns = output_tensor->dimension(2);
+    if (static_cast<int>(sv->num_qubits()) != total_qubits) {
+      arena.Resize(total_qubits, sv);
+    }
+    ss.SetAllZeros(*sv);
+    if (dense_) {
+      const auto matrix = input.tensor<std::complex<float>, 3>();
+      for (int s = 0; s < num_columns; s++) {
+        for (uint64_t r = 0; r < dim; r++) {
+          ss.SetAmpl(*sv, (uint64_t(s) << nq) | r, matrix(i, r, s));
+        }
+      }
+    } else {
+      const auto columns = input.matrix<int32_t>();
+      for (int s = 0; s < num_columns; s++) {
+        ss.SetAmpl(*sv, (uint64_t(s) << nq) | columns(i, s),
+                   std::complex<float>(1, 0));
+      }
+    }
+
+    for (const auto &gate : fused_circuit) {
+      qsim::ApplyFusedGate(sim, gate, *sv);
+    }
+
+    for (uint64_t r = 0; r < dim; r++) {
+      for (int s = 0; s < num_columns; s++) {
+        (*output_tensor)(i, r, s) =
+            std::complex<float>(ss.GetAmpl(*sv, (uint64_t(s) << nq) | r));
+      }
+    }
+    for (uint64_t r = dim; r < uint64_t(output_tensor->dimension(1)); r++) {
+      for (int s = 0; s < num_columns; s++) {
+        (*output_tensor)(i, r, s) = std::complex<float>(-2, 0);
+      }
+    }
+  }
+
+  void ComputeLarge(
+      const std::vector<int> &batch_indices, const std::vector<int> &num_qubits,
+      const std::vector<int> &state_qubits,
+      const std::vector<std::vector<qsim::GateFused<QsimGate>>> &fused_circuits,
+      const tensorflow::Tensor &input, tensorflow::OpKernelContext *context,
+      tensorflow::TTypes<std::complex<float>, 3>::Tensor *output_tensor) {
+    if (batch_indices.empty()) {
+      return;
+    }
+    const auto tfq_for = tfq::QsimFor(context);
+    using Simulator = qsim::Simulator<const tfq::QsimFor &>;
+    using StateSpace = Simulator::StateSpace;
+
+    Simulator sim = Simulator(tfq_for);
+    StateSpace ss = StateSpace(tfq_for);
+    StateArena<StateSpace> arena(ss);
+    auto sv = arena.Create(1);
+    for (const int i : batch_indices) {
+      EvolveColumns(i, num_qubits[i], state_qubits[i], fused_circuits[i], input,
+                    sim, ss, arena, &sv, output_tensor);
+    }
+  }
+
+  void ComputeSmall(
+      const std::vector<int> &batch_indices, const std::vector<int> &num_qubits,
+      const std::vector<int> &state_qubits,
+      const std::vector<std::vector<qsim::GateFused<QsimGate>>> &fused_circuits,
+      const tensorflow::Tensor &input, tensorflow::OpKernelContext *context,
+      tensorflow::TTypes<std::complex<float>, 3>::Tensor *output_tensor) {
+    const auto tfq_for = qsim::SequentialFor(1);
+    using Simulator = qsim::Simulator<const qsim::SequentialFor &>;
+    using StateSpace = Simulator::StateSpace;
+
+    auto DoWork = [&](WorkQueue &queue) {
+      Simulator sim = Simulator(tfq_for);
+      StateSpace ss = StateSpace(tfq_for);
+      StateArena<StateSpace> arena(ss);
+      auto sv = arena.Create(1);
+
+      int i;
+      while (queue.Next(&i)) {
+        EvolveColumns(i, num_qubits[i], state_qubits[i], fused_circuits[i],
+                      input, sim, ss, arena, &sv, output_tensor);
+      }
+    };
+
+    RunWorkQueue(context, batch_indices, DoWork);
+  }
+};
+
+class TfqCalculateUnitaryProductOp : public TfqCalculateUnitaryColumnsOp {
+ public:
+  explicit TfqCalculateUnitaryProductOp(
+      tensorflow::OpKernelConstruction *context)
+      : TfqCalculateUnitaryColumnsOp(context, true) {}
 };
 
 REGISTER_KERNEL_BUILDER(
     Name("TfqCalculateUnitary").Device(tensorflow::DEVICE_CPU),
     TfqCalculateUnitaryOp);
 
+REGISTER_KERNEL_BUILDER(
+    Name("TfqCalculateUnitaryRagged").Device(tensorflow::DEVICE_CPU),
+    TfqCalculateUnitaryRaggedOp);
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqCalculateUnitaryColumns").Device(tensorflow::DEVICE_CPU),
+    TfqCalculateUnitaryColumnsOp);
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqCalculateUnitaryProduct").Device(tensorflow::DEVICE_CPU),
+    TfqCalculateUnitaryProductOp);
+
 REGISTER_OP("TfqCalculateUnitary")
     .Input("programs: string")
     .Input("symbol_names: string")
@@ -185,4 +545,85 @@ REGISTER_OP("TfqCalculateUnitary")
       return tensorflow::Status::OK();
     });
 
+REGISTER_OP("TfqCalculateUnitaryRagged")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Output("unitaries: complex64")
+    .Output("dims: int32")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext *c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      // [sum of dims ** 2], [batch_size]
+      c->set_output(0, c->Vector(c->UnknownDim()));
+      c->set_output(1, c->Vector(c->Dim(programs_shape, 0)));
+
+      return tensorflow::Status::OK();
+    });
+
+REGISTER_OP("TfqCalculateUnitaryColumns")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("columns: int32")
+    .Output("columns_out: complex64")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext *c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle columns_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &columns_shape));
+
+      // [batch_size, 2 ** largest_n_qubits, n_columns]
+      c->set_output(
+          0, c->MakeShape(
+                 {c->Dim(programs_shape, 0),
+                  tensorflow::shape_inference::InferenceContext::kUnknownDim,
+                  c->Dim(columns_shape, 1)}));
+
+      return tensorflow::Status::OK();
+    });
+
+REGISTER_OP("TfqCalculateUnitaryProduct")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("matrix: complex64")
+    .Output("columns_out: complex64")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext *c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle matrix_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 3, &matrix_shape));
+
+      // [batch_size, 2 ** largest_n_qubits, n_columns]
+      c->set_output(
+          0, c->MakeShape(
+                 {c->Dim(programs_shape, 0),
+                  tensorflow::shape_inference::InferenceContext::kUnknownDim,
+                  c->Dim(matrix_shape, 2)}));
+
+      return tensorflow::Status::OK();
+    });
+
 }  // namespace tfq
@@ -0,0 +1,31 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// C entry point for load_module.py, which reads it with ctypes to decide
+// which build of the simulation op libraries to load.
+
+#include "tensorflow_quantum/core/src/cpu_features.h"
+
+#if defined(_WIN32)
+#define TFQ_EXPORT __declspec(dllexport)
+#else
+#define TFQ_EXPORT __attribute__((visibility("default")))
+#endif
+
+// Returns tfq::ActiveSimdBackend() as an int: 0 basic, 1 sse4, 2 avx2 and
+// 3 avx512.
+extern "C" TFQ_EXPORT int TfqActiveSimdBackend() {
+  return static_cast<int>(tfq::ActiveSimdBackend());
+}
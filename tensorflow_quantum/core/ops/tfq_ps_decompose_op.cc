@@ -35,6 +35,17 @@ using ::tfq::proto::Moment;
 using ::tfq::proto::Operation;
 using ::tfq::proto::Program;
 
+namespace {
+
+// The arg named key of an op, or an empty Arg when the op has none.
+const Arg &GetArg(const google::protobuf::Map<std::string, Arg> &args,
+                  const std::string &key) {
+  const auto it = args.find(key);
+  return it == args.end() ? Arg::default_instance() : it->second;
+}
+
+}  // namespace
+
 class TfqPsDecomposeOp : public tensorflow::OpKernel {
  public:
   explicit TfqPsDecomposeOp(tensorflow::OpKernelConstruction *context)
@@ -58,92 +69,97 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
     const int max_buffer_moments = 5;
 
     auto DoWork = [&](int start, int end) {
+      std::vector<Moment> temp_moment_list(max_buffer_moments, Moment());
       for (int i = start; i < end; i++) {
-        Program cur_program = programs.at(i);
+        const Program &cur_program = programs.at(i);
         Program new_program;
         std::string temp;
         new_program.mutable_language()->set_gate_set("tfq_gate_set");
         new_program.mutable_circuit()->set_scheduling_strategy(
             Circuit::MOMENT_BY_MOMENT);
+        new_program.mutable_circuit()->mutable_moments()->Reserve(
+            cur_program.circuit().moments().size());
         for (int j = 0; j < cur_program.circuit().moments().size(); j++) {
-          Moment cur_moment(cur_program.circuit().moments().at(j));
-          std::vector<Moment> temp_moment_list(max_buffer_moments, Moment());
+          // Decomposed ops replace their original in cur_moment, which is
+          // written directly into new_program.
+          Moment *cur_moment = new_program.mutable_circuit()->add_moments();
+          cur_moment->CopyFrom(cur_program.circuit().moments().at(j));
           int num_extra_moments = 0;
-          for (int k = 0; k < cur_moment.operations().size(); k++) {
-            Operation cur_op = cur_moment.operations().at(k);
-            auto &cur_op_map = *cur_op.mutable_args();
+          for (int k = 0; k < cur_moment->operations().size(); k++) {
+            // cur_op is only replaced once all of its decomposed ops have
+            // been built.
+            const Operation &cur_op = cur_moment->operations().at(k);
+            const auto &cur_op_map = cur_op.args();
+            Operation first_op;
             if (cur_op.gate().id() == "PISP") {
-              auto exponent = cur_op_map.at("exponent");
-              auto phase_exponent = cur_op_map.at("phase_exponent");
+              const Arg &exponent = cur_op_map.at("exponent");
+              const Arg &phase_exponent = cur_op_map.at("phase_exponent");
               if (exponent.arg_case() == Arg::ArgCase::kSymbol ||
                   phase_exponent.arg_case() == Arg::ArgCase::kSymbol) {
                 // Decompose cirq.PhasedISwapPowGate only if it is
                 // parameterized.
                 num_extra_moments = 5;
-                Operation new_op;
-
-                new_op = getOpForPISP(cur_op, 0, 0);
-                cur_moment.mutable_operations()->at(k) = new_op;
-                new_op = getOpForPISP(cur_op, 1, 1);
-                *temp_moment_list[0].add_operations() = new_op;
-                new_op = getOpForISP(cur_op, "XXP", exponent.symbol());
-                *temp_moment_list[1].add_operations() = new_op;
-                new_op = getOpForISP(cur_op, "YYP", exponent.symbol());
-                *temp_moment_list[2].add_operations() = new_op;
-                new_op = getOpForPISP(cur_op, 1, 0);
-                *temp_moment_list[3].add_operations() = new_op;
-                new_op = getOpForPISP(cur_op, 0, 1);
-                *temp_moment_list[4].add_operations() = new_op;
+                first_op = getOpForPISP(cur_op, 0, 0);
+                *temp_moment_list[0].add_operations() =
+                    getOpForPISP(cur_op, 1, 1);
+                *temp_moment_list[1].add_operations() =
+                    getOpForISP(cur_op, "XXP", exponent.symbol());
+                *temp_moment_list[2].add_operations() =
+                    getOpForISP(cur_op, "YYP", exponent.symbol());
+                *temp_moment_list[3].add_operations() =
+                    getOpForPISP(cur_op, 1, 0);
+                *temp_moment_list[4].add_operations() =
+                    getOpForPISP(cur_op, 0, 1);
+                cur_moment->mutable_operations()->at(k).Swap(&first_op);
               }
             } else if (cur_op.gate().id() == "ISP") {
-              auto exponent = cur_op_map.at("exponent");
+              const Arg &exponent = cur_op_map.at("exponent");
               if (exponent.arg_case() == Arg::ArgCase::kSymbol) {
                 // Decompose cirq.ISwapPowGate only if it is parameterized.
                 if (num_extra_moments == 0) num_extra_moments = 1;
-                Operation new_op;
-                new_op = getOpForISP(cur_op, "XXP", exponent.symbol());
-                cur_moment.mutable_operations()->at(k) = new_op;
-                new_op = getOpForISP(cur_op, "YYP", exponent.symbol());
-                *temp_moment_list[0].add_operations() = new_op;
+                first_op = getOpForISP(cur_op, "XXP", exponent.symbol());
+                *temp_moment_list[0].add_operations() =
+                    getOpForISP(cur_op, "YYP", exponent.symbol());
+                cur_moment->mutable_operations()->at(k).Swap(&first_op);
               }
             } else if (cur_op.gate().id() == "PXP") {
-              auto exponent = cur_op_map.at("exponent");
-              auto phase_exponent = cur_op_map.at("phase_exponent");
+              const Arg &exponent = cur_op_map.at("exponent");
+              const Arg &phase_exponent = cur_op_map.at("phase_exponent");
               if (exponent.arg_case() == Arg::ArgCase::kSymbol ||
                   phase_exponent.arg_case() == Arg::ArgCase::kSymbol) {
                 // Decompose cirq.PhasedXPowGate only if it is parameterized.
                 num_extra_moments = 2;
-                Operation new_op;
-                new_op = getOpForPXP(cur_op, "ZP", "phase_exponent", true);
-                cur_moment.mutable_operations()->at(k) = new_op;
-                new_op = getOpForPXP(cur_op, "XP", "exponent", false);
-                *temp_moment_list[0].add_operations() = new_op;
-                new_op = getOpForPXP(cur_op, "ZP", "phase_exponent", false);
-                *temp_moment_list[1].add_operations() = new_op;
+                first_op = getOpForPXP(cur_op, "ZP", "phase_exponent", true);
+                *temp_moment_list[0].add_operations() =
+                    getOpForPXP(cur_op, "XP", "exponent", false);
+                *temp_moment_list[1].add_operations() =
+                    getOpForPXP(cur_op, "ZP", "phase_exponent", false);
+                cur_moment->mutable_operations()->at(k).Swap(&first_op);
               }
             } else if (cur_op.gate().id() == "FSIM") {
-              auto theta = cur_op_map.at("theta");
-              auto phi = cur_op_map.at("phi");
+              const Arg &theta = cur_op_map.at("theta");
+              const Arg &phi = cur_op_map.at("phi");
               if (theta.arg_case() == Arg::ArgCase::kSymbol ||
                   phi.arg_case() == Arg::ArgCase::kSymbol) {
                 // Decompose cirq.FSimGate only if it is parameterized.
                 num_extra_moments = 2;
-                Operation new_op;
-                new_op = getOpForFSIM(cur_op, "XXP", "theta", true);
-                cur_moment.mutable_operations()->at(k) = new_op;
-                new_op = getOpForFSIM(cur_op, "YYP", "theta", true);
-                *temp_moment_list[0].add_operations() = new_op;
-                new_op = getOpForFSIM(cur_op, "CZP", "phi", false);
-                *temp_moment_list[1].add_operations() = new_op;
+                first_op = getOpForFSIM(cur_op, "XXP", "theta", true);
+                *temp_moment_list[0].add_operations() =
+                    getOpForFSIM(cur_op, "YYP", "theta", true);
+                *temp_moment_list[1].add_operations() =
+                    getOpForFSIM(cur_op, "CZP", "phi", false);
+                cur_moment->mutable_operations()->at(k).Swap(&first_op);
               }
             }
           }
-          *new_program.mutable_circuit()->add_moments() = cur_moment;
-          if (num_extra_moments > 0) {
-            for (int l = 0; l < num_extra_moments; l++) {
-              *new_program.mutable_circuit()->add_moments() =
-                  temp_moment_list[l];
-            }
+          // The extra moments are moved into new_program and the buffers
+          // left empty for the next moment.
+          for (int l = 0; l < num_extra_moments; l++) {
+            new_program.mutable_circuit()->add_moments()->Swap(
+                &temp_moment_list[l]);
+          }
+          for (int l = 0; l < max_buffer_moments; l++) {
+            temp_moment_list[l].Clear();
           }
         }
         new_program.SerializeToString(&temp);
@@ -161,11 +177,12 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
  private:
   // Helper functions for decompositions of ISwapPowGate, PhasedX, FSIM,
   //  PhasedISwapPow.
-  Operation getOpForISP(Operation &cur_op, std::string id, std::string symbol) {
+  Operation getOpForISP(const Operation &cur_op, const std::string &id,
+                        const std::string &symbol) {
     // Step 1. parse the current op.
-    auto &cur_op_map = *cur_op.mutable_args();
+    const auto &cur_op_map = cur_op.args();
     float cur_exponent_scalar =
-        cur_op_map["exponent_scalar"].arg_value().float_value();
+        GetArg(cur_op_map, "exponent_scalar").arg_value().float_value();
     auto &cur_op_qubits = cur_op.qubits();
     // Step 2. create a new op.
     Operation new_op;
@@ -178,22 +195,24 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
     new_op_map["exponent"].set_symbol(symbol);
     // Copy over control metadata.
     new_op_map["control_qubits"].mutable_arg_value()->set_string_value(
-        cur_op_map["control_qubits"].arg_value().string_value());
+        GetArg(cur_op_map, "control_qubits").arg_value().string_value());
     new_op_map["control_values"].mutable_arg_value()->set_string_value(
-        cur_op_map["control_values"].arg_value().string_value());
+        GetArg(cur_op_map, "control_values").arg_value().string_value());
     // Step 4. add qubits.
     *new_op.mutable_qubits() = {cur_op_qubits.begin(), cur_op_qubits.end()};
     return new_op;
   }
 
-  Operation getOpForPXP(Operation &cur_op, std::string id, std::string key,
-                        bool sign_flip = false) {
+  Operation getOpForPXP(const Operation &cur_op, const std::string &id,
+                        const std::string &key, bool sign_flip = false) {
     // Step 1. parse the current op.
-    auto &cur_op_map = *cur_op.mutable_args();
+    const auto &cur_op_map = cur_op.args();
     auto &cur_op_qubits = cur_op.qubits();
-    auto target_exponent = cur_op_map[key];
+    const Arg &target_exponent = GetArg(cur_op_map, key);
     float target_exponent_scalar =
-        cur_op_map[absl::StrCat(key, "_scalar")].arg_value().float_value();
+        GetArg(cur_op_map, absl::StrCat(key, "_scalar"))
+            .arg_value()
+            .float_value();
     float sign = (sign_flip) ? -1.0 : 1.0;
     // Step 2. create a new op.
     Operation new_op;
@@ -222,19 +241,20 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
     *new_op.mutable_qubits() = {cur_op_qubits.begin(), cur_op_qubits.end()};
     // Copy over control metadata.
     new_op_map["control_qubits"].mutable_arg_value()->set_string_value(
-        cur_op_map["control_qubits"].arg_value().string_value());
+        GetArg(cur_op_map, "control_qubits").arg_value().string_value());
     new_op_map["control_values"].mutable_arg_value()->set_string_value(
-        cur_op_map["control_values"].arg_value().string_value());
+        GetArg(cur_op_map, "control_values").arg_value().string_value());
     return new_op;
   }
 
-  Operation getOpForPISP(Operation &cur_op, bool sign_flip, bool use_target) {
+  Operation getOpForPISP(const Operation &cur_op, bool sign_flip,
+                         bool use_target) {
     // Step 1. parse the current op.
-    auto &cur_op_map = *cur_op.mutable_args();
+    const auto &cur_op_map = cur_op.args();
     auto &cur_op_qubits = cur_op.qubits();
-    auto target_exponent = cur_op_map["phase_exponent"];
+    const Arg &target_exponent = GetArg(cur_op_map, "phase_exponent");
     float target_exponent_scalar =
-        cur_op_map["phase_exponent_scalar"].arg_value().float_value();
+        GetArg(cur_op_map, "phase_exponent_scalar").arg_value().float_value();
     float sign = (sign_flip) ? -1.0 : 1.0;
     // Step 2. create a new op.
     Operation new_op;
@@ -263,20 +283,23 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
                                 cur_op_qubits.end() - !use_target};
     // Copy over control metadata.
     new_op_map["control_qubits"].mutable_arg_value()->set_string_value(
-        cur_op_map["control_qubits"].arg_value().string_value());
+        GetArg(cur_op_map, "control_qubits").arg_value().string_value());
     new_op_map["control_values"].mutable_arg_value()->set_string_value(
-        cur_op_map["control_values"].arg_value().string_value());
+        GetArg(cur_op_map, "control_values").arg_value().string_value());
     return new_op;
   }
 
-  Operation getOpForFSIM(Operation &cur_op, std::string id, std::string key,
+  Operation getOpForFSIM(const Operation &cur_op, const std::string &id,
+                         const std::string &key,
                          bool use_global_shift = false) {
     // Step 1. parse the current op.
-    auto &cur_op_map = *cur_op.mutable_args();
+    const auto &cur_op_map = cur_op.args();
     auto &cur_op_qubits = cur_op.qubits();
-    auto target_exponent = cur_op_map[key];
+    const Arg &target_exponent = GetArg(cur_op_map, key);
     float target_exponent_scalar =
-        cur_op_map[absl::StrCat(key, "_scalar")].arg_value().float_value();
+        GetArg(cur_op_map, absl::StrCat(key, "_scalar"))
+            .arg_value()
+            .float_value();
     float global_shift = (use_global_shift) ? -0.5 : 0.0;
     float sign = (key == "theta") ? 1.0 : -1.0;
     // Step 2. create a new op.
@@ -307,9 +330,9 @@ class TfqPsDecomposeOp : public tensorflow::OpKernel {
     *new_op.mutable_qubits() = {cur_op_qubits.begin(), cur_op_qubits.end()};
     // Copy over control metadata.
     new_op_map["control_qubits"].mutable_arg_value()->set_string_value(
-        cur_op_map["control_qubits"].arg_value().string_value());
+        GetArg(cur_op_map, "control_qubits").arg_value().string_value());
     new_op_map["control_values"].mutable_arg_value()->set_string_value(
-        cur_op_map["control_values"].arg_value().string_value());
+        GetArg(cur_op_map, "control_values").arg_value().string_value());
     return new_op;
   }
 };
@@ -83,41 +83,43 @@ class TfqPsSymbolReplaceOp : public tensorflow::OpKernel {
                              n_symbols, std::vector<std::string>()));
 
     auto DoWork = [&](int start, int end) {
+      // Every occurrence is serialized from one working copy of its program,
+      // with the replacement symbol set just for that occurrence.
+      Program temp;
       for (int i = start; i < end; i++) {
         int sidx = i % n_symbols;
         int pidx = i / n_symbols;
-        std::string symbol_to_replace = symbols(sidx);
-        std::string temp_symbol_holder;
-        Program cur_program = programs.at(pidx);
+        const std::string symbol_to_replace = symbols(sidx);
+        const std::string replacement = replacement_symbols(sidx);
+        const Program &cur_program = programs.at(pidx);
+        bool copied = false;
+        std::vector<std::string> &results = output_programs.at(pidx).at(sidx);
         for (int j = 0; j < cur_program.circuit().moments().size(); j++) {
-          Moment cur_moment = cur_program.circuit().moments().at(j);
+          const Moment &cur_moment = cur_program.circuit().moments().at(j);
           for (int k = 0; k < cur_moment.operations().size(); k++) {
-            Operation cur_op = cur_moment.operations().at(k);
+            const Operation &cur_op = cur_moment.operations().at(k);
             for (auto l = cur_op.args().begin(); l != cur_op.args().end();
                  l++) {
-              const std::string key = (*l).first;
+              const std::string &key = (*l).first;
               const Arg &arg = (*l).second;
-              if (arg.symbol() == symbol_to_replace) {
-                // Copy the proto, modify the symbol and append to output.
-                Program temp(cur_program);
-
-                // temp_symbol_holder is needed to avoid call ambiguity for
-                // set_symbol below.
-                temp_symbol_holder = replacement_symbols(sidx);
-                temp.mutable_circuit()
-                    ->mutable_moments()
-                    ->at(j)
-                    .mutable_operations()
-                    ->at(k)
-                    .mutable_args()
-                    ->at(key)
-                    .set_symbol(temp_symbol_holder);
-
-                std::string res;
-                temp.SerializeToString(&res);
-                output_programs.at(pidx).at(sidx).push_back(res);
-                temp.Clear();
+              if (arg.symbol() != symbol_to_replace) {
+                continue;
               }
+              if (!copied) {
+                temp.CopyFrom(cur_program);
+                copied = true;
+              }
+              Arg &temp_arg = temp.mutable_circuit()
+                                  ->mutable_moments()
+                                  ->at(j)
+                                  .mutable_operations()
+                                  ->at(k)
+                                  .mutable_args()
+                                  ->at(key);
+              temp_arg.set_symbol(replacement);
+              results.emplace_back();
+              temp.SerializeToString(&results.back());
+              temp_arg.CopyFrom(arg);
             }
           }
         }
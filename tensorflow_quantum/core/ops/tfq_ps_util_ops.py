@@ -21,3 +21,5 @@ PS_UTIL_MODULE = load_module("_tfq_ps_utils.so")
 tfq_ps_decompose = PS_UTIL_MODULE.tfq_ps_decompose
 tfq_ps_symbol_replace = PS_UTIL_MODULE.tfq_ps_symbol_replace
 tfq_ps_weights_from_symbols = PS_UTIL_MODULE.tfq_ps_weights_from_symbols
+tfq_ps_gate_indices_from_symbols = (
+    PS_UTIL_MODULE.tfq_ps_gate_indices_from_symbols)
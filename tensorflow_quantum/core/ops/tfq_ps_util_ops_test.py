@@ -841,5 +841,58 @@ class PSWeightsFromSymbolTest(tf.test.TestCase):
         self.assertAllClose(tf.shape(res), [len(circuit_batch), 2, 0])
 
 
+class PSGateIndicesFromSymbolsTest(tf.test.TestCase):
+    """Tests tfq_ps_gate_indices_from_symbols."""
+
+    def test_padding(self):
+        """Ensure that indices line up with the weights and pad with -1."""
+        bit = cirq.GridQubit(0, 0)
+        circuits = [
+            cirq.Circuit(
+                cirq.X(bit)**(sympy.Symbol('alpha') * 2.0),
+                cirq.Y(bit)**3.0,
+                cirq.Z(bit)**(sympy.Symbol('alpha') * 4.0),
+            ),
+            cirq.Circuit(
+                cirq.X(bit)**2.0,
+                cirq.Y(bit)**(sympy.Symbol('beta') * 3.0),
+                cirq.Z(bit)**(sympy.Symbol('gamma') * 4.0),
+            ),
+            cirq.Circuit()
+        ]
+        inputs = util.convert_to_tensor(circuits)
+        symbols = tf.convert_to_tensor(['alpha', 'beta', 'gamma'])
+        res = tfq_ps_util_ops.tfq_ps_gate_indices_from_symbols(inputs, symbols)
+        self.assertAllEqual(
+            res,
+            np.array([[[0, 2], [-1, -1], [-1, -1]],
+                      [[-1, -1], [1, -1], [2, -1]],
+                      [[-1, -1], [-1, -1], [-1, -1]]]))
+        weights = tfq_ps_util_ops.tfq_ps_weights_from_symbols(inputs, symbols)
+        self.assertAllEqual(tf.shape(res), tf.shape(weights))
+
+    def test_ignorance(self):
+        """Test ignorance of ISP, PXP, FSIM gates."""
+        circuit_batch = _complex_test_circuit()
+        inputs = util.convert_to_tensor(circuit_batch)
+        symbols = tf.convert_to_tensor(['r', 't'])
+        res = tfq_ps_util_ops.tfq_ps_gate_indices_from_symbols(inputs, symbols)
+        self.assertAllClose(tf.shape(res), [len(circuit_batch), 2, 0])
+
+    def test_error(self):
+        """Ensure if a symbol can't be found the op errors."""
+        bit = cirq.GridQubit(0, 0)
+        circuit = cirq.Circuit(cirq.X(bit)**(sympy.Symbol('delta') * 2))
+        inputs = util.convert_to_tensor([circuit])
+        symbols = tf.convert_to_tensor(['alpha'])
+        with self.assertRaisesRegex(Exception, expected_regex='sympy.Symbol'):
+            tfq_ps_util_ops.tfq_ps_gate_indices_from_symbols(inputs, symbols)
+
+        symbols = tf.convert_to_tensor([['delta']])
+        with self.assertRaisesRegex(Exception,
+                                    expected_regex='rank 1. Got rank 2.'):
+            tfq_ps_util_ops.tfq_ps_gate_indices_from_symbols(inputs, symbols)
+
+
 if __name__ == "__main__":
     tf.test.main()
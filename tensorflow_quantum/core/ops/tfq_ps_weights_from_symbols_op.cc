@@ -35,6 +35,50 @@ using ::tfq::proto::Moment;
 using ::tfq::proto::Operation;
 using ::tfq::proto::Program;
 
+namespace {
+
+// Gates that never have their exponent shifted, either because they are
+// decomposed by TfqPsDecompose beforehand or because they are channels.
+const absl::flat_hash_set<std::string> &IgnoredGates() {
+  static const absl::flat_hash_set<std::string> *ignored =
+      new absl::flat_hash_set<std::string>(
+          {"I", "ISP", "PXP", "FSIM", "PISP", "AD", "ADP", "DP", "GAD", "BF",
+           "PF", "PD", "RST"});
+  return *ignored;
+}
+
+// Calls visit(symbol_index, gate_index, op) for every op of program with
+// a symbolic exponent, in program order. symbol_index is the index of the
+// symbol in symbols_map and gate_index the position of the op in program,
+// which is also the index of its gate in the qsim circuit.
+template <typename Function>
+tensorflow::Status VisitSymbolicExponents(
+    const Program &program,
+    const absl::flat_hash_map<std::string, int> &symbols_map,
+    Function &&visit) {
+  int gate_index = 0;
+  for (const Moment &cur_moment : program.circuit().moments()) {
+    for (const Operation &cur_op : cur_moment.operations()) {
+      const int index = gate_index++;
+      if (IgnoredGates().contains(cur_op.gate().id())) continue;
+
+      const Arg &exponent = cur_op.args().at("exponent");
+      if (exponent.arg_case() != Arg::ArgCase::kSymbol) continue;
+      // this gate has parameterized exponent.
+      const auto symbol = symbols_map.find(exponent.symbol());
+      if (symbol == symbols_map.end()) {
+        // Should never happen. raise error.
+        return tensorflow::errors::InvalidArgument(
+            "A circuit contains a sympy.Symbol not found in symbols!");
+      }
+      visit(symbol->second, index, cur_op);
+    }
+  }
+  return tensorflow::Status::OK();
+}
+
+}  // namespace
+
 class TfqPsWeightsFromSymbolOp : public tensorflow::OpKernel {
  public:
   explicit TfqPsWeightsFromSymbolOp(tensorflow::OpKernelConstruction *context)
@@ -71,44 +115,22 @@ class TfqPsWeightsFromSymbolOp : public tensorflow::OpKernel {
     for (int i = 0; i < n_symbols; i++) {
       symbols_map[symbols(i)] = i;
     }
-    std::vector<std::string> ignore_list = {"I",  "ISP", "PXP", "FSIM", "PISP",
-                                            "AD", "ADP", "DP",  "GAD",  "BF",
-                                            "PF", "PD",  "RST"};
-    absl::flat_hash_set<std::string> ignored_symbol_set(ignore_list.begin(),
-                                                        ignore_list.end());
-
     std::vector<int> n_single_symbol(programs.size(), 0);
 
     auto DoWork = [&](int start, int end) {
       for (int i = start; i < end; i++) {
-        Program cur_program = programs.at(i);
-        for (int j = 0; j < cur_program.circuit().moments().size(); j++) {
-          Moment cur_moment = cur_program.circuit().moments().at(j);
-          for (int k = 0; k < cur_moment.operations().size(); k++) {
-            Operation cur_op = cur_moment.operations().at(k);
-            if (ignored_symbol_set.contains(cur_op.gate().id())) continue;
-
-            const auto &cur_op_map = *cur_op.mutable_args();
-            const auto exponent = cur_op_map.at("exponent");
-            if (exponent.arg_case() == Arg::ArgCase::kSymbol) {
-              // this gate has parameterized exponent.
-              const absl::string_view symbol_name = exponent.symbol();
-              if (!symbols_map.contains(symbol_name)) {
-                // Should never happen. raise error.
-                OP_REQUIRES(context, false,
-                            tensorflow::errors::InvalidArgument(
-                                "A circuit contains a sympy.Symbol not found "
-                                "in symbols!"));
-              }
-              output_results.at(i)
-                  .at(symbols_map.at(symbol_name))
-                  .push_back(cur_op.args()
-                                 .at("exponent_scalar")
-                                 .arg_value()
-                                 .float_value());
-            }
-          }
-        }
+        std::vector<std::vector<float>> &results = output_results.at(i);
+        OP_REQUIRES_OK(
+            context,
+            VisitSymbolicExponents(
+                programs.at(i), symbols_map,
+                [&results](const int symbol, const int gate_index,
+                           const Operation &cur_op) {
+                  results.at(symbol).push_back(cur_op.args()
+                                                   .at("exponent_scalar")
+                                                   .arg_value()
+                                                   .float_value());
+                }));
         // loop over all index entries of symbols_map and find largest
         // value from output_results.
         for (int j = 0; j < n_symbols; j++) {
@@ -187,4 +209,119 @@ REGISTER_OP("TfqPsWeightsFromSymbols")
       return tensorflow::Status::OK();
     });
 
+// The positions in their program of the gates TfqPsWeightsFromSymbols
+// reports weights for, in the same order and padded with -1. Together with
+// the weights this describes every parameter shifted circuit as a (program,
+// gate, shift) triple for TfqSimulateShiftedExpectation, without building
+// the circuits.
+class TfqPsGateIndicesFromSymbolsOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqPsGateIndicesFromSymbolsOp(
+      tensorflow::OpKernelConstruction *context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext *context) override {
+    std::vector<Program> programs;
+
+    const int num_inputs = context->num_inputs();
+    OP_REQUIRES(context, num_inputs == 2,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Expected 2 inputs, got ", num_inputs, " inputs.")));
+
+    OP_REQUIRES_OK(context, ParsePrograms(context, "programs", &programs));
+
+    const Tensor *symbols_tensor;
+    OP_REQUIRES_OK(context, context->input("symbols", &symbols_tensor));
+    OP_REQUIRES(
+        context, symbols_tensor->dims() == 1,
+        tensorflow::errors::InvalidArgument(absl::StrCat(
+            "symbols must be rank 1. Got rank ", symbols_tensor->dims(), ".")));
+
+    const auto symbols = symbols_tensor->vec<tensorflow::tstring>();
+    const int n_symbols = symbols.size();
+
+    absl::flat_hash_map<std::string, int> symbols_map;
+    for (int i = 0; i < n_symbols; i++) {
+      symbols_map[symbols(i)] = i;
+    }
+
+    // (i,j,k) = the gate of the kth occurrence of symbols(j) in programs(i).
+    std::vector<std::vector<std::vector<int>>> output_results(
+        programs.size(),
+        std::vector<std::vector<int>>(n_symbols, std::vector<int>()));
+
+    auto DoWork = [&](int start, int end) {
+      for (int i = start; i < end; i++) {
+        std::vector<std::vector<int>> &results = output_results.at(i);
+        OP_REQUIRES_OK(
+            context,
+            VisitSymbolicExponents(
+                programs.at(i), symbols_map,
+                [&results](const int symbol, const int gate_index,
+                           const Operation &cur_op) {
+                  results.at(symbol).push_back(gate_index);
+                }));
+      }
+    };
+
+    const int block_size = GetBlockSize(context, programs.size());
+    context->device()
+        ->tensorflow_cpu_worker_threads()
+        ->workers->TransformRangeConcurrently(block_size, programs.size(),
+                                              DoWork);
+    if (!context->status().ok()) {
+      return;
+    }
+
+    size_t largest_single_symbol = 0;
+    for (const auto &results : output_results) {
+      for (const auto &symbol_results : results) {
+        largest_single_symbol =
+            std::max(largest_single_symbol, symbol_results.size());
+      }
+    }
+
+    tensorflow::Tensor *output = nullptr;
+    tensorflow::TensorShape output_shape;
+    output_shape.AddDim(programs.size());
+    output_shape.AddDim(n_symbols);
+    output_shape.AddDim(largest_single_symbol);
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+
+    auto output_tensor = output->tensor<int, 3>();
+    for (size_t i = 0; i < output_results.size(); i++) {
+      for (int j = 0; j < n_symbols; j++) {
+        const std::vector<int> &gates = output_results[i][j];
+        for (size_t k = 0; k < largest_single_symbol; k++) {
+          output_tensor(i, j, k) = k < gates.size() ? gates[k] : -1;
+        }
+      }
+    }
+  }
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqPsGateIndicesFromSymbols").Device(tensorflow::DEVICE_CPU),
+    TfqPsGateIndicesFromSymbolsOp);
+
+REGISTER_OP("TfqPsGateIndicesFromSymbols")
+    .Input("programs: string")
+    .Input("symbols: string")
+    .Output("gate_indices: int32")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext *c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbols_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbols_shape));
+
+      c->set_output(
+          0, c->MakeShape(
+                 {c->Dim(programs_shape, 0),
+                  tensorflow::shape_inference::InferenceContext::kUnknownDim,
+                  tensorflow::shape_inference::InferenceContext::kUnknownDim}));
+
+      return tensorflow::Status::OK();
+    });
+
 }  // namespace tfq
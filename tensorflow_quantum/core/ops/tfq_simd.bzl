@@ -0,0 +1,49 @@
+"""Builds of the simulation op libraries for several instruction sets."""
+
+# Compiler flags of every build next to the default one, which keeps the
+# flags of the bazel invocation. The simulator that qsim/lib/simmux.h picks
+# follows from these flags, load_module.py then loads the widest build that
+# the CPU can run.
+_SIMD_VARIANTS = {
+    "avx2": {
+        "windows": ["/arch:AVX2"],
+        "default": ["-mavx2", "-mfma"],
+    },
+    "avx512": {
+        "windows": ["/arch:AVX512"],
+        "default": ["-mavx512f", "-mavx2", "-mfma"],
+    },
+}
+
+def tfq_simd_variants(name):
+    """Returns the labels of all builds of the op library `name`.
+
+    Args:
+      name: label of the default build, e.g. ":_tfq_simulate_ops.so".
+    """
+    base = name[:-len(".so")]
+    return [name] + [base + "_" + v + ".so" for v in _SIMD_VARIANTS]
+
+def tfq_simd_cc_binary(name, copts = [], **kwargs):
+    """A cc_binary op library that is also built for every SIMD variant.
+
+    The variants are named like `name` with the instruction set appended,
+    e.g. _tfq_simulate_ops_avx2.so. The calling package needs a ":windows"
+    config_setting.
+
+    Args:
+      name: name of the default build, ending in ".so".
+      copts: compiler flags shared by all builds.
+      **kwargs: passed on to every cc_binary.
+    """
+    native.cc_binary(name = name, copts = copts, **kwargs)
+    base = name[:-len(".so")]
+    for variant, flags in _SIMD_VARIANTS.items():
+        native.cc_binary(
+            name = base + "_" + variant + ".so",
+            copts = copts + select({
+                ":windows": flags["windows"],
+                "//conditions:default": flags["default"],
+            }),
+            **kwargs
+        )
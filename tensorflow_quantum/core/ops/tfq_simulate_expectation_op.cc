@@ -14,6 +14,8 @@ limitations under the License.
 ==============================================================================*/
 
 #include <memory>
+#include <numeric>
+#include <string>
 #include <vector>
 
 #include "../qsim/lib/circuit.h"
@@ -31,6 +33,9 @@ limitations under the License.
 #include "tensorflow_quantum/core/ops/parse_context.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
+#include "tensorflow_quantum/core/src/batched_states.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
+#include "tensorflow_quantum/core/src/prefix_sharing.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
@@ -45,7 +50,11 @@ typedef qsim::Circuit<QsimGate> QsimCircuit;
 class TfqSimulateExpectationOp : public tensorflow::OpKernel {
  public:
   explicit TfqSimulateExpectationOp(tensorflow::OpKernelConstruction* context)
-      : OpKernel(context) {}
+      : OpKernel(context) {
+    std::string precision;
+    OP_REQUIRES_OK(context, context->GetAttr("precision", &precision));
+    double_precision_ = precision == "double";
+  }
 
   void Compute(tensorflow::OpKernelContext* context) override {
     // TODO (mbbrough): add more dimension checks for other inputs here.
@@ -66,11 +75,13 @@ class TfqSimulateExpectationOp : public tensorflow::OpKernel {
     auto output_tensor = output->matrix<float>();
 
     // Parse program protos.
-    std::vector<Program> programs;
+    ResolvedPrograms resolved;
     std::vector<int> num_qubits;
-    std::vector<std::vector<PauliSum>> pauli_sums;
-    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &programs,
-                                                    &num_qubits, &pauli_sums));
+    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &resolved,
+                                                    &num_qubits, true));
+    const std::vector<const Program*>& programs = resolved.programs;
+    const std::vector<std::vector<const PauliSum*>>& pauli_sums =
+        resolved.p_sums;
 
     std::vector<SymbolMap> maps;
     OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
@@ -81,167 +92,215 @@ class TfqSimulateExpectationOp : public tensorflow::OpKernel {
                     programs.size(), " circuits and ", maps.size(),
                     " symbol values.")));
 
-    // Construct qsim circuits.
-    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
-    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
-        programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
-
-    Status parse_status = Status::OK();
-    auto p_lock = tensorflow::mutex();
-    auto construct_f = [&](int start, int end) {
-      for (int i = start; i < end; i++) {
-        Status local =
-            QsimCircuitFromProgram(programs[i], maps[i], num_qubits[i],
-                                   &qsim_circuits[i], &fused_circuits[i]);
-        NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
-      }
-    };
-
-    const int num_cycles = 1000;
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        programs.size(), num_cycles, construct_f);
-    OP_REQUIRES_OK(context, parse_status);
+    // Compiled observables.
+    std::vector<CompiledPauliSums> pauli_masks;
+    OP_REQUIRES_OK(context, GetPauliSumMasks(context, pauli_sums, num_qubits,
+                                             &pauli_masks));
 
-    int max_num_qubits = 0;
-    for (const int num : num_qubits) {
-      max_num_qubits = std::max(max_num_qubits, num);
-    }
+    // Repeated rows are computed once and copied afterwards.
+    std::vector<int> first_row;
+    OP_REQUIRES_OK(context,
+                   GetDuplicateRows(context, {"pauli_sums"}, &first_row));
 
-    // Cross reference with standard google cloud compute instances
-    // Memory ~= 2 * num_threads * (2 * 64 * 2 ** num_qubits in circuits)
-    // e2s2 = 2 CPU, 8GB -> Can safely do 25 since Memory = 4GB
-    // e2s4 = 4 CPU, 16GB -> Can safely do 25 since Memory = 8GB
-    // ...
-    if (max_num_qubits >= 26 || programs.size() == 1) {
-      ComputeLarge(num_qubits, fused_circuits, pauli_sums, context,
-                   &output_tensor);
+    if (double_precision_) {
+      Simulate<double>(programs, num_qubits, maps, pauli_masks, first_row,
+                       context, &output_tensor);
     } else {
-      ComputeSmall(num_qubits, max_num_qubits, fused_circuits, pauli_sums,
-                   context, &output_tensor);
+      Simulate<float>(programs, num_qubits, maps, pauli_masks, first_row,
+                      context, &output_tensor);
     }
+    if (!context->status().ok()) {
+      return;
+    }
+    CopyDuplicateRows(first_row, &output_tensor);
   }
 
  private:
+  bool double_precision_;
+
+  // Builds the circuits with fp_type gates and simulates them with fp_type
+  // amplitudes.
+  template <typename fp_type>
+  void Simulate(const std::vector<const Program*>& programs,
+                const std::vector<int>& num_qubits,
+                const std::vector<SymbolMap>& maps,
+                const std::vector<CompiledPauliSums>& pauli_masks,
+                const std::vector<int>& first_row,
+                tensorflow::OpKernelContext* context,
+                tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+    // Construct qsim circuits.
+    std::vector<qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>> qsim_circuits;
+    std::vector<std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>>
+        fused_circuits;
+    OP_REQUIRES_OK(context, GetQsimCircuits(context, programs, num_qubits, maps,
+                                            &qsim_circuits, &fused_circuits));
+
+    PhaseTrace trace(context, "simulate");
+    // Large or expensive circuits are simulated one at a time over the
+    // whole threadpool, the rest concurrently with one thread each.
+    CircuitSchedule schedule;
+    ScheduleFusedCircuits(context, num_qubits, fused_circuits, 1, &schedule);
+    SkipDuplicateRows(first_row, &schedule);
+    ComputeLarge(schedule.wide, num_qubits, fused_circuits, pauli_masks,
+                 context, output_tensor);
+    ComputeSmall(schedule.narrow, num_qubits, fused_circuits, pauli_masks,
+                 context, output_tensor);
+  }
+
+  template <typename Gate>
   void ComputeLarge(
-      const std::vector<int>& num_qubits,
-      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
-      const std::vector<std::vector<PauliSum>>& pauli_sums,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
+      const std::vector<std::vector<qsim::GateFused<Gate>>>& fused_circuits,
+      const std::vector<CompiledPauliSums>& pauli_masks,
       tensorflow::OpKernelContext* context,
       tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+    if (batch_indices.empty()) {
+      return;
+    }
     // Instantiate qsim objects.
     const auto tfq_for = tfq::QsimFor(context);
-    using Simulator = qsim::Simulator<const tfq::QsimFor&>;
-    using StateSpace = Simulator::StateSpace;
+    using Simulator =
+        typename QsimSimulator<const tfq::QsimFor&,
+                               typename Gate::fp_type>::type;
+    using StateSpace = typename Simulator::StateSpace;
 
     // Begin simulation.
-    int largest_nq = 1;
     Simulator sim = Simulator(tfq_for);
     StateSpace ss = StateSpace(tfq_for);
-    auto sv = ss.Create(largest_nq);
-    auto scratch = ss.Create(largest_nq);
+    StateArena<StateSpace> arena(ss);
+    auto sv = arena.Create(1);
 
     // Simulate programs one by one. Parallelizing over state vectors
-    // we no longer parallelize over circuits. Each time we encounter a
-    // a larger circuit we will grow the Statevector as necessary.
-    for (int i = 0; i < fused_circuits.size(); i++) {
-      int nq = num_qubits[i];
-
-      if (nq > largest_nq) {
-        // need to switch to larger statespace.
-        largest_nq = nq;
-        sv = ss.Create(largest_nq);
-        scratch = ss.Create(largest_nq);
-      }
-      // TODO: add heuristic here so that we do not always recompute
-      //  the state if there is a possibility that circuit[i] and
-      //  circuit[i + 1] produce the same state.
-      ss.SetStateZero(sv);
-      for (int j = 0; j < fused_circuits[i].size(); j++) {
-        qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
-      }
-      for (int j = 0; j < pauli_sums[i].size(); j++) {
-        // (#679) Just ignore empty program
-        if (fused_circuits[i].size() == 0) {
-          (*output_tensor)(i, j) = -2.0;
-          continue;
-        }
-        float exp_v = 0.0;
-        OP_REQUIRES_OK(context,
-                       ComputeExpectationQsim(pauli_sums[i][j], sim, ss, sv,
-                                              scratch, &exp_v));
-        (*output_tensor)(i, j) = exp_v;
-      }
-    }
+    // we no longer parallelize over circuits. Circuits that start with the
+    // same gates resume from a checkpoint of their common prefix instead
+    // of recomputing it.
+    PrefixPlan plan;
+    PlanSharedPrefixes(batch_indices, num_qubits, fused_circuits, &plan);
+    RunSharedPrefixes(
+        plan, 0, plan.order.size(), num_qubits, fused_circuits, sim, ss, arena,
+        &sv, CheckpointBudget(1), [&](const int i) {
+          for (int j = 0; j < pauli_masks[i]->size(); j++) {
+            // (#679) Just ignore empty program
+            if (fused_circuits[i].size() == 0) {
+              (*output_tensor)(i, j) = -2.0;
+              continue;
+            }
+            float exp_v = 0.0;
+            OP_REQUIRES_OK(context,
+                           ComputeExpectationMasks((*pauli_masks[i])[j],
+                                                   tfq_for, ss, sv, &exp_v));
+            (*output_tensor)(i, j) = exp_v;
+          }
+        });
   }
 
+  template <typename Gate>
   void ComputeSmall(
-      const std::vector<int>& num_qubits, const int max_num_qubits,
-      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
-      const std::vector<std::vector<PauliSum>>& pauli_sums,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
+      const std::vector<std::vector<qsim::GateFused<Gate>>>& fused_circuits,
+      const std::vector<CompiledPauliSums>& pauli_masks,
       tensorflow::OpKernelContext* context,
       tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
     const auto tfq_for = qsim::SequentialFor(1);
-    using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
-    using StateSpace = Simulator::StateSpace;
-
-    const int output_dim_op_size = output_tensor->dimension(1);
+    using Simulator =
+        typename QsimSimulator<const qsim::SequentialFor&,
+                               typename Gate::fp_type>::type;
+    using StateSpace = typename Simulator::StateSpace;
+
+    // Circuits of the same structure are simulated together, the others
+    // one at a time.
+    const int num_threads =
+        context->device()->tensorflow_cpu_worker_threads()->num_threads;
+    std::vector<std::vector<int>> groups;
+    std::vector<int> unbatched;
+    PlanBatchedCircuits(batch_indices, num_qubits, fused_circuits, num_threads,
+                        &groups, &unbatched);
+    ComputeBatched(groups, num_qubits, fused_circuits, pauli_masks, context,
+                   output_tensor);
+
+    // Workers take whole chunks of the prefix sharing order so that each
+    // shared prefix is simulated by a single worker.
+    PrefixPlan plan;
+    PlanSharedPrefixes(unbatched, num_qubits, fused_circuits, &plan);
+    std::vector<size_t> chunk_starts;
+    ChunkPrefixPlan(plan, 4 * num_threads, &chunk_starts);
+    std::vector<int> chunks(chunk_starts.size() - 1);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    const uint64_t checkpoint_bytes = CheckpointBudget(num_threads);
 
     Status compute_status = Status::OK();
     auto c_lock = tensorflow::mutex();
-    auto DoWork = [&](int start, int end) {
-      int old_batch_index = -2;
-      int cur_batch_index = -1;
-      int largest_nq = 1;
-      int cur_op_index;
-
+    auto DoWork = [&](WorkQueue& queue) {
       Simulator sim = Simulator(tfq_for);
       StateSpace ss = StateSpace(tfq_for);
-      auto sv = ss.Create(largest_nq);
-      auto scratch = ss.Create(largest_nq);
-      for (int i = start; i < end; i++) {
-        cur_batch_index = i / output_dim_op_size;
-        cur_op_index = i % output_dim_op_size;
-
-        const int nq = num_qubits[cur_batch_index];
-
-        // (#679) Just ignore empty program
-        if (fused_circuits[cur_batch_index].size() == 0) {
-          (*output_tensor)(cur_batch_index, cur_op_index) = -2.0;
-          continue;
-        }
+      StateArena<StateSpace> arena(ss);
+      auto sv = arena.Create(1);
+      int c;
+      while (queue.Next(&c)) {
+        RunSharedPrefixes(
+            plan, chunk_starts[c], chunk_starts[c + 1], num_qubits,
+            fused_circuits, sim, ss, arena, &sv, checkpoint_bytes,
+            [&](const int i) {
+              // (#679) Just ignore empty program
+              if (fused_circuits[i].size() == 0) {
+                for (int j = 0; j < pauli_masks[i]->size(); j++) {
+                  (*output_tensor)(i, j) = -2.0;
+                }
+                return;
+              }
+
+              for (int j = 0; j < pauli_masks[i]->size(); j++) {
+                float exp_v = 0.0;
+                NESTED_FN_STATUS_SYNC(
+                    compute_status,
+                    ComputeExpectationMasks((*pauli_masks[i])[j], tfq_for, ss,
+                                            sv, &exp_v),
+                    c_lock);
+                (*output_tensor)(i, j) = exp_v;
+              }
+            });
+      }
+    };
 
-        if (cur_batch_index != old_batch_index) {
-          // We've run into a new state vector we must compute.
-          // Only compute a new state vector when we have to.
-          if (nq > largest_nq) {
-            largest_nq = nq;
-            sv = ss.Create(largest_nq);
-            scratch = ss.Create(largest_nq);
-          }
-          // no need to update scratch_state since ComputeExpectation
-          // will take care of things for us.
-          ss.SetStateZero(sv);
-          for (int j = 0; j < fused_circuits[cur_batch_index].size(); j++) {
-            qsim::ApplyFusedGate(sim, fused_circuits[cur_batch_index][j], sv);
+    RunWorkQueue(context, chunks, DoWork);
+    OP_REQUIRES_OK(context, compute_status);
+  }
+
+  // Simulates every group of same structure circuits on interleaved states
+  // with one thread each.
+  template <typename Gate>
+  void ComputeBatched(
+      const std::vector<std::vector<int>>& groups,
+      const std::vector<int>& num_qubits,
+      const std::vector<std::vector<qsim::GateFused<Gate>>>& fused_circuits,
+      const std::vector<CompiledPauliSums>& pauli_masks,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+    typedef typename Gate::fp_type fp_type;
+    std::vector<int> tasks(groups.size());
+    std::iota(tasks.begin(), tasks.end(), 0);
+
+    auto DoWork = [&](WorkQueue& queue) {
+      BatchedStates<fp_type> states;
+      std::vector<fp_type> scratch;
+      int g;
+      while (queue.Next(&g)) {
+        const std::vector<int>& group = groups[g];
+        RunBatchedCircuits(group, num_qubits, fused_circuits, &states,
+                           &scratch);
+        for (size_t k = 0; k < group.size(); k++) {
+          const int i = group[k];
+          for (int j = 0; j < pauli_masks[i]->size(); j++) {
+            float exp_v = 0.0;
+            ComputeBatchedExpectationMasks((*pauli_masks[i])[j], states, k,
+                                           &exp_v);
+            (*output_tensor)(i, j) = exp_v;
           }
         }
-
-        float exp_v = 0.0;
-        NESTED_FN_STATUS_SYNC(
-            compute_status,
-            ComputeExpectationQsim(pauli_sums[cur_batch_index][cur_op_index],
-                                   sim, ss, sv, scratch, &exp_v),
-            c_lock);
-        (*output_tensor)(cur_batch_index, cur_op_index) = exp_v;
-        old_batch_index = cur_batch_index;
       }
     };
 
-    const int64_t num_cycles =
-        200 * (int64_t(1) << static_cast<int64_t>(max_num_qubits));
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        fused_circuits.size() * output_dim_op_size, num_cycles, DoWork);
-    OP_REQUIRES_OK(context, compute_status);
+    RunWorkQueue(context, tasks, DoWork);
   }
 };
 
@@ -255,6 +314,7 @@ REGISTER_OP("TfqSimulateExpectation")
     .Input("symbol_values: float")
     .Input("pauli_sums: string")
     .Output("expectations: float")
+    .Attr("precision: {'single', 'double'} = 'single'")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
       TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
@@ -19,7 +19,12 @@ from tensorflow_quantum.core.ops.load_module import load_module
 SIM_OP_MODULE = load_module("_tfq_simulate_ops.so")
 
 
-def tfq_simulate_expectation(programs, symbol_names, symbol_values, pauli_sums):
+def tfq_simulate_expectation(programs,
+                             symbol_names,
+                             symbol_values,
+                             pauli_sums,
+                             *,
+                             precision='single'):
     """Calculate the expectation value of circuits wrt some operator(s)
 
     Args:
@@ -36,16 +41,73 @@ def tfq_simulate_expectation(programs, symbol_names, symbol_values, pauli_sums):
         pauli_sums: `tf.Tensor` of strings with shape [batch_size, n_ops]
             containing the string representation of the operators that will
             be used on all of the circuits in the expectation calculations.
+        precision: Python `str`, either 'single' or 'double'. Selects the
+            floating point type used for the simulation. 'double' is slower
+            but accumulates far less rounding error in deep circuits. The
+            output dtype is the same in both cases.
     Returns:
         `tf.Tensor` with shape [batch_size, n_ops] that holds the
             expectation value for each circuit with each op applied to it
             (after resolving the corresponding parameters in).
     """
     return SIM_OP_MODULE.tfq_simulate_expectation(
-        programs, symbol_names, tf.cast(symbol_values, tf.float32), pauli_sums)
+        programs,
+        symbol_names,
+        tf.cast(symbol_values, tf.float32),
+        pauli_sums,
+        precision=precision)
 
 
-def tfq_simulate_state(programs, symbol_names, symbol_values):
+def tfq_simulate_shifted_expectation(programs, symbol_names, symbol_values,
+                                     pauli_sums, shift_programs, shift_gates,
+                                     shift_values):
+    """Calculate expectation values of parameter shifted circuits.
+
+    Each shifted circuit is a program from `programs` in which the symbol
+    value in the exponent of a single gate is shifted, as described by the
+    triple `(shift_programs[m], shift_gates[m], shift_values[m])`. The gate
+    indices are those returned by `tfq_ps_gate_indices_from_symbols`. This
+    gives the same expectations as replacing the symbol of that gate with
+    `tfq_ps_symbol_replace` and resolving it to the shifted value, without
+    building or parsing any new programs.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be shifted.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specificed by programs, following the ordering
+            dictated by `symbol_names`.
+        pauli_sums: `tf.Tensor` of strings with shape [batch_size, n_ops]
+            containing the string representation of the operators that will
+            be used on all of the circuits in the expectation calculations.
+        shift_programs: `tf.Tensor` of integers with shape [n_shifts], the
+            index into `programs` of every shifted circuit.
+        shift_gates: `tf.Tensor` of integers with shape [n_shifts], the
+            index of the shifted gate in its program. -1 leaves the program
+            unshifted.
+        shift_values: `tf.Tensor` of real numbers with shape [n_shifts],
+            the amount added to the symbol value of the shifted gate.
+    Returns:
+        `tf.Tensor` with shape [n_shifts, n_ops] that holds the expectation
+            value of `pauli_sums[shift_programs[m]]` for every shifted
+            circuit m.
+    """
+    return SIM_OP_MODULE.tfq_simulate_shifted_expectation(
+        programs, symbol_names, tf.cast(symbol_values, tf.float32),
+        pauli_sums, tf.cast(shift_programs, tf.int32),
+        tf.cast(shift_gates, tf.int32), tf.cast(shift_values, tf.float32))
+
+
+def tfq_simulate_state(programs,
+                       symbol_names,
+                       symbol_values,
+                       *,
+                       precision='single'):
     """Returns the state of the programs using the C++ state vector simulator.
 
     Simulate the final state of `programs` given `symbol_values` are placed
@@ -62,14 +124,22 @@ def tfq_simulate_state(programs, symbol_names, symbol_values):
             [batch_size, n_params] specifying parameter values to resolve
             into the circuits specificed by programs, following the ordering
             dictated by `symbol_names`.
+        precision: Python `str`, either 'single' or 'double'. Selects the
+            floating point type used for the simulation. 'double' is slower
+            but accumulates far less rounding error in deep circuits. The
+            output dtype is the same in both cases.
     Returns:
         A `tf.Tensor` containing the final state of each circuit in `programs`.
     """
-    return SIM_OP_MODULE.tfq_simulate_state(programs, symbol_names,
-                                            tf.cast(symbol_values, tf.float32))
+    return SIM_OP_MODULE.tfq_simulate_state(
+        programs,
+        symbol_names,
+        tf.cast(symbol_values, tf.float32),
+        precision=precision)
 
 
-def tfq_simulate_samples(programs, symbol_names, symbol_values, num_samples):
+def tfq_simulate_samples(programs, symbol_names, symbol_values, num_samples,
+                         seed=None):
     """Generate samples using the C++ state vector simulator.
 
     Simulate the final state of `programs` given `symbol_values` are placed
@@ -90,16 +160,111 @@ def tfq_simulate_samples(programs, symbol_names, symbol_values, num_samples):
             dictated by `symbol_names`.
         num_samples: `tf.Tensor` with one element indicating the number of
             samples to draw.
+        seed: Optional Python integer. Together with the global seed of
+            `tf.random.set_seed` it makes the samples reproducible, like
+            the seeds of the TensorFlow random ops. The samples do not
+            depend on the number of threads.
     Returns:
         A `tf.Tensor` containing the samples taken from each circuit in
         `programs`.
     """
+    seed1, seed2 = tf.compat.v1.random.get_seed(seed)
     return SIM_OP_MODULE.tfq_simulate_samples(
-        programs, symbol_names, tf.cast(symbol_values, tf.float32), num_samples)
+        programs,
+        symbol_names,
+        tf.cast(symbol_values, tf.float32),
+        num_samples,
+        seed=seed1,
+        seed2=seed2)
+
+
+def tfq_simulate_samples_packed(programs, symbol_names, symbol_values,
+                                num_samples, seed=None):
+    """Generate samples as packed bitstrings using the C++ simulator.
+
+    Same as `tfq_simulate_samples`, except that every sample is a single
+    integer instead of a row of bits padded to the largest circuit. Bit
+    `n_qubits - 1 - k` of a sample of a circuit on `n_qubits` qubits holds
+    the measurement of its k-th qubit, so that reading the binary digits
+    from the most significant one gives the bits `tfq_simulate_samples`
+    returns without padding.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specified by programs, following the ordering
+            dictated by `symbol_names`.
+        num_samples: `tf.Tensor` with one element indicating the number of
+            samples to draw.
+        seed: Optional Python integer. Together with the global seed of
+            `tf.random.set_seed` it makes the samples reproducible, like
+            the seeds of the TensorFlow random ops. The samples do not
+            depend on the number of threads.
+    Returns:
+        An int64 `tf.Tensor` with shape [batch_size, num_samples] containing
+        the samples taken from each circuit in `programs`.
+    """
+    seed1, seed2 = tf.compat.v1.random.get_seed(seed)
+    return SIM_OP_MODULE.tfq_simulate_samples_packed(
+        programs,
+        symbol_names,
+        tf.cast(symbol_values, tf.float32),
+        num_samples,
+        seed=seed1,
+        seed2=seed2)
+
+
+def tfq_simulate_sample_counts(programs, symbol_names, symbol_values,
+                               num_samples, seed=None):
+    """Count the bitstrings sampled from circuits with the C++ simulator.
+
+    Simulate the final state of `programs` given `symbol_values` are placed
+    inside of the symbols with the name in `symbol_names` in each circuit.
+    Then draw how many of `num_samples` samples measure each bitstring,
+    without drawing the individual samples. The cost of this beyond the
+    simulation grows with the number of distinct bitstrings, not with
+    `num_samples`.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specified by programs, following the ordering
+            dictated by `symbol_names`.
+        num_samples: `tf.Tensor` with one element indicating the number of
+            samples to draw.
+        seed: Optional Python integer. Together with the global seed of
+            `tf.random.set_seed` it makes the samples reproducible, like
+            the seeds of the TensorFlow random ops. The samples do not
+            depend on the number of threads.
+    Returns:
+        A pair of int64 `tf.RaggedTensor`s with shape [batch_size, None]
+        containing the distinct bitstrings sampled from each circuit in
+        `programs`, in increasing order and packed like the samples of
+        `tfq_simulate_samples_packed`, and the number of times each was sampled.
+    """
+    seed1, seed2 = tf.compat.v1.random.get_seed(seed)
+    bitstrings, counts, row_splits = SIM_OP_MODULE.tfq_simulate_sample_counts(
+        programs, symbol_names, tf.cast(symbol_values, tf.float32), num_samples,
+        seed=seed1,
+        seed2=seed2)
+    return (tf.RaggedTensor.from_row_splits(bitstrings, row_splits),
+            tf.RaggedTensor.from_row_splits(counts, row_splits))
 
 
 def tfq_simulate_sampled_expectation(programs, symbol_names, symbol_values,
-                                     pauli_sums, num_samples):
+                                     pauli_sums, num_samples, seed=None):
     """Calculate the expectation value of circuits using samples.
 
     Simulate the final state of `programs` given `symbol_values` are placed
@@ -125,11 +290,21 @@ def tfq_simulate_sampled_expectation(programs, symbol_names, symbol_values,
             number of samples to draw in each term of `pauli_sums[i][j]`
             when estimating the expectation. Therefore, `num_samples` must
             have the same shape as `pauli_sums`.
+        seed: Optional Python integer. Together with the global seed of
+            `tf.random.set_seed` it makes the expectations reproducible, like
+            the seeds of the TensorFlow random ops. The expectations do not
+            depend on the number of threads.
     Returns:
         `tf.Tensor` with shape [batch_size, n_ops] that holds the
             expectation value for each circuit with each op applied to it
             (after resolving the corresponding parameters in).
     """
+    seed1, seed2 = tf.compat.v1.random.get_seed(seed)
     return SIM_OP_MODULE.tfq_simulate_sampled_expectation(
-        programs, symbol_names, tf.cast(symbol_values, tf.float32), pauli_sums,
-        tf.cast(num_samples, dtype=tf.int32))
+        programs,
+        symbol_names,
+        tf.cast(symbol_values, tf.float32),
+        pauli_sums,
+        tf.cast(num_samples, dtype=tf.int32),
+        seed=seed1,
+        seed2=seed2)
@@ -17,6 +17,7 @@ import numpy as np
 from absl.testing import parameterized
 import tensorflow as tf
 import cirq
+import sympy
 
 from tensorflow_quantum.core.ops import tfq_simulate_ops
 from tensorflow_quantum.python import util
@@ -194,6 +195,206 @@ class SimulateExpectationTest(tf.test.TestCase):
             util.convert_to_tensor([[x] for x in pauli_sums]))
         self.assertDTypeEqual(res, np.float32)
 
+    def test_simulate_expectation_duplicate_rows(self):
+        """Repeated rows must get the same results as their first copy, and
+        rows that only differ in their pauli_sums must not be merged."""
+        n_qubits = 4
+        batch_size = 3
+        symbol_names = ['alpha']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+        pauli_sums = util.random_pauli_sums(qubits, 3, 2 * batch_size)
+
+        unique = tfq_simulate_ops.tfq_simulate_expectation(
+            util.convert_to_tensor(circuit_batch * 2), symbol_names,
+            np.concatenate([symbol_values_array] * 2),
+            util.convert_to_tensor([[x] for x in pauli_sums]))
+
+        order = [0, 1, 0, 2, 1, 0, 3, 4, 5, 3]
+        repeated = tfq_simulate_ops.tfq_simulate_expectation(
+            util.convert_to_tensor(
+                [(circuit_batch * 2)[i] for i in order]), symbol_names,
+            np.concatenate([symbol_values_array] * 2)[order],
+            util.convert_to_tensor([[pauli_sums[i]] for i in order]))
+        self.assertAllClose(repeated, np.array(unique)[order], atol=1e-5)
+
+    def test_simulate_expectation_double_precision(self):
+        """Double precision must agree with cirq and keep float32 outputs."""
+        n_qubits = 5
+        batch_size = 5
+        symbol_names = ['alpha']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+        pauli_sums = util.random_pauli_sums(qubits, 3, batch_size)
+
+        res = tfq_simulate_ops.tfq_simulate_expectation(
+            util.convert_to_tensor(circuit_batch),
+            symbol_names,
+            symbol_values_array,
+            util.convert_to_tensor([[x] for x in pauli_sums]),
+            precision='double')
+        self.assertDTypeEqual(res, np.float32)
+
+        sim = cirq.Simulator(dtype=np.complex128)
+        expected = []
+        for circuit, resolver, pauli_sum in zip(circuit_batch, resolver_batch,
+                                                pauli_sums):
+            state = sim.simulate(circuit, resolver,
+                                 qubit_order=qubits).final_state_vector
+            expected.append([
+                pauli_sum.expectation_from_state_vector(
+                    state, {q: i for i, q in enumerate(qubits)}).real
+            ])
+        self.assertAllClose(res, expected, atol=1e-5)
+
+    def test_simulate_expectation_shared_structure(self):
+        """One circuit resolved many times is simulated in batches, which
+        must agree with cirq."""
+        n_qubits = 4
+        batch_size = 21
+        symbol_names = ['alpha', 'beta']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit = cirq.Circuit(
+            [cirq.H(q) for q in qubits],
+            cirq.X(qubits[0])**sympy.Symbol('alpha'),
+            cirq.CNOT(qubits[0], qubits[1]),
+            cirq.ZZ(qubits[1], qubits[2])**sympy.Symbol('beta'),
+            cirq.Y(qubits[3]).controlled_by(qubits[2]),
+            cirq.X(qubits[3])**sympy.Symbol('beta'))
+        symbol_values_array = np.random.uniform(size=(batch_size, 2))
+        pauli_sums = util.random_pauli_sums(qubits, 3, batch_size)
+
+        res = tfq_simulate_ops.tfq_simulate_expectation(
+            util.convert_to_tensor([circuit] * batch_size), symbol_names,
+            symbol_values_array,
+            util.convert_to_tensor([[x] for x in pauli_sums]))
+
+        sim = cirq.Simulator()
+        expected = []
+        for values, pauli_sum in zip(symbol_values_array, pauli_sums):
+            resolver = cirq.ParamResolver(dict(zip(symbol_names, values)))
+            state = sim.simulate(circuit, resolver,
+                                 qubit_order=qubits).final_state_vector
+            expected.append([
+                pauli_sum.expectation_from_state_vector(
+                    state, {q: i for i, q in enumerate(qubits)}).real
+            ])
+        self.assertAllClose(res, expected, atol=1e-5)
+
+    def test_simulate_expectation_empty_circuit_with_observable(self):
+        """Empty circuits in a batch with observables are ignored."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        circuit_batch = [
+            cirq.Circuit(cirq.X(qubits[0]), cirq.X(qubits[1])),
+            cirq.Circuit()
+        ]
+        pauli_sums = util.convert_to_tensor(
+            [[cirq.Z(qubits[0]) + 0.5 * cirq.Z(qubits[1])]] * 2)
+        res = tfq_simulate_ops.tfq_simulate_expectation(
+            util.convert_to_tensor(circuit_batch), [], [[]] * 2, pauli_sums)
+        self.assertAllClose(res, [[-1.5], [-2.0]])
+
+
+class SimulateShiftedExpectationTest(tf.test.TestCase):
+    """Tests tfq_simulate_shifted_expectation."""
+
+    def test_simulate_shifted_expectation(self):
+        """Shifting one gate must agree with cirq on the shifted circuit."""
+        n_qubits = 4
+        batch_size = 3
+        symbol_names = ['alpha', 'beta']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+
+        def make_circuit(alpha, beta_1, beta_2):
+            return cirq.Circuit(
+                [cirq.H(q) for q in qubits],
+                cirq.X(qubits[0])**alpha,
+                cirq.CNOT(qubits[0], qubits[1]),
+                cirq.ZZ(qubits[1], qubits[2])**beta_1,
+                cirq.Y(qubits[3]).controlled_by(qubits[2]),
+                cirq.X(qubits[3])**beta_2)
+
+        alpha, beta = sympy.symbols('alpha beta')
+        circuit = make_circuit(alpha, beta, beta)
+        symbol_values_array = np.random.uniform(size=(batch_size, 2))
+        pauli_sums = util.random_pauli_sums(qubits, 3, batch_size)
+
+        # The symbolic gates are X**alpha, ZZ**beta and X**beta.
+        shift_programs = [0, 0, 1, 1, 2, 2]
+        shift_gates = [4, -1, 6, 8, 8, 4]
+        shift_values = [0.5, 0.0, -0.25, 1.5, -0.5, 2.0]
+        res = tfq_simulate_ops.tfq_simulate_shifted_expectation(
+            util.convert_to_tensor([circuit] * batch_size), symbol_names,
+            symbol_values_array,
+            util.convert_to_tensor([[x] for x in pauli_sums]), shift_programs,
+            shift_gates, shift_values)
+
+        expected = []
+        for i, gate, shift in zip(shift_programs, shift_gates, shift_values):
+            a, b = symbol_values_array[i]
+            exponents = [a, b, b]
+            if gate >= 0:
+                exponents[[4, 6, 8].index(gate)] += shift
+            state = cirq.final_state_vector(make_circuit(*exponents),
+                                            qubit_order=qubits)
+            expected.append([
+                pauli_sums[i].expectation_from_state_vector(
+                    state, {q: k for k, q in enumerate(qubits)}).real
+            ])
+        self.assertAllClose(res, expected, atol=1e-5)
+
+    def test_simulate_shifted_expectation_inputs(self):
+        """Make sure that the shifted op fails gracefully on bad shifts."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        circuit = cirq.Circuit(
+            cirq.H(qubits[0]),
+            cirq.X(qubits[1])**sympy.Symbol('alpha'))
+        programs = util.convert_to_tensor([circuit])
+        pauli_sums = util.convert_to_tensor([[cirq.Z(qubits[1])]])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'symbolic gate to shift'):
+            # H has no symbol to shift.
+            tfq_simulate_ops.tfq_simulate_shifted_expectation(
+                programs, ['alpha'], [[0.5]], pauli_sums, [0], [0], [1.0])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'must index into programs'):
+            tfq_simulate_ops.tfq_simulate_shifted_expectation(
+                programs, ['alpha'], [[0.5]], pauli_sums, [1], [1], [1.0])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'same size'):
+            tfq_simulate_ops.tfq_simulate_shifted_expectation(
+                programs, ['alpha'], [[0.5]], pauli_sums, [0, 0], [1],
+                [1.0])
+
+    def test_simulate_shifted_expectation_empty_circuit_with_observable(self):
+        """Empty circuits in a batch with observables are ignored."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        circuit_batch = [
+            cirq.Circuit(cirq.X(qubits[0]), cirq.X(qubits[1])),
+            cirq.Circuit()
+        ]
+        pauli_sums = util.convert_to_tensor(
+            [[cirq.Z(qubits[0]) + 0.5 * cirq.Z(qubits[1])]] * 2)
+        res = tfq_simulate_ops.tfq_simulate_shifted_expectation(
+            util.convert_to_tensor(circuit_batch), [], [[]] * 2, pauli_sums,
+            [0, 1], [-1, -1], [0.0, 0.0])
+        self.assertAllClose(res, [[-1.5], [-2.0]])
+
 
 class SimulateStateTest(tf.test.TestCase, parameterized.TestCase):
     """Tests tfq_simulate_state."""
@@ -337,6 +538,46 @@ class SimulateStateTest(tf.test.TestCase, parameterized.TestCase):
 
         self.assertAllClose(tfq_results, manual_padded_results, atol=1e-5)
 
+    def test_simulate_state_double_precision(self):
+        """Double precision states must match the single precision ones."""
+        qubits = cirq.GridQubit.rect(1, 6)
+        circuit_batch = util.random_circuit_resolver_batch(qubits, 3)[0]
+
+        single = tfq_simulate_ops.tfq_simulate_state(
+            util.convert_to_tensor(circuit_batch), [],
+            [[]] * len(circuit_batch))
+        double = tfq_simulate_ops.tfq_simulate_state(
+            util.convert_to_tensor(circuit_batch), [],
+            [[]] * len(circuit_batch),
+            precision='double')
+        self.assertDTypeEqual(double, np.complex64)
+        self.assertAllClose(double, single, atol=1e-5)
+
+    def test_simulate_state_shared_structure(self):
+        """States of batched same structure circuits must match cirq and
+        keep their padding."""
+        qubits = cirq.GridQubit.rect(1, 3)
+        circuit = cirq.Circuit(
+            cirq.H(qubits[0]),
+            cirq.X(qubits[1])**sympy.Symbol('alpha'),
+            cirq.CZ(qubits[0], qubits[1])**sympy.Symbol('alpha'),
+            cirq.Y(qubits[2]).controlled_by(qubits[0]))
+        larger = cirq.Circuit(cirq.H.on_each(*cirq.GridQubit.rect(1, 4)))
+        values = np.linspace(0, 2, 9)
+        circuits = [circuit] * len(values) + [larger]
+
+        tfq_results = tfq_simulate_ops.tfq_simulate_state(
+            util.convert_to_tensor(circuits), ['alpha'],
+            [[x] for x in values] + [[0.0]])
+
+        sim = cirq.Simulator()
+        for i, value in enumerate(values):
+            expected = sim.simulate(circuit,
+                                    cirq.ParamResolver({'alpha': value}),
+                                    qubit_order=qubits).final_state_vector
+            self.assertAllClose(tfq_results[i][:8], expected, atol=1e-5)
+            self.assertAllClose(tfq_results[i][8:], [-2] * 8)
+
 
 class SimulateSamplesTest(tf.test.TestCase, parameterized.TestCase):
     """Tests tfq_simulate_samples."""
@@ -483,6 +724,131 @@ class SimulateSamplesTest(tf.test.TestCase, parameterized.TestCase):
                      [n_samples]).numpy()
         self.assertAllClose(expected_outputs, results)
 
+    @parameterized.parameters([
+        {
+            'all_n_qubits': [2, 3],
+            'n_samples': 10
+        },
+        {
+            'all_n_qubits': [1, 5, 8],
+            'n_samples': 10
+        },
+    ])
+    def test_sampling_packed(self, all_n_qubits, n_samples):
+        """Check that packed samples are the unpadded bitstrings."""
+        circuits = []
+        expected_outputs = []
+        for n_qubits in all_n_qubits:
+            qubits = cirq.GridQubit.rect(1, n_qubits)
+            # Flip every other qubit, starting from the first.
+            circuits.append(cirq.Circuit(*cirq.X.on_each(*qubits[::2])))
+            expected_outputs.append([
+                sum(1 << (n_qubits - 1 - k) for k in range(0, n_qubits, 2))
+            ] * n_samples)
+        circuit_tensor = util.convert_to_tensor(circuits)
+        packed = tfq_simulate_ops.tfq_simulate_samples_packed(
+            circuit_tensor, [], [[]] * len(circuits), [n_samples])
+        self.assertEqual(packed.dtype, tf.int64)
+        self.assertAllEqual(expected_outputs, packed)
+
+        bits = tfq_simulate_ops.tfq_simulate_samples(
+            circuit_tensor, [], [[]] * len(circuits), [n_samples]).numpy()
+        for n_qubits, row, packed_row in zip(all_n_qubits, bits, packed):
+            weights = 1 << np.arange(n_qubits - 1, -1, -1)
+            self.assertAllEqual(row[:, -n_qubits:].dot(weights), packed_row)
+
+    def test_seeded_samples(self):
+        """Test that seeded samples are reproducible."""
+        qubits = cirq.GridQubit.rect(1, 4)
+        circuits = util.convert_to_tensor(
+            [cirq.Circuit(cirq.H.on_each(*qubits))] * 2)
+
+        tf.random.set_seed(1234)
+        first = tfq_simulate_ops.tfq_simulate_samples_packed(circuits, [],
+                                                             [[]] * 2, [100],
+                                                             seed=5)
+        second = tfq_simulate_ops.tfq_simulate_samples_packed(circuits, [],
+                                                              [[]] * 2, [100],
+                                                              seed=5)
+        tf.random.set_seed(1234)
+        repeated = tfq_simulate_ops.tfq_simulate_samples_packed(
+            circuits, [], [[]] * 2, [100], seed=5)
+        self.assertAllEqual(first, repeated)
+        self.assertNotAllEqual(first, second)
+        self.assertNotAllEqual(first[0], first[1])
+
+
+class SimulateSampleCountsTest(tf.test.TestCase, parameterized.TestCase):
+    """Tests tfq_simulate_sample_counts."""
+
+    def test_sample_counts_deterministic(self):
+        """Check that fixed bitstrings get all of the samples."""
+        circuits = [
+            cirq.Circuit(cirq.X(cirq.GridQubit(0, 0))),
+            cirq.Circuit(
+                cirq.X(cirq.GridQubit(0, 0)),
+                cirq.I.on_each(*cirq.GridQubit.rect(1, 3, 0, 1))),
+            cirq.Circuit(),
+        ]
+        bitstrings, counts = tfq_simulate_ops.tfq_simulate_sample_counts(
+            util.convert_to_tensor(circuits), [], [[]] * len(circuits),
+            [100000])
+        self.assertEqual(bitstrings.to_list(), [[1], [8], [0]])
+        self.assertEqual(counts.to_list(), [[100000], [100000], [100000]])
+
+    @parameterized.parameters([{
+        'n_qubits': 3,
+        'batch_size': 5
+    }, {
+        'n_qubits': 8,
+        'batch_size': 2
+    }])
+    def test_sample_counts_multinomial(self, n_qubits, batch_size):
+        """Check counts against the cirq state distribution."""
+        symbol_names = ['alpha']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch])
+
+        n_samples = 1000000
+        bitstrings, counts = tfq_simulate_ops.tfq_simulate_sample_counts(
+            util.convert_to_tensor(circuit_batch), symbol_names,
+            symbol_values_array, [n_samples])
+
+        for circuit, resolver, row_bits, row_counts in zip(
+                circuit_batch, resolver_batch, bitstrings.to_list(),
+                counts.to_list()):
+            self.assertEqual(sorted(row_bits), row_bits)
+            self.assertEqual(len(set(row_bits)), len(row_bits))
+            self.assertEqual(sum(row_counts), n_samples)
+            state = cirq.final_state_vector(
+                cirq.resolve_parameters(circuit, resolver),
+                qubit_order=qubits)
+            probabilities = np.abs(state)**2
+            hist = np.zeros(2**n_qubits)
+            hist[row_bits] = row_counts
+            self.assertAllClose(hist / n_samples, probabilities, atol=5e-3)
+
+    def test_sample_counts_inputs(self):
+        """Make sure the count op fails gracefully on bad inputs."""
+        circuits = util.convert_to_tensor([cirq.Circuit()])
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'rank 1. Got rank 2'):
+            # programs tensor has the wrong shape.
+            tfq_simulate_ops.tfq_simulate_sample_counts([circuits], [], [[]],
+                                                        [10])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'num_samples must contain 1 element'):
+            # num_samples has too many elements.
+            tfq_simulate_ops.tfq_simulate_sample_counts(circuits, [], [[]],
+                                                        [10, 10])
+
 
 class SimulateSampledExpectationTest(tf.test.TestCase):
     """Tests tfq_simulate_sampled_expectation."""
@@ -681,6 +1047,20 @@ class SimulateSampledExpectationTest(tf.test.TestCase):
                 symbol_names, symbol_values_array,
                 util.convert_to_tensor([[x] for x in pauli_sums]), num_samples)
 
+    def test_simulate_sampled_expectation_empty_circuit_with_observable(self):
+        """Empty circuits in a batch with observables are ignored."""
+        qubits = cirq.GridQubit.rect(1, 2)
+        circuit_batch = [
+            cirq.Circuit(cirq.X(qubits[0]), cirq.X(qubits[1])),
+            cirq.Circuit()
+        ]
+        pauli_sums = util.convert_to_tensor(
+            [[cirq.Z(qubits[0]) + 0.5 * cirq.Z(qubits[1])]] * 2)
+        res = tfq_simulate_ops.tfq_simulate_sampled_expectation(
+            util.convert_to_tensor(circuit_batch), [], [[]] * 2, pauli_sums,
+            [[100]] * 2)
+        self.assertAllClose(res, [[-1.5], [-2.0]])
+
 
 class InputTypesTest(tf.test.TestCase, parameterized.TestCase):
     """Tests that different inputs types work for all of the ops. """
@@ -30,10 +30,10 @@ limitations under the License.
 #include "tensorflow/core/lib/random/random.h"
 #include "tensorflow/core/lib/random/simple_philox.h"
 #include "tensorflow/core/platform/mutex.h"
-#include "tensorflow/core/util/guarded_philox_random.h"
 #include "tensorflow_quantum/core/ops/parse_context.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
@@ -49,7 +49,9 @@ class TfqSimulateSampledExpectationOp : public tensorflow::OpKernel {
  public:
   explicit TfqSimulateSampledExpectationOp(
       tensorflow::OpKernelConstruction* context)
-      : OpKernel(context) {}
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, streams_.Init(context));
+  }
 
   void Compute(tensorflow::OpKernelContext* context) override {
     // TODO (mbbrough): add more dimension checks for other inputs here.
@@ -69,11 +71,13 @@ class TfqSimulateSampledExpectationOp : public tensorflow::OpKernel {
     OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
     auto output_tensor = output->matrix<float>();
 
-    std::vector<Program> programs;
+    ResolvedPrograms resolved;
     std::vector<int> num_qubits;
-    std::vector<std::vector<PauliSum>> pauli_sums;
-    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &programs,
-                                                    &num_qubits, &pauli_sums));
+    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &resolved,
+                                                    &num_qubits, true));
+    const std::vector<const Program*>& programs = resolved.programs;
+    const std::vector<std::vector<const PauliSum*>>& pauli_sums =
+        resolved.p_sums;
 
     std::vector<SymbolMap> maps;
     OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
@@ -101,53 +105,41 @@ class TfqSimulateSampledExpectationOp : public tensorflow::OpKernel {
             context->input(3).dim_size(1), " lists of pauli sums.")));
 
     // Construct qsim circuits.
-    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
-    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
-        programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
-
-    Status parse_status = Status::OK();
-    auto p_lock = tensorflow::mutex();
-    auto construct_f = [&](int start, int end) {
-      for (int i = start; i < end; i++) {
-        Status local =
-            QsimCircuitFromProgram(programs[i], maps[i], num_qubits[i],
-                                   &qsim_circuits[i], &fused_circuits[i]);
-        NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
-      }
-    };
-
-    const int num_cycles = 1000;
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        programs.size(), num_cycles, construct_f);
-    OP_REQUIRES_OK(context, parse_status);
-
-    int max_num_qubits = 0;
-    for (const int num : num_qubits) {
-      max_num_qubits = std::max(max_num_qubits, num);
-    }
-
-    // Cross reference with standard google cloud compute instances
-    // Memory ~= 2 * num_threads * (2 * 64 * 2 ** num_qubits in circuits)
-    // e2s2 = 2 CPU, 8GB -> Can safely do 25 since Memory = 4GB
-    // e2s4 = 4 CPU, 16GB -> Can safely do 25 since Memory = 8GB
-    // ...
-    if (max_num_qubits >= 26 || programs.size() == 1) {
-      ComputeLarge(num_qubits, fused_circuits, pauli_sums, num_samples, context,
-                   &output_tensor);
-    } else {
-      ComputeSmall(num_qubits, max_num_qubits, fused_circuits, pauli_sums,
-                   num_samples, context, &output_tensor);
-    }
+    std::vector<QsimCircuit> qsim_circuits;
+    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits;
+    OP_REQUIRES_OK(context, GetQsimCircuits(context, programs, num_qubits, maps,
+                                            &qsim_circuits, &fused_circuits));
+
+    // Compiled observables.
+    std::vector<CompiledPauliSums> pauli_masks;
+    OP_REQUIRES_OK(context, GetPauliSumMasks(context, pauli_sums, num_qubits,
+                                             &pauli_masks));
+
+    PhaseTrace trace(context, "simulate");
+    // Large or expensive circuits are simulated one at a time over the
+    // whole threadpool, the rest concurrently with one thread each.
+    CircuitSchedule schedule;
+    ScheduleFusedCircuits(context, num_qubits, fused_circuits, 2, &schedule);
+    const uint64_t call = streams_.NextCall();
+    ComputeLarge(schedule.wide, num_qubits, fused_circuits, pauli_masks,
+                 num_samples, call, context, &output_tensor);
+    ComputeSmall(schedule.narrow, num_qubits, fused_circuits, pauli_masks,
+                 num_samples, call, context, &output_tensor);
   }
 
  private:
+  RandomStreams streams_;
+
   void ComputeLarge(
-      const std::vector<int>& num_qubits,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
       const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
-      const std::vector<std::vector<PauliSum>>& pauli_sums,
-      const std::vector<std::vector<int>>& num_samples,
+      const std::vector<CompiledPauliSums>& pauli_masks,
+      const std::vector<std::vector<int>>& num_samples, const uint64_t call,
       tensorflow::OpKernelContext* context,
       tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+    if (batch_indices.empty()) {
+      return;
+    }
     // Instantiate qsim objects.
     const auto tfq_for = tfq::QsimFor(context);
     using Simulator = qsim::Simulator<const tfq::QsimFor&>;
@@ -157,32 +149,21 @@ class TfqSimulateSampledExpectationOp : public tensorflow::OpKernel {
     int largest_nq = 1;
     Simulator sim = Simulator(tfq_for);
     StateSpace ss = StateSpace(tfq_for);
-    auto sv = ss.Create(largest_nq);
-    auto scratch = ss.Create(largest_nq);
-
-    tensorflow::GuardedPhiloxRandom random_gen;
-    random_gen.Init(tensorflow::random::New64(), tensorflow::random::New64());
-    int largest_sum = -1;
-    for (const auto& sums : pauli_sums) {
-      for (const auto& sum : sums) {
-        largest_sum = std::max(largest_sum, sum.terms().size());
-      }
-    }
-    auto local_gen = random_gen.ReserveSamples32(
-        largest_sum * pauli_sums[0].size() * fused_circuits.size() + 1);
-    tensorflow::random::SimplePhilox rand_source(&local_gen);
+    StateArena<StateSpace> arena(ss);
+    auto sv = arena.Create(largest_nq);
+    auto scratch = arena.Create(largest_nq);
 
     // Simulate programs one by one. Parallelizing over state vectors
     // we no longer parallelize over circuits. Each time we encounter a
     // a larger circuit we will grow the Statevector as necessary.
-    for (int i = 0; i < fused_circuits.size(); i++) {
+    for (const int i : batch_indices) {
       int nq = num_qubits[i];
 
       if (nq > largest_nq) {
         // need to switch to larger statespace.
         largest_nq = nq;
-        sv = ss.Create(largest_nq);
-        scratch = ss.Create(largest_nq);
+        arena.Resize(largest_nq, &sv);
+        arena.Resize(largest_nq, &scratch);
       }
       // TODO: add heuristic here so that we do not always recompute
       //  the state if there is a possibility that circuit[i] and
@@ -191,15 +172,18 @@ class TfqSimulateSampledExpectationOp : public tensorflow::OpKernel {
       for (int j = 0; j < fused_circuits[i].size(); j++) {
         qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
       }
-      for (int j = 0; j < pauli_sums[i].size(); j++) {
+      // The samples of all ops of circuit i come from its first stream.
+      auto local_gen = streams_.Stream(call, i, 0);
+      tensorflow::random::SimplePhilox rand_source(&local_gen);
+      for (int j = 0; j < pauli_masks[i]->size(); j++) {
         // (#679) Just ignore empty program
         if (fused_circuits[i].size() == 0) {
           (*output_tensor)(i, j) = -2.0;
           continue;
         }
         float exp_v = 0.0;
-        OP_REQUIRES_OK(context, ComputeSampledExpectationQsim(
-                                    pauli_sums[i][j], sim, ss, sv, scratch,
+        OP_REQUIRES_OK(context, ComputeSampledExpectationMasks(
+                                    (*pauli_masks[i])[j], sim, ss, sv, scratch,
                                     num_samples[i][j], rand_source, &exp_v));
         (*output_tensor)(i, j) = exp_v;
       }
@@ -207,95 +191,68 @@ class TfqSimulateSampledExpectationOp : public tensorflow::OpKernel {
   }
 
   void ComputeSmall(
-      const std::vector<int>& num_qubits, const int max_num_qubits,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
       const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
-      const std::vector<std::vector<PauliSum>>& pauli_sums,
-      const std::vector<std::vector<int>>& num_samples,
+      const std::vector<CompiledPauliSums>& pauli_masks,
+      const std::vector<std::vector<int>>& num_samples, const uint64_t call,
       tensorflow::OpKernelContext* context,
       tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
     const auto tfq_for = qsim::SequentialFor(1);
     using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
     using StateSpace = Simulator::StateSpace;
 
-    const int output_dim_op_size = output_tensor->dimension(1);
-
-    tensorflow::GuardedPhiloxRandom random_gen;
-    random_gen.Init(tensorflow::random::New64(), tensorflow::random::New64());
-    int largest_sum = -1;
-    for (const auto& sums : pauli_sums) {
-      for (const auto& sum : sums) {
-        largest_sum = std::max(largest_sum, sum.terms().size());
-      }
-    }
-    const int num_threads = context->device()
-                                ->tensorflow_cpu_worker_threads()
-                                ->workers->NumThreads();
-
     Status compute_status = Status::OK();
     auto c_lock = tensorflow::mutex();
-    auto DoWork = [&](int start, int end) {
-      int old_batch_index = -2;
-      int cur_batch_index = -1;
+    auto DoWork = [&](WorkQueue& queue) {
       int largest_nq = 1;
-      int cur_op_index;
-
       Simulator sim = Simulator(tfq_for);
       StateSpace ss = StateSpace(tfq_for);
-      auto sv = ss.Create(largest_nq);
-      auto scratch = ss.Create(largest_nq);
-
-      int n_random = largest_sum * output_dim_op_size * fused_circuits.size();
-      n_random /= num_threads;
-      n_random += 1;
-      auto local_gen = random_gen.ReserveSamples32(n_random);
-      tensorflow::random::SimplePhilox rand_source(&local_gen);
-
-      for (int i = start; i < end; i++) {
-        cur_batch_index = i / output_dim_op_size;
-        cur_op_index = i % output_dim_op_size;
+      StateArena<StateSpace> arena(ss);
+      auto sv = arena.Create(largest_nq);
+      auto scratch = arena.Create(largest_nq);
 
-        const int nq = num_qubits[cur_batch_index];
+      int i;
+      while (queue.Next(&i)) {
+        const int nq = num_qubits[i];
 
         // (#679) Just ignore empty program
-        if (fused_circuits[cur_batch_index].size() == 0) {
-          (*output_tensor)(cur_batch_index, cur_op_index) = -2.0;
+        if (fused_circuits[i].size() == 0) {
+          for (int j = 0; j < pauli_masks[i]->size(); j++) {
+            (*output_tensor)(i, j) = -2.0;
+          }
           continue;
         }
 
-        if (cur_batch_index != old_batch_index) {
-          // We've run into a new state vector we must compute.
-          // Only compute a new state vector when we have to.
-          if (nq > largest_nq) {
-            largest_nq = nq;
-            sv = ss.Create(largest_nq);
-            scratch = ss.Create(largest_nq);
-          }
-          // no need to update scratch_state since ComputeExpectation
-          // will take care of things for us.
-          ss.SetStateZero(sv);
-          for (int j = 0; j < fused_circuits[cur_batch_index].size(); j++) {
-            qsim::ApplyFusedGate(sim, fused_circuits[cur_batch_index][j], sv);
-          }
+        if (nq > largest_nq) {
+          largest_nq = nq;
+          arena.Resize(largest_nq, &sv);
+          arena.Resize(largest_nq, &scratch);
+        }
+        // no need to update scratch_state since ComputeExpectation
+        // will take care of things for us.
+        ss.SetStateZero(sv);
+        for (int j = 0; j < fused_circuits[i].size(); j++) {
+          qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
         }
 
-        float exp_v = 0.0;
-        NESTED_FN_STATUS_SYNC(
-            compute_status,
-            ComputeSampledExpectationQsim(
-                pauli_sums[cur_batch_index][cur_op_index], sim, ss, sv, scratch,
-                num_samples[cur_batch_index][cur_op_index], rand_source,
-                &exp_v),
-            c_lock);
-
-        (*output_tensor)(cur_batch_index, cur_op_index) = exp_v;
-        old_batch_index = cur_batch_index;
+        // The samples of all ops of circuit i come from its first stream.
+        auto local_gen = streams_.Stream(call, i, 0);
+        tensorflow::random::SimplePhilox rand_source(&local_gen);
+
+        for (int j = 0; j < pauli_masks[i]->size(); j++) {
+          float exp_v = 0.0;
+          NESTED_FN_STATUS_SYNC(
+              compute_status,
+              ComputeSampledExpectationMasks((*pauli_masks[i])[j], sim, ss, sv,
+                                             scratch, num_samples[i][j],
+                                             rand_source, &exp_v),
+              c_lock);
+          (*output_tensor)(i, j) = exp_v;
+        }
       }
     };
 
-    const int64_t num_cycles =
-        200 * (int64_t(1) << static_cast<int64_t>(max_num_qubits));
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        fused_circuits.size() * output_dim_op_size, num_cycles, DoWork);
+    RunWorkQueue(context, batch_indices, DoWork);
     OP_REQUIRES_OK(context, compute_status);
   }
 };
@@ -310,6 +267,8 @@ REGISTER_OP("TfqSimulateSampledExpectation")
     .Input("symbol_values: float")
     .Input("pauli_sums: string")
     .Input("num_samples: int32")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
     .Output("expectations: float")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
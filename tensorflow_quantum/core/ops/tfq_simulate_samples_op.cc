@@ -15,7 +15,9 @@ limitations under the License.
 
 #include <stdlib.h>
 
+#include <numeric>
 #include <string>
+#include <vector>
 
 #include "../qsim/lib/circuit.h"
 #include "../qsim/lib/gate_appl.h"
@@ -28,13 +30,17 @@ limitations under the License.
 #include "tensorflow/core/lib/core/error_codes.pb.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/lib/random/philox_random.h"
 #include "tensorflow/core/lib/random/random.h"
 #include "tensorflow/core/lib/random/simple_philox.h"
 #include "tensorflow/core/platform/mutex.h"
-#include "tensorflow/core/util/guarded_philox_random.h"
 #include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/ops/tfq_simulate_utils.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
 #include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
+#include "tensorflow_quantum/core/src/prefix_sharing.h"
+#include "tensorflow_quantum/core/src/sample_counts.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
@@ -47,18 +53,22 @@ typedef qsim::Circuit<QsimGate> QsimCircuit;
 
 class TfqSimulateSamplesOp : public tensorflow::OpKernel {
  public:
-  explicit TfqSimulateSamplesOp(tensorflow::OpKernelConstruction* context)
-      : OpKernel(context) {}
+  explicit TfqSimulateSamplesOp(tensorflow::OpKernelConstruction* context,
+                                const SampleFormat format = kSampleBits)
+      : OpKernel(context), format_(format) {
+    OP_REQUIRES_OK(context, streams_.Init(context));
+  }
 
   void Compute(tensorflow::OpKernelContext* context) override {
     // TODO (mbbrough): add more dimension checks for other inputs here.
     DCHECK_EQ(4, context->num_inputs());
 
     // Parse to Program Proto and num_qubits.
-    std::vector<Program> programs;
+    ResolvedPrograms resolved;
     std::vector<int> num_qubits;
     OP_REQUIRES_OK(context,
-                   GetProgramsAndNumQubits(context, &programs, &num_qubits));
+                   GetProgramsAndNumQubits(context, &resolved, &num_qubits));
+    const std::vector<const Program*>& programs = resolved.programs;
 
     // Parse symbol maps for parameter resolution in the circuits.
     std::vector<SymbolMap> maps;
@@ -73,25 +83,10 @@ class TfqSimulateSamplesOp : public tensorflow::OpKernel {
     OP_REQUIRES_OK(context, GetIndividualSample(context, &num_samples));
 
     // Construct qsim circuits.
-    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
-    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
-        programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
-
-    Status parse_status = Status::OK();
-    auto p_lock = tensorflow::mutex();
-    auto construct_f = [&](int start, int end) {
-      for (int i = start; i < end; i++) {
-        Status local =
-            QsimCircuitFromProgram(programs[i], maps[i], num_qubits[i],
-                                   &qsim_circuits[i], &fused_circuits[i]);
-        NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
-      }
-    };
-
-    const int num_cycles = 1000;
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        programs.size(), num_cycles, construct_f);
-    OP_REQUIRES_OK(context, parse_status);
+    std::vector<QsimCircuit> qsim_circuits;
+    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits;
+    OP_REQUIRES_OK(context, GetQsimCircuits(context, programs, num_qubits, maps,
+                                            &qsim_circuits, &fused_circuits));
 
     // Find largest circuit for tensor size padding and allocate
     // the output tensor.
@@ -100,166 +95,176 @@ class TfqSimulateSamplesOp : public tensorflow::OpKernel {
       max_num_qubits = std::max(max_num_qubits, num);
     }
 
-    const int output_dim_size = maps.size();
-    tensorflow::TensorShape output_shape;
-    output_shape.AddDim(output_dim_size);
-    output_shape.AddDim(num_samples);
-    output_shape.AddDim(max_num_qubits);
-
-    tensorflow::Tensor* output = nullptr;
-    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
-    auto output_tensor = output->tensor<int8_t, 3>();
+    // Counts are only output once the number of distinct bitstrings of
+    // every circuit is known.
+    SampleWriter writer;
+    std::vector<BitstringCounts> counts;
+    if (format_ == kSampleCounts) {
+      counts.resize(maps.size());
+    } else {
+      OP_REQUIRES_OK(context, SampleWriter::Allocate(
+                                  context, format_ == kSamplePacked,
+                                  maps.size(), num_samples, max_num_qubits,
+                                  &writer));
+    }
 
     if (num_samples == 0) {
+      if (format_ == kSampleCounts) {
+        OP_REQUIRES_OK(context, OutputSampleCounts(context, counts));
+      }
       return;  // bug in qsim dependency we can't control.
     }
 
-    // Cross reference with standard google cloud compute instances
-    // Memory ~= 2 * num_threads * (2 * 64 * 2 ** num_qubits in circuits)
-    // e2s2 = 2 CPU, 8GB -> Can safely do 25 since Memory = 4GB
-    // e2s4 = 4 CPU, 16GB -> Can safely do 25 since Memory = 8GB
-    // ...
-    if (max_num_qubits >= 26 || programs.size() == 1) {
-      ComputeLarge(num_qubits, max_num_qubits, num_samples, fused_circuits,
-                   context, &output_tensor);
-    } else {
-      ComputeSmall(num_qubits, max_num_qubits, num_samples, fused_circuits,
-                   context, &output_tensor);
+    PhaseTrace trace(context, "simulate");
+    // Large or expensive circuits are simulated one at a time over the
+    // whole threadpool, the rest concurrently with one thread each.
+    CircuitSchedule schedule;
+    ScheduleFusedCircuits(context, num_qubits, fused_circuits, 1, &schedule);
+    std::vector<BitstringCounts>* counts_ptr =
+        format_ == kSampleCounts ? &counts : nullptr;
+    const uint64_t call = streams_.NextCall();
+    ComputeLarge(schedule.wide, num_qubits, num_samples, fused_circuits, call,
+                 context, writer, counts_ptr);
+    ComputeSmall(schedule.narrow, num_qubits, num_samples, fused_circuits,
+                 call, context, writer, counts_ptr);
+    if (format_ == kSampleCounts) {
+      OP_REQUIRES_OK(context, OutputSampleCounts(context, counts));
     }
   }
 
  private:
+  const SampleFormat format_;
+  RandomStreams streams_;
+
+  // Draws num_samples bitstrings from the nq qubit state in sv into row i
+  // of the output, or their counts into (*counts)[i] if counts is set.
+  // All samples of circuit i are drawn from its first stream.
+  template <typename StateSpaceT>
+  void WriteSamples(const StateSpaceT& ss,
+                    const typename StateSpaceT::State& sv, const int nq,
+                    const int num_samples, const uint64_t call, const int i,
+                    const SampleWriter& writer,
+                    std::vector<BitstringCounts>* counts) const {
+    auto gen = streams_.Stream(call, i, 0);
+    tensorflow::random::SimplePhilox rng(&gen);
+    if (counts != nullptr) {
+      SampleStateCounts(ss, sv, nq, num_samples, &rng, &(*counts)[i]);
+      return;
+    }
+    auto samples = ss.Sample(sv, num_samples, rng.Rand32());
+    writer.Write(i, 0, nq, samples.data(), samples.size());
+  }
+
   void ComputeLarge(
-      const std::vector<int>& num_qubits, const int max_num_qubits,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
       const int num_samples,
       const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
-      tensorflow::OpKernelContext* context,
-      tensorflow::TTypes<int8_t, 3>::Tensor* output_tensor) {
+      const uint64_t call, tensorflow::OpKernelContext* context,
+      const SampleWriter& writer, std::vector<BitstringCounts>* counts) {
+    if (batch_indices.empty()) {
+      return;
+    }
     // Instantiate qsim objects.
     const auto tfq_for = tfq::QsimFor(context);
     using Simulator = qsim::Simulator<const tfq::QsimFor&>;
     using StateSpace = Simulator::StateSpace;
 
     // Begin simulation.
-    int largest_nq = 1;
     Simulator sim = Simulator(tfq_for);
     StateSpace ss = StateSpace(tfq_for);
-    auto sv = ss.Create(largest_nq);
-
-    tensorflow::GuardedPhiloxRandom random_gen;
-    random_gen.Init(tensorflow::random::New64(), tensorflow::random::New64());
-    auto local_gen = random_gen.ReserveSamples32(fused_circuits.size() + 1);
-    tensorflow::random::SimplePhilox rand_source(&local_gen);
+    StateArena<StateSpace> arena(ss);
+    auto sv = arena.Create(1);
 
     // Simulate programs one by one. Parallelizing over state vectors
-    // we no longer parallelize over circuits. Each time we encounter a
-    // a larger circuit we will grow the Statevector as nescessary.
-    for (int i = 0; i < fused_circuits.size(); i++) {
-      int nq = num_qubits[i];
-
-      if (nq > largest_nq) {
-        // need to switch to larger statespace.
-        largest_nq = nq;
-        sv = ss.Create(largest_nq);
-      }
-      ss.SetStateZero(sv);
-      for (int j = 0; j < fused_circuits[i].size(); j++) {
-        qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
-      }
-
-      auto samples = ss.Sample(sv, num_samples, rand_source.Rand32());
-      for (int j = 0; j < num_samples; j++) {
-        uint64_t q_ind = 0;
-        uint64_t mask = 1;
-        bool val = 0;
-        while (q_ind < nq) {
-          val = samples[j] & mask;
-          (*output_tensor)(
-              i, j, static_cast<ptrdiff_t>(max_num_qubits - q_ind - 1)) = val;
-          q_ind++;
-          mask <<= 1;
-        }
-        while (q_ind < max_num_qubits) {
-          (*output_tensor)(
-              i, j, static_cast<ptrdiff_t>(max_num_qubits - q_ind - 1)) = -2;
-          q_ind++;
-        }
-      }
-    }
+    // we no longer parallelize over circuits. Circuits that start with the
+    // same gates resume from a checkpoint of their common prefix instead
+    // of recomputing it.
+    PrefixPlan plan;
+    PlanSharedPrefixes(batch_indices, num_qubits, fused_circuits, &plan);
+    RunSharedPrefixes(plan, 0, plan.order.size(), num_qubits, fused_circuits,
+                      sim, ss, arena, &sv, CheckpointBudget(1),
+                      [&](const int i) {
+                        WriteSamples(ss, sv, num_qubits[i], num_samples, call,
+                                     i, writer, counts);
+                      });
   }
 
   void ComputeSmall(
-      const std::vector<int>& num_qubits, const int max_num_qubits,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
       const int num_samples,
       const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
-      tensorflow::OpKernelContext* context,
-      tensorflow::TTypes<int8_t, 3>::Tensor* output_tensor) {
+      const uint64_t call, tensorflow::OpKernelContext* context,
+      const SampleWriter& writer, std::vector<BitstringCounts>* counts) {
     const auto tfq_for = qsim::SequentialFor(1);
     using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
     using StateSpace = Simulator::StateSpace;
 
-    tensorflow::GuardedPhiloxRandom random_gen;
-    random_gen.Init(tensorflow::random::New64(), tensorflow::random::New64());
-
-    auto DoWork = [&](int start, int end) {
-      int largest_nq = 1;
+    // Workers take whole chunks of the prefix sharing order so that each
+    // shared prefix is simulated by a single worker.
+    PrefixPlan plan;
+    PlanSharedPrefixes(batch_indices, num_qubits, fused_circuits, &plan);
+    const int num_threads =
+        context->device()->tensorflow_cpu_worker_threads()->num_threads;
+    std::vector<size_t> chunk_starts;
+    ChunkPrefixPlan(plan, 4 * num_threads, &chunk_starts);
+    std::vector<int> chunks(chunk_starts.size() - 1);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    const uint64_t checkpoint_bytes = CheckpointBudget(num_threads);
+
+    auto DoWork = [&](WorkQueue& queue) {
       Simulator sim = Simulator(tfq_for);
       StateSpace ss = StateSpace(tfq_for);
-      auto sv = ss.Create(largest_nq);
-
-      auto local_gen = random_gen.ReserveSamples32(fused_circuits.size() + 1);
-      tensorflow::random::SimplePhilox rand_source(&local_gen);
-
-      for (int i = start; i < end; i++) {
-        int nq = num_qubits[i];
-
-        if (nq > largest_nq) {
-          // need to switch to larger statespace.
-          largest_nq = nq;
-          sv = ss.Create(largest_nq);
-        }
-        ss.SetStateZero(sv);
-        for (int j = 0; j < fused_circuits[i].size(); j++) {
-          qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
-        }
-
-        auto samples = ss.Sample(sv, num_samples, rand_source.Rand32());
-        for (int j = 0; j < num_samples; j++) {
-          uint64_t q_ind = 0;
-          uint64_t mask = 1;
-          bool val = 0;
-          while (q_ind < nq) {
-            val = samples[j] & mask;
-            (*output_tensor)(
-                i, j, static_cast<ptrdiff_t>(max_num_qubits - q_ind - 1)) = val;
-            q_ind++;
-            mask <<= 1;
-          }
-          while (q_ind < max_num_qubits) {
-            (*output_tensor)(
-                i, j, static_cast<ptrdiff_t>(max_num_qubits - q_ind - 1)) = -2;
-            q_ind++;
-          }
-        }
+      StateArena<StateSpace> arena(ss);
+      auto sv = arena.Create(1);
+
+      int c;
+      while (queue.Next(&c)) {
+        RunSharedPrefixes(plan, chunk_starts[c], chunk_starts[c + 1],
+                          num_qubits, fused_circuits, sim, ss, arena, &sv,
+                          checkpoint_bytes, [&](const int i) {
+                            WriteSamples(ss, sv, num_qubits[i], num_samples,
+                                         call, i, writer, counts);
+                          });
       }
     };
 
-    const int64_t num_cycles =
-        200 * (int64_t(1) << static_cast<int64_t>(max_num_qubits));
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        fused_circuits.size(), num_cycles, DoWork);
+    RunWorkQueue(context, chunks, DoWork);
   }
 };
 
+class TfqSimulateSamplesPackedOp : public TfqSimulateSamplesOp {
+ public:
+  explicit TfqSimulateSamplesPackedOp(
+      tensorflow::OpKernelConstruction* context)
+      : TfqSimulateSamplesOp(context, kSamplePacked) {}
+};
+
+class TfqSimulateSampleCountsOp : public TfqSimulateSamplesOp {
+ public:
+  explicit TfqSimulateSampleCountsOp(
+      tensorflow::OpKernelConstruction* context)
+      : TfqSimulateSamplesOp(context, kSampleCounts) {}
+};
+
 REGISTER_KERNEL_BUILDER(
     Name("TfqSimulateSamples").Device(tensorflow::DEVICE_CPU),
     TfqSimulateSamplesOp);
 
+REGISTER_KERNEL_BUILDER(
+    Name("TfqSimulateSamplesPacked").Device(tensorflow::DEVICE_CPU),
+    TfqSimulateSamplesPackedOp);
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqSimulateSampleCounts").Device(tensorflow::DEVICE_CPU),
+    TfqSimulateSampleCountsOp);
+
 REGISTER_OP("TfqSimulateSamples")
     .Input("programs: string")
     .Input("symbol_names: string")
     .Input("symbol_values: float")
     .Input("num_samples: int32")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
     .Output("samples: int8")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
@@ -284,4 +289,67 @@ REGISTER_OP("TfqSimulateSamples")
       return tensorflow::Status::OK();
     });
 
+REGISTER_OP("TfqSimulateSamplesPacked")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("num_samples: int32")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Output("samples: int64")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle num_samples_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 1, &num_samples_shape));
+
+      // [batch_size, n_samples]
+      c->set_output(
+          0, c->MakeShape(
+                 {c->Dim(programs_shape, 0),
+                  tensorflow::shape_inference::InferenceContext::kUnknownDim}));
+
+      return tensorflow::Status::OK();
+    });
+
+REGISTER_OP("TfqSimulateSampleCounts")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("num_samples: int32")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .Output("bitstrings: int64")
+    .Output("counts: int64")
+    .Output("row_splits: int64")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle num_samples_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 1, &num_samples_shape));
+
+      // [n_distinct], [n_distinct], [batch_size + 1]
+      tensorflow::shape_inference::DimensionHandle num_splits;
+      TF_RETURN_IF_ERROR(c->Add(c->Dim(programs_shape, 0), 1, &num_splits));
+      c->set_output(0, c->Vector(c->UnknownDim()));
+      c->set_output(1, c->Vector(c->UnknownDim()));
+      c->set_output(2, c->Vector(num_splits));
+
+      return tensorflow::Status::OK();
+    });
+
 }  // namespace tfq
@@ -0,0 +1,365 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "../qsim/lib/circuit.h"
+#include "../qsim/lib/gate_appl.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/seqfor.h"
+#include "../qsim/lib/simmux.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/shape_inference.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/core/error_codes.pb.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow_quantum/core/ops/parse_context.h"
+#include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/proto/program.pb.h"
+#include "tensorflow_quantum/core/src/batched_states.h"
+#include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
+#include "tensorflow_quantum/core/src/prefix_sharing.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
+
+namespace tfq {
+
+using ::tensorflow::Status;
+using ::tfq::proto::PauliSum;
+using ::tfq::proto::Program;
+
+typedef qsim::Cirq::GateCirq<float> QsimGate;
+typedef qsim::Circuit<QsimGate> QsimCircuit;
+typedef std::vector<qsim::GateFused<QsimGate>> QsimFusedCircuit;
+
+// Expectation values of parameter shifted circuits given as (program, gate,
+// shift) triples, such as those described by TfqPsGateIndicesFromSymbols and
+// TfqPsWeightsFromSymbols. Row m of the output is the expectation of
+// pauli_sums[shift_programs[m]] for programs[shift_programs[m]] with
+// shift_values[m] added to the symbol value in the exponent of gate
+// shift_gates[m]. A gate of -1 leaves the program unshifted. The shifts are
+// applied while the qsim gates are built, so no shifted program is ever
+// serialized or parsed.
+class TfqSimulateShiftedExpectationOp : public tensorflow::OpKernel {
+ public:
+  explicit TfqSimulateShiftedExpectationOp(
+      tensorflow::OpKernelConstruction* context)
+      : OpKernel(context) {}
+
+  void Compute(tensorflow::OpKernelContext* context) override {
+    const int num_inputs = context->num_inputs();
+    OP_REQUIRES(context, num_inputs == 7,
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Expected 7 inputs, got ", num_inputs, " inputs.")));
+
+    // Parse program protos.
+    ResolvedPrograms resolved;
+    std::vector<int> num_qubits;
+    OP_REQUIRES_OK(context, GetProgramsAndNumQubits(context, &resolved,
+                                                    &num_qubits, true));
+    const std::vector<const Program*>& programs = resolved.programs;
+    const std::vector<std::vector<const PauliSum*>>& pauli_sums =
+        resolved.p_sums;
+
+    std::vector<SymbolMap> maps;
+    OP_REQUIRES_OK(context, GetSymbolMaps(context, &maps));
+
+    OP_REQUIRES(context, programs.size() == maps.size(),
+                tensorflow::errors::InvalidArgument(absl::StrCat(
+                    "Number of circuits and symbol_values do not match. Got ",
+                    programs.size(), " circuits and ", maps.size(),
+                    " symbol values.")));
+
+    std::vector<int> shift_programs;
+    std::vector<GateShift> shifts;
+    OP_REQUIRES_OK(context,
+                   GetShifts(context, programs.size(), &shift_programs,
+                             &shifts));
+
+    // Create the output Tensor.
+    const int num_shifted = shift_programs.size();
+    const int output_dim_op_size = context->input(3).dim_size(1);
+    tensorflow::TensorShape output_shape;
+    output_shape.AddDim(num_shifted);
+    output_shape.AddDim(output_dim_op_size);
+
+    tensorflow::Tensor* output = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, output_shape, &output));
+    auto output_tensor = output->matrix<float>();
+
+    // Compiled observables, shared by all shifts of a program.
+    std::vector<CompiledPauliSums> program_masks;
+    OP_REQUIRES_OK(context, GetPauliSumMasks(context, pauli_sums, num_qubits,
+                                             &program_masks));
+
+    std::vector<QsimCircuit> qsim_circuits;
+    std::vector<QsimFusedCircuit> fused_circuits;
+    OP_REQUIRES_OK(context, GetShiftedQsimCircuits(
+                                context, programs, num_qubits, maps,
+                                shift_programs, shifts, &qsim_circuits,
+                                &fused_circuits));
+
+    std::vector<int> shifted_num_qubits(num_shifted);
+    std::vector<CompiledPauliSums> pauli_masks(num_shifted);
+    for (int m = 0; m < num_shifted; m++) {
+      shifted_num_qubits[m] = num_qubits[shift_programs[m]];
+      pauli_masks[m] = program_masks[shift_programs[m]];
+    }
+
+    PhaseTrace trace(context, "simulate");
+    CircuitSchedule schedule;
+    ScheduleFusedCircuits(context, shifted_num_qubits, fused_circuits, 1,
+                          &schedule);
+    ComputeLarge(schedule.wide, shifted_num_qubits, fused_circuits,
+                 pauli_masks, context, &output_tensor);
+    ComputeSmall(schedule.narrow, shifted_num_qubits, fused_circuits,
+                 pauli_masks, context, &output_tensor);
+  }
+
+ private:
+  // Reads the shift_programs, shift_gates and shift_values inputs.
+  static Status GetShifts(tensorflow::OpKernelContext* context,
+                          const int num_programs,
+                          std::vector<int>* shift_programs,
+                          std::vector<GateShift>* shifts) {
+    const tensorflow::Tensor* programs_input;
+    TF_RETURN_IF_ERROR(context->input("shift_programs", &programs_input));
+    const tensorflow::Tensor* gates_input;
+    TF_RETURN_IF_ERROR(context->input("shift_gates", &gates_input));
+    const tensorflow::Tensor* values_input;
+    TF_RETURN_IF_ERROR(context->input("shift_values", &values_input));
+    if (programs_input->dims() != 1 || gates_input->dims() != 1 ||
+        values_input->dims() != 1) {
+      return tensorflow::errors::InvalidArgument(
+          "shift_programs, shift_gates and shift_values must be rank 1.");
+    }
+    const auto programs = programs_input->vec<int>();
+    const auto gates = gates_input->vec<int>();
+    const auto values = values_input->vec<float>();
+    if (gates.size() != programs.size() || values.size() != programs.size()) {
+      return tensorflow::errors::InvalidArgument(absl::StrCat(
+          "shift_programs, shift_gates and shift_values must have the same "
+          "size. Got ",
+          programs.size(), ", ", gates.size(), " and ", values.size(), "."));
+    }
+
+    shift_programs->resize(programs.size());
+    shifts->resize(programs.size());
+    for (int m = 0; m < programs.size(); m++) {
+      if (programs(m) < 0 || programs(m) >= num_programs) {
+        return tensorflow::errors::InvalidArgument(absl::StrCat(
+            "shift_programs must index into programs. Got ", programs(m),
+            " for ", num_programs, " programs."));
+      }
+      (*shift_programs)[m] = programs(m);
+      (*shifts)[m] = GateShift{gates(m), values(m)};
+    }
+    return Status::OK();
+  }
+
+  void ComputeLarge(const std::vector<int>& batch_indices,
+                    const std::vector<int>& num_qubits,
+                    const std::vector<QsimFusedCircuit>& fused_circuits,
+                    const std::vector<CompiledPauliSums>& pauli_masks,
+                    tensorflow::OpKernelContext* context,
+                    tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+    if (batch_indices.empty()) {
+      return;
+    }
+    // Instantiate qsim objects.
+    const auto tfq_for = tfq::QsimFor(context);
+    using Simulator = qsim::Simulator<const tfq::QsimFor&>;
+    using StateSpace = Simulator::StateSpace;
+
+    // Begin simulation.
+    Simulator sim = Simulator(tfq_for);
+    StateSpace ss = StateSpace(tfq_for);
+    StateArena<StateSpace> arena(ss);
+    auto sv = arena.Create(1);
+
+    // Shifts of the same program agree up to the shifted gate, so they
+    // resume from a checkpoint of their common prefix.
+    PrefixPlan plan;
+    PlanSharedPrefixes(batch_indices, num_qubits, fused_circuits, &plan);
+    RunSharedPrefixes(
+        plan, 0, plan.order.size(), num_qubits, fused_circuits, sim, ss, arena,
+        &sv, CheckpointBudget(1), [&](const int m) {
+          for (int j = 0; j < pauli_masks[m]->size(); j++) {
+            // (#679) Just ignore empty program
+            if (fused_circuits[m].size() == 0) {
+              (*output_tensor)(m, j) = -2.0;
+              continue;
+            }
+            float exp_v = 0.0;
+            OP_REQUIRES_OK(context,
+                           ComputeExpectationMasks((*pauli_masks[m])[j],
+                                                   tfq_for, ss, sv, &exp_v));
+            (*output_tensor)(m, j) = exp_v;
+          }
+        });
+  }
+
+  void ComputeSmall(const std::vector<int>& batch_indices,
+                    const std::vector<int>& num_qubits,
+                    const std::vector<QsimFusedCircuit>& fused_circuits,
+                    const std::vector<CompiledPauliSums>& pauli_masks,
+                    tensorflow::OpKernelContext* context,
+                    tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+    const auto tfq_for = qsim::SequentialFor(1);
+    using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
+    using StateSpace = Simulator::StateSpace;
+
+    // Shifts of the same program always have the same structure, so most
+    // of them are simulated together on interleaved states.
+    const int num_threads =
+        context->device()->tensorflow_cpu_worker_threads()->num_threads;
+    std::vector<std::vector<int>> groups;
+    std::vector<int> unbatched;
+    PlanBatchedCircuits(batch_indices, num_qubits, fused_circuits, num_threads,
+                        &groups, &unbatched);
+    ComputeBatched(groups, num_qubits, fused_circuits, pauli_masks, context,
+                   output_tensor);
+
+    PrefixPlan plan;
+    PlanSharedPrefixes(unbatched, num_qubits, fused_circuits, &plan);
+    std::vector<size_t> chunk_starts;
+    ChunkPrefixPlan(plan, 4 * num_threads, &chunk_starts);
+    std::vector<int> chunks(chunk_starts.size() - 1);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    const uint64_t checkpoint_bytes = CheckpointBudget(num_threads);
+
+    Status compute_status = Status::OK();
+    auto c_lock = tensorflow::mutex();
+    auto DoWork = [&](WorkQueue& queue) {
+      Simulator sim = Simulator(tfq_for);
+      StateSpace ss = StateSpace(tfq_for);
+      StateArena<StateSpace> arena(ss);
+      auto sv = arena.Create(1);
+      int c;
+      while (queue.Next(&c)) {
+        RunSharedPrefixes(
+            plan, chunk_starts[c], chunk_starts[c + 1], num_qubits,
+            fused_circuits, sim, ss, arena, &sv, checkpoint_bytes,
+            [&](const int m) {
+              // (#679) Just ignore empty program
+              if (fused_circuits[m].size() == 0) {
+                for (int j = 0; j < pauli_masks[m]->size(); j++) {
+                  (*output_tensor)(m, j) = -2.0;
+                }
+                return;
+              }
+
+              for (int j = 0; j < pauli_masks[m]->size(); j++) {
+                float exp_v = 0.0;
+                NESTED_FN_STATUS_SYNC(
+                    compute_status,
+                    ComputeExpectationMasks((*pauli_masks[m])[j], tfq_for, ss,
+                                            sv, &exp_v),
+                    c_lock);
+                (*output_tensor)(m, j) = exp_v;
+              }
+            });
+      }
+    };
+
+    RunWorkQueue(context, chunks, DoWork);
+    OP_REQUIRES_OK(context, compute_status);
+  }
+
+  // Simulates every group of same structure circuits on interleaved states
+  // with one thread each.
+  void ComputeBatched(const std::vector<std::vector<int>>& groups,
+                      const std::vector<int>& num_qubits,
+                      const std::vector<QsimFusedCircuit>& fused_circuits,
+                      const std::vector<CompiledPauliSums>& pauli_masks,
+                      tensorflow::OpKernelContext* context,
+                      tensorflow::TTypes<float, 1>::Matrix* output_tensor) {
+    std::vector<int> tasks(groups.size());
+    std::iota(tasks.begin(), tasks.end(), 0);
+
+    auto DoWork = [&](WorkQueue& queue) {
+      BatchedStates<float> states;
+      std::vector<float> scratch;
+      int g;
+      while (queue.Next(&g)) {
+        const std::vector<int>& group = groups[g];
+        RunBatchedCircuits(group, num_qubits, fused_circuits, &states,
+                           &scratch);
+        for (size_t k = 0; k < group.size(); k++) {
+          const int m = group[k];
+          for (int j = 0; j < pauli_masks[m]->size(); j++) {
+            float exp_v = 0.0;
+            ComputeBatchedExpectationMasks((*pauli_masks[m])[j], states, k,
+                                           &exp_v);
+            (*output_tensor)(m, j) = exp_v;
+          }
+        }
+      }
+    };
+
+    RunWorkQueue(context, tasks, DoWork);
+  }
+};
+
+REGISTER_KERNEL_BUILDER(
+    Name("TfqSimulateShiftedExpectation").Device(tensorflow::DEVICE_CPU),
+    TfqSimulateShiftedExpectationOp);
+
+REGISTER_OP("TfqSimulateShiftedExpectation")
+    .Input("programs: string")
+    .Input("symbol_names: string")
+    .Input("symbol_values: float")
+    .Input("pauli_sums: string")
+    .Input("shift_programs: int32")
+    .Input("shift_gates: int32")
+    .Input("shift_values: float")
+    .Output("expectations: float")
+    .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
+      tensorflow::shape_inference::ShapeHandle programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_names_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &symbol_names_shape));
+
+      tensorflow::shape_inference::ShapeHandle symbol_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 2, &symbol_values_shape));
+
+      tensorflow::shape_inference::ShapeHandle pauli_sums_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(3), 2, &pauli_sums_shape));
+
+      tensorflow::shape_inference::ShapeHandle shift_programs_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(4), 1, &shift_programs_shape));
+
+      tensorflow::shape_inference::ShapeHandle shift_gates_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(5), 1, &shift_gates_shape));
+
+      tensorflow::shape_inference::ShapeHandle shift_values_shape;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(6), 1, &shift_values_shape));
+
+      tensorflow::shape_inference::DimensionHandle output_rows =
+          c->Dim(shift_programs_shape, 0);
+      tensorflow::shape_inference::DimensionHandle output_cols =
+          c->Dim(pauli_sums_shape, 1);
+      c->set_output(0, c->Matrix(output_rows, output_cols));
+
+      return tensorflow::Status::OK();
+    });
+
+}  // namespace tfq
@@ -13,7 +13,9 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <numeric>
 #include <string>
+#include <vector>
 
 #include "../qsim/lib/circuit.h"
 #include "../qsim/lib/gate_appl.h"
@@ -29,7 +31,10 @@ limitations under the License.
 #include "tensorflow/core/platform/mutex.h"
 #include "tensorflow_quantum/core/ops/parse_context.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
+#include "tensorflow_quantum/core/src/batched_states.h"
 #include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/phase_trace.h"
+#include "tensorflow_quantum/core/src/prefix_sharing.h"
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
 namespace tfq {
@@ -37,23 +42,25 @@ namespace tfq {
 using ::tensorflow::Status;
 using ::tfq::proto::Program;
 
-typedef qsim::Cirq::GateCirq<float> QsimGate;
-typedef qsim::Circuit<QsimGate> QsimCircuit;
-
 class TfqSimulateStateOp : public tensorflow::OpKernel {
  public:
   explicit TfqSimulateStateOp(tensorflow::OpKernelConstruction* context)
-      : OpKernel(context) {}
+      : OpKernel(context) {
+    std::string precision;
+    OP_REQUIRES_OK(context, context->GetAttr("precision", &precision));
+    double_precision_ = precision == "double";
+  }
 
   void Compute(tensorflow::OpKernelContext* context) override {
     // TODO (mbbrough): add more dimension checks for other inputs here.
     DCHECK_EQ(3, context->num_inputs());
 
     // Parse to Program Proto and num_qubits.
-    std::vector<Program> programs;
+    ResolvedPrograms resolved;
     std::vector<int> num_qubits;
     OP_REQUIRES_OK(context,
-                   GetProgramsAndNumQubits(context, &programs, &num_qubits));
+                   GetProgramsAndNumQubits(context, &resolved, &num_qubits));
+    const std::vector<const Program*>& programs = resolved.programs;
 
     // Parse symbol maps for parameter resolution in the circuits.
     std::vector<SymbolMap> maps;
@@ -64,27 +71,6 @@ class TfqSimulateStateOp : public tensorflow::OpKernel {
             "Number of circuits and values do not match. Got ", programs.size(),
             " circuits and ", maps.size(), " values.")));
 
-    // Construct qsim circuits.
-    std::vector<QsimCircuit> qsim_circuits(programs.size(), QsimCircuit());
-    std::vector<std::vector<qsim::GateFused<QsimGate>>> fused_circuits(
-        programs.size(), std::vector<qsim::GateFused<QsimGate>>({}));
-
-    Status parse_status = Status::OK();
-    auto p_lock = tensorflow::mutex();
-    auto construct_f = [&](int start, int end) {
-      for (int i = start; i < end; i++) {
-        Status local =
-            QsimCircuitFromProgram(programs[i], maps[i], num_qubits[i],
-                                   &qsim_circuits[i], &fused_circuits[i]);
-        NESTED_FN_STATUS_SYNC(parse_status, local, p_lock);
-      }
-    };
-
-    const int num_cycles = 1000;
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        programs.size(), num_cycles, construct_f);
-    OP_REQUIRES_OK(context, parse_status);
-
     // Find largest circuit for tensor size padding and allocate
     // the output tensor.
     int max_num_qubits = 0;
@@ -102,116 +88,207 @@ class TfqSimulateStateOp : public tensorflow::OpKernel {
     tensorflow::TTypes<std::complex<float>, 1>::Matrix output_tensor =
         output->matrix<std::complex<float>>();
 
-    // Cross reference with standard google cloud compute instances
-    // Memory ~= 2 * num_threads * (2 * 64 * 2 ** num_qubits in circuits)
-    // e2s2 = 2 CPU, 8GB -> Can safely do 25 since Memory = 4GB
-    // e2s4 = 4 CPU, 16GB -> Can safely do 25 since Memory = 8GB
-    // ...
-    if (max_num_qubits >= 26 || programs.size() == 1) {
-      ComputeLarge(num_qubits, max_num_qubits, fused_circuits, context,
-                   &output_tensor);
+    // Repeated rows are computed once and copied afterwards.
+    std::vector<int> first_row;
+    OP_REQUIRES_OK(context, GetDuplicateRows(context, {}, &first_row));
+
+    if (double_precision_) {
+      Simulate<double>(programs, num_qubits, maps, max_num_qubits, first_row,
+                       context, &output_tensor);
     } else {
-      ComputeSmall(num_qubits, max_num_qubits, fused_circuits, context,
-                   &output_tensor);
+      Simulate<float>(programs, num_qubits, maps, max_num_qubits, first_row,
+                      context, &output_tensor);
     }
+    if (!context->status().ok()) {
+      return;
+    }
+    CopyDuplicateRows(first_row, &output_tensor);
   }
 
  private:
+  bool double_precision_;
+
+  // Builds the circuits with fp_type gates and simulates them with fp_type
+  // amplitudes. The states are rounded to complex64 in the output.
+  template <typename fp_type>
+  void Simulate(
+      const std::vector<const Program*>& programs,
+      const std::vector<int>& num_qubits, const std::vector<SymbolMap>& maps,
+      const int max_num_qubits,
+      const std::vector<int>& first_row, tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
+    // Construct qsim circuits.
+    std::vector<qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>> qsim_circuits;
+    std::vector<std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>>
+        fused_circuits;
+    OP_REQUIRES_OK(context, GetQsimCircuits(context, programs, num_qubits, maps,
+                                            &qsim_circuits, &fused_circuits));
+
+    PhaseTrace trace(context, "simulate");
+    // Large or expensive circuits are simulated one at a time over the
+    // whole threadpool, the rest concurrently with one thread each.
+    CircuitSchedule schedule;
+    ScheduleFusedCircuits(context, num_qubits, fused_circuits, 1, &schedule);
+    SkipDuplicateRows(first_row, &schedule);
+    ComputeLarge(schedule.wide, num_qubits, max_num_qubits, fused_circuits,
+                 context, output_tensor);
+    ComputeSmall(schedule.narrow, num_qubits, max_num_qubits, fused_circuits,
+                 context, output_tensor);
+  }
+
+  template <typename Gate>
   void ComputeLarge(
-      const std::vector<int>& num_qubits, const int max_num_qubits,
-      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
+      const int max_num_qubits,
+      const std::vector<std::vector<qsim::GateFused<Gate>>>& fused_circuits,
       tensorflow::OpKernelContext* context,
       tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
+    if (batch_indices.empty()) {
+      return;
+    }
     // Instantiate qsim objects.
     const auto tfq_for = tfq::QsimFor(context);
-    using Simulator = qsim::Simulator<const tfq::QsimFor&>;
-    using StateSpace = Simulator::StateSpace;
+    using Simulator =
+        typename QsimSimulator<const tfq::QsimFor&,
+                               typename Gate::fp_type>::type;
+    using StateSpace = typename Simulator::StateSpace;
 
     // Begin simulation.
-    int largest_nq = 1;
     Simulator sim = Simulator(tfq_for);
     StateSpace ss = StateSpace(tfq_for);
-    auto sv = ss.Create(largest_nq);
+    StateArena<StateSpace> arena(ss);
+    auto sv = arena.Create(1);
 
     // Simulate programs one by one. Parallelizing over state vectors
-    // we no longer parallelize over circuits. Each time we encounter a
-    // a larger circuit we will grow the Statevector as nescessary.
-    for (int i = 0; i < fused_circuits.size(); i++) {
-      int nq = num_qubits[i];
-
-      if (nq > largest_nq) {
-        // need to switch to larger statespace.
-        largest_nq = nq;
-        sv = ss.Create(largest_nq);
-      }
-      ss.SetStateZero(sv);
-      for (int j = 0; j < fused_circuits[i].size(); j++) {
-        qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
-      }
-
-      // Parallel copy state vector information from qsim into tensorflow
-      // tensors.
-      auto copy_f = [i, nq, max_num_qubits, &output_tensor, &ss, &sv](
-                        uint64_t start, uint64_t end) {
-        uint64_t crossover = uint64_t(1) << nq;
-        uint64_t upper = std::min(end, crossover);
-
-        if (start < crossover) {
-          for (uint64_t j = 0; j < upper; j++) {
-            (*output_tensor)(i, j) = ss.GetAmpl(sv, j);
-          }
-        }
-        for (uint64_t j = upper; j < end; j++) {
-          (*output_tensor)(i, j) = std::complex<float>(-2, 0);
-        }
-      };
-      const int num_cycles_copy = 50;
-      context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-          uint64_t(1) << max_num_qubits, num_cycles_copy, copy_f);
-    }
+    // we no longer parallelize over circuits. Circuits that start with the
+    // same gates resume from a checkpoint of their common prefix instead
+    // of recomputing it.
+    PrefixPlan plan;
+    PlanSharedPrefixes(batch_indices, num_qubits, fused_circuits, &plan);
+    RunSharedPrefixes(
+        plan, 0, plan.order.size(), num_qubits, fused_circuits, sim, ss, arena,
+        &sv, CheckpointBudget(1), [&](const int i) {
+          const int nq = num_qubits[i];
+          // Parallel copy state vector information from qsim into tensorflow
+          // tensors.
+          auto copy_f = [i, nq, max_num_qubits, &output_tensor, &ss, &sv](
+                            uint64_t start, uint64_t end) {
+            uint64_t crossover = uint64_t(1) << nq;
+            uint64_t upper = std::min(end, crossover);
+
+            if (start < crossover) {
+              for (uint64_t j = 0; j < upper; j++) {
+                (*output_tensor)(i, j) = std::complex<float>(ss.GetAmpl(sv, j));
+              }
+            }
+            for (uint64_t j = upper; j < end; j++) {
+              (*output_tensor)(i, j) = std::complex<float>(-2, 0);
+            }
+          };
+          const int num_cycles_copy = 50;
+          context->device()
+              ->tensorflow_cpu_worker_threads()
+              ->workers->ParallelFor(uint64_t(1) << max_num_qubits,
+                                     num_cycles_copy, copy_f);
+        });
   }
 
+  template <typename Gate>
   void ComputeSmall(
-      const std::vector<int>& num_qubits, const int max_num_qubits,
-      const std::vector<std::vector<qsim::GateFused<QsimGate>>>& fused_circuits,
+      const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
+      const int max_num_qubits,
+      const std::vector<std::vector<qsim::GateFused<Gate>>>& fused_circuits,
       tensorflow::OpKernelContext* context,
       tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
     const auto tfq_for = qsim::SequentialFor(1);
-    using Simulator = qsim::Simulator<const qsim::SequentialFor&>;
-    using StateSpace = Simulator::StateSpace;
-
-    auto DoWork = [&](int start, int end) {
-      int largest_nq = 1;
+    using Simulator =
+        typename QsimSimulator<const qsim::SequentialFor&,
+                               typename Gate::fp_type>::type;
+    using StateSpace = typename Simulator::StateSpace;
+
+    // Circuits of the same structure are simulated together, the others
+    // one at a time.
+    const int num_threads =
+        context->device()->tensorflow_cpu_worker_threads()->num_threads;
+    std::vector<std::vector<int>> groups;
+    std::vector<int> unbatched;
+    PlanBatchedCircuits(batch_indices, num_qubits, fused_circuits, num_threads,
+                        &groups, &unbatched);
+    ComputeBatched(groups, num_qubits, max_num_qubits, fused_circuits, context,
+                   output_tensor);
+
+    // Workers take whole chunks of the prefix sharing order so that each
+    // shared prefix is simulated by a single worker.
+    PrefixPlan plan;
+    PlanSharedPrefixes(unbatched, num_qubits, fused_circuits, &plan);
+    std::vector<size_t> chunk_starts;
+    ChunkPrefixPlan(plan, 4 * num_threads, &chunk_starts);
+    std::vector<int> chunks(chunk_starts.size() - 1);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    const uint64_t checkpoint_bytes = CheckpointBudget(num_threads);
+
+    auto DoWork = [&](WorkQueue& queue) {
       Simulator sim = Simulator(tfq_for);
       StateSpace ss = StateSpace(tfq_for);
-      auto sv = ss.Create(largest_nq);
-      for (int i = start; i < end; i++) {
-        int nq = num_qubits[i];
-
-        if (nq > largest_nq) {
-          // need to switch to larger statespace.
-          largest_nq = nq;
-          sv = ss.Create(largest_nq);
-        }
-        ss.SetStateZero(sv);
-        for (int j = 0; j < fused_circuits[i].size(); j++) {
-          qsim::ApplyFusedGate(sim, fused_circuits[i][j], sv);
-        }
+      StateArena<StateSpace> arena(ss);
+      auto sv = arena.Create(1);
+      int c;
+      while (queue.Next(&c)) {
+        RunSharedPrefixes(
+            plan, chunk_starts[c], chunk_starts[c + 1], num_qubits,
+            fused_circuits, sim, ss, arena, &sv, checkpoint_bytes,
+            [&](const int i) {
+              const int nq = num_qubits[i];
+              for (uint64_t j = 0; j < (uint64_t(1) << nq); j++) {
+                (*output_tensor)(i, j) = std::complex<float>(ss.GetAmpl(sv, j));
+              }
+              for (uint64_t j = (uint64_t(1) << nq);
+                   j < (uint64_t(1) << max_num_qubits); j++) {
+                (*output_tensor)(i, j) = std::complex<float>(-2, 0);
+              }
+            });
+      }
+    };
 
-        for (uint64_t j = 0; j < (uint64_t(1) << nq); j++) {
-          (*output_tensor)(i, j) = ss.GetAmpl(sv, j);
-        }
-        for (uint64_t j = (uint64_t(1) << nq);
-             j < (uint64_t(1) << max_num_qubits); j++) {
-          (*output_tensor)(i, j) = std::complex<float>(-2, 0);
+    RunWorkQueue(context, chunks, DoWork);
+  }
+
+  // Simulates every group of same structure circuits on interleaved states
+  // with one thread each.
+  template <typename Gate>
+  void ComputeBatched(
+      const std::vector<std::vector<int>>& groups,
+      const std::vector<int>& num_qubits, const int max_num_qubits,
+      const std::vector<std::vector<qsim::GateFused<Gate>>>& fused_circuits,
+      tensorflow::OpKernelContext* context,
+      tensorflow::TTypes<std::complex<float>, 1>::Matrix* output_tensor) {
+    typedef typename Gate::fp_type fp_type;
+    std::vector<int> tasks(groups.size());
+    std::iota(tasks.begin(), tasks.end(), 0);
+
+    auto DoWork = [&](WorkQueue& queue) {
+      BatchedStates<fp_type> states;
+      std::vector<fp_type> scratch;
+      int g;
+      while (queue.Next(&g)) {
+        const std::vector<int>& group = groups[g];
+        RunBatchedCircuits(group, num_qubits, fused_circuits, &states,
+                           &scratch);
+        for (size_t k = 0; k < group.size(); k++) {
+          const int i = group[k];
+          const uint64_t size = uint64_t(1) << num_qubits[i];
+          for (uint64_t j = 0; j < size; j++) {
+            (*output_tensor)(i, j) =
+                std::complex<float>(states.GetAmpl(k, j));
+          }
+          for (uint64_t j = size; j < (uint64_t(1) << max_num_qubits); j++) {
+            (*output_tensor)(i, j) = std::complex<float>(-2, 0);
+          }
         }
       }
     };
 
-    const int64_t num_cycles =
-        200 * (int64_t(1) << static_cast<int64_t>(max_num_qubits));
-    context->device()->tensorflow_cpu_worker_threads()->workers->ParallelFor(
-        fused_circuits.size(), num_cycles, DoWork);
+    RunWorkQueue(context, tasks, DoWork);
   }
 };
 
@@ -223,6 +300,7 @@ REGISTER_OP("TfqSimulateState")
     .Input("symbol_names: string")
     .Input("symbol_values: float")
     .Output("state_vector: complex64")
+    .Attr("precision: {'single', 'double'} = 'single'")
     .SetShapeFn([](tensorflow::shape_inference::InferenceContext* c) {
       tensorflow::shape_inference::ShapeHandle programs_shape;
       TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &programs_shape));
@@ -16,6 +16,9 @@ limitations under the License.
 #include "tensorflow_quantum/core/ops/tfq_simulate_utils.h"
 
 #include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/framework/tensor_shape.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/status.h"
 #include "tensorflow/core/lib/core/threadpool.h"
 
 namespace tfq {
@@ -26,4 +29,83 @@ int GetBlockSize(tensorflow::OpKernelContext* context, const int output_size) {
   return std::max(size, 1);
 }
 
+tensorflow::Status SampleWriter::Allocate(tensorflow::OpKernelContext* context,
+                                          const bool packed,
+                                          const int batch_size,
+                                          const int num_samples,
+                                          const int max_num_qubits,
+                                          SampleWriter* writer) {
+  tensorflow::TensorShape output_shape;
+  output_shape.AddDim(batch_size);
+  output_shape.AddDim(num_samples);
+  if (!packed) {
+    output_shape.AddDim(max_num_qubits);
+  } else if (max_num_qubits >= 64) {
+    return tensorflow::errors::InvalidArgument(
+        "Packed samples hold at most 63 qubits. Got a circuit on ",
+        max_num_qubits, " qubits.");
+  }
+
+  tensorflow::Tensor* output = nullptr;
+  TF_RETURN_IF_ERROR(context->allocate_output(0, output_shape, &output));
+  writer->Init(packed, num_samples, max_num_qubits, output);
+  return tensorflow::Status::OK();
+}
+
+tensorflow::Status SampleWriter::AllocateTemp(
+    tensorflow::OpKernelContext* context, const int batch_size,
+    const int num_samples, const int max_num_qubits,
+    tensorflow::Tensor* samples, SampleWriter* writer) {
+  if (max_num_qubits >= 64) {
+    return tensorflow::errors::InvalidArgument(
+        "Packed samples hold at most 63 qubits. Got a circuit on ",
+        max_num_qubits, " qubits.");
+  }
+  TF_RETURN_IF_ERROR(context->allocate_temp(
+      tensorflow::DT_INT64, tensorflow::TensorShape({batch_size, num_samples}),
+      samples));
+  writer->Init(true, num_samples, max_num_qubits, samples);
+  return tensorflow::Status::OK();
+}
+
+void SampleWriter::Init(const bool packed, const int num_samples,
+                        const int max_num_qubits, tensorflow::Tensor* output) {
+  num_samples_ = num_samples;
+  max_num_qubits_ = max_num_qubits;
+  if (packed) {
+    packed_ = output->flat<tensorflow::int64>().data();
+  } else {
+    bits_ = output->flat<int8_t>().data();
+  }
+}
+
+tensorflow::Status OutputSampleCounts(
+    tensorflow::OpKernelContext* context,
+    const std::vector<BitstringCounts>& counts) {
+  const tensorflow::int64 batch_size = counts.size();
+  tensorflow::Tensor* row_splits = nullptr;
+  TF_RETURN_IF_ERROR(context->allocate_output(
+      2, tensorflow::TensorShape({batch_size + 1}), &row_splits));
+  auto splits = row_splits->vec<tensorflow::int64>();
+  splits(0) = 0;
+  for (int i = 0; i < batch_size; i++) {
+    splits(i + 1) = splits(i) + counts[i].size();
+  }
+
+  const tensorflow::TensorShape values_shape({splits(batch_size)});
+  tensorflow::Tensor* bitstrings = nullptr;
+  TF_RETURN_IF_ERROR(context->allocate_output(0, values_shape, &bitstrings));
+  tensorflow::Tensor* values = nullptr;
+  TF_RETURN_IF_ERROR(context->allocate_output(1, values_shape, &values));
+  auto bitstrings_flat = bitstrings->vec<tensorflow::int64>();
+  auto values_flat = values->vec<tensorflow::int64>();
+  for (int i = 0; i < batch_size; i++) {
+    for (size_t c = 0; c < counts[i].size(); c++) {
+      bitstrings_flat(splits(i) + c) = counts[i][c].first;
+      values_flat(splits(i) + c) = counts[i][c].second;
+    }
+  }
+  return tensorflow::Status::OK();
+}
+
 }  // namespace tfq
@@ -16,7 +16,14 @@ limitations under the License.
 #ifndef TFQ_CORE_OPS_TFQ_SIMULATE_UTILS_H_
 #define TFQ_CORE_OPS_TFQ_SIMULATE_UTILS_H_
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
 #include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow_quantum/core/src/sample_counts.h"
 
 namespace tfq {
 
@@ -24,6 +31,83 @@ namespace tfq {
 // circuits.
 int GetBlockSize(tensorflow::OpKernelContext* context, const int output_size);
 
+// Outputs of the sampling ops.
+enum SampleFormat {
+  // int8 bits, see SampleWriter.
+  kSampleBits = 0,
+  // int64 bitstrings, see SampleWriter.
+  kSamplePacked = 1,
+  // Ragged (bitstring, count) pairs, see OutputSampleCounts.
+  kSampleCounts = 2,
+};
+
+// Output of the sampling ops. A sample is a qsim bitstring, in which bit
+// nq - 1 - k holds qubit k of an nq qubit circuit.
+class SampleWriter {
+ public:
+  // Allocates output 0 of context for num_samples samples of each of
+  // batch_size circuits. Packed outputs are int64 of shape
+  // [batch_size, num_samples] holding the bitstrings themselves and need
+  // max_num_qubits < 64. Otherwise the output is int8 of shape
+  // [batch_size, num_samples, max_num_qubits] with one bit per qubit, left
+  // padded with -2 for circuits on fewer than max_num_qubits qubits.
+  static tensorflow::Status Allocate(tensorflow::OpKernelContext* context,
+                                     const bool packed, const int batch_size,
+                                     const int num_samples,
+                                     const int max_num_qubits,
+                                     SampleWriter* writer);
+
+  // Packed samples written to the temporary tensor *samples instead of an
+  // output.
+  static tensorflow::Status AllocateTemp(tensorflow::OpKernelContext* context,
+                                         const int batch_size,
+                                         const int num_samples,
+                                         const int max_num_qubits,
+                                         tensorflow::Tensor* samples,
+                                         SampleWriter* writer);
+
+  // Stores count consecutive samples of circuit i on nq qubits, starting at
+  // sample j. Distinct samples may be written concurrently.
+  void Write(const int i, const int j, const int nq, const uint64_t* samples,
+             const int count) const {
+    const int64_t row = static_cast<int64_t>(i) * num_samples_ + j;
+    if (packed_ != nullptr) {
+      std::memcpy(packed_ + row, samples, count * sizeof(uint64_t));
+      return;
+    }
+    const int pad = max_num_qubits_ - nq;
+    int8_t* out = bits_ + row * max_num_qubits_;
+    for (int s = 0; s < count; s++, out += max_num_qubits_) {
+      std::fill(out, out + pad, -2);
+      for (int q = 0; q < nq; q++) {
+        out[pad + q] = (samples[s] >> (nq - 1 - q)) & 1;
+      }
+    }
+  }
+
+  void Write(const int i, const int j, const int nq,
+             const uint64_t sample) const {
+    Write(i, j, nq, &sample, 1);
+  }
+
+ private:
+  void Init(const bool packed, const int num_samples, const int max_num_qubits,
+            tensorflow::Tensor* output);
+
+  int num_samples_ = 0;
+  int max_num_qubits_ = 0;
+  int8_t* bits_ = nullptr;
+  tensorflow::int64* packed_ = nullptr;
+};
+
+// Allocates outputs 0, 1 and 2 of context to the int64 bitstrings, their
+// int64 counts and the int64 row_splits of counts, the concatenated counts
+// of every circuit. The pairs of circuit i are at [row_splits[i],
+// row_splits[i + 1]).
+tensorflow::Status OutputSampleCounts(
+    tensorflow::OpKernelContext* context,
+    const std::vector<BitstringCounts>& counts);
+
 }  // namespace tfq
 
 #endif  // TFQ_CORE_OPS_TFQ_SIMULATE_UTILS_H_
@@ -14,7 +14,6 @@
 # ==============================================================================
 """Module to register python op gradient."""
 import tensorflow as tf
-from tensorflow_quantum.core.ops import tfq_utility_ops
 from tensorflow_quantum.core.ops.load_module import load_module
 from tensorflow_quantum.python import quantum_context
 
@@ -61,21 +60,102 @@ def get_unitary_op(
             dictated by `symbol_names`.
         Returns:
             `tf.Tensor` with shape
-                [batch_size, <ragged 2**max_qubits>, <ragged 2**max_qubits>]
+                [batch_size, <ragged 2**n_qubits>, <ragged 2**n_qubits>]
                 that holds the unitary matrix for each circuit (after resolving
                 the corresponding parameters in).
     """
     if quantum_concurrent is True:
         # Do not block graph level parallelism.
         return lambda programs, symbol_names, symbol_values: \
-            tfq_utility_ops.padded_to_ragged2d(
-                OP_MODULE.tfq_calculate_unitary(
-                    programs, symbol_names, tf.cast(symbol_values, tf.float32)))
+            _calculate_unitary_ragged(
+                programs, symbol_names, tf.cast(symbol_values, tf.float32))
 
     # Block graph level parallelism.
     return lambda programs, symbol_names, symbol_values: \
             quantum_context._GLOBAL_OP_LOCK.execute(lambda: \
-                tfq_utility_ops.padded_to_ragged2d(
-                    OP_MODULE.tfq_calculate_unitary(
-                        programs,symbol_names, tf.cast(
-                            symbol_values, tf.float32))))
+                _calculate_unitary_ragged(
+                    programs, symbol_names, tf.cast(
+                        symbol_values, tf.float32)))
+
+
+def _calculate_unitary_ragged(programs, symbol_names, symbol_values):
+    """Unitaries of programs of their own sizes as a `tf.RaggedTensor`."""
+    unitaries, dims = OP_MODULE.tfq_calculate_unitary_ragged(
+        programs, symbol_names, symbol_values)
+    dims = tf.cast(dims, tf.int64)
+    return tf.RaggedTensor.from_nested_row_lengths(
+        unitaries, [dims, tf.repeat(dims, dims)])
+
+
+def calculate_unitary_columns(programs, symbol_names, symbol_values, columns):
+    """Calculate selected columns of the unitary matrices of circuits.
+
+    Evolves the basis states in `columns` through each circuit together in a
+    single simulation, which needs memory for `k` states instead of the full
+    unitary.
+
+    >>> qubits = cirq.GridQubit.rect(1, 2)
+    >>> my_circuit = cirq.Circuit(cirq.H(qubits[0]), cirq.CNOT(*qubits))
+    >>> tensor_circuit = tfq.convert_to_tensor([my_circuit])
+    >>> calculate_unitary_columns(tensor_circuit, [], [[]], [[0]])
+    <tf.Tensor: shape=(1, 4, 1), dtype=complex64, numpy=
+    array([[[0.70710677+0.j],
+            [0.        +0.j],
+            [0.        +0.j],
+            [0.70710677+0.j]]], dtype=complex64)>
+
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specified by programs, following the ordering
+            dictated by `symbol_names`.
+        columns: `tf.Tensor` of integers with shape [batch_size, k] holding
+            the indices of the columns to calculate for each circuit, each
+            less than 2 ** (number of qubits of the circuit).
+    Returns:
+        `tf.Tensor` with shape [batch_size, 2 ** max_qubits, k] whose column
+        j in batch entry i holds column `columns[i][j]` of the unitary of
+        circuit i. Rows beyond the size of smaller circuits hold -2.
+    """
+    return OP_MODULE.tfq_calculate_unitary_columns(
+        programs, symbol_names, tf.cast(symbol_values, tf.float32),
+        tf.cast(columns, tf.int32))
+
+
+def calculate_unitary_product(programs, symbol_names, symbol_values, matrix):
+    """Multiply the unitary matrices of circuits with matrices.
+
+    Evolves the `k` columns of each matrix through its circuit together in a
+    single simulation, which needs memory for `k` states instead of the full
+    unitary.
+
+    Args:
+        programs: `tf.Tensor` of strings with shape [batch_size] containing
+            the string representations of the circuits to be executed.
+        symbol_names: `tf.Tensor` of strings with shape [n_params], which
+            is used to specify the order in which the values in
+            `symbol_values` should be placed inside of the circuits in
+            `programs`.
+        symbol_values: `tf.Tensor` of real numbers with shape
+            [batch_size, n_params] specifying parameter values to resolve
+            into the circuits specified by programs, following the ordering
+            dictated by `symbol_names`.
+        matrix: `tf.Tensor` of complex numbers with shape
+            [batch_size, 2 ** max_qubits, k]. Only the first
+            2 ** (number of qubits of the circuit) rows are used for each
+            circuit.
+    Returns:
+        `tf.Tensor` with shape [batch_size, 2 ** max_qubits, k] holding the
+        product of the unitary of each circuit with its matrix. Rows beyond
+        the size of smaller circuits hold -2.
+    """
+    return OP_MODULE.tfq_calculate_unitary_product(
+        programs, symbol_names, tf.cast(symbol_values, tf.float32),
+        tf.cast(matrix, tf.complex64))
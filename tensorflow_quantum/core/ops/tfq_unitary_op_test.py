@@ -135,6 +135,23 @@ class UnitaryTest(tf.test.TestCase, parameterized.TestCase):
 
         self.assertAllClose(tfq_results.to_list(), results, atol=1e-5)
 
+    def test_calculate_unitary_padded_raw_op(self):
+        """The padded op fills beyond each circuit with -2."""
+        circuit_batch = []
+        for n_qubits in [1, 3]:
+            qubits = cirq.GridQubit.rect(1, n_qubits)
+            circuit_batch += util.random_circuit_resolver_batch(qubits, 1)[0]
+
+        padded = tfq_unitary_op.OP_MODULE.tfq_calculate_unitary(
+            util.convert_to_tensor(circuit_batch), [], [[]] * 2).numpy()
+        self.assertEqual(padded.shape, (2, 8, 8))
+        self.assertAllClose(padded[0, :2, :2], cirq.unitary(circuit_batch[0]),
+                            atol=1e-5)
+        self.assertAllClose(padded[0, 2:, :], np.full((6, 8), -2))
+        self.assertAllClose(padded[0, :2, 2:], np.full((2, 6), -2))
+        self.assertAllClose(padded[1], cirq.unitary(circuit_batch[1]),
+                            atol=1e-5)
+
     def test_calculate_unitary_empty(self):
         """Ensure calculate_unitary is consistent with empty circuits."""
         unitary_op = tfq_unitary_op.get_unitary_op()
@@ -217,5 +234,95 @@ class UnitaryTest(tf.test.TestCase, parameterized.TestCase):
         self.assertAllClose(tfq_results, results, atol=1e-5)
 
 
+class UnitaryColumnsTest(tf.test.TestCase, parameterized.TestCase):
+    """Tests calculate_unitary_columns and calculate_unitary_product."""
+
+    @parameterized.parameters([{
+        'all_n_qubits': [3, 3],
+        'n_columns': 1
+    }, {
+        'all_n_qubits': [2, 4, 5],
+        'n_columns': 3
+    }])
+    def test_calculate_unitary_columns(self, all_n_qubits, n_columns):
+        """Columns match those of the cirq unitary."""
+        symbols = ['alpha']
+        circuit_batch = []
+        resolver_batch = []
+        for n_qubits in all_n_qubits:
+            circuits, resolvers = util.random_symbol_circuit_resolver_batch(
+                cirq.GridQubit.rect(1, n_qubits), symbols, 1)
+            circuit_batch += circuits
+            resolver_batch += resolvers
+        values = [[resolver[symbol]
+                   for symbol in symbols]
+                  for resolver in resolver_batch]
+        columns = [
+            np.random.randint(0, 2**n, size=n_columns) for n in all_n_qubits
+        ]
+
+        tfq_results = tfq_unitary_op.calculate_unitary_columns(
+            util.convert_to_tensor(circuit_batch), symbols, values,
+            columns).numpy()
+
+        max_dim = 2**max(all_n_qubits)
+        self.assertEqual(tfq_results.shape,
+                         (len(circuit_batch), max_dim, n_columns))
+        for n_qubits, circuit, resolver, cols, result in zip(
+                all_n_qubits, circuit_batch, resolver_batch, columns,
+                tfq_results):
+            unitary = cirq.unitary(cirq.resolve_parameters(circuit, resolver))
+            self.assertAllClose(result[:2**n_qubits], unitary[:, cols],
+                                atol=1e-5)
+            self.assertAllClose(result[2**n_qubits:],
+                                np.full((max_dim - 2**n_qubits, n_columns),
+                                        -2))
+
+    def test_calculate_unitary_product(self):
+        """Products match those with the cirq unitary."""
+        all_n_qubits = [2, 4]
+        circuit_batch = []
+        for n_qubits in all_n_qubits:
+            circuit_batch += util.random_circuit_resolver_batch(
+                cirq.GridQubit.rect(1, n_qubits), 1)[0]
+        n_columns = 5
+        matrix = (np.random.randn(2, 16, n_columns) +
+                  1j * np.random.randn(2, 16, n_columns))
+
+        tfq_results = tfq_unitary_op.calculate_unitary_product(
+            util.convert_to_tensor(circuit_batch), [], [[]] * 2,
+            matrix).numpy()
+
+        for n_qubits, circuit, m, result in zip(all_n_qubits, circuit_batch,
+                                                matrix, tfq_results):
+            dim = 2**n_qubits
+            self.assertAllClose(result[:dim],
+                                cirq.unitary(circuit) @ m[:dim],
+                                atol=1e-4)
+
+    def test_calculate_unitary_columns_inputs(self):
+        """Bad columns and matrices fail gracefully."""
+        circuits = util.convert_to_tensor(
+            [cirq.Circuit(cirq.X(cirq.GridQubit(0, 0)))])
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'is not a basis state'):
+            tfq_unitary_op.calculate_unitary_columns(circuits, [], [[]], [[2]])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'do not match'):
+            tfq_unitary_op.calculate_unitary_columns(circuits, [], [[]],
+                                                     [[0], [1]])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'at most'):
+            tfq_unitary_op.calculate_unitary_columns(circuits, [], [[]],
+                                                     [[0, 1, 0]])
+
+        with self.assertRaisesRegex(tf.errors.InvalidArgumentError,
+                                    'rows'):
+            tfq_unitary_op.calculate_unitary_product(circuits, [], [[]],
+                                                     np.zeros((1, 4, 1)))
+
+
 if __name__ == "__main__":
     tf.test.main()
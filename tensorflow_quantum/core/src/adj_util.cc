@@ -31,26 +31,35 @@ namespace tfq {
 
 static const float _GRAD_EPS = 5e-3;
 
-typedef qsim::Cirq::GateCirq<float> QsimGate;
-typedef qsim::Circuit<QsimGate> QsimCircuit;
+namespace {
 
+template <typename fp_type>
+using QsimGateT = qsim::Cirq::GateCirq<fp_type>;
+template <typename fp_type>
+using QsimCircuitT = qsim::Circuit<QsimGateT<fp_type>>;
+
+}  // namespace
+
+template <typename fp_type>
 void CreateGradientCircuit(
-    const QsimCircuit& circuit, const std::vector<GateMetaData>& metadata,
-    std::vector<std::vector<qsim::GateFused<QsimGate>>>* partial_fuses,
-    std::vector<GradientOfGate>* grad_gates) {
+    const QsimCircuitT<fp_type>& circuit,
+    const std::vector<GateMetaDataT<fp_type>>& metadata,
+    std::vector<std::vector<qsim::GateFused<QsimGateT<fp_type>>>>*
+        partial_fuses,
+    std::vector<GradientOfGateT<fp_type>>* grad_gates) {
   for (int i = 0; i < metadata.size(); i++) {
     if (metadata[i].symbol_values.empty()) {
       continue;
     }
     // found a gate that was constructed with symbols.
-    GradientOfGate grad;
+    GradientOfGateT<fp_type> grad;
 
     // Single qubit Eigen.
     if (circuit.gates[i].kind == qsim::Cirq::GateKind::kXPowGate ||
         circuit.gates[i].kind == qsim::Cirq::GateKind::kYPowGate ||
         circuit.gates[i].kind == qsim::Cirq::GateKind::kZPowGate ||
         circuit.gates[i].kind == qsim::Cirq::GateKind::kHPowGate) {
-      PopulateGradientSingleEigen(
+      PopulateGradientSingleEigen<fp_type>(
           metadata[i].create_f1, metadata[i].symbol_values[0], i,
           circuit.gates[i].qubits[0], metadata[i].gate_params[0],
           metadata[i].gate_params[1], metadata[i].gate_params[2], &grad);
@@ -66,7 +75,7 @@ void CreateGradientCircuit(
              circuit.gates[i].kind == qsim::Cirq::GateKind::kISwapPowGate ||
              circuit.gates[i].kind == qsim::Cirq::GateKind::kSwapPowGate) {
       bool swapq = circuit.gates[i].swapped;
-      PopulateGradientTwoEigen(
+      PopulateGradientTwoEigen<fp_type>(
           metadata[i].create_f2, metadata[i].symbol_values[0], i,
           swapq ? circuit.gates[i].qubits[1] : circuit.gates[i].qubits[0],
           swapq ? circuit.gates[i].qubits[0] : circuit.gates[i].qubits[1],
@@ -153,30 +162,29 @@ void CreateGradientCircuit(
   }
 
   // Produce partial fuses around the gradient gates.
-  auto fuser = qsim::BasicGateFuser<qsim::IO, QsimGate>();
+  typedef qsim::BasicGateFuser<qsim::IO, QsimGateT<fp_type>> Fuser;
+  auto fuser = Fuser();
   auto left = circuit.gates.begin();
   auto right = left;
 
   partial_fuses->assign(grad_gates->size() + 1,
-                        std::vector<qsim::GateFused<QsimGate>>({}));
+                        std::vector<qsim::GateFused<QsimGateT<fp_type>>>({}));
   for (int i = 0; i < grad_gates->size(); i++) {
     right = circuit.gates.begin() + (*grad_gates)[i].index;
-    (*partial_fuses)[i] =
-        fuser.FuseGates(qsim::BasicGateFuser<qsim::IO, QsimGate>::Parameter(),
-                        circuit.num_qubits, left, right);
+    (*partial_fuses)[i] = fuser.FuseGates(typename Fuser::Parameter(),
+                                          circuit.num_qubits, left, right);
     left = right + 1;
   }
   right = circuit.gates.end();
-  (*partial_fuses)[grad_gates->size()] =
-      fuser.FuseGates(qsim::BasicGateFuser<qsim::IO, QsimGate>::Parameter(),
-                      circuit.num_qubits, left, right);
+  (*partial_fuses)[grad_gates->size()] = fuser.FuseGates(
+      typename Fuser::Parameter(), circuit.num_qubits, left, right);
 }
 
+template <typename fp_type>
 void PopulateGradientSingleEigen(
-    const std::function<QsimGate(unsigned int, unsigned int, float, float)>&
-        create_f,
+    const typename GateMetaDataT<fp_type>::SingleEigenCreateF& create_f,
     const std::string& symbol, unsigned int location, unsigned int qid,
-    float exp, float exp_s, float gs, GradientOfGate* grad) {
+    float exp, float exp_s, float gs, GradientOfGateT<fp_type>* grad) {
   grad->params.push_back(symbol);
   grad->index = location;
   auto left = create_f(0, qid, (exp + _GRAD_EPS) * exp_s, gs);
@@ -187,11 +195,12 @@ void PopulateGradientSingleEigen(
   grad->grad_gates.push_back(left);
 }
 
+template <typename fp_type>
 void PopulateGradientTwoEigen(
-    const std::function<QsimGate(unsigned int, unsigned int, unsigned int,
-                                 float, float)>& create_f,
+    const typename GateMetaDataT<fp_type>::TwoEigenCreateF& create_f,
     const std::string& symbol, unsigned int location, unsigned int qid,
-    unsigned int qid2, float exp, float exp_s, float gs, GradientOfGate* grad) {
+    unsigned int qid2, float exp, float exp_s, float gs,
+    GradientOfGateT<fp_type>* grad) {
   grad->params.push_back(symbol);
   grad->index = location;
   auto left = create_f(0, qid, qid2, (exp + _GRAD_EPS) * exp_s, gs);
@@ -202,16 +211,18 @@ void PopulateGradientTwoEigen(
   grad->grad_gates.push_back(left);
 }
 
+template <typename fp_type>
 void PopulateGradientPhasedXPhasedExponent(const std::string& symbol,
                                            unsigned int location,
                                            unsigned int qid, float pexp,
                                            float pexp_s, float exp, float exp_s,
-                                           float gs, GradientOfGate* grad) {
+                                           float gs,
+                                           GradientOfGateT<fp_type>* grad) {
   grad->params.push_back(symbol);
   grad->index = location;
-  auto left = qsim::Cirq::PhasedXPowGate<float>::Create(
+  auto left = qsim::Cirq::PhasedXPowGate<fp_type>::Create(
       0, qid, (pexp + _GRAD_EPS) * pexp_s, exp * exp_s, gs);
-  auto right = qsim::Cirq::PhasedXPowGate<float>::Create(
+  auto right = qsim::Cirq::PhasedXPowGate<fp_type>::Create(
       0, qid, (pexp - _GRAD_EPS) * pexp_s, exp * exp_s, gs);
   Matrix2Diff(right.matrix,
               left.matrix);  // left's entries have right subtracted.
@@ -219,16 +230,17 @@ void PopulateGradientPhasedXPhasedExponent(const std::string& symbol,
   grad->grad_gates.push_back(left);
 }
 
+template <typename fp_type>
 void PopulateGradientPhasedXExponent(const std::string& symbol,
                                      unsigned int location, unsigned int qid,
                                      float pexp, float pexp_s, float exp,
                                      float exp_s, float gs,
-                                     GradientOfGate* grad) {
+                                     GradientOfGateT<fp_type>* grad) {
   grad->params.push_back(symbol);
   grad->index = location;
-  auto left = qsim::Cirq::PhasedXPowGate<float>::Create(
+  auto left = qsim::Cirq::PhasedXPowGate<fp_type>::Create(
       0, qid, pexp * pexp_s, (exp + _GRAD_EPS) * exp_s, gs);
-  auto right = qsim::Cirq::PhasedXPowGate<float>::Create(
+  auto right = qsim::Cirq::PhasedXPowGate<fp_type>::Create(
       0, qid, pexp * pexp_s, (exp - _GRAD_EPS) * exp_s, gs);
   Matrix2Diff(right.matrix,
               left.matrix);  // left's entries have right subtracted.
@@ -236,15 +248,16 @@ void PopulateGradientPhasedXExponent(const std::string& symbol,
   grad->grad_gates.push_back(left);
 }
 
+template <typename fp_type>
 void PopulateGradientFsimTheta(const std::string& symbol, unsigned int location,
                                unsigned int qid, unsigned qid2, float theta,
                                float theta_s, float phi, float phi_s,
-                               GradientOfGate* grad) {
+                               GradientOfGateT<fp_type>* grad) {
   grad->params.push_back(symbol);
   grad->index = location;
-  auto left = qsim::Cirq::FSimGate<float>::Create(
+  auto left = qsim::Cirq::FSimGate<fp_type>::Create(
       0, qid, qid2, (theta + _GRAD_EPS) * theta_s, phi * phi_s);
-  auto right = qsim::Cirq::FSimGate<float>::Create(
+  auto right = qsim::Cirq::FSimGate<fp_type>::Create(
       0, qid, qid2, (theta - _GRAD_EPS) * theta_s, phi * phi_s);
   Matrix4Diff(right.matrix,
               left.matrix);  // left's entries have right subtracted.
@@ -252,15 +265,16 @@ void PopulateGradientFsimTheta(const std::string& symbol, unsigned int location,
   grad->grad_gates.push_back(left);
 }
 
+template <typename fp_type>
 void PopulateGradientFsimPhi(const std::string& symbol, unsigned int location,
                              unsigned int qid, unsigned qid2, float theta,
                              float theta_s, float phi, float phi_s,
-                             GradientOfGate* grad) {
+                             GradientOfGateT<fp_type>* grad) {
   grad->params.push_back(symbol);
   grad->index = location;
-  auto left = qsim::Cirq::FSimGate<float>::Create(0, qid, qid2, theta * theta_s,
-                                                  (phi + _GRAD_EPS) * phi_s);
-  auto right = qsim::Cirq::FSimGate<float>::Create(
+  auto left = qsim::Cirq::FSimGate<fp_type>::Create(
+      0, qid, qid2, theta * theta_s, (phi + _GRAD_EPS) * phi_s);
+  auto right = qsim::Cirq::FSimGate<fp_type>::Create(
       0, qid, qid2, theta * theta_s, (phi - _GRAD_EPS) * phi_s);
   Matrix4Diff(right.matrix,
               left.matrix);  // left's entries have right subtracted.
@@ -268,15 +282,16 @@ void PopulateGradientFsimPhi(const std::string& symbol, unsigned int location,
   grad->grad_gates.push_back(left);
 }
 
+template <typename fp_type>
 void PopulateGradientPhasedISwapPhasedExponent(
     const std::string& symbol, unsigned int location, unsigned int qid,
     unsigned int qid2, float pexp, float pexp_s, float exp, float exp_s,
-    GradientOfGate* grad) {
+    GradientOfGateT<fp_type>* grad) {
   grad->params.push_back(symbol);
   grad->index = location;
-  auto left = qsim::Cirq::PhasedISwapPowGate<float>::Create(
+  auto left = qsim::Cirq::PhasedISwapPowGate<fp_type>::Create(
       0, qid, qid2, (pexp + _GRAD_EPS) * pexp_s, exp * exp_s);
-  auto right = qsim::Cirq::PhasedISwapPowGate<float>::Create(
+  auto right = qsim::Cirq::PhasedISwapPowGate<fp_type>::Create(
       0, qid, qid2, (pexp - _GRAD_EPS) * pexp_s, exp * exp_s);
   Matrix4Diff(right.matrix,
               left.matrix);  // left's entries have right subtracted.
@@ -284,16 +299,18 @@ void PopulateGradientPhasedISwapPhasedExponent(
   grad->grad_gates.push_back(left);
 }
 
+template <typename fp_type>
 void PopulateGradientPhasedISwapExponent(const std::string& symbol,
                                          unsigned int location,
                                          unsigned int qid, unsigned int qid2,
                                          float pexp, float pexp_s, float exp,
-                                         float exp_s, GradientOfGate* grad) {
+                                         float exp_s,
+                                         GradientOfGateT<fp_type>* grad) {
   grad->params.push_back(symbol);
   grad->index = location;
-  auto left = qsim::Cirq::PhasedISwapPowGate<float>::Create(
+  auto left = qsim::Cirq::PhasedISwapPowGate<fp_type>::Create(
       0, qid, qid2, pexp * pexp_s, (exp + _GRAD_EPS) * exp_s);
-  auto right = qsim::Cirq::PhasedISwapPowGate<float>::Create(
+  auto right = qsim::Cirq::PhasedISwapPowGate<fp_type>::Create(
       0, qid, qid2, pexp * pexp_s, (exp - _GRAD_EPS) * exp_s);
   Matrix4Diff(right.matrix,
               left.matrix);  // left's entries have right subtracted.
@@ -301,4 +318,51 @@ void PopulateGradientPhasedISwapExponent(const std::string& symbol,
   grad->grad_gates.push_back(left);
 }
 
+// Single and double precision instantiations.
+#define TFQ_INSTANTIATE_ADJ_UTIL(fp_type)                                    \
+  template void CreateGradientCircuit<fp_type>(                              \
+      const QsimCircuitT<fp_type>& circuit,                                  \
+      const std::vector<GateMetaDataT<fp_type>>& metadata,                   \
+      std::vector<std::vector<qsim::GateFused<QsimGateT<fp_type>>>>*         \
+          partial_fuses,                                                     \
+      std::vector<GradientOfGateT<fp_type>>* grad_gates);                    \
+  template void PopulateGradientSingleEigen<fp_type>(                        \
+      const GateMetaDataT<fp_type>::SingleEigenCreateF& create_f,            \
+      const std::string& symbol, unsigned int location, unsigned int qid,    \
+      float exp, float exp_s, float gs, GradientOfGateT<fp_type>* grad);     \
+  template void PopulateGradientTwoEigen<fp_type>(                           \
+      const GateMetaDataT<fp_type>::TwoEigenCreateF& create_f,               \
+      const std::string& symbol, unsigned int location, unsigned int qid,    \
+      unsigned int qid2, float exp, float exp_s, float gs,                   \
+      GradientOfGateT<fp_type>* grad);                                       \
+  template void PopulateGradientPhasedXPhasedExponent<fp_type>(              \
+      const std::string& symbol, unsigned int location, unsigned int qid,    \
+      float pexp, float pexp_s, float exp, float exp_s, float gs,            \
+      GradientOfGateT<fp_type>* grad);                                       \
+  template void PopulateGradientPhasedXExponent<fp_type>(                    \
+      const std::string& symbol, unsigned int location, unsigned int qid,    \
+      float pexp, float pexp_s, float exp, float exp_s, float gs,            \
+      GradientOfGateT<fp_type>* grad);                                       \
+  template void PopulateGradientFsimTheta<fp_type>(                          \
+      const std::string& symbol, unsigned int location, unsigned int qid,    \
+      unsigned qid2, float theta, float theta_s, float phi, float phi_s,     \
+      GradientOfGateT<fp_type>* grad);                                       \
+  template void PopulateGradientFsimPhi<fp_type>(                            \
+      const std::string& symbol, unsigned int location, unsigned int qid,    \
+      unsigned qid2, float theta, float theta_s, float phi, float phi_s,     \
+      GradientOfGateT<fp_type>* grad);                                       \
+  template void PopulateGradientPhasedISwapPhasedExponent<fp_type>(          \
+      const std::string& symbol, unsigned int location, unsigned int qid,    \
+      unsigned int qid2, float pexp, float pexp_s, float exp, float exp_s,   \
+      GradientOfGateT<fp_type>* grad);                                       \
+  template void PopulateGradientPhasedISwapExponent<fp_type>(                \
+      const std::string& symbol, unsigned int location, unsigned int qid,    \
+      unsigned int qid2, float pexp, float pexp_s, float exp, float exp_s,   \
+      GradientOfGateT<fp_type>* grad);
+
+TFQ_INSTANTIATE_ADJ_UTIL(float)
+TFQ_INSTANTIATE_ADJ_UTIL(double)
+
+#undef TFQ_INSTANTIATE_ADJ_UTIL
+
 }  // namespace tfq
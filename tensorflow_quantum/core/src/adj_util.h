@@ -30,7 +30,8 @@ limitations under the License.
 
 namespace tfq {
 
-struct GradientOfGate {
+template <typename fp_type>
+struct GradientOfGateT {
   // name of parameters used by gate.
   std::vector<std::string> params;
 
@@ -41,64 +42,79 @@ struct GradientOfGate {
   int index;
 
   // Gates for gradients. Has a 1:1 mapping with params.
-  std::vector<qsim::Cirq::GateCirq<float>> grad_gates;
+  std::vector<qsim::Cirq::GateCirq<fp_type>> grad_gates;
 };
 
+typedef GradientOfGateT<float> GradientOfGate;
+
+// Everything below is available for gates of single (fp_type = float) and
+// double (fp_type = double) precision.
+
 // Computes all gates who's gradient will need to be taken, in addition
 // fuses all gates around those gates for faster circuit execution.
+template <typename fp_type>
 void CreateGradientCircuit(
-    const qsim::Circuit<qsim::Cirq::GateCirq<float>>& circuit,
-    const std::vector<GateMetaData>& metadata,
-    std::vector<std::vector<qsim::GateFused<qsim::Cirq::GateCirq<float>>>>*
+    const qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>& circuit,
+    const std::vector<GateMetaDataT<fp_type>>& metadata,
+    std::vector<std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>>*
         partial_fuses,
-    std::vector<GradientOfGate>* grad_gates);
+    std::vector<GradientOfGateT<fp_type>>* grad_gates);
 
+template <typename fp_type>
 void PopulateGradientSingleEigen(
-    const std::function<qsim::Cirq::GateCirq<float>(unsigned int, unsigned int,
-                                                    float, float)>& create_f,
+    const typename GateMetaDataT<fp_type>::SingleEigenCreateF& create_f,
     const std::string& symbol, unsigned int location, unsigned int qid,
-    float exp, float exp_s, float gs, GradientOfGate* grad);
+    float exp, float exp_s, float gs, GradientOfGateT<fp_type>* grad);
 
+template <typename fp_type>
 void PopulateGradientTwoEigen(
-    const std::function<qsim::Cirq::GateCirq<float>(
-        unsigned int, unsigned int, unsigned int, float, float)>& create_f,
+    const typename GateMetaDataT<fp_type>::TwoEigenCreateF& create_f,
     const std::string& symbol, unsigned int location, unsigned int qid,
-    unsigned int qid2, float exp, float exp_s, float gs, GradientOfGate* grad);
+    unsigned int qid2, float exp, float exp_s, float gs,
+    GradientOfGateT<fp_type>* grad);
 
 // Note: all methods below expect gate qubit indices to have been swapped so
 // qid < qid2.
+template <typename fp_type>
 void PopulateGradientPhasedXPhasedExponent(const std::string& symbol,
                                            unsigned int location,
                                            unsigned int qid, float pexp,
                                            float pexp_s, float exp, float exp_s,
-                                           float gs, GradientOfGate* grad);
+                                           float gs,
+                                           GradientOfGateT<fp_type>* grad);
 
+template <typename fp_type>
 void PopulateGradientPhasedXExponent(const std::string& symbol,
                                      unsigned int location, unsigned int qid,
                                      float pexp, float pexp_s, float exp,
                                      float exp_s, float gs,
-                                     GradientOfGate* grad);
+                                     GradientOfGateT<fp_type>* grad);
 
+template <typename fp_type>
 void PopulateGradientFsimTheta(const std::string& symbol, unsigned int location,
                                unsigned int qid, unsigned qid2, float theta,
                                float theta_s, float phi, float phi_s,
-                               GradientOfGate* grad);
+                               GradientOfGateT<fp_type>* grad);
 
+template <typename fp_type>
 void PopulateGradientFsimPhi(const std::string& symbol, unsigned int location,
                              unsigned int qid, unsigned qid2, float theta,
                              float theta_s, float phi, float phi_s,
-                             GradientOfGate* grad);
+                             GradientOfGateT<fp_type>* grad);
 
+template <typename fp_type>
 void PopulateGradientPhasedISwapPhasedExponent(
     const std::string& symbol, unsigned int location, unsigned int qid,
     unsigned int qid2, float pexp, float pexp_s, float exp, float exp_s,
-    GradientOfGate* grad);
+    GradientOfGateT<fp_type>* grad);
 
+template <typename fp_type>
 void PopulateGradientPhasedISwapExponent(const std::string& symbol,
                                          unsigned int location,
                                          unsigned int qid, unsigned int qid2,
                                          float pexp, float pexp_s, float exp,
-                                         float exp_s, GradientOfGate* grad);
+                                         float exp_s,
+                                         GradientOfGateT<fp_type>* grad);
 
 // does matrix elementiwse subtraction dest -= source.
 template <typename Array2>
@@ -0,0 +1,338 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Simulation of several small circuits of the same structure at once.
+// Circuits whose fused gates act on the same qubits, and only differ in
+// their matrices (e.g. one circuit resolved with different symbol values),
+// are simulated together on K interleaved state vectors: every fused gate is
+// applied to all K states in a single pass, with the K matrices side by side
+// so that the innermost loops run over the states and vectorize.
+
+#ifndef TFQ_CORE_SRC_BATCHED_STATES_H_
+#define TFQ_CORE_SRC_BATCHED_STATES_H_
+
+#include <algorithm>
+#include <complex>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "../qsim/lib/gate.h"
+
+namespace tfq {
+
+// Largest number of qubits simulated in batches. The states of a batch
+// should fit in the L2 cache of one core.
+static const int kMaxBatchedQubits = 14;
+
+// Bounds on the number of states simulated together.
+static const int kMaxBatchedStates = 16;
+static const int kMinBatchedStates = 4;
+
+// Bytes of state vectors aimed for per batch.
+static const uint64_t kBatchedStateBytes = uint64_t(1) << 21;
+
+// K state vectors on the same qubits. The K real parts of amplitude a are
+// stored contiguously, followed by its K imaginary parts. Amplitudes are
+// indexed like qsim::StateSpace::GetAmpl.
+template <typename FP>
+class BatchedStates {
+ public:
+  typedef FP fp_type;
+
+  BatchedStates() : num_qubits_(0), num_states_(0) {}
+
+  // Resizes to num_states states on num_qubits qubits, all set to |0>.
+  void SetStatesZero(const unsigned num_qubits, const unsigned num_states) {
+    num_qubits_ = num_qubits;
+    num_states_ = num_states;
+    data_.assign(2 * num_states * (uint64_t(1) << num_qubits), 0);
+    std::fill(data_.begin(), data_.begin() + num_states, 1);
+  }
+
+  unsigned num_qubits() const { return num_qubits_; }
+  unsigned num_states() const { return num_states_; }
+
+  // Real parts of amplitude a of all states, followed by the imaginary ones.
+  fp_type* amplitude(const uint64_t a) {
+    return data_.data() + 2 * a * num_states_;
+  }
+  const fp_type* amplitude(const uint64_t a) const {
+    return data_.data() + 2 * a * num_states_;
+  }
+
+  std::complex<fp_type> GetAmpl(const unsigned k, const uint64_t a) const {
+    const fp_type* p = amplitude(a);
+    return std::complex<fp_type>(p[k], p[num_states_ + k]);
+  }
+
+ private:
+  unsigned num_qubits_;
+  unsigned num_states_;
+  std::vector<fp_type> data_;
+};
+
+// Number of states of num_qubits qubits and fp_type amplitudes that are
+// simulated together.
+template <typename fp_type>
+int BatchedStatesPerGroup(const int num_qubits) {
+  const uint64_t state_bytes =
+      2 * sizeof(fp_type) * (uint64_t(1) << num_qubits);
+  const uint64_t fit = kBatchedStateBytes / state_bytes;
+  return static_cast<int>(std::max<uint64_t>(
+      kMinBatchedStates,
+      std::min<uint64_t>(kMaxBatchedStates, fit)));
+}
+
+// True if a and b act on the same qubits with the same controls, i.e. they
+// can be applied to interleaved states together.
+template <typename Gate>
+bool SameFusedStructure(const qsim::GateFused<Gate>& a,
+                        const qsim::GateFused<Gate>& b) {
+  if (a.kind != b.kind || a.qubits != b.qubits) {
+    return false;
+  }
+  const bool a_controlled =
+      a.parent != nullptr && !a.parent->controlled_by.empty();
+  const bool b_controlled =
+      b.parent != nullptr && !b.parent->controlled_by.empty();
+  if (a_controlled != b_controlled) {
+    return false;
+  }
+  return !a_controlled || (a.parent->controlled_by == b.parent->controlled_by &&
+                           a.parent->cmask == b.parent->cmask);
+}
+
+// Splits batch_indices into groups of circuits on the same number of qubits
+// (at most kMaxBatchedQubits) with the same fused gate structure. Groups hold
+// between kMinBatchedStates and BatchedStatesPerGroup circuits, every other
+// circuit, including empty ones, is added to rest. Both keep the order of
+// batch_indices.
+//
+// Every group is simulated by a single one of num_threads threads, so groups
+// are made small enough that there are at least num_threads of them. When
+// even groups of kMinBatchedStates circuits are too few for that, batching
+// would leave threads idle and every circuit is added to rest instead.
+template <typename Gate>
+void PlanBatchedCircuits(
+    const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
+    const std::vector<std::vector<qsim::GateFused<Gate>>>& fused_circuits,
+    const int num_threads, std::vector<std::vector<int>>* groups,
+    std::vector<int>* rest) {
+  typedef typename Gate::fp_type fp_type;
+  groups->clear();
+
+  // Circuits of equal structure, found through a hash of the structure and
+  // confirmed gate by gate.
+  std::vector<std::vector<int>> classes;
+  std::unordered_map<uint64_t, std::vector<int>> buckets;
+  for (const int i : batch_indices) {
+    const auto& gates = fused_circuits[i];
+    if (gates.empty() || num_qubits[i] > kMaxBatchedQubits) {
+      continue;
+    }
+    uint64_t h = 14695981039346656037ull;
+    auto mix = [&h](const uint64_t v) {
+      h = (h ^ v) * 1099511628211ull;
+    };
+    mix(num_qubits[i]);
+    mix(gates.size());
+    for (const auto& gate : gates) {
+      mix(gate.kind);
+      for (const unsigned q : gate.qubits) {
+        mix(q);
+      }
+      if (gate.parent != nullptr && !gate.parent->controlled_by.empty()) {
+        mix(gate.parent->cmask);
+        for (const unsigned q : gate.parent->controlled_by) {
+          mix(q + 64);
+        }
+      }
+    }
+
+    std::vector<int>& bucket = buckets[h];
+    int match = -1;
+    for (const int c : bucket) {
+      const int j = classes[c][0];
+      if (num_qubits[j] != num_qubits[i] ||
+          fused_circuits[j].size() != gates.size()) {
+        continue;
+      }
+      size_t g = 0;
+      while (g < gates.size() &&
+             SameFusedStructure(fused_circuits[j][g], gates[g])) {
+        g++;
+      }
+      if (g == gates.size()) {
+        match = c;
+        break;
+      }
+    }
+    if (match < 0) {
+      match = classes.size();
+      classes.push_back({});
+      bucket.push_back(match);
+    }
+    classes[match].push_back(i);
+  }
+
+  // Largest group size that still gives every thread a group.
+  size_t num_batchable = 0;
+  for (const auto& members : classes) {
+    num_batchable += members.size();
+  }
+  const size_t threads = std::max(num_threads, 1);
+  const size_t max_per_group = std::max<size_t>(
+      kMinBatchedStates, (num_batchable + threads - 1) / threads);
+
+  std::vector<bool> batched(fused_circuits.size(), false);
+  for (const auto& members : classes) {
+    const size_t per_group = std::min<size_t>(
+        max_per_group, BatchedStatesPerGroup<fp_type>(num_qubits[members[0]]));
+    for (size_t start = 0; start < members.size(); start += per_group) {
+      const size_t end = std::min(members.size(), start + per_group);
+      // Remainders that are too small are not worth batching.
+      if (end - start < static_cast<size_t>(kMinBatchedStates)) {
+        break;
+      }
+      groups->emplace_back(members.begin() + start, members.begin() + end);
+      for (size_t m = start; m < end; m++) {
+        batched[members[m]] = true;
+      }
+    }
+  }
+
+  if (groups->size() < threads) {
+    groups->clear();
+    batched.assign(fused_circuits.size(), false);
+  }
+
+  rest->clear();
+  for (const int i : batch_indices) {
+    if (!batched[i]) {
+      rest->push_back(i);
+    }
+  }
+}
+
+// Applies gates[k] to state k of states. All gates must have the same
+// structure (see SameFusedStructure). scratch is resized as needed.
+// Measurement gates are skipped like in qsim::ApplyFusedGate.
+template <typename Gate, typename fp_type>
+void ApplyBatchedFusedGate(
+    const std::vector<const qsim::GateFused<Gate>*>& gates,
+    BatchedStates<fp_type>* states, std::vector<fp_type>* scratch) {
+  const qsim::GateFused<Gate>& gate = *gates[0];
+  if (gate.kind == qsim::gate_measurement) {
+    return;
+  }
+  const uint64_t num_states = states->num_states();
+  const unsigned num_targets = gate.qubits.size();
+  const uint64_t dim = uint64_t(1) << num_targets;
+
+  // Bits of the controls and their required values.
+  uint64_t cmask = 0;
+  uint64_t cvals = 0;
+  if (gate.parent != nullptr) {
+    const auto& controls = gate.parent->controlled_by;
+    for (size_t c = 0; c < controls.size(); c++) {
+      cmask |= uint64_t(1) << controls[c];
+      cvals |= uint64_t((gate.parent->cmask >> c) & 1) << controls[c];
+    }
+  }
+
+  // offsets[r] sets the target bits of row r of the matrix, whose bit j
+  // belongs to gate.qubits[j].
+  std::vector<uint64_t> offsets(dim, 0);
+  for (uint64_t r = 0; r < dim; r++) {
+    for (unsigned j = 0; j < num_targets; j++) {
+      offsets[r] |= ((r >> j) & 1) << gate.qubits[j];
+    }
+  }
+  std::vector<unsigned> targets(gate.qubits.begin(), gate.qubits.end());
+  std::sort(targets.begin(), targets.end());
+
+  // The K matrices side by side: the real parts of entry e of all gates,
+  // then the imaginary ones, followed by the K input amplitudes of every
+  // column in the same layout.
+  const uint64_t stride = 2 * num_states;
+  scratch->resize(stride * (dim * dim + dim));
+  fp_type* matrix = scratch->data();
+  fp_type* in = matrix + stride * dim * dim;
+  for (uint64_t k = 0; k < num_states; k++) {
+    const auto& m = gates[k]->matrix;
+    for (uint64_t e = 0; e < dim * dim; e++) {
+      matrix[e * stride + k] = m[2 * e];
+      matrix[e * stride + num_states + k] = m[2 * e + 1];
+    }
+  }
+
+  const uint64_t num_groups =
+      uint64_t(1) << (states->num_qubits() - num_targets);
+  for (uint64_t b = 0; b < num_groups; b++) {
+    // Insert zeros at the target bits.
+    uint64_t base = b;
+    for (const unsigned q : targets) {
+      const uint64_t low = base & ((uint64_t(1) << q) - 1);
+      base = ((base >> q) << (q + 1)) | low;
+    }
+    if ((base & cmask) != cvals) {
+      continue;
+    }
+
+    for (uint64_t c = 0; c < dim; c++) {
+      const fp_type* a = states->amplitude(base | offsets[c]);
+      std::copy(a, a + stride, in + c * stride);
+    }
+    for (uint64_t r = 0; r < dim; r++) {
+      fp_type* out_re = states->amplitude(base | offsets[r]);
+      fp_type* out_im = out_re + num_states;
+      std::fill(out_re, out_re + stride, 0);
+      for (uint64_t c = 0; c < dim; c++) {
+        const fp_type* m_re = matrix + (r * dim + c) * stride;
+        const fp_type* m_im = m_re + num_states;
+        const fp_type* in_re = in + c * stride;
+        const fp_type* in_im = in_re + num_states;
+        for (uint64_t k = 0; k < num_states; k++) {
+          out_re[k] += m_re[k] * in_re[k] - m_im[k] * in_im[k];
+          out_im[k] += m_re[k] * in_im[k] + m_im[k] * in_re[k];
+        }
+      }
+    }
+  }
+}
+
+// Simulates the circuits group (indices into fused_circuits, all of the
+// same structure) into states, state k holding the final state of circuit
+// group[k].
+template <typename Gate, typename fp_type>
+void RunBatchedCircuits(
+    const std::vector<int>& group, const std::vector<int>& num_qubits,
+    const std::vector<std::vector<qsim::GateFused<Gate>>>& fused_circuits,
+    BatchedStates<fp_type>* states, std::vector<fp_type>* scratch) {
+  states->SetStatesZero(num_qubits[group[0]], group.size());
+  std::vector<const qsim::GateFused<Gate>*> gates(group.size());
+  const size_t num_gates = fused_circuits[group[0]].size();
+  for (size_t g = 0; g < num_gates; g++) {
+    for (size_t k = 0; k < group.size(); k++) {
+      gates[k] = &fused_circuits[group[k]][g];
+    }
+    ApplyBatchedFusedGate(gates, states, scratch);
+  }
+}
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_BATCHED_STATES_H_
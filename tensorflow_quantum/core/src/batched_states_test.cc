@@ -0,0 +1,198 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/batched_states.h"
+
+#include <vector>
+
+#include "../qsim/lib/circuit.h"
+#include "../qsim/lib/formux.h"
+#include "../qsim/lib/fuser_basic.h"
+#include "../qsim/lib/gate_appl.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/io.h"
+#include "../qsim/lib/simmux.h"
+#include "gtest/gtest.h"
+
+namespace tfq {
+namespace {
+
+typedef qsim::Cirq::GateCirq<float> QsimGate;
+typedef qsim::Circuit<QsimGate> QsimCircuit;
+typedef std::vector<qsim::GateFused<QsimGate>> QsimFusedCircuit;
+typedef qsim::Simulator<qsim::SequentialFor> Simulator;
+typedef Simulator::StateSpace StateSpace;
+
+// Four qubit circuit whose structure does not depend on t, with a control
+// on qubit 3 that is only satisfied when it is 0.
+QsimCircuit StructuredCircuit(const float t) {
+  QsimCircuit circuit;
+  circuit.num_qubits = 4;
+  circuit.gates.push_back(qsim::Cirq::HGate<float>::Create(0, 0));
+  circuit.gates.push_back(qsim::Cirq::XPowGate<float>::Create(0, 2, t, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::CXPowGate<float>::Create(1, 0, 1, 1.0, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::YPowGate<float>::Create(2, 1, 0.5 * t, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::CZPowGate<float>::Create(3, 1, 2, t, 0.25));
+  circuit.gates.push_back(
+      qsim::Cirq::XPowGate<float>::Create(4, 0, 1.0 - t, 0.0));
+  qsim::MakeControlledGate({3}, {0}, circuit.gates.back());
+  circuit.gates.push_back(qsim::Cirq::HGate<float>::Create(5, 3));
+  return circuit;
+}
+
+QsimFusedCircuit FuseCircuit(const QsimCircuit& circuit) {
+  return qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+      qsim::BasicGateFuser<qsim::IO, QsimGate>::Parameter(),
+      circuit.num_qubits, circuit.gates);
+}
+
+class BatchedStatesTest : public ::testing::Test {
+ protected:
+  void Add(const QsimCircuit& circuit) {
+    circuits_.push_back(circuit);
+    num_qubits_.push_back(circuit.num_qubits);
+    batch_indices_.push_back(batch_indices_.size());
+  }
+
+  // Fuses after all circuits are added, the fused gates point into
+  // circuits_.
+  void Fuse() {
+    for (const auto& circuit : circuits_) {
+      fused_circuits_.push_back(FuseCircuit(circuit));
+    }
+  }
+
+  std::vector<QsimCircuit> circuits_;
+  std::vector<QsimFusedCircuit> fused_circuits_;
+  std::vector<int> num_qubits_;
+  std::vector<int> batch_indices_;
+};
+
+TEST_F(BatchedStatesTest, MatchesQsim) {
+  for (int k = 0; k < 6; k++) {
+    Add(StructuredCircuit(0.1 + 0.15 * k));
+  }
+  Fuse();
+
+  BatchedStates<float> states;
+  std::vector<float> scratch;
+  RunBatchedCircuits(batch_indices_, num_qubits_, fused_circuits_, &states,
+                     &scratch);
+  ASSERT_EQ(states.num_states(), 6);
+  ASSERT_EQ(states.num_qubits(), 4);
+
+  Simulator sim(1);
+  StateSpace ss(1);
+  auto expected = ss.Create(4);
+  for (int k = 0; k < 6; k++) {
+    ss.SetStateZero(expected);
+    for (const auto& gate : fused_circuits_[k]) {
+      qsim::ApplyFusedGate(sim, gate, expected);
+    }
+    for (uint64_t j = 0; j < 16; j++) {
+      EXPECT_NEAR(states.GetAmpl(k, j).real(),
+                  ss.GetAmpl(expected, j).real(), 1e-5);
+      EXPECT_NEAR(states.GetAmpl(k, j).imag(),
+                  ss.GetAmpl(expected, j).imag(), 1e-5);
+    }
+  }
+}
+
+TEST_F(BatchedStatesTest, PlanGroupsByStructure) {
+  for (int k = 0; k < 5; k++) {
+    Add(StructuredCircuit(0.2 * k));
+  }
+  // A circuit of another structure and an empty one.
+  QsimCircuit other;
+  other.num_qubits = 4;
+  other.gates.push_back(qsim::Cirq::HGate<float>::Create(0, 1));
+  Add(other);
+  Add(QsimCircuit());
+  circuits_.back().num_qubits = 4;
+  num_qubits_.back() = 4;
+  Fuse();
+
+  std::vector<std::vector<int>> groups;
+  std::vector<int> rest;
+  PlanBatchedCircuits(batch_indices_, num_qubits_, fused_circuits_, 1,
+                      &groups, &rest);
+  ASSERT_EQ(groups.size(), 1);
+  EXPECT_EQ(groups[0], std::vector<int>({0, 1, 2, 3, 4}));
+  EXPECT_EQ(rest, std::vector<int>({5, 6}));
+
+  // Too few circuits of one structure are left to the caller.
+  batch_indices_ = {6, 0, 2, 5};
+  PlanBatchedCircuits(batch_indices_, num_qubits_, fused_circuits_, 1,
+                      &groups, &rest);
+  EXPECT_TRUE(groups.empty());
+  EXPECT_EQ(rest, batch_indices_);
+}
+
+TEST_F(BatchedStatesTest, PlanSplitsLargeClasses) {
+  const int n = BatchedStatesPerGroup<float>(4) + kMinBatchedStates - 1;
+  for (int k = 0; k < n; k++) {
+    Add(StructuredCircuit(0.01 * k));
+  }
+  Fuse();
+
+  std::vector<std::vector<int>> groups;
+  std::vector<int> rest;
+  PlanBatchedCircuits(batch_indices_, num_qubits_, fused_circuits_, 1,
+                      &groups, &rest);
+  ASSERT_EQ(groups.size(), 1);
+  EXPECT_EQ(groups[0].size(), BatchedStatesPerGroup<float>(4));
+  EXPECT_EQ(rest.size(), kMinBatchedStates - 1);
+}
+
+TEST_F(BatchedStatesTest, PlanSpreadsGroupsOverThreads) {
+  const int n = 4 * BatchedStatesPerGroup<float>(4);
+  for (int k = 0; k < n; k++) {
+    Add(StructuredCircuit(0.01 * k));
+  }
+  Fuse();
+
+  // Groups shrink so that each of the 8 threads gets one.
+  std::vector<std::vector<int>> groups;
+  std::vector<int> rest;
+  PlanBatchedCircuits(batch_indices_, num_qubits_, fused_circuits_, 8,
+                      &groups, &rest);
+  EXPECT_GE(groups.size(), 8);
+  size_t num_batched = 0;
+  for (const auto& group : groups) {
+    EXPECT_GE(group.size(), kMinBatchedStates);
+    EXPECT_LE(group.size(), n / 8);
+    num_batched += group.size();
+  }
+  EXPECT_EQ(num_batched + rest.size(), n);
+
+  // Too few circuits for a group per thread are not batched at all.
+  PlanBatchedCircuits(batch_indices_, num_qubits_, fused_circuits_,
+                      n / kMinBatchedStates + 1, &groups, &rest);
+  EXPECT_TRUE(groups.empty());
+  EXPECT_EQ(rest, batch_indices_);
+}
+
+TEST(BatchedStatesPerGroupTest, Bounds) {
+  EXPECT_EQ(BatchedStatesPerGroup<float>(2), kMaxBatchedStates);
+  EXPECT_EQ(BatchedStatesPerGroup<float>(kMaxBatchedQubits), 16);
+  EXPECT_EQ(BatchedStatesPerGroup<double>(kMaxBatchedQubits), 8);
+  EXPECT_EQ(BatchedStatesPerGroup<double>(20), kMinBatchedStates);
+}
+
+}  // namespace
+}  // namespace tfq
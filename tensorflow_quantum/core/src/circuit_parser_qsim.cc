@@ -15,7 +15,10 @@ limitations under the License.
 
 #include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
 
+#include <algorithm>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "../qsim/lib/channel.h"
@@ -24,6 +27,7 @@ limitations under the License.
 #include "../qsim/lib/circuit_noisy.h"
 #include "../qsim/lib/fuser.h"
 #include "../qsim/lib/fuser_basic.h"
+#include "../qsim/lib/fuser_mqubit.h"
 #include "../qsim/lib/gates_cirq.h"
 #include "../qsim/lib/io.h"
 #include "absl/container/flat_hash_map.h"
@@ -31,12 +35,16 @@ limitations under the License.
 #include "absl/strings/str_split.h"
 #include "absl/types/optional.h"
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/util/env_var.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
 #include "tensorflow_quantum/core/proto/program.pb.h"
+#include "tensorflow_quantum/core/src/cpu_features.h"
 
 namespace tfq {
 
 using ::tensorflow::Status;
+using ::tfq::proto::Arg;
 using ::tfq::proto::Moment;
 using ::tfq::proto::Operation;
 using ::tfq::proto::PauliTerm;
@@ -49,6 +57,19 @@ typedef qsim::Cirq::GateCirq<float> QsimGate;
 typedef qsim::Circuit<QsimGate> QsimCircuit;
 typedef qsim::NoisyCircuit<QsimGate> NoisyQsimCircuit;
 
+template <typename fp_type>
+using QsimGateT = qsim::Cirq::GateCirq<fp_type>;
+template <typename fp_type>
+using QsimCircuitT = qsim::Circuit<QsimGateT<fp_type>>;
+template <typename fp_type>
+using QsimFusedCircuitT = std::vector<qsim::GateFused<QsimGateT<fp_type>>>;
+
+// Largest gate qsim can apply.
+const int kMaxFusedQubits = 6;
+
+// Circuits on fewer qubits are always fused into blocks of two qubits.
+const int kMinQubitsForWideFusion = 12;
+
 inline Status ParseProtoArg(
     const Operation& op, const std::string& arg_name,
     const SymbolMap& param_map, float* result,
@@ -127,9 +148,10 @@ inline Status ParseProtoControls(const Operation& op,
   return Status::OK();
 }
 
+template <typename fp_type>
 inline Status OptionalInsertControls(const Operation& op,
                                      const unsigned int num_qubits,
-                                     QsimGate* gate) {
+                                     QsimGateT<fp_type>* gate) {
   std::vector<unsigned int> control_values;
   std::vector<unsigned int> control_qubits;
   Status s;
@@ -150,11 +172,14 @@ inline Status OptionalInsertControls(const Operation& op,
 // upstream.
 
 // single qubit gate Create(time, q0)
+template <typename fp_type>
 inline Status SingleConstantGate(
     const Operation& op, const SymbolMap& param_map,
-    const std::function<QsimGate(unsigned int, unsigned int)>& create_f,
+    const std::function<QsimGateT<fp_type>(unsigned int, unsigned int)>&
+        create_f,
     const unsigned int num_qubits, const unsigned int time,
-    QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
+    QsimCircuitT<fp_type>* circuit,
+    std::vector<GateMetaDataT<fp_type>>* metadata) {
   unsigned int q0;
   (void)absl::SimpleAtoi(op.qubits(0).id(), &q0);
   auto gate = create_f(time, num_qubits - q0 - 1);
@@ -166,7 +191,7 @@ inline Status SingleConstantGate(
 
   // check for symbols and track metadata if needed.
   if (metadata != nullptr) {
-    GateMetaData info;
+    GateMetaDataT<fp_type> info;
     info.index = circuit->gates.size() - 1;
     metadata->push_back(info);
   }
@@ -174,12 +199,14 @@ inline Status SingleConstantGate(
 }
 
 // two qubit gate Create(time, q0, q1)
+template <typename fp_type>
 inline Status TwoConstantGate(
     const Operation& op, const SymbolMap& param_map,
-    const std::function<QsimGate(unsigned int, unsigned int, unsigned int)>&
-        create_f,
+    const std::function<QsimGateT<fp_type>(unsigned int, unsigned int,
+                                           unsigned int)>& create_f,
     const unsigned int num_qubits, const unsigned int time,
-    QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
+    QsimCircuitT<fp_type>* circuit,
+    std::vector<GateMetaDataT<fp_type>>* metadata) {
   unsigned int q0, q1;
   bool unused = absl::SimpleAtoi(op.qubits(0).id(), &q0);
   unused = absl::SimpleAtoi(op.qubits(1).id(), &q1);
@@ -192,7 +219,7 @@ inline Status TwoConstantGate(
 
   // check for symbols and track metadata if needed.
   if (metadata != nullptr) {
-    GateMetaData info;
+    GateMetaDataT<fp_type> info;
     info.index = circuit->gates.size() - 1;
     metadata->push_back(info);
   }
@@ -200,12 +227,13 @@ inline Status TwoConstantGate(
 }
 
 // single qubit eigen -> Create(time, q0, exponent, global_shift)
+template <typename fp_type>
 inline Status SingleEigenGate(
     const Operation& op, const SymbolMap& param_map,
-    const std::function<QsimGate(unsigned int, unsigned int, float, float)>&
-        create_f,
+    const typename GateMetaDataT<fp_type>::SingleEigenCreateF& create_f,
     const unsigned int num_qubits, const unsigned int time,
-    QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
+    QsimCircuitT<fp_type>* circuit,
+    std::vector<GateMetaDataT<fp_type>>* metadata) {
   unsigned int q0;
   bool unused;
   float exp, exp_s, gs;
@@ -235,7 +263,7 @@ inline Status SingleEigenGate(
 
   // check for symbols and track metadata if needed.
   if (metadata != nullptr) {
-    GateMetaData info;
+    GateMetaDataT<fp_type> info;
     info.index = circuit->gates.size() - 1;
     info.gate_params = {exp, exp_s, gs};
     info.create_f1 = create_f;
@@ -249,12 +277,13 @@ inline Status SingleEigenGate(
 }
 
 // two qubit eigen -> Create(time, q0, q1, exp, gs)
+template <typename fp_type>
 inline Status TwoEigenGate(
     const Operation& op, const SymbolMap& param_map,
-    const std::function<QsimGate(unsigned int, unsigned int, unsigned int,
-                                 float, float)>& create_f,
+    const typename GateMetaDataT<fp_type>::TwoEigenCreateF& create_f,
     const unsigned int num_qubits, const unsigned int time,
-    QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
+    QsimCircuitT<fp_type>* circuit,
+    std::vector<GateMetaDataT<fp_type>>* metadata) {
   unsigned int q0, q1;
   float exp, exp_s, gs;
   bool unused;
@@ -286,7 +315,7 @@ inline Status TwoEigenGate(
 
   // check for symbols and track metadata if needed.
   if (metadata != nullptr) {
-    GateMetaData info;
+    GateMetaDataT<fp_type> info;
     info.index = circuit->gates.size() - 1;
     info.gate_params = {exp, exp_s, gs};
     info.create_f2 = create_f;
@@ -299,102 +328,143 @@ inline Status TwoEigenGate(
   return Status::OK();
 }
 
+template <typename fp_type>
 Status IGate(const Operation& op, const SymbolMap& param_map,
              const unsigned int num_qubits, const unsigned int time,
-             QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return SingleConstantGate(op, param_map, &qsim::Cirq::I1<float>::Create,
-                            num_qubits, time, circuit, metadata);
+             QsimCircuitT<fp_type>* circuit,
+             std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return SingleConstantGate<fp_type>(
+      op, param_map, &qsim::Cirq::I1<fp_type>::Create, num_qubits, time,
+      circuit, metadata);
 }
 
+template <typename fp_type>
 Status I2Gate(const Operation& op, const SymbolMap& param_map,
               const unsigned int num_qubits, const unsigned int time,
-              QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return TwoConstantGate(op, param_map, &qsim::Cirq::I2<float>::Create,
-                         num_qubits, time, circuit, metadata);
+              QsimCircuitT<fp_type>* circuit,
+              std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return TwoConstantGate<fp_type>(
+      op, param_map, &qsim::Cirq::I2<fp_type>::Create, num_qubits, time,
+      circuit, metadata);
 }
 
+template <typename fp_type>
 Status HGate(const Operation& op, const SymbolMap& param_map,
              const unsigned int num_qubits, const unsigned int time,
-             QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return SingleEigenGate(op, param_map, &qsim::Cirq::HPowGate<float>::Create,
-                         num_qubits, time, circuit, metadata);
+             QsimCircuitT<fp_type>* circuit,
+             std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return SingleEigenGate<fp_type>(
+      op, param_map, &qsim::Cirq::HPowGate<fp_type>::Create, num_qubits, time,
+      circuit, metadata);
 }
 
+template <typename fp_type>
 Status XGate(const Operation& op, const SymbolMap& param_map,
              const unsigned int num_qubits, const unsigned int time,
-             QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return SingleEigenGate(op, param_map, &qsim::Cirq::XPowGate<float>::Create,
-                         num_qubits, time, circuit, metadata);
+             QsimCircuitT<fp_type>* circuit,
+             std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return SingleEigenGate<fp_type>(
+      op, param_map, &qsim::Cirq::XPowGate<fp_type>::Create, num_qubits, time,
+      circuit, metadata);
 }
 
+template <typename fp_type>
 Status XXGate(const Operation& op, const SymbolMap& param_map,
               const unsigned int num_qubits, const unsigned int time,
-              QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return TwoEigenGate(op, param_map, &qsim::Cirq::XXPowGate<float>::Create,
-                      num_qubits, time, circuit, metadata);
+              QsimCircuitT<fp_type>* circuit,
+              std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return TwoEigenGate<fp_type>(
+      op, param_map, &qsim::Cirq::XXPowGate<fp_type>::Create, num_qubits, time,
+      circuit, metadata);
 }
 
+template <typename fp_type>
 Status YGate(const Operation& op, const SymbolMap& param_map,
              const unsigned int num_qubits, const unsigned int time,
-             QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return SingleEigenGate(op, param_map, &qsim::Cirq::YPowGate<float>::Create,
-                         num_qubits, time, circuit, metadata);
+             QsimCircuitT<fp_type>* circuit,
+             std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return SingleEigenGate<fp_type>(
+      op, param_map, &qsim::Cirq::YPowGate<fp_type>::Create, num_qubits, time,
+      circuit, metadata);
 }
 
+template <typename fp_type>
 Status YYGate(const Operation& op, const SymbolMap& param_map,
               const unsigned int num_qubits, const unsigned int time,
-              QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return TwoEigenGate(op, param_map, &qsim::Cirq::YYPowGate<float>::Create,
-                      num_qubits, time, circuit, metadata);
+              QsimCircuitT<fp_type>* circuit,
+              std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return TwoEigenGate<fp_type>(
+      op, param_map, &qsim::Cirq::YYPowGate<fp_type>::Create, num_qubits, time,
+      circuit, metadata);
 }
 
+template <typename fp_type>
 Status ZGate(const Operation& op, const SymbolMap& param_map,
              const unsigned int num_qubits, const unsigned int time,
-             QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return SingleEigenGate(op, param_map, &qsim::Cirq::ZPowGate<float>::Create,
-                         num_qubits, time, circuit, metadata);
+             QsimCircuitT<fp_type>* circuit,
+             std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return SingleEigenGate<fp_type>(
+      op, param_map, &qsim::Cirq::ZPowGate<fp_type>::Create, num_qubits, time,
+      circuit, metadata);
 }
 
+template <typename fp_type>
 Status ZZGate(const Operation& op, const SymbolMap& param_map,
               const unsigned int num_qubits, const unsigned int time,
-              QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return TwoEigenGate(op, param_map, &qsim::Cirq::ZZPowGate<float>::Create,
-                      num_qubits, time, circuit, metadata);
+              QsimCircuitT<fp_type>* circuit,
+              std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return TwoEigenGate<fp_type>(
+      op, param_map, &qsim::Cirq::ZZPowGate<fp_type>::Create, num_qubits, time,
+      circuit, metadata);
 }
 
+template <typename fp_type>
 Status CZGate(const Operation& op, const SymbolMap& param_map,
               const unsigned int num_qubits, const unsigned int time,
-              QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return TwoEigenGate(op, param_map, &qsim::Cirq::CZPowGate<float>::Create,
-                      num_qubits, time, circuit, metadata);
+              QsimCircuitT<fp_type>* circuit,
+              std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return TwoEigenGate<fp_type>(
+      op, param_map, &qsim::Cirq::CZPowGate<fp_type>::Create, num_qubits, time,
+      circuit, metadata);
 }
 
+template <typename fp_type>
 Status CXGate(const Operation& op, const SymbolMap& param_map,
               const unsigned int num_qubits, const unsigned int time,
-              QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return TwoEigenGate(op, param_map, &qsim::Cirq::CXPowGate<float>::Create,
-                      num_qubits, time, circuit, metadata);
+              QsimCircuitT<fp_type>* circuit,
+              std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return TwoEigenGate<fp_type>(
+      op, param_map, &qsim::Cirq::CXPowGate<fp_type>::Create, num_qubits, time,
+      circuit, metadata);
 }
 
+template <typename fp_type>
 Status SwapGate(const Operation& op, const SymbolMap& param_map,
                 const unsigned int num_qubits, const unsigned int time,
-                QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return TwoEigenGate(op, param_map, &qsim::Cirq::SwapPowGate<float>::Create,
-                      num_qubits, time, circuit, metadata);
+                QsimCircuitT<fp_type>* circuit,
+                std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return TwoEigenGate<fp_type>(
+      op, param_map, &qsim::Cirq::SwapPowGate<fp_type>::Create, num_qubits,
+      time, circuit, metadata);
 }
 
+template <typename fp_type>
 Status ISwapGate(const Operation& op, const SymbolMap& param_map,
                  const unsigned int num_qubits, const unsigned int time,
-                 QsimCircuit* circuit, std::vector<GateMetaData>* metadata) {
-  return TwoEigenGate(op, param_map, &qsim::Cirq::ISwapPowGate<float>::Create,
-                      num_qubits, time, circuit, metadata);
+                 QsimCircuitT<fp_type>* circuit,
+                 std::vector<GateMetaDataT<fp_type>>* metadata) {
+  return TwoEigenGate<fp_type>(
+      op, param_map, &qsim::Cirq::ISwapPowGate<fp_type>::Create, num_qubits,
+      time, circuit, metadata);
 }
 
 // single qubit PhasedXPow -> Create(time, q0, pexp, exp, gs)
+template <typename fp_type>
 inline Status PhasedXGate(const Operation& op, const SymbolMap& param_map,
                           const unsigned int num_qubits,
-                          const unsigned int time, QsimCircuit* circuit,
-                          std::vector<GateMetaData>* metadata) {
+                          const unsigned int time,
+                          QsimCircuitT<fp_type>* circuit,
+                          std::vector<GateMetaDataT<fp_type>>* metadata) {
   int q0;
   bool unused;
   float pexp, pexp_s, exp, exp_s, gs;
@@ -424,7 +494,7 @@ inline Status PhasedXGate(const Operation& op, const SymbolMap& param_map,
   if (!u.ok()) {
     return u;
   }
-  auto gate = qsim::Cirq::PhasedXPowGate<float>::Create(
+  auto gate = qsim::Cirq::PhasedXPowGate<fp_type>::Create(
       time, num_qubits - q0 - 1, pexp * pexp_s, exp * exp_s, gs);
   Status s = OptionalInsertControls(op, num_qubits, &gate);
   if (!s.ok()) {
@@ -434,7 +504,7 @@ inline Status PhasedXGate(const Operation& op, const SymbolMap& param_map,
 
   // check for symbols and track metadata if needed.
   if (metadata != nullptr) {
-    GateMetaData info;
+    GateMetaDataT<fp_type> info;
     info.index = circuit->gates.size() - 1;
     info.gate_params = {pexp, pexp_s, exp, exp_s, gs};
     if (phase_exponent_symbol.has_value()) {
@@ -451,10 +521,11 @@ inline Status PhasedXGate(const Operation& op, const SymbolMap& param_map,
 }
 
 // two qubit fsim -> Create(time, q0, q1, theta, phi)
+template <typename fp_type>
 inline Status FsimGate(const Operation& op, const SymbolMap& param_map,
                        const unsigned int num_qubits, const unsigned int time,
-                       QsimCircuit* circuit,
-                       std::vector<GateMetaData>* metadata) {
+                       QsimCircuitT<fp_type>* circuit,
+                       std::vector<GateMetaDataT<fp_type>>* metadata) {
   int q0, q1;
   bool unused;
   float theta, theta_s, phi, phi_s;
@@ -480,7 +551,7 @@ inline Status FsimGate(const Operation& op, const SymbolMap& param_map,
   if (!u.ok()) {
     return u;
   }
-  auto gate = qsim::Cirq::FSimGate<float>::Create(time, num_qubits - q0 - 1,
+  auto gate = qsim::Cirq::FSimGate<fp_type>::Create(time, num_qubits - q0 - 1,
                                                   num_qubits - q1 - 1,
                                                   theta * theta_s, phi * phi_s);
   Status s = OptionalInsertControls(op, num_qubits, &gate);
@@ -491,7 +562,7 @@ inline Status FsimGate(const Operation& op, const SymbolMap& param_map,
 
   // check for symbols and track metadata if needed.
   if (metadata != nullptr) {
-    GateMetaData info;
+    GateMetaDataT<fp_type> info;
     info.index = circuit->gates.size() - 1;
     info.gate_params = {theta, theta_s, phi, phi_s};
     if (theta_symbol.has_value()) {
@@ -508,10 +579,12 @@ inline Status FsimGate(const Operation& op, const SymbolMap& param_map,
 }
 
 // two qubit phase iswap -> Create(time, q0, q1, pexp, exp)
+template <typename fp_type>
 inline Status PhasedISwapGate(const Operation& op, const SymbolMap& param_map,
                               const unsigned int num_qubits,
-                              const unsigned int time, QsimCircuit* circuit,
-                              std::vector<GateMetaData>* metadata) {
+                              const unsigned int time,
+                              QsimCircuitT<fp_type>* circuit,
+                              std::vector<GateMetaDataT<fp_type>>* metadata) {
   int q0, q1;
   bool unused;
   float pexp, pexp_s, exp, exp_s;
@@ -538,7 +611,7 @@ inline Status PhasedISwapGate(const Operation& op, const SymbolMap& param_map,
   if (!u.ok()) {
     return u;
   }
-  auto gate = qsim::Cirq::PhasedISwapPowGate<float>::Create(
+  auto gate = qsim::Cirq::PhasedISwapPowGate<fp_type>::Create(
       time, num_qubits - q0 - 1, num_qubits - q1 - 1, pexp * pexp_s,
       exp * exp_s);
   Status s = OptionalInsertControls(op, num_qubits, &gate);
@@ -549,7 +622,7 @@ inline Status PhasedISwapGate(const Operation& op, const SymbolMap& param_map,
 
   // check for symbols and track metadata if needed.
   if (metadata != nullptr) {
-    GateMetaData info;
+    GateMetaDataT<fp_type> info;
     info.index = circuit->gates.size() - 1;
     info.gate_params = {pexp, pexp_s, exp, exp_s};
     if (phase_exponent_symbol.has_value()) {
@@ -565,27 +638,35 @@ inline Status PhasedISwapGate(const Operation& op, const SymbolMap& param_map,
   return Status::OK();
 }
 
-tensorflow::Status ParseAppendGate(const Operation& op,
-                                   const SymbolMap& param_map,
-                                   const unsigned int num_qubits,
-                                   const unsigned int time,
-                                   QsimCircuit* circuit,
-                                   std::vector<GateMetaData>* metadata,
-                                   bool* lookup_succeeded) {
+template <typename fp_type>
+tensorflow::Status ParseAppendGate(
+    const Operation& op, const SymbolMap& param_map,
+    const unsigned int num_qubits, const unsigned int time,
+    QsimCircuitT<fp_type>* circuit,
+    std::vector<GateMetaDataT<fp_type>>* metadata, bool* lookup_succeeded) {
   // map gate name -> callable to build that qsim gate from operation proto.
   static const absl::flat_hash_map<
       std::string,
       std::function<Status(const Operation&, const SymbolMap&,
-                           const unsigned int, const unsigned int, QsimCircuit*,
-                           std::vector<GateMetaData>*)>>
-      func_map = {{"I", &IGate},       {"HP", &HGate},
-                  {"XP", &XGate},      {"XXP", &XXGate},
-                  {"YP", &YGate},      {"YYP", &YYGate},
-                  {"ZP", &ZGate},      {"ZZP", &ZZGate},
-                  {"CZP", &CZGate},    {"I2", &I2Gate},
-                  {"CNP", &CXGate},    {"SP", &SwapGate},
-                  {"ISP", &ISwapGate}, {"PXP", &PhasedXGate},
-                  {"FSIM", &FsimGate}, {"PISP", &PhasedISwapGate}};
+                           const unsigned int, const unsigned int,
+                           QsimCircuitT<fp_type>*,
+                           std::vector<GateMetaDataT<fp_type>>*)>>
+      func_map = {{"I", &IGate<fp_type>},
+                  {"HP", &HGate<fp_type>},
+                  {"XP", &XGate<fp_type>},
+                  {"XXP", &XXGate<fp_type>},
+                  {"YP", &YGate<fp_type>},
+                  {"YYP", &YYGate<fp_type>},
+                  {"ZP", &ZGate<fp_type>},
+                  {"ZZP", &ZZGate<fp_type>},
+                  {"CZP", &CZGate<fp_type>},
+                  {"I2", &I2Gate<fp_type>},
+                  {"CNP", &CXGate<fp_type>},
+                  {"SP", &SwapGate<fp_type>},
+                  {"ISP", &ISwapGate<fp_type>},
+                  {"PXP", &PhasedXGate<fp_type>},
+                  {"FSIM", &FsimGate<fp_type>},
+                  {"PISP", &PhasedISwapGate<fp_type>}};
 
   auto build_f = func_map.find(op.gate().id());
   if (build_f == func_map.end()) {
@@ -802,8 +883,8 @@ tensorflow::Status NoisyQsimCircuitFromProgram(const Program& program,
     for (const Operation& op : moment.operations()) {
       placeholder.gates.clear();
       gate_found = false;
-      Status status = ParseAppendGate(op, param_map, num_qubits, time,
-                                      &placeholder, nullptr, &gate_found);
+      Status status = ParseAppendGate<float>(
+          op, param_map, num_qubits, time, &placeholder, nullptr, &gate_found);
       if (gate_found && !status.ok()) {
         // gate found, failed when parsing proto.
         return status;
@@ -837,10 +918,119 @@ tensorflow::Status NoisyQsimCircuitFromProgram(const Program& program,
   return Status::OK();
 }
 
+const GateFusionOptions& GetGateFusionOptions() {
+  static const GateFusionOptions* options = [] {
+    GateFusionOptions* parsed = new GateFusionOptions();
+    std::string fuser;
+    Status status =
+        tensorflow::ReadStringFromEnvVar("TFQ_GATE_FUSER", "auto", &fuser);
+    if (status.ok() && fuser == "basic") {
+      parsed->fuser = GateFusionOptions::kBasic;
+    } else if (status.ok() && fuser == "multi") {
+      parsed->fuser = GateFusionOptions::kMultiQubit;
+    } else if (!status.ok() || fuser != "auto") {
+      LOG(WARNING) << "Ignoring unknown TFQ_GATE_FUSER \"" << fuser << "\".";
+    }
+    tensorflow::int64 max_fused_qubits;
+    status = tensorflow::ReadInt64FromEnvVar("TFQ_MAX_FUSED_QUBITS", 0,
+                                             &max_fused_qubits);
+    if (status.ok() && max_fused_qubits >= 2 &&
+        max_fused_qubits <= kMaxFusedQubits) {
+      parsed->max_fused_qubits = max_fused_qubits;
+    } else if (!status.ok() || max_fused_qubits != 0) {
+      LOG(WARNING) << "Ignoring TFQ_MAX_FUSED_QUBITS outside of [2, "
+                   << kMaxFusedQubits << "].";
+    }
+    return parsed;
+  }();
+  return *options;
+}
+
+template <typename fp_type>
+unsigned ChooseMaxFusedQubits(const int num_qubits,
+                              const std::vector<QsimGateT<fp_type>>& gates,
+                              const unsigned simd_lanes) {
+  // Small states stay in cache, where a pass is cheap and bigger matrices
+  // only add arithmetic.
+  if (num_qubits < kMinQubitsForWideFusion) {
+    return 2;
+  }
+  unsigned size = 2;
+  while (size < 5 && (1u << size) <= simd_lanes) {
+    size++;
+  }
+  // A block of k qubits only saves passes when there are enough gates to
+  // fill it, on average about 2k gate operands per qubit of the circuit.
+  uint64_t operands = 0;
+  for (const QsimGateT<fp_type>& gate : gates) {
+    operands += gate.qubits.size() + gate.controlled_by.size();
+  }
+  while (size > 2 && operands < uint64_t(2) * size * num_qubits) {
+    size--;
+  }
+  return std::min<unsigned>(size, std::max(num_qubits, 2));
+}
+
+template <typename fp_type>
+void FuseQsimCircuit(const GateFusionOptions& options,
+                     const QsimCircuitT<fp_type>& circuit,
+                     QsimFusedCircuitT<fp_type>* fused_circuit) {
+  GateFusionOptions::Fuser fuser = options.fuser;
+  unsigned max_fused_qubits = options.max_fused_qubits;
+  if (max_fused_qubits == 0 && fuser != GateFusionOptions::kBasic) {
+    // Double precision always runs on qsim::SimulatorBasic.
+    const unsigned simd_lanes = std::is_same<fp_type, float>::value
+                                    ? SimdLanes(BuildSimdBackend())
+                                    : 1;
+    max_fused_qubits =
+        ChooseMaxFusedQubits(circuit.num_qubits, circuit.gates, simd_lanes);
+  }
+  if (fuser == GateFusionOptions::kAuto) {
+    fuser = max_fused_qubits > 2 ? GateFusionOptions::kMultiQubit
+                                 : GateFusionOptions::kBasic;
+  }
+
+  if (fuser == GateFusionOptions::kMultiQubit) {
+    typedef qsim::MultiQubitGateFuser<qsim::IO, QsimGateT<fp_type>> Fuser;
+    typename Fuser::Parameter param;
+    param.max_fused_size = max_fused_qubits;
+    *fused_circuit = Fuser::FuseGates(param, circuit.num_qubits, circuit.gates);
+    return;
+  }
+  typedef qsim::BasicGateFuser<qsim::IO, QsimGateT<fp_type>> Fuser;
+  *fused_circuit = Fuser().FuseGates(typename Fuser::Parameter(),
+                                     circuit.num_qubits, circuit.gates);
+}
+
+void SplitNoisyCircuitPrefix(NoisyQsimCircuit* ncircuit, QsimCircuit* prefix,
+                             QsimFusedCircuitT<float>* fused_prefix) {
+  prefix->num_qubits = ncircuit->num_qubits;
+  prefix->gates.clear();
+  fused_prefix->clear();
+
+  size_t length = 0;
+  for (; length < ncircuit->channels.size(); length++) {
+    const qsim::Channel<QsimGate>& channel = ncircuit->channels[length];
+    if (channel.size() != 1 || !channel[0].unitary ||
+        channel[0].kind == qsim::KrausOperator<QsimGate>::kMeasurement) {
+      break;
+    }
+    prefix->gates.insert(prefix->gates.end(), channel[0].ops.begin(),
+                         channel[0].ops.end());
+  }
+  ncircuit->channels.erase(ncircuit->channels.begin(),
+                           ncircuit->channels.begin() + length);
+
+  if (!prefix->gates.empty()) {
+    FuseQsimCircuit(GetGateFusionOptions(), *prefix, fused_prefix);
+  }
+}
+
+template <typename fp_type>
 tensorflow::Status QsimCircuitFromProgram(
     const Program& program, const SymbolMap& param_map, const int num_qubits,
-    QsimCircuit* circuit, std::vector<qsim::GateFused<QsimGate>>* fused_circuit,
-    std::vector<GateMetaData>* metadata /*=nullptr*/) {
+    QsimCircuitT<fp_type>* circuit, QsimFusedCircuitT<fp_type>* fused_circuit,
+    std::vector<GateMetaDataT<fp_type>>* metadata /*=nullptr*/) {
   // Convert proto to qsim internal representation.
   circuit->num_qubits = num_qubits;
   int time = 0;
@@ -856,8 +1046,8 @@ tensorflow::Status QsimCircuitFromProgram(
   }
   for (const Moment& moment : program.circuit().moments()) {
     for (const Operation& op : moment.operations()) {
-      Status status = ParseAppendGate(op, param_map, num_qubits, time, circuit,
-                                      metadata, &unused);
+      Status status = ParseAppendGate<fp_type>(op, param_map, num_qubits, time,
+                                               circuit, metadata, &unused);
       if (!status.ok()) {
         return status;
       }
@@ -866,15 +1056,178 @@ tensorflow::Status QsimCircuitFromProgram(
   }
 
   // Build fused circuit.
-  *fused_circuit = qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
-      qsim::BasicGateFuser<qsim::IO, QsimGate>::Parameter(),
-      circuit->num_qubits, circuit->gates);
+  FuseQsimCircuit(GetGateFusionOptions(), *circuit, fused_circuit);
+  return Status::OK();
+}
+
+template <typename fp_type>
+Status BuildQsimCircuitTemplate(
+    const Program& program, const SymbolMap& param_map, const int num_qubits,
+    QsimCircuitTemplateT<fp_type>* circuit_template) {
+  circuit_template->circuit.gates.clear();
+  circuit_template->fused_circuit.clear();
+  circuit_template->metadata.clear();
+  circuit_template->symbolic_gates.clear();
+  circuit_template->symbolic_ops.clear();
+  circuit_template->symbolic_times.clear();
+  circuit_template->symbolic_blocks.clear();
+
+  Status status = QsimCircuitFromProgram(
+      program, param_map, num_qubits, &circuit_template->circuit,
+      &circuit_template->fused_circuit, &circuit_template->metadata);
+  if (!status.ok() || num_qubits <= 0) {
+    return status;
+  }
+
+  // Every operation appends exactly one gate, so the position of an
+  // operation in the program is the index of its gate.
+  int index = 0;
+  unsigned int time = 0;
+  for (const Moment& moment : program.circuit().moments()) {
+    for (const Operation& op : moment.operations()) {
+      for (const auto& arg : op.args()) {
+        if (!arg.second.symbol().empty()) {
+          circuit_template->symbolic_gates.push_back(index);
+          circuit_template->symbolic_ops.push_back(op);
+          circuit_template->symbolic_times.push_back(time);
+          break;
+        }
+      }
+      index++;
+    }
+    time++;
+  }
+
+  std::vector<bool> is_symbolic(circuit_template->circuit.gates.size(), false);
+  for (const int gate_index : circuit_template->symbolic_gates) {
+    is_symbolic[gate_index] = true;
+  }
+  const QsimGateT<fp_type>* base = circuit_template->circuit.gates.data();
+  const QsimGateT<fp_type>* end = base + circuit_template->circuit.gates.size();
+  for (size_t i = 0; i < circuit_template->fused_circuit.size(); i++) {
+    for (const QsimGateT<fp_type>* gate :
+         circuit_template->fused_circuit[i].gates) {
+      if (gate >= base && gate < end && is_symbolic[gate - base]) {
+        circuit_template->symbolic_blocks.push_back(i);
+        break;
+      }
+    }
+  }
   return Status::OK();
 }
 
+namespace {
+
+// BindQsimCircuitTemplate, additionally adding shift->shift to the exponent
+// of gate shift->gate if shift is not null.
+template <typename fp_type>
+Status BindTemplate(const QsimCircuitTemplateT<fp_type>& circuit_template,
+                    const SymbolMap& param_map, const GateShift* shift,
+                    QsimCircuitT<fp_type>* circuit,
+                    QsimFusedCircuitT<fp_type>* fused_circuit,
+                    std::vector<GateMetaDataT<fp_type>>* metadata) {
+  *circuit = circuit_template.circuit;
+  if (metadata != nullptr) {
+    *metadata = circuit_template.metadata;
+  }
+
+  // Rebuild the symbolic gates in place.
+  QsimCircuitT<fp_type> placeholder;
+  placeholder.gates.reserve(1);
+  std::vector<GateMetaDataT<fp_type>> gate_metadata;
+  bool unused;
+  Operation shifted_op;
+  bool shifted = false;
+  for (size_t i = 0; i < circuit_template.symbolic_gates.size(); i++) {
+    placeholder.gates.clear();
+    gate_metadata.clear();
+    const int index = circuit_template.symbolic_gates[i];
+    const Operation* op = &circuit_template.symbolic_ops[i];
+    if (shift != nullptr && shift->gate == index) {
+      // The shifted exponent becomes a constant of a copy of the op.
+      float exponent;
+      Status status = ParseProtoArg(*op, "exponent", param_map, &exponent);
+      if (!status.ok()) {
+        return status;
+      }
+      shifted_op = *op;
+      Arg& arg = (*shifted_op.mutable_args())["exponent"];
+      arg.Clear();
+      arg.mutable_arg_value()->set_float_value(exponent + shift->shift);
+      op = &shifted_op;
+      shifted = true;
+    }
+    Status status = ParseAppendGate<fp_type>(
+        *op, param_map, circuit->num_qubits,
+        circuit_template.symbolic_times[i], &placeholder,
+        metadata != nullptr ? &gate_metadata : nullptr, &unused);
+    if (!status.ok()) {
+      return status;
+    }
+    circuit->gates[index] = std::move(placeholder.gates[0]);
+    if (metadata != nullptr) {
+      gate_metadata[0].index = index;
+      (*metadata)[index] = std::move(gate_metadata[0]);
+    }
+  }
+
+  if (shift != nullptr && !shifted) {
+    return Status(tensorflow::error::INVALID_ARGUMENT,
+                  absl::StrCat("Could not find symbolic gate to shift: ",
+                               shift->gate));
+  }
+
+  // Copy the fusion plan and point it at the new gates.
+  *fused_circuit = circuit_template.fused_circuit;
+  const QsimGateT<fp_type>* old_base = circuit_template.circuit.gates.data();
+  const QsimGateT<fp_type>* old_end =
+      old_base + circuit_template.circuit.gates.size();
+  const QsimGateT<fp_type>* new_base = circuit->gates.data();
+  auto rebase = [old_base, old_end, new_base](const QsimGateT<fp_type>* gate) {
+    return (gate >= old_base && gate < old_end) ? new_base + (gate - old_base)
+                                                : gate;
+  };
+  for (auto& fused_gate : *fused_circuit) {
+    fused_gate.parent = rebase(fused_gate.parent);
+    for (auto& gate : fused_gate.gates) {
+      gate = rebase(gate);
+    }
+  }
+
+  // Only blocks containing symbolic gates have a different matrix.
+  for (const int block : circuit_template.symbolic_blocks) {
+    qsim::CalculateFusedMatrix((*fused_circuit)[block]);
+  }
+  return Status::OK();
+}
+
+}  // namespace
+
+template <typename fp_type>
+Status BindQsimCircuitTemplate(
+    const QsimCircuitTemplateT<fp_type>& circuit_template,
+    const SymbolMap& param_map,
+    QsimCircuitT<fp_type>* circuit, QsimFusedCircuitT<fp_type>* fused_circuit,
+    std::vector<GateMetaDataT<fp_type>>* metadata /*=nullptr*/) {
+  return BindTemplate(circuit_template, param_map, nullptr, circuit,
+                      fused_circuit, metadata);
+}
+
+template <typename fp_type>
+Status BindShiftedQsimCircuitTemplate(
+    const QsimCircuitTemplateT<fp_type>& circuit_template,
+    const SymbolMap& param_map, const GateShift& shift,
+    QsimCircuitT<fp_type>* circuit,
+    QsimFusedCircuitT<fp_type>* fused_circuit) {
+  return BindTemplate<fp_type>(circuit_template, param_map,
+                               shift.gate < 0 ? nullptr : &shift, circuit,
+                               fused_circuit, nullptr);
+}
+
+template <typename fp_type>
 Status QsimCircuitFromPauliTerm(
-    const PauliTerm& term, const int num_qubits, QsimCircuit* circuit,
-    std::vector<qsim::GateFused<QsimGate>>* fused_circuit) {
+    const PauliTerm& term, const int num_qubits, QsimCircuitT<fp_type>* circuit,
+    QsimFusedCircuitT<fp_type>* fused_circuit) {
   Program measurement_program;
   SymbolMap empty_map;
   measurement_program.mutable_circuit()->set_scheduling_strategy(
@@ -906,9 +1259,10 @@ Status QsimCircuitFromPauliTerm(
                                 circuit, fused_circuit);
 }
 
+template <typename fp_type>
 Status QsimZBasisCircuitFromPauliTerm(
-    const PauliTerm& term, const int num_qubits, QsimCircuit* circuit,
-    std::vector<qsim::GateFused<QsimGate>>* fused_circuit) {
+    const PauliTerm& term, const int num_qubits, QsimCircuitT<fp_type>* circuit,
+    QsimFusedCircuitT<fp_type>* fused_circuit) {
   Program measurement_program;
   SymbolMap empty_map;
   measurement_program.mutable_circuit()->set_scheduling_strategy(
@@ -956,4 +1310,44 @@ Status QsimZBasisCircuitFromPauliTerm(
                                 circuit, fused_circuit);
 }
 
+// Single and double precision instantiations of the parsing functions.
+#define TFQ_INSTANTIATE_QSIM_PARSER(fp_type)                                 \
+  template unsigned ChooseMaxFusedQubits<fp_type>(                           \
+      const int num_qubits, const std::vector<QsimGateT<fp_type>>& gates,    \
+      const unsigned simd_lanes);                                            \
+  template void FuseQsimCircuit<fp_type>(                                    \
+      const GateFusionOptions& options, const QsimCircuitT<fp_type>& circuit, \
+      QsimFusedCircuitT<fp_type>* fused_circuit);                            \
+  template Status QsimCircuitFromProgram<fp_type>(                           \
+      const Program& program, const SymbolMap& param_map,                    \
+      const int num_qubits, QsimCircuitT<fp_type>* circuit,                  \
+      QsimFusedCircuitT<fp_type>* fused_circuit,                             \
+      std::vector<GateMetaDataT<fp_type>>* metadata);                        \
+  template Status BuildQsimCircuitTemplate<fp_type>(                         \
+      const Program& program, const SymbolMap& param_map,                    \
+      const int num_qubits, QsimCircuitTemplateT<fp_type>* circuit_template); \
+  template Status BindQsimCircuitTemplate<fp_type>(                          \
+      const QsimCircuitTemplateT<fp_type>& circuit_template,                 \
+      const SymbolMap& param_map, QsimCircuitT<fp_type>* circuit,            \
+      QsimFusedCircuitT<fp_type>* fused_circuit,                             \
+      std::vector<GateMetaDataT<fp_type>>* metadata);                        \
+  template Status BindShiftedQsimCircuitTemplate<fp_type>(                   \
+      const QsimCircuitTemplateT<fp_type>& circuit_template,                 \
+      const SymbolMap& param_map, const GateShift& shift,                    \
+      QsimCircuitT<fp_type>* circuit,                                        \
+      QsimFusedCircuitT<fp_type>* fused_circuit);                            \
+  template Status QsimCircuitFromPauliTerm<fp_type>(                         \
+      const PauliTerm& term, const int num_qubits,                           \
+      QsimCircuitT<fp_type>* circuit,                                        \
+      QsimFusedCircuitT<fp_type>* fused_circuit);                            \
+  template Status QsimZBasisCircuitFromPauliTerm<fp_type>(                   \
+      const PauliTerm& term, const int num_qubits,                           \
+      QsimCircuitT<fp_type>* circuit,                                        \
+      QsimFusedCircuitT<fp_type>* fused_circuit);
+
+TFQ_INSTANTIATE_QSIM_PARSER(float)
+TFQ_INSTANTIATE_QSIM_PARSER(double)
+
+#undef TFQ_INSTANTIATE_QSIM_PARSER
+
 }  // namespace tfq
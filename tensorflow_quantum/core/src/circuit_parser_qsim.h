@@ -16,6 +16,7 @@ limitations under the License.
 #ifndef TFQ_CORE_SRC_CIRCUIT_PARSER_QSIM_H_
 #define TFQ_CORE_SRC_CIRCUIT_PARSER_QSIM_H_
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -32,12 +33,25 @@ namespace tfq {
 
 enum GateParamNames { kExponent = 0, kPhaseExponent, kTheta, kPhi };
 
-struct GateMetaData {
+// Every parsing function below is available for gates of single
+// (fp_type = float) and double (fp_type = double) precision. Gate
+// parameters are parsed as floats either way, only the gate matrices and
+// everything computed from them use fp_type.
+
+template <typename fp_type>
+struct GateMetaDataT {
   // Struct for additional metadata about a specific gate.
   // Any new parsing features should add needed information
   // to this struct and then proceed to process the data
   // outside of the parsing code.
 
+  typedef std::function<qsim::Cirq::GateCirq<fp_type>(
+      unsigned int, unsigned int, fp_type, fp_type)>
+      SingleEigenCreateF;
+  typedef std::function<qsim::Cirq::GateCirq<fp_type>(
+      unsigned int, unsigned int, unsigned int, fp_type, fp_type)>
+      TwoEigenCreateF;
+
   // symbol name strings found in gate placeholders (if any).
   std::vector<std::string> symbol_values;
 
@@ -54,25 +68,137 @@ struct GateMetaData {
   std::vector<float> gate_params;
 
   // set only if gate is Single qubit Eigen gate.
-  std::function<qsim::Cirq::GateCirq<float>(unsigned int, unsigned int, float,
-                                            float)>
-      create_f1;
+  SingleEigenCreateF create_f1;
 
   // set only if gate is Two qubit Eigen gate.
-  std::function<qsim::Cirq::GateCirq<float>(unsigned int, unsigned int,
-                                            unsigned int, float, float)>
-      create_f2;
+  TwoEigenCreateF create_f2;
+};
+
+typedef GateMetaDataT<float> GateMetaData;
+
+// How the gates of a circuit are fused into the blocks that the simulators
+// apply.
+struct GateFusionOptions {
+  enum Fuser {
+    // Picks the fuser and block size with ChooseMaxFusedQubits.
+    kAuto,
+    // qsim::BasicGateFuser, blocks of at most two qubits.
+    kBasic,
+    // qsim::MultiQubitGateFuser with blocks of up to max_fused_qubits.
+    kMultiQubit,
+  };
+  Fuser fuser = kAuto;
+  // Largest fused block for kMultiQubit and kAuto, between 2 and 6. 0 lets
+  // ChooseMaxFusedQubits decide.
+  unsigned max_fused_qubits = 0;
 };
 
+// The GateFusionOptions of this process. They are read once from the
+// environment variables TFQ_GATE_FUSER ("auto", "basic" or "multi") and
+// TFQ_MAX_FUSED_QUBITS.
+const GateFusionOptions& GetGateFusionOptions();
+
+// Cost model for the largest fused block worth building for a circuit of
+// the given gates when the simulator processes simd_lanes floats at once.
+// Wider blocks trade more arithmetic per amplitude for fewer passes over
+// the state, which pays off once the state no longer fits in cache, the
+// vector units can absorb the larger matrices and the circuit is deep
+// enough to fill the blocks. Returns a value between 2 and 5.
+template <typename fp_type>
+unsigned ChooseMaxFusedQubits(
+    const int num_qubits,
+    const std::vector<qsim::Cirq::GateCirq<fp_type>>& gates,
+    const unsigned simd_lanes);
+
+// Fuses the gates of circuit as configured by options. Every fused circuit
+// built by this file goes through here.
+template <typename fp_type>
+void FuseQsimCircuit(
+    const GateFusionOptions& options,
+    const qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>& circuit,
+    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>*
+        fused_circuit);
+
 // parse a serialized Cirq program into a qsim representation.
 // ingests a Cirq Circuit proto and produces a resolved qsim Circuit,
 // as well as a fused circuit.
+template <typename fp_type>
 tensorflow::Status QsimCircuitFromProgram(
     const tfq::proto::Program& program,
     const absl::flat_hash_map<std::string, std::pair<int, float>>& param_map,
-    const int num_qubits, qsim::Circuit<qsim::Cirq::GateCirq<float>>* circuit,
-    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<float>>>* fused_circuit,
-    std::vector<GateMetaData>* metdata = nullptr);
+    const int num_qubits,
+    qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>* circuit,
+    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>* fused_circuit,
+    std::vector<GateMetaDataT<fp_type>>* metdata = nullptr);
+
+// A qsim circuit, fused circuit and gate metadata compiled once from a
+// program, together with what is needed to re-bind its symbolic gates to new
+// symbol values without re-parsing the program or re-running the fuser.
+template <typename fp_type>
+struct QsimCircuitTemplateT {
+  // circuit resolved against the symbol values it was built with.
+  qsim::Circuit<qsim::Cirq::GateCirq<fp_type>> circuit;
+
+  // fusion plan of circuit. Gate pointers refer to circuit.gates.
+  std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>> fused_circuit;
+
+  // metadata for every gate in circuit.
+  std::vector<GateMetaDataT<fp_type>> metadata;
+
+  // indices into circuit.gates of gates with at least one symbol, along
+  // with the operation each one was parsed from and its moment index.
+  std::vector<int> symbolic_gates;
+  std::vector<tfq::proto::Operation> symbolic_ops;
+  std::vector<unsigned int> symbolic_times;
+
+  // indices into fused_circuit of blocks that contain a symbolic gate.
+  std::vector<int> symbolic_blocks;
+};
+
+typedef QsimCircuitTemplateT<float> QsimCircuitTemplate;
+
+// compiles a program into a QsimCircuitTemplate. param_map must contain all
+// of the symbols used by program, the values are only used to validate the
+// program and are replaced by BindQsimCircuitTemplate.
+template <typename fp_type>
+tensorflow::Status BuildQsimCircuitTemplate(
+    const tfq::proto::Program& program,
+    const absl::flat_hash_map<std::string, std::pair<int, float>>& param_map,
+    const int num_qubits, QsimCircuitTemplateT<fp_type>* circuit_template);
+
+// produces the same circuit, fused circuit and (optionally) metadata as
+// QsimCircuitFromProgram would for the template's program under param_map.
+// Only the symbolic gates are rebuilt and only the fused blocks that contain
+// them have their matrices recomputed. The outputs are overwritten, existing
+// capacity is reused.
+template <typename fp_type>
+tensorflow::Status BindQsimCircuitTemplate(
+    const QsimCircuitTemplateT<fp_type>& circuit_template,
+    const absl::flat_hash_map<std::string, std::pair<int, float>>& param_map,
+    qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>* circuit,
+    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>* fused_circuit,
+    std::vector<GateMetaDataT<fp_type>>* metadata = nullptr);
+
+// A shift of the symbol value in the exponent of one gate, as used by the
+// parameter shift rule. gate is an index into circuit.gates of a template,
+// a negative gate shifts nothing.
+struct GateShift {
+  int gate;
+  float shift;
+};
+
+// BindQsimCircuitTemplate for the template's program with the exponent of
+// gate shift.gate resolved to its value under param_map plus shift.shift.
+// This is the circuit the program would give if that one occurrence of the
+// symbol were replaced by a new symbol with the shifted value. shift.gate
+// must be one of the template's symbolic gates.
+template <typename fp_type>
+tensorflow::Status BindShiftedQsimCircuitTemplate(
+    const QsimCircuitTemplateT<fp_type>& circuit_template,
+    const absl::flat_hash_map<std::string, std::pair<int, float>>& param_map,
+    const GateShift& shift,
+    qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>* circuit,
+    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>* fused_circuit);
 
 // parse a serialized Cirq program into a qsim representation.
 // ingests a Cirq Circuit proto and produces a resolved Noisy qsim Circuit.
@@ -86,20 +212,32 @@ tensorflow::Status NoisyQsimCircuitFromProgram(
     const int num_qubits, const bool add_tmeasures,
     qsim::NoisyCircuit<qsim::Cirq::GateCirq<float>>* ncircuit);
 
+// Moves the leading channels of ncircuit that act the same way in every
+// trajectory, those made of a single unitary Kraus operator, into prefix as
+// plain gates and fuses them into fused_prefix. A trajectory of the original
+// circuit is fused_prefix applied to |0> followed by a trajectory of what
+// remains in ncircuit. fused_prefix points into prefix.
+void SplitNoisyCircuitPrefix(
+    qsim::NoisyCircuit<qsim::Cirq::GateCirq<float>>* ncircuit,
+    qsim::Circuit<qsim::Cirq::GateCirq<float>>* prefix,
+    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<float>>>* fused_prefix);
+
 // parse a serialized pauliTerm from a larger cirq.Paulisum proto
 // into a qsim Circuit and fused circuit.
+template <typename fp_type>
 tensorflow::Status QsimCircuitFromPauliTerm(
     const tfq::proto::PauliTerm& term, const int num_qubits,
-    qsim::Circuit<qsim::Cirq::GateCirq<float>>* circuit,
-    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<float>>>* fused_circuit);
+    qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>* circuit,
+    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>* fused_circuit);
 
 // parse a serialized pauliTerm from a larger cirq.Paulisum proto
 // into a qsim Circuit and fused circuit that represents the transformation
 // to the z basis.
+template <typename fp_type>
 tensorflow::Status QsimZBasisCircuitFromPauliTerm(
     const tfq::proto::PauliTerm& term, const int num_qubits,
-    qsim::Circuit<qsim::Cirq::GateCirq<float>>* circuit,
-    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<float>>>* fused_circuit);
+    qsim::Circuit<qsim::Cirq::GateCirq<fp_type>>* circuit,
+    std::vector<qsim::GateFused<qsim::Cirq::GateCirq<fp_type>>>* fused_circuit);
 
 }  // namespace tfq
 
@@ -16,6 +16,7 @@ limitations under the License.
 #include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
 
 #include <string>
+#include <vector>
 
 #include "../qsim/lib/channel.h"
 #include "../qsim/lib/channels_cirq.h"
@@ -1706,5 +1707,362 @@ TEST(QsimCircuitParserTest, ZBasisCircuitFromPauliTermEmpty) {
   ASSERT_EQ(test_circuit.gates.size(), 0);
 }
 
+void AddEigenOp(Moment* moment, const std::string& name, const Arg& exponent,
+                const std::vector<std::string>& qubits) {
+  Operation* operations_proto = moment->add_operations();
+  operations_proto->mutable_gate()->set_id(name);
+  google::protobuf::Map<std::string, Arg>* args_proto =
+      operations_proto->mutable_args();
+  (*args_proto)["global_shift"] = MakeArg(0.0);
+  (*args_proto)["exponent"] = exponent;
+  (*args_proto)["exponent_scalar"] = MakeArg(1.0);
+  (*args_proto)["control_qubits"] = MakeControlArg("");
+  (*args_proto)["control_values"] = MakeControlArg("");
+  for (const auto& qubit : qubits) {
+    operations_proto->add_qubits()->set_id(qubit);
+  }
+}
+
+Program MakeTemplateProgram() {
+  Program program_proto;
+  Circuit* circuit_proto = program_proto.mutable_circuit();
+  circuit_proto->set_scheduling_strategy(circuit_proto->MOMENT_BY_MOMENT);
+  Moment* moment = circuit_proto->add_moments();
+  AddEigenOp(moment, "HP", MakeArg(1.0), {"0"});
+  AddEigenOp(moment, "XP", MakeArg("alpha"), {"1"});
+  AddEigenOp(moment, "YP", MakeArg(0.25), {"2"});
+  moment = circuit_proto->add_moments();
+  AddEigenOp(moment, "CZP", MakeArg(1.0), {"0", "1"});
+  moment = circuit_proto->add_moments();
+  AddEigenOp(moment, "ZZP", MakeArg("beta"), {"1", "2"});
+  moment = circuit_proto->add_moments();
+  AddEigenOp(moment, "XP", MakeArg(0.5), {"0"});
+  AddEigenOp(moment, "YP", MakeArg("alpha"), {"2"});
+  return program_proto;
+}
+
+TEST(QsimCircuitParserTest, CircuitTemplateMatchesParser) {
+  Program program_proto = MakeTemplateProgram();
+  SymbolMap build_map = {{"alpha", std::pair<int, float>(0, 0.1)},
+                         {"beta", std::pair<int, float>(1, 0.2)}};
+  SymbolMap bind_map = {{"alpha", std::pair<int, float>(0, -0.7)},
+                        {"beta", std::pair<int, float>(1, 1.3)}};
+
+  QsimCircuitTemplate circuit_template;
+  ASSERT_EQ(BuildQsimCircuitTemplate(program_proto, build_map, 3,
+                                     &circuit_template),
+            tensorflow::Status::OK());
+  EXPECT_EQ(circuit_template.symbolic_gates, std::vector<int>({1, 4, 6}));
+
+  QsimCircuit ref_circuit;
+  std::vector<qsim::GateFused<QsimGate>> ref_fused;
+  std::vector<GateMetaData> ref_metadata;
+  ASSERT_EQ(QsimCircuitFromProgram(program_proto, bind_map, 3, &ref_circuit,
+                                   &ref_fused, &ref_metadata),
+            tensorflow::Status::OK());
+
+  QsimCircuit test_circuit;
+  std::vector<qsim::GateFused<QsimGate>> test_fused;
+  std::vector<GateMetaData> test_metadata;
+  ASSERT_EQ(BindQsimCircuitTemplate(circuit_template, bind_map, &test_circuit,
+                                    &test_fused, &test_metadata),
+            tensorflow::Status::OK());
+
+  ASSERT_EQ(test_circuit.num_qubits, ref_circuit.num_qubits);
+  ASSERT_EQ(test_circuit.gates.size(), ref_circuit.gates.size());
+  for (size_t i = 0; i < ref_circuit.gates.size(); i++) {
+    EXPECT_EQ(test_circuit.gates[i].kind, ref_circuit.gates[i].kind);
+    EXPECT_EQ(test_circuit.gates[i].time, ref_circuit.gates[i].time);
+    EXPECT_EQ(test_circuit.gates[i].qubits, ref_circuit.gates[i].qubits);
+    ASSERT_EQ(test_circuit.gates[i].matrix.size(),
+              ref_circuit.gates[i].matrix.size());
+    for (size_t j = 0; j < ref_circuit.gates[i].matrix.size(); j++) {
+      EXPECT_NEAR(test_circuit.gates[i].matrix[j],
+                  ref_circuit.gates[i].matrix[j], 1e-5);
+    }
+  }
+
+  ASSERT_EQ(test_fused.size(), ref_fused.size());
+  for (size_t i = 0; i < ref_fused.size(); i++) {
+    EXPECT_EQ(test_fused[i].qubits, ref_fused[i].qubits);
+    ASSERT_EQ(test_fused[i].gates.size(), ref_fused[i].gates.size());
+    for (size_t j = 0; j < ref_fused[i].gates.size(); j++) {
+      // Fused gates must point into the bound circuit, not the template.
+      EXPECT_EQ(test_fused[i].gates[j] - test_circuit.gates.data(),
+                ref_fused[i].gates[j] - ref_circuit.gates.data());
+    }
+    ASSERT_EQ(test_fused[i].matrix.size(), ref_fused[i].matrix.size());
+    for (size_t j = 0; j < ref_fused[i].matrix.size(); j++) {
+      EXPECT_NEAR(test_fused[i].matrix[j], ref_fused[i].matrix[j], 1e-5);
+    }
+  }
+
+  ASSERT_EQ(test_metadata.size(), ref_metadata.size());
+  for (size_t i = 0; i < ref_metadata.size(); i++) {
+    EXPECT_EQ(test_metadata[i].index, ref_metadata[i].index);
+    EXPECT_EQ(test_metadata[i].symbol_values, ref_metadata[i].symbol_values);
+    EXPECT_EQ(test_metadata[i].placeholder_names,
+              ref_metadata[i].placeholder_names);
+    ASSERT_EQ(test_metadata[i].gate_params.size(),
+              ref_metadata[i].gate_params.size());
+    for (size_t j = 0; j < ref_metadata[i].gate_params.size(); j++) {
+      EXPECT_NEAR(test_metadata[i].gate_params[j],
+                  ref_metadata[i].gate_params[j], 1e-5);
+    }
+  }
+}
+
+TEST(QsimCircuitParserTest, CircuitTemplateMissingSymbol) {
+  Program program_proto = MakeTemplateProgram();
+  SymbolMap build_map = {{"alpha", std::pair<int, float>(0, 0.1)},
+                         {"beta", std::pair<int, float>(1, 0.2)}};
+  SymbolMap bind_map = {{"alpha", std::pair<int, float>(0, 0.1)}};
+
+  QsimCircuitTemplate circuit_template;
+  ASSERT_EQ(
+      BuildQsimCircuitTemplate(program_proto, bind_map, 3, &circuit_template),
+      tensorflow::Status(tensorflow::error::INVALID_ARGUMENT,
+                         "Could not find symbol in parameter map: beta"));
+
+  ASSERT_EQ(
+      BuildQsimCircuitTemplate(program_proto, build_map, 3, &circuit_template),
+      tensorflow::Status::OK());
+  QsimCircuit test_circuit;
+  std::vector<qsim::GateFused<QsimGate>> test_fused;
+  ASSERT_EQ(
+      BindQsimCircuitTemplate(circuit_template, bind_map, &test_circuit,
+                              &test_fused),
+      tensorflow::Status(tensorflow::error::INVALID_ARGUMENT,
+                         "Could not find symbol in parameter map: beta"));
+}
+
+TEST(QsimCircuitParserTest, CircuitTemplateShifted) {
+  Program program_proto = MakeTemplateProgram();
+  SymbolMap bind_map = {{"alpha", std::pair<int, float>(0, -0.7)},
+                        {"beta", std::pair<int, float>(1, 1.3)}};
+
+  QsimCircuitTemplate circuit_template;
+  ASSERT_EQ(BuildQsimCircuitTemplate(program_proto, bind_map, 3,
+                                     &circuit_template),
+            tensorflow::Status::OK());
+
+  // Shifting the second occurrence of alpha is the same as replacing it by
+  // a new symbol with the shifted value.
+  Program replaced_proto = MakeTemplateProgram();
+  (*replaced_proto.mutable_circuit()
+        ->mutable_moments(3)
+        ->mutable_operations(1)
+        ->mutable_args())["exponent"] = MakeArg("shifted");
+  SymbolMap replaced_map = bind_map;
+  replaced_map["shifted"] = std::pair<int, float>(2, -0.7 + 0.5);
+
+  QsimCircuit ref_circuit;
+  std::vector<qsim::GateFused<QsimGate>> ref_fused;
+  ASSERT_EQ(QsimCircuitFromProgram(replaced_proto, replaced_map, 3,
+                                   &ref_circuit, &ref_fused),
+            tensorflow::Status::OK());
+
+  QsimCircuit test_circuit;
+  std::vector<qsim::GateFused<QsimGate>> test_fused;
+  ASSERT_EQ(BindShiftedQsimCircuitTemplate(circuit_template, bind_map,
+                                           GateShift{6, 0.5}, &test_circuit,
+                                           &test_fused),
+            tensorflow::Status::OK());
+
+  ASSERT_EQ(test_circuit.gates.size(), ref_circuit.gates.size());
+  for (size_t i = 0; i < ref_circuit.gates.size(); i++) {
+    ASSERT_EQ(test_circuit.gates[i].matrix.size(),
+              ref_circuit.gates[i].matrix.size());
+    for (size_t j = 0; j < ref_circuit.gates[i].matrix.size(); j++) {
+      EXPECT_NEAR(test_circuit.gates[i].matrix[j],
+                  ref_circuit.gates[i].matrix[j], 1e-5);
+    }
+  }
+  ASSERT_EQ(test_fused.size(), ref_fused.size());
+  for (size_t i = 0; i < ref_fused.size(); i++) {
+    ASSERT_EQ(test_fused[i].matrix.size(), ref_fused[i].matrix.size());
+    for (size_t j = 0; j < ref_fused[i].matrix.size(); j++) {
+      EXPECT_NEAR(test_fused[i].matrix[j], ref_fused[i].matrix[j], 1e-5);
+    }
+  }
+
+  // Gate 2 has no symbol.
+  ASSERT_EQ(BindShiftedQsimCircuitTemplate(circuit_template, bind_map,
+                                           GateShift{2, 0.5}, &test_circuit,
+                                           &test_fused),
+            tensorflow::Status(tensorflow::error::INVALID_ARGUMENT,
+                               "Could not find symbolic gate to shift: 2"));
+}
+
+TEST(QsimCircuitParserTest, CircuitTemplateEmpty) {
+  Program program_proto;
+  Circuit* circuit_proto = program_proto.mutable_circuit();
+  circuit_proto->set_scheduling_strategy(circuit_proto->MOMENT_BY_MOMENT);
+  SymbolMap empty_map;
+
+  QsimCircuitTemplate circuit_template;
+  ASSERT_EQ(
+      BuildQsimCircuitTemplate(program_proto, empty_map, 2, &circuit_template),
+      tensorflow::Status::OK());
+  EXPECT_EQ(circuit_template.symbolic_gates.size(), 0);
+  EXPECT_EQ(circuit_template.symbolic_blocks.size(), 0);
+
+  QsimCircuit test_circuit;
+  std::vector<qsim::GateFused<QsimGate>> test_fused;
+  std::vector<GateMetaData> test_metadata;
+  ASSERT_EQ(BindQsimCircuitTemplate(circuit_template, empty_map, &test_circuit,
+                                    &test_fused, &test_metadata),
+            tensorflow::Status::OK());
+  ASSERT_EQ(test_circuit.num_qubits, 2);
+  ASSERT_EQ(test_circuit.gates.size(), 0);
+  ASSERT_EQ(test_fused.size(), 0);
+  ASSERT_EQ(test_metadata.size(), 0);
+}
+
+// Brickwork circuit of depth layers on num_qubits qubits.
+QsimCircuit BrickworkCircuit(const int num_qubits, const int layers) {
+  QsimCircuit circuit;
+  circuit.num_qubits = num_qubits;
+  unsigned time = 0;
+  for (int l = 0; l < layers; l++) {
+    for (int q = 0; q < num_qubits; q++) {
+      circuit.gates.push_back(
+          qsim::Cirq::XPowGate<float>::Create(time, q, 0.25, 0.0));
+    }
+    time++;
+    for (int q = l % 2; q + 1 < num_qubits; q += 2) {
+      circuit.gates.push_back(
+          qsim::Cirq::CZPowGate<float>::Create(time, q, q + 1, 0.5, 0.0));
+    }
+    time++;
+  }
+  return circuit;
+}
+
+TEST(QsimCircuitParserTest, ChooseMaxFusedQubits) {
+  // Small states always use two qubit blocks.
+  QsimCircuit small = BrickworkCircuit(8, 20);
+  EXPECT_EQ(ChooseMaxFusedQubits(8, small.gates, 16), 2);
+
+  // Deep circuits on large states scale with the vector width.
+  QsimCircuit deep = BrickworkCircuit(16, 20);
+  EXPECT_EQ(ChooseMaxFusedQubits(16, deep.gates, 1), 2);
+  EXPECT_EQ(ChooseMaxFusedQubits(16, deep.gates, 4), 3);
+  EXPECT_EQ(ChooseMaxFusedQubits(16, deep.gates, 8), 4);
+  EXPECT_EQ(ChooseMaxFusedQubits(16, deep.gates, 16), 5);
+
+  // Shallow circuits cannot fill wide blocks.
+  QsimCircuit shallow = BrickworkCircuit(16, 4);
+  EXPECT_EQ(ChooseMaxFusedQubits(16, shallow.gates, 16), 3);
+  EXPECT_EQ(ChooseMaxFusedQubits<float>(16, {}, 16), 2);
+}
+
+TEST(QsimCircuitParserTest, FuseQsimCircuitMultiQubit) {
+  QsimCircuit circuit = BrickworkCircuit(6, 6);
+  for (const unsigned max_fused_qubits : {2u, 3u, 4u}) {
+    GateFusionOptions options;
+    options.fuser = GateFusionOptions::kMultiQubit;
+    options.max_fused_qubits = max_fused_qubits;
+    std::vector<qsim::GateFused<QsimGate>> fused;
+    FuseQsimCircuit(options, circuit, &fused);
+
+    size_t num_gates = 0;
+    for (const auto& block : fused) {
+      EXPECT_LE(block.qubits.size(), max_fused_qubits);
+      num_gates += block.gates.size();
+    }
+    // Every gate lands in exactly one block.
+    EXPECT_EQ(num_gates, circuit.gates.size());
+  }
+
+  GateFusionOptions basic;
+  basic.fuser = GateFusionOptions::kBasic;
+  std::vector<qsim::GateFused<QsimGate>> fused;
+  FuseQsimCircuit(basic, circuit, &fused);
+  for (const auto& block : fused) {
+    EXPECT_LE(block.qubits.size(), 2);
+  }
+}
+
+TEST(QsimCircuitParserTest, DoublePrecision) {
+  Program program_proto;
+  Circuit* circuit_proto = program_proto.mutable_circuit();
+  circuit_proto->set_scheduling_strategy(circuit_proto->MOMENT_BY_MOMENT);
+  Moment* moments_proto = circuit_proto->add_moments();
+  Operation* operations_proto = moments_proto->add_operations();
+  operations_proto->mutable_gate()->set_id("XP");
+  google::protobuf::Map<std::string, Arg>* args_proto =
+      operations_proto->mutable_args();
+  (*args_proto)["global_shift"] = MakeArg(0.2);
+  (*args_proto)["exponent"] = MakeArg("alpha");
+  (*args_proto)["exponent_scalar"] = MakeArg(0.5);
+  (*args_proto)["control_qubits"] = MakeControlArg("");
+  (*args_proto)["control_values"] = MakeControlArg("");
+  operations_proto->add_qubits()->set_id("0");
+
+  SymbolMap symbol_map = {{"alpha", std::pair<int, float>(0, 0.3)}};
+  QsimCircuit float_circuit;
+  std::vector<qsim::GateFused<QsimGate>> float_fused;
+  ASSERT_EQ(QsimCircuitFromProgram(program_proto, symbol_map, 1,
+                                   &float_circuit, &float_fused),
+            tensorflow::Status::OK());
+
+  qsim::Circuit<qsim::Cirq::GateCirq<double>> double_circuit;
+  std::vector<qsim::GateFused<qsim::Cirq::GateCirq<double>>> double_fused;
+  std::vector<GateMetaDataT<double>> metadata;
+  ASSERT_EQ(QsimCircuitFromProgram(program_proto, symbol_map, 1,
+                                   &double_circuit, &double_fused, &metadata),
+            tensorflow::Status::OK());
+  ASSERT_EQ(double_circuit.gates.size(), 1);
+  ASSERT_EQ(double_fused.size(), float_fused.size());
+  for (int i = 0; i < 8; i++) {
+    EXPECT_NEAR(double_circuit.gates[0].matrix[i],
+                float_circuit.gates[0].matrix[i], 1e-6);
+  }
+
+  // Gradient gates built from the metadata keep the precision.
+  auto ref_gate = qsim::Cirq::XPowGate<double>::Create(0, 0, 0.15, 0.2);
+  auto grad_gate = metadata[0].create_f1(0, 0, 0.15, 0.2);
+  for (int i = 0; i < 8; i++) {
+    EXPECT_EQ(grad_gate.matrix[i], ref_gate.matrix[i]);
+  }
+}
+
+TEST(QsimCircuitParserTest, SplitNoisyCircuitPrefix) {
+  NoisyQsimCircuit ncircuit;
+  ncircuit.num_qubits = 2;
+  ncircuit.channels.push_back(qsim::MakeChannelFromGate(
+      0, qsim::Cirq::XPowGate<float>::Create(0, 0, 0.5, 0.0)));
+  ncircuit.channels.push_back(qsim::MakeChannelFromGate(
+      1, qsim::Cirq::CXPowGate<float>::Create(1, 0, 1, 1.0, 0.0)));
+  ncircuit.channels.push_back(
+      qsim::Cirq::DepolarizingChannel<float>::Create(2, 1, 0.1));
+  ncircuit.channels.push_back(qsim::MakeChannelFromGate(
+      3, qsim::Cirq::HGate<float>::Create(3, 0)));
+
+  QsimCircuit prefix;
+  std::vector<qsim::GateFused<QsimGate>> fused_prefix;
+  SplitNoisyCircuitPrefix(&ncircuit, &prefix, &fused_prefix);
+  EXPECT_EQ(prefix.num_qubits, 2);
+  ASSERT_EQ(prefix.gates.size(), 2);
+  EXPECT_EQ(prefix.gates[0].time, 0);
+  EXPECT_EQ(prefix.gates[1].time, 1);
+  EXPECT_EQ(prefix.gates[1].qubits.size(), 2);
+  EXPECT_FALSE(fused_prefix.empty());
+  // Gates after the first noisy channel stay in the circuit.
+  ASSERT_EQ(ncircuit.channels.size(), 2);
+  EXPECT_EQ(ncircuit.channels[0].size(), 4);
+  EXPECT_EQ(ncircuit.channels[1][0].ops[0].time, 3);
+
+  // Measurements are never part of the prefix.
+  NoisyQsimCircuit measured;
+  ASSERT_EQ(NoisyQsimCircuitFromProgram(Program(), {}, 1, true, &measured),
+            tensorflow::Status::OK());
+  SplitNoisyCircuitPrefix(&measured, &prefix, &fused_prefix);
+  EXPECT_TRUE(prefix.gates.empty());
+  EXPECT_TRUE(fused_prefix.empty());
+  EXPECT_EQ(measured.channels.size(), 1);
+}
+
 }  // namespace
 }  // namespace tfq
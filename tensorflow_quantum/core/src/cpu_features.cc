@@ -0,0 +1,176 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/cpu_features.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <initializer_list>
+#include <string>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define TFQ_X86_CPUID 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define TFQ_X86_CPUID 1
+#endif
+
+namespace tfq {
+
+namespace {
+
+#ifdef TFQ_X86_CPUID
+
+// Registers eax, ebx, ecx and edx of CPUID leaf (and subleaf).
+void Cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+#if defined(_MSC_VER)
+  int out[4];
+  __cpuidex(out, leaf, subleaf);
+  for (int i = 0; i < 4; i++) {
+    regs[i] = static_cast<uint32_t>(out[i]);
+  }
+#else
+  __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state the operating system saves on context switches. Only
+// valid when CPUID reports OSXSAVE.
+uint64_t XGetBv() {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  uint32_t eax, edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+bool Bit(uint32_t reg, int bit) { return (reg >> bit) & 1; }
+
+#endif  // TFQ_X86_CPUID
+
+// Widest backend passed to RecordBuildSimdBackend, -1 if none.
+std::atomic<int> build_backend(-1);
+
+}  // namespace
+
+SimdBackend DetectSimdBackend() {
+#ifdef TFQ_X86_CPUID
+  uint32_t regs[4];
+  Cpuid(0, 0, regs);
+  const uint32_t max_leaf = regs[0];
+  if (max_leaf < 1) {
+    return kSimdBasic;
+  }
+  Cpuid(1, 0, regs);
+  const uint32_t ecx1 = regs[2];
+  if (!Bit(ecx1, 19)) {
+    return kSimdBasic;
+  }
+  // AVX registers also need the operating system to save the XMM and YMM
+  // state (XCR0 bits 1 and 2).
+  const bool avx = Bit(ecx1, 27) && Bit(ecx1, 28) && (XGetBv() & 0x6) == 0x6;
+  if (!avx || !Bit(ecx1, 12) || max_leaf < 7) {
+    return kSimdSSE4;
+  }
+  Cpuid(7, 0, regs);
+  const uint32_t ebx7 = regs[1];
+  if (!Bit(ebx7, 5)) {
+    return kSimdSSE4;
+  }
+  // AVX-512 additionally needs the opmask and ZMM state (XCR0 bits 5-7).
+  if (Bit(ebx7, 16) && (XGetBv() & 0xe0) == 0xe0) {
+    return kSimdAVX512;
+  }
+  return kSimdAVX2;
+#else
+  return kSimdBasic;
+#endif
+}
+
+bool ParseSimdBackend(const std::string& name, SimdBackend* backend) {
+  for (const SimdBackend b : {kSimdBasic, kSimdSSE4, kSimdAVX2, kSimdAVX512}) {
+    if (name == SimdBackendName(b)) {
+      *backend = b;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* SimdBackendName(SimdBackend backend) {
+  switch (backend) {
+    case kSimdBasic:
+      return "basic";
+    case kSimdSSE4:
+      return "sse4";
+    case kSimdAVX2:
+      return "avx2";
+    case kSimdAVX512:
+      return "avx512";
+  }
+  return "basic";
+}
+
+SimdBackend ActiveSimdBackend() {
+  static const SimdBackend active = [] {
+    SimdBackend backend = DetectSimdBackend();
+    // Not tensorflow::ReadStringFromEnvVar: the CPU feature library is
+    // loaded before, and without, the TensorFlow runtime.
+    const char* value = std::getenv("TFQ_SIMD_BACKEND");
+    SimdBackend requested;
+    if (value != nullptr && ParseSimdBackend(value, &requested) &&
+        requested != kSimdBasic && requested < backend) {
+      backend = requested;
+    }
+    return backend;
+  }();
+  return active;
+}
+
+bool RecordBuildSimdBackend(SimdBackend backend) {
+  int recorded = build_backend.load();
+  while (recorded < backend &&
+         !build_backend.compare_exchange_weak(recorded, backend)) {
+  }
+  return true;
+}
+
+SimdBackend BuildSimdBackend() {
+  const int recorded = build_backend.load();
+  if (recorded < 0) {
+    return ActiveSimdBackend();
+  }
+  return static_cast<SimdBackend>(recorded);
+}
+
+unsigned SimdLanes(SimdBackend backend) {
+  switch (backend) {
+    case kSimdBasic:
+      return 1;
+    case kSimdSSE4:
+      return 4;
+    case kSimdAVX2:
+      return 8;
+    case kSimdAVX512:
+      return 16;
+  }
+  return 1;
+}
+
+}  // namespace tfq
@@ -0,0 +1,91 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Runtime selection of the qsim simulator backend. The simulation op
+// libraries are built once per instruction set (see ops/tfq_simd.bzl) and
+// load_module.py loads the build for ActiveSimdBackend().
+//
+// Apart from the TFQ_COMPILED_SIMD_BACKEND macro nothing in here may depend
+// on the instruction set flags of the translation unit that includes it,
+// since the op libraries of every backend link it.
+
+#ifndef TFQ_CORE_SRC_CPU_FEATURES_H_
+#define TFQ_CORE_SRC_CPU_FEATURES_H_
+
+#include <string>
+
+namespace tfq {
+
+// qsim simulators in increasing order of vector width.
+enum SimdBackend {
+  // qsim::SimulatorBasic, no vector instructions.
+  kSimdBasic = 0,
+  // qsim::SimulatorSSE, SSE4.1.
+  kSimdSSE4 = 1,
+  // qsim::SimulatorAVX, AVX2 and FMA.
+  kSimdAVX2 = 2,
+  // qsim::SimulatorAVX512, AVX-512F.
+  kSimdAVX512 = 3,
+};
+
+// Widest backend that this CPU and operating system can run, from CPUID.
+SimdBackend DetectSimdBackend();
+
+// Parses "basic", "sse4", "avx2" or "avx512". Returns false (and leaves
+// *backend alone) for anything else.
+bool ParseSimdBackend(const std::string& name, SimdBackend* backend);
+
+// Inverse of ParseSimdBackend.
+const char* SimdBackendName(SimdBackend backend);
+
+// The backend that load_module.py picks a build for: DetectSimdBackend(),
+// lowered to the value of the environment variable TFQ_SIMD_BACKEND when
+// that is set to a narrower backend. Unknown values, "auto" and "basic" are
+// ignored (there is no basic build next to the default one, so
+// load_module.py rejects "basic") and backends the CPU cannot run are never
+// returned. Read once.
+SimdBackend ActiveSimdBackend();
+
+// Number of floats the simulator of backend processes per instruction.
+unsigned SimdLanes(SimdBackend backend);
+
+// The backend of the simulator that qsim/lib/simmux.h picks for the
+// instruction set flags of the translation unit this is expanded in.
+#if defined(__AVX512F__)
+#define TFQ_COMPILED_SIMD_BACKEND ::tfq::kSimdAVX512
+#elif defined(__AVX2__)
+#define TFQ_COMPILED_SIMD_BACKEND ::tfq::kSimdAVX2
+#elif defined(__SSE4_1__)
+#define TFQ_COMPILED_SIMD_BACKEND ::tfq::kSimdSSE4
+#else
+#define TFQ_COMPILED_SIMD_BACKEND ::tfq::kSimdBasic
+#endif
+
+// Records that a translation unit of the calling library was compiled for
+// backend. The widest recorded backend wins, since the translation units of
+// an op library build only ever add instruction set flags to those of the
+// libraries it links. Returns true so that it can initialize a static.
+bool RecordBuildSimdBackend(SimdBackend backend);
+
+// The backend that the simulators of the calling library were compiled
+// for, as recorded by RecordBuildSimdBackend. This is what the loaded build
+// actually runs, which may be narrower than ActiveSimdBackend() when the
+// build for that is missing. Falls back to ActiveSimdBackend() when nothing
+// was recorded.
+SimdBackend BuildSimdBackend();
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_CPU_FEATURES_H_
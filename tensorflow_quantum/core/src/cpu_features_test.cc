@@ -0,0 +1,68 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/cpu_features.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace tfq {
+namespace {
+
+TEST(CpuFeaturesTest, ParseSimdBackend) {
+  for (const SimdBackend b : {kSimdBasic, kSimdSSE4, kSimdAVX2, kSimdAVX512}) {
+    SimdBackend parsed = kSimdBasic;
+    ASSERT_TRUE(ParseSimdBackend(SimdBackendName(b), &parsed));
+    EXPECT_EQ(parsed, b);
+  }
+
+  SimdBackend unchanged = kSimdAVX2;
+  EXPECT_FALSE(ParseSimdBackend("auto", &unchanged));
+  EXPECT_FALSE(ParseSimdBackend("AVX2", &unchanged));
+  EXPECT_FALSE(ParseSimdBackend("", &unchanged));
+  EXPECT_EQ(unchanged, kSimdAVX2);
+}
+
+TEST(CpuFeaturesTest, DetectSupportsThisBuild) {
+  // The test runs on a machine that can execute the flags it was built
+  // with.
+#if defined(__AVX512F__)
+  EXPECT_GE(DetectSimdBackend(), kSimdAVX512);
+#elif defined(__AVX2__) && defined(__FMA__)
+  EXPECT_GE(DetectSimdBackend(), kSimdAVX2);
+#elif defined(__SSE4_1__)
+  EXPECT_GE(DetectSimdBackend(), kSimdSSE4);
+#endif
+  EXPECT_LE(ActiveSimdBackend(), DetectSimdBackend());
+  EXPECT_LE(TFQ_COMPILED_SIMD_BACKEND, DetectSimdBackend());
+}
+
+TEST(CpuFeaturesTest, BuildSimdBackendKeepsWidest) {
+  EXPECT_TRUE(RecordBuildSimdBackend(kSimdSSE4));
+  EXPECT_TRUE(RecordBuildSimdBackend(kSimdAVX2));
+  EXPECT_TRUE(RecordBuildSimdBackend(kSimdSSE4));
+  EXPECT_EQ(BuildSimdBackend(), kSimdAVX2);
+}
+
+TEST(CpuFeaturesTest, SimdLanes) {
+  EXPECT_EQ(SimdLanes(kSimdBasic), 1);
+  EXPECT_EQ(SimdLanes(kSimdSSE4), 4);
+  EXPECT_EQ(SimdLanes(kSimdAVX2), 8);
+  EXPECT_EQ(SimdLanes(kSimdAVX512), 16);
+}
+
+}  // namespace
+}  // namespace tfq
@@ -0,0 +1,219 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Exact simulation of small noisy circuits on density matrices, as an
+// alternative to sampling quantum trajectories. The density matrix rho of
+// n qubits is stored as a qsim state of 2n qubits, with amplitude
+// a | (b << n) holding rho[a][b]. A gate U then maps rho to U rho U^dagger
+// by applying U to qubits q and conj(U) to qubits q + n, so the regular qsim
+// simulators evolve density matrices without any changes.
+
+#ifndef TFQ_CORE_SRC_DENSITY_MATRIX_H_
+#define TFQ_CORE_SRC_DENSITY_MATRIX_H_
+
+#include <algorithm>
+#include <complex>
+#include <cstdint>
+#include <vector>
+
+#include "../qsim/lib/channel.h"
+#include "../qsim/lib/circuit_noisy.h"
+#include "../qsim/lib/gate_appl.h"
+
+namespace tfq {
+
+// Largest number of qubits simulated on density matrices. A density matrix of
+// 12 qubits takes as much memory as a state vector of 24 qubits.
+static const int kMaxDensityMatrixQubits = 12;
+
+// How the noisy ops simulate a circuit: with quantum trajectories, on its
+// density matrix, or with whichever of the two is estimated to be cheaper.
+enum class NoisyBackend {
+  kTrajectory,
+  kDensityMatrix,
+  kAuto,
+};
+
+// Number of sweeps over the density matrix needed for the channels of
+// ncircuit: channels of a single unitary Kraus operator are applied in place
+// with two sweeps per gate, every other Kraus operator also needs a copy and
+// an add.
+template <typename NoisyCircuit>
+uint64_t CountDensityMatrixSweeps(const NoisyCircuit& ncircuit) {
+  uint64_t sweeps = 0;
+  for (const auto& channel : ncircuit.channels) {
+    if (channel.size() == 1 && channel[0].unitary) {
+      sweeps += 2 * channel[0].ops.size();
+      continue;
+    }
+    for (const auto& kop : channel) {
+      sweeps += 2 * kop.ops.size() + 2;
+    }
+  }
+  return sweeps;
+}
+
+// Estimate of the cost of simulating a circuit on num_qubits qubits with
+// num_sweeps sweeps (see CountDensityMatrixSweeps) over its density matrix,
+// plus a final pass to read the output. Comparable to EstimateCircuitCost.
+inline uint64_t EstimateDensityMatrixCost(const int num_qubits,
+                                          const uint64_t num_sweeps) {
+  return (num_sweeps + 1) << (2 * num_qubits);
+}
+
+// True if a circuit on num_qubits qubits is simulated on its density matrix
+// with backend. kAuto picks the density matrix when its cost is below the
+// trajectory_cost of sampling all trajectories.
+inline bool UseDensityMatrix(const NoisyBackend backend, const int num_qubits,
+                             const uint64_t density_matrix_cost,
+                             const uint64_t trajectory_cost) {
+  switch (backend) {
+    case NoisyBackend::kTrajectory:
+      return false;
+    case NoisyBackend::kDensityMatrix:
+      return true;
+    default:
+      return num_qubits <= kMaxDensityMatrixQubits &&
+             density_matrix_cost < trajectory_cost;
+  }
+}
+
+// The gate that applies conj(gate) to the column qubits of a density matrix
+// of num_qubits qubits.
+template <typename Gate>
+Gate DensityMatrixColumnGate(const Gate& gate, const unsigned num_qubits) {
+  Gate column = gate;
+  for (auto& q : column.qubits) {
+    q += num_qubits;
+  }
+  for (auto& q : column.controlled_by) {
+    q += num_qubits;
+  }
+  for (size_t k = 1; k < column.matrix.size(); k += 2) {
+    column.matrix[k] = -column.matrix[k];
+  }
+  return column;
+}
+
+// rho -> gate rho gate^dagger for the density matrix rho of num_qubits
+// qubits. Measurement gates are skipped like in qsim::ApplyGate.
+template <typename Simulator, typename Gate>
+void ApplyDensityMatrixGate(const Simulator& sim, const unsigned num_qubits,
+                            const Gate& gate,
+                            typename Simulator::State& rho) {
+  qsim::ApplyGate(sim, gate, rho);
+  qsim::ApplyGate(sim, DensityMatrixColumnGate(gate, num_qubits), rho);
+}
+
+// Sets rho, a state of 2 * state.num_qubits() qubits, to |state><state|.
+template <typename StateSpace>
+void SetDensityMatrixPure(const StateSpace& ss,
+                          const typename StateSpace::State& state,
+                          typename StateSpace::State& rho) {
+  typedef typename StateSpace::fp_type fp_type;
+  const unsigned num_qubits = state.num_qubits();
+  const uint64_t dim = uint64_t(1) << num_qubits;
+  std::vector<std::complex<fp_type>> amplitudes(dim);
+  for (uint64_t a = 0; a < dim; a++) {
+    amplitudes[a] = ss.GetAmpl(state, a);
+  }
+  for (uint64_t b = 0; b < dim; b++) {
+    const std::complex<fp_type> conj_b = std::conj(amplitudes[b]);
+    for (uint64_t a = 0; a < dim; a++) {
+      ss.SetAmpl(rho, a | (b << num_qubits), amplitudes[a] * conj_b);
+    }
+  }
+}
+
+// Applies the channels of ncircuit, a noisy circuit on num_qubits qubits, to
+// the density matrix rho: rho -> sum_k K_k rho K_k^dagger for every channel.
+// Kraus operator k is the product of its ops, scaled by sqrt(prob) when it
+// is unitary. Measurement channels only read out the state and are skipped.
+// scratch and sum must have the size of rho.
+template <typename Simulator, typename StateSpace, typename Gate>
+void RunDensityMatrixChannels(const Simulator& sim, const StateSpace& ss,
+                              const unsigned num_qubits,
+                              const qsim::NoisyCircuit<Gate>& ncircuit,
+                              typename StateSpace::State& rho,
+                              typename StateSpace::State& scratch,
+                              typename StateSpace::State& sum) {
+  typedef typename StateSpace::fp_type fp_type;
+  for (const auto& channel : ncircuit.channels) {
+    if (channel.empty() ||
+        channel[0].kind == qsim::KrausOperator<Gate>::kMeasurement) {
+      continue;
+    }
+    if (channel.size() == 1 && channel[0].unitary) {
+      for (const auto& op : channel[0].ops) {
+        ApplyDensityMatrixGate(sim, num_qubits, op, rho);
+      }
+      continue;
+    }
+
+    ss.SetAllZeros(sum);
+    for (const auto& kop : channel) {
+      ss.Copy(rho, scratch);
+      for (const auto& op : kop.ops) {
+        ApplyDensityMatrixGate(sim, num_qubits, op, scratch);
+      }
+      if (kop.unitary) {
+        ss.Multiply(static_cast<fp_type>(kop.prob), scratch);
+      }
+      ss.Add(scratch, sum);
+    }
+    ss.Copy(sum, rho);
+  }
+}
+
+// The diagonal of the density matrix rho of num_qubits qubits, i.e. the
+// probabilities of the computational basis states. Rounding errors that make
+// an entry negative are clipped.
+template <typename StateSpace>
+void DensityMatrixDiagonal(const StateSpace& ss, const unsigned num_qubits,
+                           const typename StateSpace::State& rho,
+                           std::vector<double>* probabilities) {
+  const uint64_t dim = uint64_t(1) << num_qubits;
+  probabilities->resize(dim);
+  for (uint64_t a = 0; a < dim; a++) {
+    (*probabilities)[a] =
+        std::max(0.0, double(ss.GetAmpl(rho, a | (a << num_qubits)).real()));
+  }
+}
+
+// Draws num_samples basis states from the unnormalized probabilities, with
+// uniform doubles in [0, 1) from random_source.RandDouble().
+template <typename RandomSource>
+void SampleProbabilities(const std::vector<double>& probabilities,
+                         const int num_samples, RandomSource* random_source,
+                         std::vector<uint64_t>* samples) {
+  std::vector<double> cumulative(probabilities.size());
+  double total = 0;
+  for (size_t a = 0; a < probabilities.size(); a++) {
+    total += probabilities[a];
+    cumulative[a] = total;
+  }
+  samples->resize(num_samples);
+  for (int s = 0; s < num_samples; s++) {
+    const double u = random_source->RandDouble() * total;
+    const uint64_t a =
+        std::upper_bound(cumulative.begin(), cumulative.end(), u) -
+        cumulative.begin();
+    (*samples)[s] = std::min<uint64_t>(a, probabilities.size() - 1);
+  }
+}
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_DENSITY_MATRIX_H_
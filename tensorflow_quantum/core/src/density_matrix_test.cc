@@ -0,0 +1,143 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/density_matrix.h"
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "../qsim/lib/channels_cirq.h"
+#include "../qsim/lib/circuit_noisy.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/seqfor.h"
+#include "../qsim/lib/simmux.h"
+#include "gtest/gtest.h"
+
+namespace tfq {
+namespace {
+
+typedef qsim::Cirq::GateCirq<float> QsimGate;
+typedef qsim::NoisyCircuit<QsimGate> NoisyQsimCircuit;
+typedef qsim::Simulator<qsim::SequentialFor> Simulator;
+typedef Simulator::StateSpace StateSpace;
+
+// Uniform doubles in [0, 1) for SampleProbabilities.
+struct TestRandom {
+  std::mt19937 engine;
+  double RandDouble() {
+    return std::uniform_real_distribution<double>(0, 1)(engine);
+  }
+};
+
+TEST(DensityMatrixTest, ColumnGate) {
+  const auto gate = qsim::Cirq::YPowGate<float>::Create(0, 1, 0.3, 0.0);
+  const auto column = DensityMatrixColumnGate(gate, 3);
+  EXPECT_EQ(column.qubits, std::vector<unsigned>({4}));
+  for (size_t k = 0; k < gate.matrix.size(); k++) {
+    EXPECT_EQ(column.matrix[k], k % 2 ? -gate.matrix[k] : gate.matrix[k]);
+  }
+}
+
+TEST(DensityMatrixTest, PureStateEvolution) {
+  Simulator sim(1);
+  StateSpace ss(1);
+  auto state = ss.Create(2);
+  auto rho = ss.Create(4);
+  auto scratch = ss.Create(4);
+  auto sum = ss.Create(4);
+
+  ss.SetStateZero(state);
+  qsim::ApplyGate(sim, qsim::Cirq::HGate<float>::Create(0, 0), state);
+  SetDensityMatrixPure(ss, state, rho);
+
+  // Unitary channels keep the state pure.
+  NoisyQsimCircuit ncircuit;
+  ncircuit.num_qubits = 2;
+  const auto cx = qsim::Cirq::CXPowGate<float>::Create(1, 0, 1, 0.7, 0.0);
+  const auto ry = qsim::Cirq::YPowGate<float>::Create(2, 1, 0.25, 0.0);
+  ncircuit.channels.push_back(
+      {{qsim::KrausOperator<QsimGate>::kNormal, true, 1.0, {cx, ry}}});
+  RunDensityMatrixChannels(sim, ss, 2, ncircuit, rho, scratch, sum);
+  qsim::ApplyGate(sim, cx, state);
+  qsim::ApplyGate(sim, ry, state);
+
+  for (uint64_t a = 0; a < 4; a++) {
+    for (uint64_t b = 0; b < 4; b++) {
+      const auto expected =
+          ss.GetAmpl(state, a) * std::conj(ss.GetAmpl(state, b));
+      const auto actual = ss.GetAmpl(rho, a | (b << 2));
+      EXPECT_NEAR(actual.real(), expected.real(), 1e-5);
+      EXPECT_NEAR(actual.imag(), expected.imag(), 1e-5);
+    }
+  }
+}
+
+TEST(DensityMatrixTest, Channels) {
+  Simulator sim(1);
+  StateSpace ss(1);
+  auto state = ss.Create(1);
+  auto rho = ss.Create(2);
+  auto scratch = ss.Create(2);
+  auto sum = ss.Create(2);
+
+  // |1>, amplitude damping and a bit flip.
+  ss.SetStateZero(state);
+  qsim::ApplyGate(sim, qsim::Cirq::XGate<float>::Create(0, 0), state);
+  SetDensityMatrixPure(ss, state, rho);
+  NoisyQsimCircuit ncircuit;
+  ncircuit.num_qubits = 1;
+  ncircuit.channels.push_back(
+      qsim::Cirq::AmplitudeDampingChannel<float>::Create(1, 0, 0.3));
+  ncircuit.channels.push_back(
+      qsim::Cirq::BitFlipChannel<float>::Create(2, 0, 0.1));
+  RunDensityMatrixChannels(sim, ss, 1, ncircuit, rho, scratch, sum);
+
+  // P(0) = 0.3 * 0.9 + 0.7 * 0.1.
+  std::vector<double> probabilities;
+  DensityMatrixDiagonal(ss, 1, rho, &probabilities);
+  ASSERT_EQ(probabilities.size(), 2);
+  EXPECT_NEAR(probabilities[0], 0.34, 1e-5);
+  EXPECT_NEAR(probabilities[1], 0.66, 1e-5);
+  EXPECT_NEAR(std::abs(ss.GetAmpl(rho, 2)), 0.0, 1e-5);
+}
+
+TEST(DensityMatrixTest, SampleProbabilities) {
+  TestRandom random_source;
+  std::vector<uint64_t> samples;
+  SampleProbabilities({0.2, 0.0, 0.6, 0.2}, 20000, &random_source, &samples);
+  ASSERT_EQ(samples.size(), 20000);
+  std::vector<int> counts(4, 0);
+  for (const uint64_t sample : samples) {
+    counts[sample]++;
+  }
+  EXPECT_EQ(counts[1], 0);
+  EXPECT_NEAR(counts[0] / 20000.0, 0.2, 0.02);
+  EXPECT_NEAR(counts[2] / 20000.0, 0.6, 0.02);
+}
+
+TEST(DensityMatrixTest, UseDensityMatrix) {
+  const uint64_t dm_cost = EstimateDensityMatrixCost(4, 10);
+  EXPECT_EQ(dm_cost, uint64_t(11) << 8);
+  EXPECT_FALSE(UseDensityMatrix(NoisyBackend::kTrajectory, 4, 1, 2));
+  EXPECT_TRUE(UseDensityMatrix(NoisyBackend::kDensityMatrix, 4, 2, 1));
+  EXPECT_TRUE(UseDensityMatrix(NoisyBackend::kAuto, 4, 1, 2));
+  EXPECT_FALSE(UseDensityMatrix(NoisyBackend::kAuto, 4, 2, 1));
+  EXPECT_FALSE(UseDensityMatrix(NoisyBackend::kAuto,
+                                kMaxDensityMatrixQubits + 1, 1, 2));
+}
+
+}  // namespace
+}  // namespace tfq
@@ -0,0 +1,370 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Microbenchmarks of the individual stages behind the op kernels: proto
+// parsing and qubit resolution, circuit construction, expectation values,
+// operator accumulation, gradient circuits and shot planning. Run with
+//   bazel run -c opt //tensorflow_quantum/core/src:microbenchmark
+// and select benchmarks with --benchmark_filter=<regex>.
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../qsim/lib/circuit.h"
+#include "../qsim/lib/formux.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/simmux.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_cat.h"
+#include "benchmark/benchmark.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/proto/program.pb.h"
+#include "tensorflow_quantum/core/src/adj_util.h"
+#include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/program_resolution.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
+
+namespace tfq {
+namespace {
+
+using ::tfq::proto::Arg;
+using ::tfq::proto::Moment;
+using ::tfq::proto::Operation;
+using ::tfq::proto::PauliSum;
+using ::tfq::proto::PauliTerm;
+using ::tfq::proto::Program;
+
+typedef absl::flat_hash_map<std::string, std::pair<int, float>> SymbolMap;
+typedef qsim::Cirq::GateCirq<float> QsimGate;
+typedef qsim::Circuit<QsimGate> QsimCircuit;
+typedef std::vector<qsim::GateFused<QsimGate>> QsimFusedCircuit;
+typedef qsim::Simulator<qsim::SequentialFor> Simulator;
+typedef Simulator::StateSpace StateSpace;
+
+// Number of layers of the benchmark circuits.
+const int kDepth = 8;
+
+Arg FloatArg(const float value) {
+  Arg arg;
+  arg.mutable_arg_value()->set_float_value(value);
+  return arg;
+}
+
+Arg SymbolArg(const std::string& symbol) {
+  Arg arg;
+  arg.set_symbol(symbol);
+  return arg;
+}
+
+Arg EmptyControlArg() {
+  Arg arg;
+  arg.mutable_arg_value()->set_string_value("");
+  return arg;
+}
+
+std::string QubitId(const int q) { return absl::StrCat("0_", q); }
+
+void AddEigenGate(const std::string& id, const std::vector<int>& qubits,
+                  const Arg& exponent, Moment* moment) {
+  Operation* op = moment->add_operations();
+  op->mutable_gate()->set_id(id);
+  auto& args = *op->mutable_args();
+  args["exponent"] = exponent;
+  args["exponent_scalar"] = FloatArg(1.0);
+  args["global_shift"] = FloatArg(0.0);
+  args["control_qubits"] = EmptyControlArg();
+  args["control_values"] = EmptyControlArg();
+  for (const int q : qubits) {
+    op->add_qubits()->set_id(QubitId(q));
+  }
+}
+
+// A hardware efficient ansatz on a line of GridQubits: every layer is a
+// symbolic XPowGate on each qubit followed by a ladder of ZZPowGates. Layer
+// l uses the symbol "theta<l>".
+Program LayeredProgram(const int num_qubits, const int depth) {
+  Program program;
+  auto* circuit = program.mutable_circuit();
+  circuit->set_scheduling_strategy(circuit->MOMENT_BY_MOMENT);
+  for (int l = 0; l < depth; l++) {
+    Moment* rotations = circuit->add_moments();
+    for (int q = 0; q < num_qubits; q++) {
+      AddEigenGate("XP", {q}, SymbolArg(absl::StrCat("theta", l)), rotations);
+    }
+    for (int parity = 0; parity < 2; parity++) {
+      Moment* entanglers = circuit->add_moments();
+      for (int q = parity; q + 1 < num_qubits; q += 2) {
+        AddEigenGate("ZZP", {q, q + 1}, FloatArg(0.25), entanglers);
+      }
+    }
+  }
+  return program;
+}
+
+SymbolMap LayeredSymbols(const int depth, const float offset) {
+  SymbolMap symbols;
+  for (int l = 0; l < depth; l++) {
+    symbols[absl::StrCat("theta", l)] =
+        std::pair<int, float>(l, offset + 0.1 * l);
+  }
+  return symbols;
+}
+
+// A transverse field Ising Hamiltonian on a line of num_qubits qubits, with
+// qubit ids given by id(q).
+template <typename IdF>
+PauliSum IsingPauliSum(const int num_qubits, IdF id) {
+  PauliSum p_sum;
+  for (int q = 0; q < num_qubits; q++) {
+    PauliTerm* field = p_sum.add_terms();
+    field->set_coefficient_real(0.5);
+    auto* x = field->add_paulis();
+    x->set_qubit_id(id(q));
+    x->set_pauli_type("X");
+    if (q + 1 < num_qubits) {
+      PauliTerm* coupling = p_sum.add_terms();
+      coupling->set_coefficient_real(-1.0);
+      for (int p = q; p < q + 2; p++) {
+        auto* z = coupling->add_paulis();
+        z->set_qubit_id(id(p));
+        z->set_pauli_type("Z");
+      }
+    }
+  }
+  return p_sum;
+}
+
+// IsingPauliSum on resolved qubit indices, as seen by the simulation code.
+PauliSum ResolvedIsingPauliSum(const int num_qubits) {
+  return IsingPauliSum(num_qubits,
+                       [](const int q) { return std::to_string(q); });
+}
+
+// Args are {num_qubits, batch_size}.
+void QubitsAndBatch(benchmark::internal::Benchmark* b) {
+  for (const int num_qubits : {4, 10, 16}) {
+    for (const int batch_size : {1, 16, 128}) {
+      b->Args({num_qubits, batch_size});
+    }
+  }
+}
+
+// Args are {num_qubits}.
+void Qubits(benchmark::internal::Benchmark* b) {
+  for (const int num_qubits : {4, 8, 12, 16, 20}) {
+    b->Args({num_qubits});
+  }
+}
+
+void BM_ParseAndResolveProgram(benchmark::State& state) {
+  const int num_qubits = state.range(0);
+  const int batch_size = state.range(1);
+  const std::string program_string =
+      LayeredProgram(num_qubits, kDepth).SerializeAsString();
+  const std::string sum_string =
+      IsingPauliSum(num_qubits, QubitId).SerializeAsString();
+
+  for (auto _ : state) {
+    for (int i = 0; i < batch_size; i++) {
+      Program program;
+      std::vector<PauliSum> p_sums(1);
+      program.ParseFromString(program_string);
+      p_sums[0].ParseFromString(sum_string);
+      unsigned int resolved_qubits;
+      benchmark::DoNotOptimize(
+          ResolveQubitIds(&program, &resolved_qubits, &p_sums));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+  state.SetBytesProcessed(state.iterations() * batch_size *
+                          (program_string.size() + sum_string.size()));
+}
+BENCHMARK(BM_ParseAndResolveProgram)->Apply(QubitsAndBatch);
+
+// Resolves the qubits of LayeredProgram(num_qubits, kDepth).
+Program ResolvedLayeredProgram(const int num_qubits) {
+  Program program = LayeredProgram(num_qubits, kDepth);
+  unsigned int resolved_qubits;
+  ResolveQubitIds(&program, &resolved_qubits);
+  return program;
+}
+
+void BM_QsimCircuitFromProgram(benchmark::State& state) {
+  const int num_qubits = state.range(0);
+  const int batch_size = state.range(1);
+  const Program program = ResolvedLayeredProgram(num_qubits);
+  const SymbolMap symbols = LayeredSymbols(kDepth, 0.0);
+
+  for (auto _ : state) {
+    for (int i = 0; i < batch_size; i++) {
+      QsimCircuit circuit;
+      QsimFusedCircuit fused_circuit;
+      benchmark::DoNotOptimize(QsimCircuitFromProgram(
+          program, symbols, num_qubits, &circuit, &fused_circuit));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+BENCHMARK(BM_QsimCircuitFromProgram)->Apply(QubitsAndBatch);
+
+// The cached path of the ops: one template bound to batch_size different
+// sets of symbol values.
+void BM_BindQsimCircuitTemplate(benchmark::State& state) {
+  const int num_qubits = state.range(0);
+  const int batch_size = state.range(1);
+  const Program program = ResolvedLayeredProgram(num_qubits);
+  std::vector<SymbolMap> symbols;
+  for (int i = 0; i < batch_size; i++) {
+    symbols.push_back(LayeredSymbols(kDepth, 0.01 * i));
+  }
+  QsimCircuitTemplate circuit_template;
+  BuildQsimCircuitTemplate(program, symbols[0], num_qubits,
+                           &circuit_template);
+
+  QsimCircuit circuit;
+  QsimFusedCircuit fused_circuit;
+  for (auto _ : state) {
+    for (int i = 0; i < batch_size; i++) {
+      benchmark::DoNotOptimize(BindQsimCircuitTemplate(
+          circuit_template, symbols[i], &circuit, &fused_circuit));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+BENCHMARK(BM_BindQsimCircuitTemplate)->Apply(QubitsAndBatch);
+
+void BM_ComputeExpectationQsim(benchmark::State& state) {
+  const int num_qubits = state.range(0);
+  const PauliSum p_sum = ResolvedIsingPauliSum(num_qubits);
+  Simulator sim(1);
+  StateSpace ss(1);
+  auto sv = ss.Create(num_qubits);
+  auto scratch = ss.Create(num_qubits);
+  ss.SetStateUniform(sv);
+
+  for (auto _ : state) {
+    float expectation = 0;
+    benchmark::DoNotOptimize(
+        ComputeExpectationQsim(p_sum, sim, ss, sv, scratch, &expectation));
+    benchmark::DoNotOptimize(expectation);
+  }
+  state.SetItemsProcessed(state.iterations() * p_sum.terms_size());
+}
+BENCHMARK(BM_ComputeExpectationQsim)->Apply(Qubits);
+
+// ComputeExpectationQsim evaluated from precompiled masks, as the ops do.
+void BM_ComputeExpectationMasks(benchmark::State& state) {
+  const int num_qubits = state.range(0);
+  const PauliSum p_sum = ResolvedIsingPauliSum(num_qubits);
+  PauliSumMasks masks;
+  PauliSumToMasks(p_sum, num_qubits, &masks);
+  StateSpace ss(1);
+  auto sv = ss.Create(num_qubits);
+  ss.SetStateUniform(sv);
+
+  for (auto _ : state) {
+    float expectation = 0;
+    benchmark::DoNotOptimize(ComputeExpectationMasks(
+        masks, qsim::SequentialFor(1), ss, sv, &expectation));
+    benchmark::DoNotOptimize(expectation);
+  }
+  state.SetItemsProcessed(state.iterations() * p_sum.terms_size());
+}
+BENCHMARK(BM_ComputeExpectationMasks)->Apply(Qubits);
+
+// Args are {num_qubits, number of operators}.
+void BM_AccumulateOperators(benchmark::State& state) {
+  const int num_qubits = state.range(0);
+  const int num_ops = state.range(1);
+  const std::vector<PauliSum> p_sums(num_ops,
+                                     ResolvedIsingPauliSum(num_qubits));
+  std::vector<float> op_coeffs;
+  for (int j = 0; j < num_ops; j++) {
+    op_coeffs.push_back(1.0 - 0.1 * j);
+  }
+  Simulator sim(1);
+  StateSpace ss(1);
+  auto source = ss.Create(num_qubits);
+  auto scratch = ss.Create(num_qubits);
+  auto dest = ss.Create(num_qubits);
+  ss.SetStateUniform(source);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(AccumulateOperators(p_sums, op_coeffs, sim, ss,
+                                                 source, scratch, dest));
+  }
+  state.SetItemsProcessed(state.iterations() * num_ops);
+}
+BENCHMARK(BM_AccumulateOperators)
+    ->Args({4, 1})
+    ->Args({4, 4})
+    ->Args({12, 1})
+    ->Args({12, 4})
+    ->Args({16, 1})
+    ->Args({16, 4});
+
+void BM_CreateGradientCircuit(benchmark::State& state) {
+  const int num_qubits = state.range(0);
+  const int batch_size = state.range(1);
+  const Program program = ResolvedLayeredProgram(num_qubits);
+  QsimCircuit circuit;
+  QsimFusedCircuit fused_circuit;
+  std::vector<GateMetaData> metadata;
+  QsimCircuitFromProgram(program, LayeredSymbols(kDepth, 0.0), num_qubits,
+                         &circuit, &fused_circuit, &metadata);
+
+  for (auto _ : state) {
+    for (int i = 0; i < batch_size; i++) {
+      std::vector<QsimFusedCircuit> partial_fuses;
+      std::vector<GradientOfGate> grad_gates;
+      CreateGradientCircuit(circuit, metadata, &partial_fuses, &grad_gates);
+      benchmark::DoNotOptimize(grad_gates.data());
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+BENCHMARK(BM_CreateGradientCircuit)->Apply(QubitsAndBatch);
+
+// Planning and ordering of the trajectory blocks of a batch of noisy
+// circuits. Args are {batch_size, shots per circuit}.
+void BM_PlanShotBlocks(benchmark::State& state) {
+  const int batch_size = state.range(0);
+  const int num_shots = state.range(1);
+  const std::vector<int> shots(batch_size, num_shots);
+  std::vector<uint64_t> costs;
+  for (int i = 0; i < batch_size; i++) {
+    costs.push_back(EstimateTrajectoryCost(4 + i % 12, i % 7));
+  }
+
+  ShotBlocks plan;
+  std::vector<int> tasks;
+  for (auto _ : state) {
+    PlanShotBlocks(shots, &plan);
+    SortShotBlocksByCost(plan, costs, &tasks);
+    benchmark::DoNotOptimize(tasks.data());
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+BENCHMARK(BM_PlanShotBlocks)
+    ->Args({1, 1000})
+    ->Args({64, 1000})
+    ->Args({64, 100000})
+    ->Args({1024, 1000});
+
+}  // namespace
+}  // namespace tfq
@@ -0,0 +1,81 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Profiler annotations for the phases of an op kernel (parsing, circuit
+// construction, simulation, ...). Every phase shows up in TF profiler traces
+// as "<op type>:<phase>" with its duration, the state vector bytes
+// allocated while it ran and any counters the kernel attaches. Nothing is
+// recorded unless a trace is being collected.
+
+#ifndef TFQ_CORE_SRC_PHASE_TRACE_H_
+#define TFQ_CORE_SRC_PHASE_TRACE_H_
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/profiler/lib/traceme.h"
+#include "tensorflow_quantum/core/src/state_pool.h"
+
+namespace tfq {
+
+// Scoped trace of one phase of context's op. Construct it at the start of
+// the phase; the phase ends when it goes out of scope.
+class PhaseTrace {
+ public:
+  PhaseTrace(tensorflow::OpKernelContext* context, const char* phase)
+      : trace_([context, phase]() {
+          return absl::StrCat(context->op_kernel().type_string(), ":", phase);
+        }),
+        start_bytes_(StatePool::Global()->allocated_bytes()) {}
+
+  ~PhaseTrace() {
+    if (!tensorflow::profiler::TraceMe::Active()) {
+      return;
+    }
+    Count("state_bytes_allocated",
+          StatePool::Global()->allocated_bytes() - start_bytes_);
+    trace_.AppendMetadata([this]() {
+      std::string metadata = "#";
+      for (size_t i = 0; i < counters_.size(); i++) {
+        absl::StrAppend(&metadata, i == 0 ? "" : ",", counters_[i].first, "=",
+                        counters_[i].second);
+      }
+      return absl::StrCat(metadata, "#");
+    });
+  }
+
+  PhaseTrace(const PhaseTrace&) = delete;
+  PhaseTrace& operator=(const PhaseTrace&) = delete;
+
+  // Attaches a counter to the phase. name must outlive the trace.
+  void Count(const char* name, uint64_t value) {
+    if (tensorflow::profiler::TraceMe::Active()) {
+      counters_.emplace_back(name, value);
+    }
+  }
+
+ private:
+  tensorflow::profiler::TraceMe trace_;
+  const uint64_t start_bytes_;
+  std::vector<std::pair<const char*, uint64_t>> counters_;
+};
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_PHASE_TRACE_H_
@@ -0,0 +1,317 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Simulation of batches whose circuits start with the same gates. Circuits
+// are ordered so that common prefixes are adjacent (a flattened prefix
+// trie), the state after each shared prefix is checkpointed once and every
+// circuit only simulates the gates that follow its deepest checkpoint.
+
+#ifndef TFQ_CORE_SRC_PREFIX_SHARING_H_
+#define TFQ_CORE_SRC_PREFIX_SHARING_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "../qsim/lib/gate.h"
+#include "../qsim/lib/gate_appl.h"
+#include "tensorflow/core/platform/fingerprint.h"
+#include "tensorflow_quantum/core/src/state_pool.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
+
+namespace tfq {
+
+// Fraction of the state memory budget that checkpoints may occupy.
+static const int kCheckpointBudgetDivisor = 4;
+
+// Upper bound on the checkpoints held by one worker.
+static const size_t kMaxCheckpoints = 64;
+
+// Order of a batch in which circuits with common gate prefixes are adjacent.
+struct PrefixPlan {
+  // Batch indices in simulation order.
+  std::vector<int> order;
+  // lcp[k] is the number of leading fused gates that circuit order[k]
+  // shares with circuit order[k - 1]. lcp[0] is 0.
+  std::vector<int> lcp;
+};
+
+// Fingerprint of everything that determines how a fused gate acts on a
+// state: its qubits, controls and matrix.
+template <typename Gate>
+uint64_t FusedGateFingerprint(const qsim::GateFused<Gate>& gate) {
+  uint64_t h = tensorflow::Fingerprint64(tensorflow::StringPiece(
+      reinterpret_cast<const char*>(gate.qubits.data()),
+      gate.qubits.size() * sizeof(unsigned)));
+  h = tensorflow::FingerprintCat64(h, static_cast<uint64_t>(gate.kind));
+  if (gate.parent != nullptr) {
+    h = tensorflow::FingerprintCat64(h, gate.parent->cmask);
+    h = tensorflow::FingerprintCat64(
+        h, tensorflow::Fingerprint64(tensorflow::StringPiece(
+               reinterpret_cast<const char*>(gate.parent->controlled_by.data()),
+               gate.parent->controlled_by.size() * sizeof(unsigned))));
+  }
+  return tensorflow::FingerprintCat64(
+      h, tensorflow::Fingerprint64(tensorflow::StringPiece(
+             reinterpret_cast<const char*>(gate.matrix.data()),
+             gate.matrix.size() * sizeof(gate.matrix[0]))));
+}
+
+// True if a and b act identically on every state.
+template <typename Gate>
+bool SameFusedGate(const qsim::GateFused<Gate>& a,
+                   const qsim::GateFused<Gate>& b) {
+  if (a.kind != b.kind || a.qubits != b.qubits ||
+      a.matrix.size() != b.matrix.size()) {
+    return false;
+  }
+  const bool a_controlled =
+      a.parent != nullptr && !a.parent->controlled_by.empty();
+  const bool b_controlled =
+      b.parent != nullptr && !b.parent->controlled_by.empty();
+  if (a_controlled != b_controlled) {
+    return false;
+  }
+  if (a_controlled && (a.parent->controlled_by != b.parent->controlled_by ||
+                       a.parent->cmask != b.parent->cmask)) {
+    return false;
+  }
+  return std::memcmp(a.matrix.data(), b.matrix.data(),
+                     a.matrix.size() * sizeof(a.matrix[0])) == 0;
+}
+
+// Orders batch_indices so that circuits sharing leading fused gates are
+// adjacent and records the shared lengths. Circuits on a different number
+// of qubits never share a prefix.
+template <typename Gate>
+void PlanSharedPrefixes(
+    const std::vector<int>& batch_indices, const std::vector<int>& num_qubits,
+    const std::vector<std::vector<qsim::GateFused<Gate>>>& fused_circuits,
+    PrefixPlan* plan) {
+  std::vector<std::vector<uint64_t>> keys(fused_circuits.size());
+  for (const int i : batch_indices) {
+    keys[i].reserve(fused_circuits[i].size() + 1);
+    keys[i].push_back(num_qubits[i]);
+    for (const auto& gate : fused_circuits[i]) {
+      keys[i].push_back(FusedGateFingerprint(gate));
+    }
+  }
+
+  plan->order = batch_indices;
+  std::stable_sort(plan->order.begin(), plan->order.end(),
+                   [&keys](const int a, const int b) {
+                     return keys[a] < keys[b];
+                   });
+
+  plan->lcp.assign(plan->order.size(), 0);
+  for (size_t k = 1; k < plan->order.size(); k++) {
+    const int a = plan->order[k - 1];
+    const int b = plan->order[k];
+    if (num_qubits[a] != num_qubits[b]) {
+      continue;
+    }
+    const size_t n =
+        std::min(fused_circuits[a].size(), fused_circuits[b].size());
+    size_t l = 0;
+    // Compare the gates themselves so that fingerprint collisions can only
+    // cost sharing, never correctness.
+    while (l < n && keys[a][l + 1] == keys[b][l + 1] &&
+           SameFusedGate(fused_circuits[a][l], fused_circuits[b][l])) {
+      l++;
+    }
+    plan->lcp[k] = l;
+  }
+}
+
+// Numbers of leading (*prefix) and trailing (*suffix) fused gates that all
+// of circuits have in common, with *prefix + *suffix at most the size of the
+// shortest circuit. Both are 0 for fewer than two circuits.
+template <typename Gate>
+void CommonFusedGates(
+    const std::vector<std::vector<qsim::GateFused<Gate>>>& circuits,
+    size_t* prefix, size_t* suffix) {
+  *prefix = 0;
+  *suffix = 0;
+  if (circuits.size() < 2) {
+    return;
+  }
+  size_t shortest = circuits[0].size();
+  for (const auto& circuit : circuits) {
+    shortest = std::min(shortest, circuit.size());
+  }
+
+  const auto& first = circuits[0];
+  bool same = true;
+  while (same && *prefix < shortest) {
+    for (size_t c = 1; same && c < circuits.size(); c++) {
+      same = SameFusedGate(first[*prefix], circuits[c][*prefix]);
+    }
+    if (same) {
+      (*prefix)++;
+    }
+  }
+  same = true;
+  while (same && *prefix + *suffix < shortest) {
+    const size_t back = *suffix + 1;
+    for (size_t c = 1; same && c < circuits.size(); c++) {
+      same = SameFusedGate(first[first.size() - back],
+                           circuits[c][circuits[c].size() - back]);
+    }
+    if (same) {
+      (*suffix)++;
+    }
+  }
+}
+
+// Splits plan->order into at most num_chunks contiguous ranges of similar
+// size for independent workers, preferring to cut where circuits share
+// nothing. chunk_starts receives the first position of every chunk followed
+// by plan->order.size().
+inline void ChunkPrefixPlan(const PrefixPlan& plan, const int num_chunks,
+                            std::vector<size_t>* chunk_starts) {
+  chunk_starts->clear();
+  const size_t n = plan.order.size();
+  chunk_starts->push_back(0);
+  if (n == 0) {
+    return;
+  }
+  size_t start = 0;
+  for (int remaining = num_chunks; remaining > 1; remaining--) {
+    const size_t target = (n - start + remaining - 1) / remaining;
+    if (n - start <= target) {
+      break;
+    }
+    // Look for an unshared boundary in the second half of the chunk before
+    // falling back to a hard cut.
+    size_t cut = start + target;
+    for (size_t k = start + target; k > start + target / 2; k--) {
+      if (plan.lcp[k] == 0) {
+        cut = k;
+        break;
+      }
+    }
+    chunk_starts->push_back(cut);
+    start = cut;
+  }
+  chunk_starts->push_back(n);
+}
+
+// Bytes of checkpoints that each of num_workers concurrent workers may
+// hold, a share of the global StatePool budget.
+inline uint64_t CheckpointBudget(const int num_workers) {
+  return StatePool::Global()->budget() / kCheckpointBudgetDivisor /
+         std::max(num_workers, 1);
+}
+
+// Simulates the circuits plan.order[begin, end) into *sv, calling
+// visit(batch_index) once the final state of each circuit is in *sv.
+// Circuits resume from the deepest checkpoint they share with an earlier
+// circuit of the range. Intermediate states are stored up to
+// checkpoint_bytes (and kMaxCheckpoints states), beyond that circuits
+// recompute from a shallower checkpoint. *sv is grown through arena as
+// needed and may be larger than the circuit.
+template <typename Gate, typename SimT, typename StateSpaceT,
+          typename Function>
+void RunSharedPrefixes(
+    const PrefixPlan& plan, const size_t begin, const size_t end,
+    const std::vector<int>& num_qubits,
+    const std::vector<std::vector<qsim::GateFused<Gate>>>& fused_circuits,
+    const SimT& sim, const StateSpaceT& ss, StateArena<StateSpaceT>& arena,
+    typename StateSpaceT::State* sv, const uint64_t checkpoint_bytes,
+    Function&& visit) {
+  typedef typename StateSpaceT::State State;
+  struct Checkpoint {
+    int depth;
+    int slot;
+  };
+  std::vector<State> slots;
+  std::vector<int> free_slots;
+  std::vector<Checkpoint> stack;
+  std::vector<int> targets;
+
+  for (size_t k = begin; k < end; k++) {
+    const int i = plan.order[k];
+    const int shared = k == begin ? 0 : plan.lcp[k];
+
+    // No later circuit can share more with earlier circuits than this one
+    // does, so deeper checkpoints are done.
+    while (!stack.empty() && stack.back().depth > shared) {
+      free_slots.push_back(stack.back().slot);
+      stack.pop_back();
+    }
+
+    if (static_cast<int>(sv->num_qubits()) < num_qubits[i]) {
+      arena.Resize(num_qubits[i], sv);
+    }
+    const uint64_t state_bytes =
+        sizeof(typename StateSpaceT::fp_type) * ss.MinSize(sv->num_qubits());
+    int depth = 0;
+    if (stack.empty()) {
+      ss.SetStateZero(*sv);
+    } else {
+      depth = stack.back().depth;
+      ss.Copy(slots[stack.back().slot], *sv);
+    }
+
+    // Depths at which later circuits of the range branch off this one, in
+    // increasing order.
+    const int size = fused_circuits[i].size();
+    targets.clear();
+    int running = size + 1;
+    for (size_t m = k + 1; m < end; m++) {
+      if (plan.lcp[m] >= running) {
+        continue;
+      }
+      running = plan.lcp[m];
+      if (running <= depth) {
+        break;
+      }
+      targets.push_back(running);
+    }
+    std::reverse(targets.begin(), targets.end());
+
+    size_t next_target = 0;
+    for (int g = depth; g <= size; g++) {
+      if (next_target < targets.size() && targets[next_target] == g) {
+        int slot = -1;
+        if (!free_slots.empty()) {
+          slot = free_slots.back();
+          free_slots.pop_back();
+        } else if (slots.size() < kMaxCheckpoints &&
+                   (slots.size() + 1) * state_bytes <= checkpoint_bytes) {
+          slots.push_back(arena.Create(sv->num_qubits()));
+          slot = slots.size() - 1;
+        }
+        if (slot >= 0) {
+          if (slots[slot].num_qubits() != sv->num_qubits()) {
+            arena.Resize(sv->num_qubits(), &slots[slot]);
+          }
+          ss.Copy(*sv, slots[slot]);
+          stack.push_back({g, slot});
+        }
+        next_target++;
+      }
+      if (g < size) {
+        qsim::ApplyFusedGate(sim, fused_circuits[i][g], *sv);
+      }
+    }
+    visit(i);
+  }
+}
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_PREFIX_SHARING_H_
@@ -0,0 +1,240 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/prefix_sharing.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include "../qsim/lib/circuit.h"
+#include "../qsim/lib/formux.h"
+#include "../qsim/lib/fuser_basic.h"
+#include "../qsim/lib/gate_appl.h"
+#include "../qsim/lib/gates_cirq.h"
+#include "../qsim/lib/io.h"
+#include "../qsim/lib/simmux.h"
+#include "gtest/gtest.h"
+#include "tensorflow_quantum/core/src/state_pool.h"
+#include "tensorflow_quantum/core/src/util_qsim.h"
+
+namespace tfq {
+namespace {
+
+typedef qsim::Circuit<QsimGate> QsimCircuit;
+typedef qsim::Simulator<qsim::SequentialFor> Simulator;
+typedef Simulator::StateSpace StateSpace;
+
+// Three qubit circuit with a fixed three gate prefix followed by a CXPowGate
+// with the given exponent.
+QsimCircuit PrefixCircuit(const float exponent) {
+  QsimCircuit circuit;
+  circuit.num_qubits = 3;
+  circuit.gates.push_back(
+      qsim::Cirq::XPowGate<float>::Create(0, 0, 0.25, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::CXPowGate<float>::Create(1, 0, 1, 1.0, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::CXPowGate<float>::Create(2, 1, 2, 1.0, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::CXPowGate<float>::Create(3, 0, 1, exponent, 0.0));
+  return circuit;
+}
+
+QsimCircuit TwoQubitCircuit() {
+  QsimCircuit circuit;
+  circuit.num_qubits = 2;
+  circuit.gates.push_back(
+      qsim::Cirq::YPowGate<float>::Create(0, 1, 0.5, 0.0));
+  circuit.gates.push_back(
+      qsim::Cirq::CXPowGate<float>::Create(1, 1, 0, 1.0, 0.0));
+  return circuit;
+}
+
+class PrefixSharingTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    circuits_.push_back(PrefixCircuit(0.5));
+    circuits_.push_back(TwoQubitCircuit());
+    circuits_.push_back(PrefixCircuit(0.25));
+    circuits_.push_back(PrefixCircuit(0.5));
+    circuits_.push_back(QsimCircuit());
+    circuits_.back().num_qubits = 3;
+    for (const auto& circuit : circuits_) {
+      num_qubits_.push_back(circuit.num_qubits);
+      fused_circuits_.push_back(
+          qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+              qsim::BasicGateFuser<qsim::IO, QsimGate>::Parameter(),
+              circuit.num_qubits, circuit.gates));
+      batch_indices_.push_back(batch_indices_.size());
+    }
+  }
+
+  // Runs the whole batch through RunSharedPrefixes and checks every final
+  // state against a simulation from scratch.
+  void CheckStates(const uint64_t checkpoint_bytes) {
+    PrefixPlan plan;
+    PlanSharedPrefixes(batch_indices_, num_qubits_, fused_circuits_, &plan);
+
+    StatePool pool(1 << 20);
+    Simulator sim(1);
+    StateSpace ss(1);
+    StateArena<StateSpace> arena(ss, &pool);
+    auto sv = arena.Create(1);
+    auto expected = arena.Create(3);
+    std::vector<int> visited;
+    RunSharedPrefixes(
+        plan, 0, plan.order.size(), num_qubits_, fused_circuits_, sim, ss,
+        arena, &sv, checkpoint_bytes, [&](const int i) {
+          visited.push_back(i);
+          arena.Resize(num_qubits_[i], &expected);
+          ss.SetStateZero(expected);
+          for (const auto& gate : fused_circuits_[i]) {
+            qsim::ApplyFusedGate(sim, gate, expected);
+          }
+          for (uint64_t j = 0; j < (uint64_t(1) << num_qubits_[i]); j++) {
+            EXPECT_NEAR(ss.GetAmpl(sv, j).real(),
+                        ss.GetAmpl(expected, j).real(), 1e-5);
+            EXPECT_NEAR(ss.GetAmpl(sv, j).imag(),
+                        ss.GetAmpl(expected, j).imag(), 1e-5);
+          }
+        });
+    EXPECT_EQ(visited, plan.order);
+  }
+
+  std::vector<QsimCircuit> circuits_;
+  std::vector<QsimFusedCircuit> fused_circuits_;
+  std::vector<int> num_qubits_;
+  std::vector<int> batch_indices_;
+};
+
+TEST_F(PrefixSharingTest, PlanGroupsSharedPrefixes) {
+  PrefixPlan plan;
+  PlanSharedPrefixes(batch_indices_, num_qubits_, fused_circuits_, &plan);
+  ASSERT_EQ(plan.order.size(), 5);
+  ASSERT_EQ(plan.lcp.size(), 5);
+  EXPECT_EQ(plan.lcp[0], 0);
+
+  // Smaller circuits come first and share nothing with larger ones.
+  EXPECT_EQ(plan.order[0], 1);
+  EXPECT_EQ(plan.lcp[1], 0);
+
+  std::vector<int> position(plan.order.size());
+  for (size_t k = 0; k < plan.order.size(); k++) {
+    position[plan.order[k]] = k;
+  }
+  // Identical circuits are adjacent and share all of their gates.
+  ASSERT_EQ(std::abs(position[0] - position[3]), 1);
+  EXPECT_EQ(plan.lcp[std::max(position[0], position[3])],
+            static_cast<int>(fused_circuits_[0].size()));
+  // Circuits that only differ in their last gate share the others.
+  EXPECT_GT(plan.lcp[std::max(position[2], std::min(position[0],
+                                                    position[3]))],
+            0);
+}
+
+TEST_F(PrefixSharingTest, SharedStatesMatchDirectSimulation) {
+  CheckStates(uint64_t(1) << 20);
+}
+
+TEST_F(PrefixSharingTest, NoCheckpointBudget) { CheckStates(0); }
+
+TEST_F(PrefixSharingTest, SubsetOfBatch) {
+  batch_indices_ = {3, 1};
+  PrefixPlan plan;
+  PlanSharedPrefixes(batch_indices_, num_qubits_, fused_circuits_, &plan);
+  EXPECT_EQ(plan.order, std::vector<int>({1, 3}));
+  EXPECT_EQ(plan.lcp, std::vector<int>({0, 0}));
+}
+
+TEST_F(PrefixSharingTest, CommonFusedGates) {
+  size_t prefix, suffix;
+  CommonFusedGates(std::vector<QsimFusedCircuit>(
+                       {fused_circuits_[0], fused_circuits_[2]}),
+                   &prefix, &suffix);
+  EXPECT_EQ(prefix, fused_circuits_[0].size() - 1);
+  EXPECT_EQ(suffix, 0);
+
+  // Identical circuits are all prefix.
+  CommonFusedGates(std::vector<QsimFusedCircuit>(
+                       {fused_circuits_[0], fused_circuits_[3]}),
+                   &prefix, &suffix);
+  EXPECT_EQ(prefix, fused_circuits_[0].size());
+  EXPECT_EQ(suffix, 0);
+
+  // Circuits that only differ in their first gate share the others as the
+  // suffix.
+  std::vector<QsimFusedCircuit> reversed;
+  for (const float exponent : {0.5f, 0.25f}) {
+    QsimCircuit circuit;
+    circuit.num_qubits = 3;
+    circuit.gates.push_back(
+        qsim::Cirq::CXPowGate<float>::Create(0, 0, 1, exponent, 0.0));
+    circuit.gates.push_back(
+        qsim::Cirq::CXPowGate<float>::Create(1, 1, 2, 1.0, 0.0));
+    circuit.gates.push_back(
+        qsim::Cirq::CXPowGate<float>::Create(2, 0, 1, 1.0, 0.0));
+    reversed.push_back(qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+        qsim::BasicGateFuser<qsim::IO, QsimGate>::Parameter(),
+        circuit.num_qubits, circuit.gates));
+  }
+  CommonFusedGates(reversed, &prefix, &suffix);
+  EXPECT_EQ(prefix, 0);
+  EXPECT_EQ(suffix, reversed[0].size() - 1);
+
+  // A single circuit or a circuit without gates shares nothing.
+  CommonFusedGates(std::vector<QsimFusedCircuit>({fused_circuits_[0]}),
+                   &prefix, &suffix);
+  EXPECT_EQ(prefix + suffix, 0);
+  CommonFusedGates(std::vector<QsimFusedCircuit>(
+                       {fused_circuits_[0], fused_circuits_[4]}),
+                   &prefix, &suffix);
+  EXPECT_EQ(prefix + suffix, 0);
+}
+
+TEST(ChunkPrefixPlanTest, PrefersUnsharedBoundaries) {
+  PrefixPlan plan;
+  plan.order = {0, 1, 2, 3, 4, 5, 6, 7};
+  plan.lcp = {0, 3, 3, 0, 2, 2, 2, 0};
+  std::vector<size_t> chunk_starts;
+
+  ChunkPrefixPlan(plan, 2, &chunk_starts);
+  EXPECT_EQ(chunk_starts, std::vector<size_t>({0, 3, 8}));
+
+  ChunkPrefixPlan(plan, 1, &chunk_starts);
+  EXPECT_EQ(chunk_starts, std::vector<size_t>({0, 8}));
+}
+
+TEST(ChunkPrefixPlanTest, HardCutsAndSmallPlans) {
+  PrefixPlan plan;
+  plan.order = {0, 1, 2, 3};
+  plan.lcp = {0, 1, 1, 1};
+  std::vector<size_t> chunk_starts;
+
+  // Without an unshared boundary nearby the chunk is cut at its target size.
+  ChunkPrefixPlan(plan, 2, &chunk_starts);
+  EXPECT_EQ(chunk_starts, std::vector<size_t>({0, 2, 4}));
+
+  // Never more chunks than circuits.
+  ChunkPrefixPlan(plan, 16, &chunk_starts);
+  EXPECT_EQ(chunk_starts, std::vector<size_t>({0, 1, 2, 3, 4}));
+
+  PrefixPlan empty;
+  ChunkPrefixPlan(empty, 4, &chunk_starts);
+  EXPECT_EQ(chunk_starts, std::vector<size_t>({0}));
+}
+
+}  // namespace
+}  // namespace tfq
@@ -0,0 +1,48 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/program_cache.h"
+
+#include <cstdint>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/fingerprint.h"
+#include "tensorflow/core/util/env_var.h"
+
+namespace tfq {
+
+uint64_t FingerprintSources(const std::vector<absl::string_view>& sources) {
+  uint64_t key = sources.size();
+  for (const auto& source : sources) {
+    key = tensorflow::FingerprintCat64(
+        key, tensorflow::Fingerprint64(
+                 tensorflow::StringPiece(source.data(), source.size())));
+  }
+  return key;
+}
+
+size_t CacheCapacityFromEnv(const char* name, size_t default_capacity) {
+  tensorflow::int64 capacity;
+  tensorflow::Status status =
+      tensorflow::ReadInt64FromEnvVar(name, default_capacity, &capacity);
+  if (!status.ok() || capacity < 0) {
+    return default_capacity;
+  }
+  return static_cast<size_t>(capacity);
+}
+
+}  // namespace tfq
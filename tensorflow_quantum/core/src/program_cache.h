@@ -0,0 +1,180 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// A small process-wide cache used to avoid re-parsing and re-compiling the
+// same serialized inputs on every op invocation.
+
+#ifndef TFQ_CORE_SRC_PROGRAM_CACHE_H_
+#define TFQ_CORE_SRC_PROGRAM_CACHE_H_
+
+#include <cstdint>
+#include <limits>
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/platform/thread_annotations.h"
+
+namespace tfq {
+
+// Computes the cache key of a list of serialized inputs (for example a program
+// string followed by the PauliSum strings of the same batch row).
+uint64_t FingerprintSources(const std::vector<absl::string_view>& sources);
+
+// Reads a cache capacity (in entries or bytes) from the environment variable
+// `name`, falling back to `default_capacity` when the variable is unset or
+// invalid. A capacity of zero disables the cache.
+size_t CacheCapacityFromEnv(const char* name, size_t default_capacity);
+
+// Size bounded least-recently-used cache that maps the fingerprint of a list
+// of serialized inputs to an immutable value computed from them. The original
+// bytes are stored alongside every value and compared on lookup, so that a
+// fingerprint collision can never return a value for different inputs.
+//
+// The cache is bounded both by entry count and by bytes. Every entry is
+// charged the size of its serialized inputs plus the value size the caller
+// passes to Insert, and least recently used entries are evicted until both
+// bounds hold. A single entry larger than the byte bound is not stored.
+//
+// Values are handed out as shared_ptr<const T>, which means an entry that is
+// evicted while another thread still uses it stays alive until released.
+// All methods are thread safe.
+template <typename T>
+class ProgramCache {
+ public:
+  explicit ProgramCache(
+      size_t capacity,
+      size_t byte_capacity = std::numeric_limits<size_t>::max())
+      : capacity_(capacity), byte_capacity_(byte_capacity) {}
+
+  ProgramCache(const ProgramCache&) = delete;
+  ProgramCache& operator=(const ProgramCache&) = delete;
+
+  // Returns the value stored for `sources`, or nullptr if there is none.
+  std::shared_ptr<const T> Lookup(
+      uint64_t key, const std::vector<absl::string_view>& sources) {
+    std::shared_ptr<const Entry> entry;
+    {
+      tensorflow::mutex_lock lock(mu_);
+      auto it = index_.find(key);
+      if (it == index_.end()) {
+        return nullptr;
+      }
+      // Move to the front of the recency list.
+      lru_.splice(lru_.begin(), lru_, it->second);
+      entry = *it->second;
+    }
+    if (entry->sources.size() != sources.size()) {
+      return nullptr;
+    }
+    for (size_t i = 0; i < sources.size(); i++) {
+      if (entry->sources[i] != sources[i]) {
+        return nullptr;
+      }
+    }
+    return entry->value;
+  }
+
+  // Stores `value` as the result for `sources`, replacing any previous value
+  // with the same key and evicting least recently used entries until the
+  // new one fits. `value_bytes` is the memory held by `value` itself.
+  void Insert(uint64_t key, const std::vector<absl::string_view>& sources,
+              std::shared_ptr<const T> value, size_t value_bytes = 0) {
+    if (capacity_ == 0) {
+      return;
+    }
+    size_t bytes = value_bytes;
+    for (const auto& source : sources) {
+      bytes += source.size();
+    }
+    if (bytes > byte_capacity_) {
+      return;
+    }
+    auto entry = std::make_shared<Entry>();
+    entry->sources.reserve(sources.size());
+    for (const auto& source : sources) {
+      entry->sources.emplace_back(source.data(), source.size());
+    }
+    entry->value = std::move(value);
+    entry->bytes = bytes;
+
+    tensorflow::mutex_lock lock(mu_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      bytes_ -= (*it->second)->bytes;
+      lru_.erase(it->second);
+      index_.erase(it);
+    }
+    while (!lru_.empty() && (lru_.size() >= capacity_ ||
+                             bytes_ + bytes > byte_capacity_)) {
+      bytes_ -= lru_.back()->bytes;
+      index_.erase(lru_.back()->key);
+      lru_.pop_back();
+    }
+    entry->key = key;
+    bytes_ += bytes;
+    lru_.push_front(std::move(entry));
+    index_[key] = lru_.begin();
+  }
+
+  // Removes every entry from the cache.
+  void Clear() {
+    tensorflow::mutex_lock lock(mu_);
+    index_.clear();
+    lru_.clear();
+    bytes_ = 0;
+  }
+
+  size_t size() const {
+    tensorflow::mutex_lock lock(mu_);
+    return lru_.size();
+  }
+
+  // Bytes charged to the entries currently in the cache.
+  size_t bytes() const {
+    tensorflow::mutex_lock lock(mu_);
+    return bytes_;
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  size_t byte_capacity() const { return byte_capacity_; }
+
+ private:
+  struct Entry {
+    uint64_t key;
+    size_t bytes;
+    std::vector<std::string> sources;
+    std::shared_ptr<const T> value;
+  };
+  typedef std::list<std::shared_ptr<const Entry>> EntryList;
+
+  const size_t capacity_;
+  const size_t byte_capacity_;
+  mutable tensorflow::mutex mu_;
+  size_t bytes_ TF_GUARDED_BY(mu_) = 0;
+  EntryList lru_ TF_GUARDED_BY(mu_);
+  absl::flat_hash_map<uint64_t, typename EntryList::iterator> index_
+      TF_GUARDED_BY(mu_);
+};
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_PROGRAM_CACHE_H_
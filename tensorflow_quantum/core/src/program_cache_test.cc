@@ -0,0 +1,152 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/program_cache.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "gtest/gtest.h"
+
+namespace tfq {
+namespace {
+
+TEST(ProgramCacheTest, FingerprintSourcesOrder) {
+  std::vector<absl::string_view> a = {"program", "sum"};
+  std::vector<absl::string_view> b = {"sum", "program"};
+  std::vector<absl::string_view> c = {"programsum"};
+  EXPECT_EQ(FingerprintSources(a), FingerprintSources(a));
+  EXPECT_NE(FingerprintSources(a), FingerprintSources(b));
+  EXPECT_NE(FingerprintSources(a), FingerprintSources(c));
+}
+
+TEST(ProgramCacheTest, LookupHitAndMiss) {
+  ProgramCache<int> cache(4);
+  std::vector<absl::string_view> sources = {"abc"};
+  const uint64_t key = FingerprintSources(sources);
+
+  EXPECT_EQ(cache.Lookup(key, sources), nullptr);
+  cache.Insert(key, sources, std::make_shared<const int>(7));
+  auto hit = cache.Lookup(key, sources);
+  ASSERT_NE(hit, nullptr);
+  EXPECT_EQ(*hit, 7);
+  EXPECT_EQ(cache.size(), 1);
+}
+
+TEST(ProgramCacheTest, SourceMismatch) {
+  ProgramCache<int> cache(4);
+  std::vector<absl::string_view> sources = {"abc"};
+  std::vector<absl::string_view> other = {"abd"};
+  std::vector<absl::string_view> longer = {"abc", "def"};
+  // Force a collision by reusing the same key for different bytes.
+  cache.Insert(1, sources, std::make_shared<const int>(7));
+  EXPECT_EQ(cache.Lookup(1, other), nullptr);
+  EXPECT_EQ(cache.Lookup(1, longer), nullptr);
+  EXPECT_NE(cache.Lookup(1, sources), nullptr);
+}
+
+TEST(ProgramCacheTest, ReplaceEntry) {
+  ProgramCache<int> cache(4);
+  std::vector<absl::string_view> sources = {"abc"};
+  cache.Insert(1, sources, std::make_shared<const int>(7));
+  cache.Insert(1, sources, std::make_shared<const int>(8));
+  EXPECT_EQ(cache.size(), 1);
+  EXPECT_EQ(*cache.Lookup(1, sources), 8);
+}
+
+TEST(ProgramCacheTest, EvictsLeastRecentlyUsed) {
+  ProgramCache<int> cache(2);
+  std::vector<absl::string_view> a = {"a"};
+  std::vector<absl::string_view> b = {"b"};
+  std::vector<absl::string_view> c = {"c"};
+  cache.Insert(1, a, std::make_shared<const int>(1));
+  cache.Insert(2, b, std::make_shared<const int>(2));
+
+  // Touch "a" so that "b" becomes the eviction candidate.
+  EXPECT_NE(cache.Lookup(1, a), nullptr);
+  cache.Insert(3, c, std::make_shared<const int>(3));
+
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_NE(cache.Lookup(1, a), nullptr);
+  EXPECT_EQ(cache.Lookup(2, b), nullptr);
+  EXPECT_NE(cache.Lookup(3, c), nullptr);
+}
+
+TEST(ProgramCacheTest, EvictedValueStaysAlive) {
+  ProgramCache<std::string> cache(1);
+  std::vector<absl::string_view> a = {"a"};
+  std::vector<absl::string_view> b = {"b"};
+  cache.Insert(1, a, std::make_shared<const std::string>("value"));
+  auto held = cache.Lookup(1, a);
+  cache.Insert(2, b, std::make_shared<const std::string>("other"));
+  EXPECT_EQ(cache.Lookup(1, a), nullptr);
+  EXPECT_EQ(*held, "value");
+}
+
+TEST(ProgramCacheTest, EvictsToByteCapacity) {
+  ProgramCache<int> cache(8, 64);
+  std::vector<absl::string_view> a = {"a"};
+  std::vector<absl::string_view> b = {"b"};
+  std::vector<absl::string_view> c = {"c"};
+  cache.Insert(1, a, std::make_shared<const int>(1), 30);
+  cache.Insert(2, b, std::make_shared<const int>(2), 30);
+  EXPECT_EQ(cache.bytes(), 62);
+
+  // "c" does not fit next to both, so the least recent entry goes.
+  cache.Insert(3, c, std::make_shared<const int>(3), 30);
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_EQ(cache.bytes(), 62);
+  EXPECT_EQ(cache.Lookup(1, a), nullptr);
+  EXPECT_NE(cache.Lookup(2, b), nullptr);
+  EXPECT_NE(cache.Lookup(3, c), nullptr);
+
+  // Replacing an entry releases its old charge.
+  cache.Insert(3, c, std::make_shared<const int>(4), 10);
+  EXPECT_EQ(cache.bytes(), 42);
+}
+
+TEST(ProgramCacheTest, SkipsEntriesLargerThanByteCapacity) {
+  ProgramCache<int> cache(8, 64);
+  std::vector<absl::string_view> a = {"a"};
+  std::vector<absl::string_view> b = {"b"};
+  cache.Insert(1, a, std::make_shared<const int>(1), 30);
+  cache.Insert(2, b, std::make_shared<const int>(2), 100);
+  EXPECT_EQ(cache.size(), 1);
+  EXPECT_NE(cache.Lookup(1, a), nullptr);
+  EXPECT_EQ(cache.Lookup(2, b), nullptr);
+}
+
+TEST(ProgramCacheTest, ZeroCapacityDisables) {
+  ProgramCache<int> cache(0);
+  std::vector<absl::string_view> sources = {"abc"};
+  cache.Insert(1, sources, std::make_shared<const int>(7));
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.Lookup(1, sources), nullptr);
+}
+
+TEST(ProgramCacheTest, Clear) {
+  ProgramCache<int> cache(4);
+  std::vector<absl::string_view> sources = {"abc"};
+  cache.Insert(1, sources, std::make_shared<const int>(7));
+  cache.Clear();
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.bytes(), 0);
+  EXPECT_EQ(cache.Lookup(1, sources), nullptr);
+}
+
+}  // namespace
+}  // namespace tfq
@@ -15,14 +15,17 @@ limitations under the License.
 
 #include "tensorflow_quantum/core/src/program_resolution.h"
 
+#include <algorithm>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
 #include "absl/strings/str_cat.h"
-#include "absl/strings/str_join.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
 #include "tensorflow/core/lib/core/error_codes.pb.h"
 #include "tensorflow/core/lib/core/status.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
@@ -40,137 +43,171 @@ using tfq::proto::PauliTerm;
 using tfq::proto::Program;
 using tfq::proto::Qubit;
 
+namespace {
+
 inline absl::string_view IntMaxStr() {
   static constexpr char kMaxVal[] = "2147483647";
   return kMaxVal;
 }
 
-Status RegisterQubits(
-    const std::string& qb_string,
-    absl::flat_hash_set<std::pair<std::pair<int, int>, std::string>>* id_set) {
-  // Inserts qubits found in qb_string into id_set.
+// Grid locations of qubit ids. The ids point into the program they were
+// found in.
+typedef absl::flat_hash_map<absl::string_view, std::pair<int, int>>
+    QubitLocations;
+
+// Index of every qubit of a reference program, by qubit id.
+struct QubitIndex {
+  absl::flat_hash_map<std::string, int> index;
+  // ids[i] is the new id of qubit i, i as a string.
+  std::vector<std::string> ids;
+};
+
+Status RegisterQubits(absl::string_view qb_string, QubitLocations* locations) {
+  // Inserts qubits found in qb_string into locations, parsing each id once.
   // Supported GridQubit wire formats and line qubit wire formats.
 
   if (qb_string.empty()) {
     return Status::OK();  // no control-default value specified in serializer.py
   }
 
-  const std::vector<absl::string_view> qb_list = absl::StrSplit(qb_string, ',');
-  for (auto qb : qb_list) {
-    int r, c;
-    std::vector<absl::string_view> splits = absl::StrSplit(qb, '_');
-    if (splits.size() == 1) {  // Pad the front of linequbit with INTMAX.
-      splits.insert(splits.begin(), IntMaxStr());
-    }
-
-    if (splits.size() != 2) {
-      return Status(tensorflow::error::INVALID_ARGUMENT,
-                    absl::StrCat("Unable to parse qubit: ", qb));
+  for (absl::string_view qb : absl::StrSplit(qb_string, ',')) {
+    if (locations->contains(qb)) {
+      continue;
     }
-    if (!absl::SimpleAtoi(splits[0], &r)) {
-      return Status(tensorflow::error::INVALID_ARGUMENT,
-                    absl::StrCat("Unable to parse qubit: ", qb));
+    // Pad the front of linequbit with INTMAX.
+    const size_t split = qb.find('_');
+    absl::string_view row = IntMaxStr();
+    absl::string_view col = qb;
+    if (split != absl::string_view::npos) {
+      row = qb.substr(0, split);
+      col = qb.substr(split + 1);
     }
-    if (!absl::SimpleAtoi(splits[1], &c)) {
+    int r, c;
+    if (col.find('_') != absl::string_view::npos ||
+        !absl::SimpleAtoi(row, &r) || !absl::SimpleAtoi(col, &c)) {
       return Status(tensorflow::error::INVALID_ARGUMENT,
                     absl::StrCat("Unable to parse qubit: ", qb));
     }
-    auto locs = std::pair<std::pair<int, int>, std::string>(
-        std::pair<int, int>(r, c), std::string(qb));
-    id_set->insert(locs);
+    (*locations)[qb] = std::pair<int, int>(r, c);
   }
   return Status::OK();
 }
 
-Status ResolveQubitIds(Program* program, unsigned int* num_qubits,
-                       std::vector<PauliSum>* p_sums /*=nullptr*/) {
-  if (program->circuit().moments().empty()) {
-    // (#679) Just ignore empty program.
-    // Number of qubits in empty programs is zero.
-    *num_qubits = 0;
-    return Status::OK();
-  }
-
-  absl::flat_hash_set<std::pair<std::pair<int, int>, std::string>> id_set;
-  for (const Moment& moment : program->circuit().moments()) {
+// Orders the qubits of program by their grid location.
+Status IndexQubits(const Program& program, QubitIndex* qubits) {
+  QubitLocations locations;
+  for (const Moment& moment : program.circuit().moments()) {
     for (const Operation& operation : moment.operations()) {
       Status s;
       for (const Qubit& qubit : operation.qubits()) {
-        s = RegisterQubits(qubit.id(), &id_set);
+        s = RegisterQubits(qubit.id(), &locations);
         if (!s.ok()) {
           return s;
         }
       }
       s = RegisterQubits(
           operation.args().at("control_qubits").arg_value().string_value(),
-          &id_set);
+          &locations);
       if (!s.ok()) {
         return s;
       }
     }
   }
-  *num_qubits = id_set.size();
 
   // call to std::sort will do (r1 < r2) || ((r1 == r2) && c1 < c2)
-  std::vector<std::pair<std::pair<int, int>, std::string>> ids(id_set.begin(),
-                                                               id_set.end());
+  std::vector<std::pair<std::pair<int, int>, absl::string_view>> ids;
+  ids.reserve(locations.size());
+  for (const auto& location : locations) {
+    ids.emplace_back(location.second, location.first);
+  }
   std::sort(ids.begin(), ids.end());
 
-  absl::flat_hash_map<std::string, std::string> id_to_index;
+  qubits->index.reserve(ids.size());
+  qubits->ids.reserve(ids.size());
   for (size_t i = 0; i < ids.size(); i++) {
-    id_to_index[ids[i].second] = absl::StrCat(i);
+    qubits->index.emplace(std::string(ids[i].second), i);
+    qubits->ids.push_back(absl::StrCat(i));
   }
+  return Status::OK();
+}
+
+// Replaces the ids of the qubits and control qubits of operation with their
+// indices, marking each index in *visited if it is given. Returns false if
+// operation acts on a qubit that is not in qubits. *buffer is scratch space
+// reused across calls.
+bool RenameQubits(const QubitIndex& qubits, Operation* operation,
+                  std::string* buffer, std::vector<bool>* visited) {
+  for (Qubit& qubit : *operation->mutable_qubits()) {
+    const auto result = qubits.index.find(qubit.id());
+    if (result == qubits.index.end()) {
+      return false;
+    }
+    if (visited != nullptr) {
+      (*visited)[result->second] = true;
+    }
+    qubit.set_id(qubits.ids[result->second]);
+  }
+
+  // Resolve control qubit ids found in the control_qubits arg.
+  Arg& control_arg = operation->mutable_args()->at("control_qubits");
+  absl::string_view control_qubits = control_arg.arg_value().string_value();
+  // explicit empty value set in serializer.py.
+  if (control_qubits.empty()) {
+    return true;
+  }
+  buffer->clear();
+  for (absl::string_view id : absl::StrSplit(control_qubits, ',')) {
+    const auto result = qubits.index.find(id);
+    if (result == qubits.index.end()) {
+      return false;
+    }
+    if (visited != nullptr) {
+      (*visited)[result->second] = true;
+    }
+    if (!buffer->empty()) {
+      buffer->push_back(',');
+    }
+    buffer->append(qubits.ids[result->second]);
+  }
+  control_arg.mutable_arg_value()->set_string_value(*buffer);
+  return true;
+}
+
+// Renames the qubits of program in place, returning their number.
+Status ResolveReferenceProgram(Program* program, unsigned int* num_qubits,
+                               QubitIndex* qubits) {
+  Status s = IndexQubits(*program, qubits);
+  if (!s.ok()) {
+    return s;
+  }
+  *num_qubits = qubits->ids.size();
 
   // Replace the Program Qubit ids with the indices.
+  std::string buffer;
   for (Moment& moment : *program->mutable_circuit()->mutable_moments()) {
     for (Operation& operation : *moment.mutable_operations()) {
-      // Resolve qubit ids.
-      for (Qubit& qubit : *operation.mutable_qubits()) {
-        qubit.set_id(id_to_index.at(qubit.id()));
-      }
-      // Resolve control qubit ids found in the control_qubits arg.
-      absl::string_view control_qubits =
-          operation.args().at("control_qubits").arg_value().string_value();
-      // explicit empty value set in serializer.py.
-      if (control_qubits.empty()) {
-        continue;
-      }
-      std::vector<absl::string_view> control_ids =
-          absl::StrSplit(control_qubits, ',');
-      std::vector<std::string> control_indexs;
-      control_indexs.reserve(control_ids.size());
-      for (auto id : control_ids) {
-        control_indexs.push_back(id_to_index.at(id));
-      }
-      operation.mutable_args()
-          ->at("control_qubits")
-          .mutable_arg_value()
-          ->set_string_value(absl::StrJoin(control_indexs, ","));
+      RenameQubits(*qubits, &operation, &buffer, nullptr);
     }
   }
+  return Status::OK();
+}
+
+}  // namespace
 
+Status ResolveQubitIds(Program* program, unsigned int* num_qubits,
+                       std::vector<PauliSum>* p_sums /*=nullptr*/) {
+  std::vector<PauliSum*> p_sum_ptrs;
   if (p_sums) {
-    for (size_t i = 0; i < p_sums->size(); i++) {
-      // Replace the PauliSum Qubit ids with the indices.
-      for (PauliTerm& term : *(p_sums->at(i)).mutable_terms()) {
-        for (PauliQubitPair& pair : *term.mutable_paulis()) {
-          const auto result = id_to_index.find(pair.qubit_id());
-          if (result == id_to_index.end()) {
-            return Status(
-                tensorflow::error::INVALID_ARGUMENT,
-                "Found a Pauli sum operating on qubits not found in circuit.");
-          }
-          pair.set_qubit_id(result->second);
-        }
-      }
+    p_sum_ptrs.reserve(p_sums->size());
+    for (PauliSum& p_sum : *p_sums) {
+      p_sum_ptrs.push_back(&p_sum);
     }
   }
-
-  return Status::OK();
+  return ResolveQubitIds(program, num_qubits, p_sum_ptrs);
 }
 
 Status ResolveQubitIds(Program* program, unsigned int* num_qubits,
-                       std::vector<Program>* other_programs) {
+                       const std::vector<PauliSum*>& p_sums) {
   if (program->circuit().moments().empty()) {
     // (#679) Just ignore empty program.
     // Number of qubits in empty programs is zero.
@@ -178,111 +215,70 @@ Status ResolveQubitIds(Program* program, unsigned int* num_qubits,
     return Status::OK();
   }
 
-  absl::flat_hash_set<std::pair<std::pair<int, int>, std::string>> id_set;
-  for (const Moment& moment : program->circuit().moments()) {
-    for (const Operation& operation : moment.operations()) {
-      Status s;
-      for (const Qubit& qubit : operation.qubits()) {
-        s = RegisterQubits(qubit.id(), &id_set);
-        if (!s.ok()) {
-          return s;
+  QubitIndex qubits;
+  Status s = ResolveReferenceProgram(program, num_qubits, &qubits);
+  if (!s.ok()) {
+    return s;
+  }
+
+  for (PauliSum* p_sum : p_sums) {
+    // Replace the PauliSum Qubit ids with the indices.
+    for (PauliTerm& term : *p_sum->mutable_terms()) {
+      for (PauliQubitPair& pair : *term.mutable_paulis()) {
+        const auto result = qubits.index.find(pair.qubit_id());
+        if (result == qubits.index.end()) {
+          return Status(
+              tensorflow::error::INVALID_ARGUMENT,
+              "Found a Pauli sum operating on qubits not found in circuit.");
         }
-      }
-      s = RegisterQubits(
-          operation.args().at("control_qubits").arg_value().string_value(),
-          &id_set);
-      if (!s.ok()) {
-        return s;
+        pair.set_qubit_id(qubits.ids[result->second]);
       }
     }
   }
-  *num_qubits = id_set.size();
 
-  // call to std::sort will do (r1 < r2) || ((r1 == r2) && c1 < c2)
-  std::vector<std::pair<std::pair<int, int>, std::string>> ids(id_set.begin(),
-                                                               id_set.end());
-  std::sort(ids.begin(), ids.end());
+  return Status::OK();
+}
 
-  absl::flat_hash_map<std::string, std::string> id_to_index;
-  absl::flat_hash_set<std::string> id_ref;
-  for (size_t i = 0; i < ids.size(); i++) {
-    id_to_index[ids[i].second] = absl::StrCat(i);
-    id_ref.insert(ids[i].second);
+Status ResolveQubitIds(Program* program, unsigned int* num_qubits,
+                       std::vector<Program>* other_programs) {
+  std::vector<Program*> other_ptrs;
+  other_ptrs.reserve(other_programs->size());
+  for (Program& other : *other_programs) {
+    other_ptrs.push_back(&other);
   }
+  return ResolveQubitIds(program, num_qubits, other_ptrs);
+}
 
-  // Replace the Program Qubit ids with the indices.
-  for (Moment& moment : *program->mutable_circuit()->mutable_moments()) {
-    for (Operation& operation : *moment.mutable_operations()) {
-      for (Qubit& qubit : *operation.mutable_qubits()) {
-        qubit.set_id(id_to_index.at(qubit.id()));
-      }
-      // Resolve control qubit ids found in the control_qubits arg.
-      absl::string_view control_qubits =
-          operation.args().at("control_qubits").arg_value().string_value();
-      // explicit empty value set in serializer.py.
-      if (control_qubits.empty()) {
-        continue;
-      }
-      std::vector<absl::string_view> control_ids =
-          absl::StrSplit(control_qubits, ',');
-      std::vector<std::string> control_indexs;
-      control_indexs.reserve(control_ids.size());
-      for (auto id : control_ids) {
-        control_indexs.push_back(id_to_index.at(id));
-      }
-      operation.mutable_args()
-          ->at("control_qubits")
-          .mutable_arg_value()
-          ->set_string_value(absl::StrJoin(control_indexs, ","));
-    }
+Status ResolveQubitIds(Program* program, unsigned int* num_qubits,
+                       const std::vector<Program*>& other_programs) {
+  if (program->circuit().moments().empty()) {
+    // (#679) Just ignore empty program.
+    // Number of qubits in empty programs is zero.
+    *num_qubits = 0;
+    return Status::OK();
   }
 
-  for (size_t i = 0; i < other_programs->size(); i++) {
+  QubitIndex qubits;
+  Status s = ResolveReferenceProgram(program, num_qubits, &qubits);
+  if (!s.ok()) {
+    return s;
+  }
+
+  std::string buffer;
+  std::vector<bool> visited;
+  for (Program* other : other_programs) {
     // Replace the other_program Qubit ids with the indices.
-    absl::flat_hash_set<std::string> visited_qubits(id_ref);
-    for (Moment& moment :
-         *(other_programs->at(i)).mutable_circuit()->mutable_moments()) {
+    visited.assign(qubits.ids.size(), false);
+    for (Moment& moment : *other->mutable_circuit()->mutable_moments()) {
       for (Operation& operation : *moment.mutable_operations()) {
-        // Resolve qubit ids.
-        for (Qubit& qubit : *operation.mutable_qubits()) {
-          visited_qubits.erase(qubit.id());
-          const auto result = id_to_index.find(qubit.id());
-          if (result == id_to_index.end()) {
-            return Status(tensorflow::error::INVALID_ARGUMENT,
-                          "A paired circuit contains qubits not found in "
-                          "reference circuit.");
-          }
-          qubit.set_id(result->second);
-        }
-        // Resolve control qubit ids.
-        absl::string_view control_qubits = operation.mutable_args()
-                                               ->at("control_qubits")
-                                               .arg_value()
-                                               .string_value();
-        if (control_qubits.empty()) {  // explicit empty value.
-          continue;
-        }
-        std::vector<absl::string_view> control_ids =
-            absl::StrSplit(control_qubits, ',');
-        std::vector<std::string> control_indexs;
-        control_indexs.reserve(control_ids.size());
-        for (auto id : control_ids) {
-          visited_qubits.erase(id);
-          const auto result = id_to_index.find(id);
-          if (result == id_to_index.end()) {
-            return Status(tensorflow::error::INVALID_ARGUMENT,
-                          "A paired circuit contains qubits not found in "
-                          "reference circuit.");
-          }
-          control_indexs.push_back(result->second);
+        if (!RenameQubits(qubits, &operation, &buffer, &visited)) {
+          return Status(tensorflow::error::INVALID_ARGUMENT,
+                        "A paired circuit contains qubits not found in "
+                        "reference circuit.");
         }
-        operation.mutable_args()
-            ->at("control_qubits")
-            .mutable_arg_value()
-            ->set_string_value(absl::StrJoin(control_indexs, ","));
       }
     }
-    if (!visited_qubits.empty()) {
+    if (std::find(visited.begin(), visited.end(), false) != visited.end()) {
       return Status(
           tensorflow::error::INVALID_ARGUMENT,
           "A reference circuit contains qubits not found in paired circuit.");
@@ -20,6 +20,7 @@ limitations under the License.
 #define TFQ_CORE_SRC_PROGRAM_RESOLUTION
 
 #include <string>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
 #include "tensorflow/core/lib/core/status.h"
@@ -39,6 +40,12 @@ tensorflow::Status ResolveQubitIds(
     tfq::proto::Program* program, unsigned int* num_qubits,
     std::vector<tfq::proto::PauliSum>* p_sums = nullptr);
 
+// Overload which resolves PauliSums that are not held in a vector, such as
+// messages allocated on a protobuf Arena. Every message is resolved in place.
+tensorflow::Status ResolveQubitIds(
+    tfq::proto::Program* program, unsigned int* num_qubits,
+    const std::vector<tfq::proto::PauliSum*>& p_sums);
+
 // Overload which allows for strict resolution of multiple programs.
 // Will resolve GridQubits in `program` and then double check that
 // all qubits in `other_programs` match and resolve them.
@@ -47,6 +54,11 @@ tensorflow::Status ResolveQubitIds(
     tfq::proto::Program* program, unsigned int* num_qubits,
     std::vector<tfq::proto::Program>* other_programs);
 
+// Overload of the above for other_programs that are not held in a vector.
+tensorflow::Status ResolveQubitIds(
+    tfq::proto::Program* program, unsigned int* num_qubits,
+    const std::vector<tfq::proto::Program*>& other_programs);
+
 // Resolves all of the symbols present in the Program. Iterates through all
 // operations in all moments, and if any Args have a symbol, replaces the one-of
 // with an ArgValue representing the value in the parameter map keyed by the
@@ -15,6 +15,7 @@ limitations under the License.
 
 #include "tensorflow_quantum/core/src/program_resolution.h"
 
+#include <google/protobuf/arena.h>
 #include <google/protobuf/text_format.h>
 
 #include <string>
@@ -427,6 +428,51 @@ TEST(ProgramResolutionTest, ResolveQubitIdsMultiProgramSmallerControl) {
           "A reference circuit contains qubits not found in paired circuit."));
 }
 
+TEST(ProgramResolutionTest, ResolveQubitIdsArena) {
+  google::protobuf::Arena arena;
+  Program* program = google::protobuf::Arena::CreateMessage<Program>(&arena);
+  Program* other = google::protobuf::Arena::CreateMessage<Program>(&arena);
+  PauliSum* p_sum = google::protobuf::Arena::CreateMessage<PauliSum>(&arena);
+  unsigned int qubit_count;
+  ASSERT_TRUE(
+      google::protobuf::TextFormat::ParseFromString(valid_program, program));
+  ASSERT_TRUE(
+      google::protobuf::TextFormat::ParseFromString(valid_program, other));
+  ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(valid_psum, p_sum));
+
+  // Every qubit also appears as a control, in a different order.
+  other->mutable_circuit()
+      ->mutable_moments(0)
+      ->mutable_operations(0)
+      ->mutable_args()
+      ->at("control_qubits")
+      .mutable_arg_value()
+      ->set_string_value("0_2,0_0,0_1");
+
+  EXPECT_EQ(ResolveQubitIds(program, &qubit_count,
+                            std::vector<Program*>({other})),
+            Status::OK());
+  EXPECT_EQ(qubit_count, 3);
+  EXPECT_EQ(other->circuit().moments(0).operations(0).qubits(0).id(), "1");
+  EXPECT_EQ(other->circuit()
+                .moments(0)
+                .operations(0)
+                .args()
+                .at("control_qubits")
+                .arg_value()
+                .string_value(),
+            "2,0,1");
+
+  ASSERT_TRUE(
+      google::protobuf::TextFormat::ParseFromString(valid_program, program));
+  EXPECT_EQ(ResolveQubitIds(program, &qubit_count,
+                            std::vector<PauliSum*>({p_sum})),
+            Status::OK());
+  EXPECT_EQ(p_sum->terms(0).paulis(0).qubit_id(), "0");
+  EXPECT_EQ(p_sum->terms(1).paulis(0).qubit_id(), "2");
+  EXPECT_EQ(p_sum->terms(1).paulis(1).qubit_id(), "1");
+}
+
 TEST(ProgramResolutionTest, ResolveSymbolsPartial) {
   Program symbol_program;
   ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(
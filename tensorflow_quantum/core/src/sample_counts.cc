@@ -0,0 +1,33 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/sample_counts.h"
+
+namespace tfq {
+
+double StirlingApproxTail(const double k) {
+  static const double kTailValues[] = {
+      0.0810614667953272,  0.0413406959554092, 0.0276779256849983,
+      0.02079067210376509, 0.0166446911898211, 0.0138761288230707,
+      0.0118967099458917,  0.0104112652619720, 0.00925546218271273,
+      0.00833056343336287};
+  if (k <= 9) {
+    return kTailValues[static_cast<int>(k)];
+  }
+  const double kp1sq = (k + 1) * (k + 1);
+  return (1.0 / 12 - (1.0 / 360 - 1.0 / 1260 / kp1sq) / kp1sq) / (k + 1);
+}
+
+}  // namespace tfq
@@ -0,0 +1,174 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Histograms of measurement samples. Instead of drawing every sample of a
+// state, SampleStateCounts draws the number of times each bitstring occurs
+// directly, so that the cost beyond one pass over the state only grows
+// with the number of distinct bitstrings.
+//
+// Random number generators are any type with a `double RandDouble()` method
+// returning uniform values in [0, 1), like tensorflow::random::SimplePhilox.
+
+#ifndef TFQ_CORE_SRC_SAMPLE_COUNTS_H_
+#define TFQ_CORE_SRC_SAMPLE_COUNTS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace tfq {
+
+// (bitstring, count) pairs in increasing bitstring order.
+typedef std::vector<std::pair<uint64_t, uint64_t>> BitstringCounts;
+
+// Error of Stirling's approximation of log(k!).
+double StirlingApproxTail(double k);
+
+// Draws from the binomial distribution of n trials with success probability
+// p. Inverts the geometric waiting times when n * p is small and otherwise
+// uses the BTRS rejection sampler of Hormann, "The generation of binomial
+// random variates" (1993), so that draws take O(1) expected time.
+template <typename Rng>
+uint64_t SampleBinomial(const uint64_t n, const double p, Rng* rng) {
+  if (n == 0 || p <= 0) {
+    return 0;
+  }
+  if (p >= 1) {
+    return n;
+  }
+  if (p > 0.5) {
+    return n - SampleBinomial(n, 1 - p, rng);
+  }
+
+  if (n * p < 10) {
+    const double log_q = std::log1p(-p);
+    uint64_t x = 0;
+    double trials = 0;
+    while (true) {
+      trials += std::floor(std::log(1 - rng->RandDouble()) / log_q) + 1;
+      if (trials > n) {
+        return x;
+      }
+      x++;
+    }
+  }
+
+  const double spq = std::sqrt(n * p * (1 - p));
+  const double b = 1.15 + 2.53 * spq;
+  const double a = -0.0873 + 0.0248 * b + 0.01 * p;
+  const double c = n * p + 0.5;
+  const double v_r = 0.92 - 4.2 / b;
+  const double r = p / (1 - p);
+  const double alpha = (2.83 + 5.1 / b) * spq;
+  const double m = std::floor((n + 1) * p);
+  while (true) {
+    const double u = rng->RandDouble() - 0.5;
+    double v = rng->RandDouble();
+    const double us = 0.5 - std::abs(u);
+    const double k = std::floor((2 * a / us + b) * u + c);
+    if (us >= 0.07 && v <= v_r) {
+      return k;
+    }
+    if (k < 0 || k > n) {
+      continue;
+    }
+    v = std::log(v * alpha / (a / (us * us) + b));
+    const double bound =
+        (m + 0.5) * std::log((m + 1) / (r * (n - m + 1))) +
+        (n + 1) * std::log((n - m + 1) / (n - k + 1)) +
+        (k + 0.5) * std::log(r * (n - k + 1) / (k + 1)) +
+        StirlingApproxTail(m) + StirlingApproxTail(n - m) -
+        StirlingApproxTail(k) - StirlingApproxTail(n - k);
+    if (v <= bound) {
+      return k;
+    }
+  }
+}
+
+// Draws the counts of num_samples samples of k in [0, size) with
+// probability probability(k) / norm, where norm is the sum of all
+// probabilities. Every count is a binomial draw conditioned on the samples
+// left after the smaller bitstrings, which stops as soon as all samples
+// are placed.
+template <typename Rng, typename Function>
+void SampleMultinomialCounts(const uint64_t size, const double norm,
+                             const uint64_t num_samples, Function&& probability,
+                             Rng* rng, BitstringCounts* counts) {
+  counts->clear();
+  uint64_t remaining = num_samples;
+  double mass = norm;
+  uint64_t last = size;
+  for (uint64_t k = 0; k < size && remaining > 0; k++) {
+    const double p = probability(k);
+    if (p <= 0) {
+      continue;
+    }
+    last = k;
+    const uint64_t count =
+        p >= mass ? remaining : SampleBinomial(remaining, p / mass, rng);
+    mass -= p;
+    if (count > 0) {
+      counts->push_back({k, count});
+      remaining -= count;
+    }
+  }
+  // Rounding can leave samples once the probabilities are exhausted.
+  if (remaining > 0 && last < size) {
+    if (!counts->empty() && counts->back().first == last) {
+      counts->back().second += remaining;
+    } else {
+      counts->push_back({last, remaining});
+    }
+  }
+}
+
+// Draws the counts of num_samples measurements of the first nq qubits of
+// state, bitstrings in the qsim sample order.
+template <typename StateSpaceT, typename Rng>
+void SampleStateCounts(const StateSpaceT& ss,
+                       const typename StateSpaceT::State& state, const int nq,
+                       const uint64_t num_samples, Rng* rng,
+                       BitstringCounts* counts) {
+  const uint64_t size = uint64_t{1} << nq;
+  auto probability = [&ss, &state](const uint64_t k) {
+    return static_cast<double>(std::norm(ss.GetAmpl(state, k)));
+  };
+  double norm = 0;
+  for (uint64_t k = 0; k < size; k++) {
+    norm += probability(k);
+  }
+  SampleMultinomialCounts(size, norm, num_samples, probability, rng, counts);
+}
+
+// Sorts the samples in [begin, end) in place and counts them.
+template <typename T>
+void CountSamples(T* begin, T* end, BitstringCounts* counts) {
+  counts->clear();
+  std::sort(begin, end);
+  for (T* it = begin; it != end; it++) {
+    const uint64_t bitstring = static_cast<uint64_t>(*it);
+    if (counts->empty() || counts->back().first != bitstring) {
+      counts->push_back({bitstring, 0});
+    }
+    counts->back().second++;
+  }
+}
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_SAMPLE_COUNTS_H_
@@ -0,0 +1,126 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/sample_counts.h"
+
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace tfq {
+namespace {
+
+class TestRng {
+ public:
+  explicit TestRng(const unsigned seed) : engine_(seed) {}
+  double RandDouble() { return dist_(engine_); }
+
+ private:
+  std::mt19937_64 engine_;
+  std::uniform_real_distribution<double> dist_;
+};
+
+TEST(SampleCountsTest, BinomialMoments) {
+  TestRng rng(1234);
+  const int draws = 20000;
+  // Covers inversion (small n * p), BTRS and the p > 0.5 reflection.
+  for (const uint64_t n : {1, 7, 100, 100000}) {
+    for (const double p : {0.001, 0.05, 0.3, 0.5, 0.8}) {
+      double sum = 0;
+      double sum_sq = 0;
+      for (int d = 0; d < draws; d++) {
+        const uint64_t x = SampleBinomial(n, p, &rng);
+        ASSERT_LE(x, n);
+        sum += x;
+        sum_sq += static_cast<double>(x) * x;
+      }
+      const double mean = sum / draws;
+      const double var = sum_sq / draws - mean * mean;
+      const double expected_var = n * p * (1 - p);
+      EXPECT_NEAR(mean, n * p, 5 * std::sqrt(expected_var / draws) + 1e-9)
+          << "n = " << n << ", p = " << p;
+      EXPECT_NEAR(var, expected_var, 0.1 * expected_var + 1e-3)
+          << "n = " << n << ", p = " << p;
+    }
+  }
+}
+
+TEST(SampleCountsTest, BinomialEdgeCases) {
+  TestRng rng(1);
+  EXPECT_EQ(SampleBinomial(0, 0.5, &rng), 0);
+  EXPECT_EQ(SampleBinomial(10, 0.0, &rng), 0);
+  EXPECT_EQ(SampleBinomial(10, 1.0, &rng), 10);
+}
+
+TEST(SampleCountsTest, MultinomialCounts) {
+  TestRng rng(42);
+  // Unnormalized distribution over 8 outcomes with two impossible ones.
+  const std::vector<double> weights = {1, 0, 2, 3, 0, 0.5, 1.5, 2};
+  double norm = 0;
+  for (const double w : weights) {
+    norm += w;
+  }
+  const uint64_t num_samples = 1000000;
+  BitstringCounts counts;
+  SampleMultinomialCounts(
+      weights.size(), norm, num_samples,
+      [&weights](const uint64_t k) { return weights[k]; }, &rng, &counts);
+
+  uint64_t total = 0;
+  for (size_t c = 0; c < counts.size(); c++) {
+    if (c > 0) {
+      EXPECT_LT(counts[c - 1].first, counts[c].first);
+    }
+    EXPECT_GT(weights[counts[c].first], 0);
+    EXPECT_GT(counts[c].second, 0);
+    const double p = weights[counts[c].first] / norm;
+    EXPECT_NEAR(counts[c].second / static_cast<double>(num_samples), p,
+                5 * std::sqrt(p * (1 - p) / num_samples));
+    total += counts[c].second;
+  }
+  EXPECT_EQ(counts.size(), 6);
+  EXPECT_EQ(total, num_samples);
+}
+
+TEST(SampleCountsTest, MultinomialRounding) {
+  TestRng rng(7);
+  // A norm slightly above the sum of the probabilities must not lose
+  // samples.
+  BitstringCounts counts;
+  SampleMultinomialCounts(
+      4, 1.0 + 1e-6, 100, [](const uint64_t k) { return k == 3 ? 1.0 : 0.0; },
+      &rng, &counts);
+  EXPECT_EQ(counts, BitstringCounts({{3, 100}}));
+
+  SampleMultinomialCounts(
+      4, 1.0, 0, [](const uint64_t k) { return 0.25; }, &rng, &counts);
+  EXPECT_TRUE(counts.empty());
+}
+
+TEST(SampleCountsTest, CountSamples) {
+  std::vector<int64_t> samples = {5, 1, 5, 3, 1, 5};
+  BitstringCounts counts;
+  CountSamples(samples.data(), samples.data() + samples.size(), &counts);
+  EXPECT_EQ(counts, BitstringCounts({{1, 2}, {3, 1}, {5, 3}}));
+
+  CountSamples(samples.data(), samples.data(), &counts);
+  EXPECT_TRUE(counts.empty());
+}
+
+}  // namespace
+}  // namespace tfq
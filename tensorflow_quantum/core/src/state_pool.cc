@@ -0,0 +1,130 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/state_pool.h"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/mem.h"
+#include "tensorflow/core/util/env_var.h"
+
+namespace tfq {
+
+namespace {
+
+// qsim requires state vectors to be aligned for its widest SIMD loads.
+const int kStateAlignment = 64;
+const uint64_t kDefaultStateMemoryBudget = uint64_t(4) << 30;
+
+}  // namespace
+
+uint64_t StateMemoryBudgetFromEnv() {
+  uint64_t default_budget = kDefaultStateMemoryBudget;
+  const tensorflow::port::MemoryInfo info = tensorflow::port::GetMemoryInfo();
+  if (info.total > 0 &&
+      info.total != std::numeric_limits<tensorflow::int64>::max()) {
+    default_budget = static_cast<uint64_t>(info.total) / 2;
+  }
+
+  tensorflow::int64 budget_mb;
+  tensorflow::Status status = tensorflow::ReadInt64FromEnvVar(
+      "TFQ_STATE_MEMORY_BUDGET_MB", default_budget >> 20, &budget_mb);
+  if (!status.ok() || budget_mb <= 0) {
+    return default_budget;
+  }
+  return static_cast<uint64_t>(budget_mb) << 20;
+}
+
+uint64_t StateBufferSize(uint64_t bytes) {
+  uint64_t size = kStateAlignment;
+  while (size < bytes) {
+    size <<= 1;
+  }
+  return size;
+}
+
+StatePool::StatePool(uint64_t budget_bytes)
+    : budget_(budget_bytes), cached_bytes_(0), allocated_bytes_(0) {}
+
+StatePool::~StatePool() { Clear(); }
+
+StatePool* StatePool::Global() {
+  static StatePool* pool = new StatePool(StateMemoryBudgetFromEnv());
+  return pool;
+}
+
+void* StatePool::Acquire(uint64_t* bytes) {
+  *bytes = StateBufferSize(*bytes);
+  {
+    tensorflow::mutex_lock lock(mu_);
+    auto it = free_.find(*bytes);
+    if (it != free_.end() && !it->second.empty()) {
+      void* buffer = it->second.back();
+      it->second.pop_back();
+      cached_bytes_ -= *bytes;
+      return buffer;
+    }
+  }
+  void* buffer = tensorflow::port::AlignedMalloc(*bytes, kStateAlignment);
+  if (buffer == nullptr) {
+    // Cached buffers of other sizes may be what stands in the way.
+    Clear();
+    buffer = tensorflow::port::AlignedMalloc(*bytes, kStateAlignment);
+  }
+  if (buffer != nullptr) {
+    allocated_bytes_.fetch_add(*bytes, std::memory_order_relaxed);
+  }
+  return buffer;
+}
+
+void StatePool::Release(void* buffer, uint64_t bytes) {
+  if (buffer == nullptr) {
+    return;
+  }
+  {
+    tensorflow::mutex_lock lock(mu_);
+    if (cached_bytes_ + bytes <= budget_) {
+      free_[bytes].push_back(buffer);
+      cached_bytes_ += bytes;
+      return;
+    }
+  }
+  tensorflow::port::AlignedFree(buffer);
+}
+
+void StatePool::Clear() {
+  std::vector<void*> buffers;
+  {
+    tensorflow::mutex_lock lock(mu_);
+    for (auto& entry : free_) {
+      buffers.insert(buffers.end(), entry.second.begin(), entry.second.end());
+    }
+    free_.clear();
+    cached_bytes_ = 0;
+  }
+  for (void* buffer : buffers) {
+    tensorflow::port::AlignedFree(buffer);
+  }
+}
+
+uint64_t StatePool::cached_bytes() const {
+  tensorflow::mutex_lock lock(mu_);
+  return cached_bytes_;
+}
+
+}  // namespace tfq
@@ -0,0 +1,155 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Pooled memory for simulator state vectors, so that the large aligned
+// buffers needed by every op invocation are recycled instead of being
+// allocated and page faulted in again on every call.
+
+#ifndef TFQ_CORE_SRC_STATE_POOL_H_
+#define TFQ_CORE_SRC_STATE_POOL_H_
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/platform/mutex.h"
+#include "tensorflow/core/platform/thread_annotations.h"
+
+namespace tfq {
+
+// Reads the total number of bytes that simulator state vectors may occupy
+// from the environment variable TFQ_STATE_MEMORY_BUDGET_MB. Defaults to half
+// of the physical memory of the machine (4GB if that is unknown).
+uint64_t StateMemoryBudgetFromEnv();
+
+// Size class of a state buffer: bytes rounded up to a power of two.
+uint64_t StateBufferSize(uint64_t bytes);
+
+// Process wide pool of 64 byte aligned buffers. Released buffers are kept
+// for reuse by later callers (including other ops) as long as the cached
+// bytes stay within the budget, and returned to the system beyond that.
+// All methods are thread safe.
+class StatePool {
+ public:
+  explicit StatePool(uint64_t budget_bytes);
+  ~StatePool();
+
+  StatePool(const StatePool&) = delete;
+  StatePool& operator=(const StatePool&) = delete;
+
+  // The pool shared by all ops, with the budget of StateMemoryBudgetFromEnv.
+  static StatePool* Global();
+
+  // Returns a buffer of StateBufferSize(*bytes) bytes and stores that size
+  // in *bytes. Returns nullptr if the allocation failed even after
+  // releasing every cached buffer.
+  void* Acquire(uint64_t* bytes);
+
+  // Hands a buffer obtained from Acquire back to the pool.
+  void Release(void* buffer, uint64_t bytes);
+
+  // Returns all cached buffers to the system.
+  void Clear();
+
+  uint64_t budget() const { return budget_; }
+
+  // Number of bytes held by released buffers.
+  uint64_t cached_bytes() const;
+
+  // Total number of bytes allocated from the system since construction,
+  // excluding buffers that were served from the cache.
+  uint64_t allocated_bytes() const {
+    return allocated_bytes_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  const uint64_t budget_;
+  mutable tensorflow::mutex mu_;
+  absl::flat_hash_map<uint64_t, std::vector<void*>> free_ TF_GUARDED_BY(mu_);
+  uint64_t cached_bytes_ TF_GUARDED_BY(mu_);
+  std::atomic<uint64_t> allocated_bytes_;
+};
+
+// Hands out qsim states backed by StatePool buffers to a single worker.
+// States do not own their memory: every buffer stays leased to the arena
+// and goes back to the pool when the arena is destroyed, so the arena has
+// to outlive the states it created.
+template <typename StateSpaceT>
+class StateArena {
+ public:
+  typedef typename StateSpaceT::State State;
+  typedef typename StateSpaceT::fp_type fp_type;
+
+  explicit StateArena(const StateSpaceT& ss,
+                      StatePool* pool = StatePool::Global())
+      : ss_(ss), pool_(pool) {}
+
+  ~StateArena() {
+    for (const auto& lease : leases_) {
+      pool_->Release(lease.first, lease.second);
+    }
+  }
+
+  StateArena(const StateArena&) = delete;
+  StateArena& operator=(const StateArena&) = delete;
+
+  // Returns a state of num_qubits qubits. Amplitudes are not initialized.
+  // Aborts the process if the buffer cannot be allocated, since the
+  // simulator would otherwise write through a null pointer.
+  State Create(unsigned num_qubits) {
+    uint64_t bytes = sizeof(fp_type) * ss_.MinSize(num_qubits);
+    void* buffer = pool_->Acquire(&bytes);
+    CHECK(buffer != nullptr) << "Failed to allocate " << bytes
+                             << " bytes for a state vector of " << num_qubits
+                             << " qubits.";
+    leases_.emplace_back(buffer, bytes);
+    return ss_.Create(static_cast<fp_type*>(buffer), num_qubits);
+  }
+
+  // Replaces *state, which must have been created by this arena, with a
+  // state of num_qubits qubits. The buffer of *state is reused when it is
+  // large enough and otherwise returned to the pool. Amplitudes are not
+  // preserved.
+  void Resize(unsigned num_qubits, State* state) {
+    fp_type* old = state->get();
+    const uint64_t bytes = sizeof(fp_type) * ss_.MinSize(num_qubits);
+    for (size_t i = 0; i < leases_.size(); i++) {
+      if (leases_[i].first != old) {
+        continue;
+      }
+      if (leases_[i].second >= bytes) {
+        *state = ss_.Create(old, num_qubits);
+        return;
+      }
+      *state = Create(num_qubits);
+      pool_->Release(leases_[i].first, leases_[i].second);
+      leases_.erase(leases_.begin() + i);
+      return;
+    }
+    *state = Create(num_qubits);
+  }
+
+ private:
+  const StateSpaceT& ss_;
+  StatePool* pool_;
+  std::vector<std::pair<void*, uint64_t>> leases_;
+};
+
+}  // namespace tfq
+
+#endif  // TFQ_CORE_SRC_STATE_POOL_H_
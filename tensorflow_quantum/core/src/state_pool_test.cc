@@ -0,0 +1,115 @@
+/* Copyright 2020 The TensorFlow Quantum Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "tensorflow_quantum/core/src/state_pool.h"
+
+#include <cstdint>
+
+#include "../qsim/lib/formux.h"
+#include "../qsim/lib/simmux.h"
+#include "gtest/gtest.h"
+
+namespace tfq {
+namespace {
+
+typedef qsim::Simulator<qsim::SequentialFor>::StateSpace StateSpace;
+
+TEST(StatePoolTest, BufferSize) {
+  EXPECT_EQ(StateBufferSize(1), 64);
+  EXPECT_EQ(StateBufferSize(64), 64);
+  EXPECT_EQ(StateBufferSize(65), 128);
+  EXPECT_EQ(StateBufferSize(uint64_t(3) << 20), uint64_t(4) << 20);
+}
+
+TEST(StatePoolTest, ReusesReleasedBuffers) {
+  StatePool pool(1 << 20);
+  uint64_t bytes = 1000;
+  void* buffer = pool.Acquire(&bytes);
+  ASSERT_NE(buffer, nullptr);
+  EXPECT_EQ(bytes, 1024);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(buffer) % 64, 0);
+
+  pool.Release(buffer, bytes);
+  EXPECT_EQ(pool.cached_bytes(), 1024);
+
+  uint64_t same_bytes = 1024;
+  EXPECT_EQ(pool.Acquire(&same_bytes), buffer);
+  EXPECT_EQ(pool.cached_bytes(), 0);
+  // Only the first Acquire went to the system.
+  EXPECT_EQ(pool.allocated_bytes(), 1024);
+  pool.Release(buffer, same_bytes);
+}
+
+TEST(StatePoolTest, BudgetLimitsCache) {
+  StatePool pool(2048);
+  uint64_t a_bytes = 2048;
+  uint64_t b_bytes = 2048;
+  void* a = pool.Acquire(&a_bytes);
+  void* b = pool.Acquire(&b_bytes);
+  pool.Release(a, a_bytes);
+  // Caching b as well would exceed the budget, so it is freed instead.
+  pool.Release(b, b_bytes);
+  EXPECT_EQ(pool.cached_bytes(), 2048);
+
+  pool.Clear();
+  EXPECT_EQ(pool.cached_bytes(), 0);
+}
+
+TEST(StatePoolTest, ArenaReturnsBuffersOnDestruction) {
+  StatePool pool(1 << 20);
+  StateSpace ss(1);
+  {
+    StateArena<StateSpace> arena(ss, &pool);
+    auto sv = arena.Create(4);
+    ss.SetStateZero(sv);
+    EXPECT_EQ(sv.num_qubits(), 4);
+    EXPECT_NEAR(ss.GetAmpl(sv, 0).real(), 1.0, 1e-5);
+    EXPECT_EQ(pool.cached_bytes(), 0);
+  }
+  EXPECT_GT(pool.cached_bytes(), 0);
+
+  // A new arena picks up the cached buffer.
+  const uint64_t cached = pool.cached_bytes();
+  StateArena<StateSpace> arena(ss, &pool);
+  auto sv = arena.Create(4);
+  const uint64_t bytes = StateBufferSize(sizeof(float) * ss.MinSize(4));
+  EXPECT_EQ(pool.cached_bytes(), cached - bytes);
+}
+
+TEST(StatePoolTest, ArenaResize) {
+  StatePool pool(1 << 20);
+  StateSpace ss(1);
+  StateArena<StateSpace> arena(ss, &pool);
+  auto sv = arena.Create(2);
+  float* small = sv.get();
+
+  // Growing past the buffer swaps in a new one and caches the old one.
+  arena.Resize(10, &sv);
+  EXPECT_EQ(sv.num_qubits(), 10);
+  EXPECT_NE(sv.get(), small);
+  EXPECT_EQ(pool.cached_bytes(),
+            StateBufferSize(sizeof(float) * ss.MinSize(2)));
+  ss.SetStateZero(sv);
+  EXPECT_NEAR(ss.GetAmpl(sv, 1023).real(), 0.0, 1e-5);
+
+  // Shrinking keeps the current buffer.
+  float* large = sv.get();
+  arena.Resize(3, &sv);
+  EXPECT_EQ(sv.num_qubits(), 3);
+  EXPECT_EQ(sv.get(), large);
+}
+
+}  // namespace
+}  // namespace tfq
@@ -16,9 +16,16 @@ limitations under the License.
 #ifndef UTIL_QSIM_H_
 #define UTIL_QSIM_H_
 
+#include <algorithm>
+#include <atomic>
 #include <bitset>
+#include <cmath>
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <random>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "../qsim/lib/circuit.h"
@@ -26,12 +33,25 @@ limitations under the License.
 #include "../qsim/lib/gate_appl.h"
 #include "../qsim/lib/gates_cirq.h"
 #include "../qsim/lib/matrix.h"
+#include "../qsim/lib/seqfor.h"
+#include "../qsim/lib/simmux.h"
+#include "../qsim/lib/simulator_basic.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/random/philox_random.h"
+#include "tensorflow/core/lib/random/random.h"
 #include "tensorflow/core/lib/random/simple_philox.h"
+#include "tensorflow/core/platform/fingerprint.h"
+#include "tensorflow/core/platform/mutex.h"
 #include "tensorflow/core/platform/threadpool.h"
 #include "tensorflow_quantum/core/proto/pauli_sum.pb.h"
+#include "tensorflow_quantum/core/src/batched_states.h"
 #include "tensorflow_quantum/core/src/circuit_parser_qsim.h"
+#include "tensorflow_quantum/core/src/cpu_features.h"
+#include "tensorflow_quantum/core/src/density_matrix.h"
+#include "tensorflow_quantum/core/src/state_pool.h"
 
 namespace tfq {
 
@@ -39,6 +59,25 @@ typedef qsim::Cirq::GateCirq<float> QsimGate;
 typedef qsim::Circuit<QsimGate> QsimCircuit;
 typedef std::vector<qsim::GateFused<QsimGate>> QsimFusedCircuit;
 
+// The qsim simulator for states with fp_type amplitudes. Single precision
+// runs on the vectorized simulator that qsim/lib/simmux.h picks for the
+// build, double precision on qsim's portable SimulatorBasic.
+template <typename For, typename fp_type>
+struct QsimSimulator {
+  typedef qsim::Simulator<For> type;
+};
+
+template <typename For>
+struct QsimSimulator<For, double> {
+  typedef qsim::SimulatorBasic<For, double> type;
+};
+
+// Every op translation unit records the simulator it was compiled for, so
+// that gate fusion sizes its blocks for the build that was actually loaded
+// (see BuildSimdBackend).
+static const bool kSimdBuildRecorded =
+    RecordBuildSimdBackend(TFQ_COMPILED_SIMD_BACKEND);
+
 // Custom FOR loop struct to use TF threadpool instead of native
 // qsim OpenMP or serial FOR implementations.
 struct QsimFor {
@@ -178,6 +217,438 @@ tensorflow::Status ComputeExpectationQsim(const tfq::proto::PauliSum& p_sum,
   return status;
 }
 
+// Bitmask form of a PauliSum. Using Y = iXZ every non identity term is
+// written as coeff * X^x_mask * Z^z_mask with a complex coeff that absorbs
+// the i^(number of Y) phase. Masks use the qsim qubit ordering, i.e. qubit q
+// of the proto is bit num_qubits - q - 1.
+//
+// Terms are grouped by x_mask. Terms with the same x_mask couple the same
+// pairs of amplitudes, so each group only needs to read the pair once.
+// The terms of group g are [group_offsets[g], group_offsets[g + 1]).
+//
+// For sampling, terms are also partitioned into qubit-wise commuting
+// measurement bases that are sampled from the same shots. Basis m measures
+// the qubits of basis_x_masks[m] in X, or in Y where basis_z_masks[m] is set
+// as well, and the remaining qubits in Z. Its terms are group basis_groups[k]
+// and term basis_terms[k] for k in [basis_offsets[m], basis_offsets[m + 1]).
+struct PauliSumMasks {
+  float identity_coeff = 0;
+  std::vector<uint64_t> x_masks;
+  std::vector<int> group_offsets;
+
+  // one entry per term.
+  std::vector<uint64_t> z_masks;
+  std::vector<float> coeffs_real;
+  std::vector<float> coeffs_imag;
+
+  std::vector<uint64_t> basis_x_masks;
+  std::vector<uint64_t> basis_z_masks;
+  std::vector<int> basis_offsets;
+  std::vector<int> basis_groups;
+  std::vector<int> basis_terms;
+};
+
+// The PauliSumMasks of all pauli_sums of one batch row. Shared between ops
+// and calls through the observable cache of parse_context.
+typedef std::shared_ptr<const std::vector<PauliSumMasks>> CompiledPauliSums;
+
+// A single X^x_mask Z^z_mask term with its complex coefficient, used while
+// building PauliSumMasks.
+struct PauliMaskedTerm {
+  uint64_t x_mask;
+  uint64_t z_mask;
+  float coeff_real;
+  float coeff_imag;
+};
+
+// Partitions the terms of masks into qubit-wise commuting measurement bases
+// (see PauliSumMasks). Terms are placed greedily into the first basis they
+// agree with on every shared qubit, heaviest terms first, which is the usual
+// largest-first heuristic for this graph coloring problem.
+inline void GroupQubitWiseCommuting(PauliSumMasks* masks) {
+  masks->basis_x_masks.clear();
+  masks->basis_z_masks.clear();
+  masks->basis_offsets.clear();
+  masks->basis_groups.clear();
+  masks->basis_terms.clear();
+
+  std::vector<std::pair<int, int>> order;
+  order.reserve(masks->z_masks.size());
+  for (size_t g = 0; g < masks->x_masks.size(); g++) {
+    for (int t = masks->group_offsets[g]; t < masks->group_offsets[g + 1];
+         t++) {
+      order.push_back(std::make_pair(g, t));
+    }
+  }
+  auto weight = [masks](const std::pair<int, int>& term) {
+    return std::bitset<64>(masks->x_masks[term.first] |
+                           masks->z_masks[term.second])
+        .count();
+  };
+  std::stable_sort(
+      order.begin(), order.end(),
+      [&weight](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+        return weight(a) > weight(b);
+      });
+
+  std::vector<int> basis_of(order.size());
+  for (size_t k = 0; k < order.size(); k++) {
+    const uint64_t x = masks->x_masks[order[k].first];
+    const uint64_t z = masks->z_masks[order[k].second];
+    size_t m = 0;
+    for (; m < masks->basis_x_masks.size(); m++) {
+      const uint64_t shared =
+          (x | z) & (masks->basis_x_masks[m] | masks->basis_z_masks[m]);
+      if ((((x ^ masks->basis_x_masks[m]) | (z ^ masks->basis_z_masks[m])) &
+           shared) == 0) {
+        break;
+      }
+    }
+    if (m == masks->basis_x_masks.size()) {
+      masks->basis_x_masks.push_back(0);
+      masks->basis_z_masks.push_back(0);
+    }
+    masks->basis_x_masks[m] |= x;
+    masks->basis_z_masks[m] |= z;
+    basis_of[k] = m;
+  }
+
+  // Store the terms of each basis contiguously, in term order.
+  const int num_bases = masks->basis_x_masks.size();
+  masks->basis_offsets.assign(num_bases + 1, 0);
+  for (const int m : basis_of) {
+    masks->basis_offsets[m + 1]++;
+  }
+  for (int m = 0; m < num_bases; m++) {
+    masks->basis_offsets[m + 1] += masks->basis_offsets[m];
+  }
+  std::vector<int> filled(masks->basis_offsets.begin(),
+                          masks->basis_offsets.end() - 1);
+  masks->basis_groups.resize(order.size());
+  masks->basis_terms.resize(order.size());
+  std::vector<size_t> by_term(order.size());
+  for (size_t k = 0; k < order.size(); k++) {
+    by_term[order[k].second] = k;
+  }
+  for (const size_t k : by_term) {
+    const int slot = filled[basis_of[k]]++;
+    masks->basis_groups[slot] = order[k].first;
+    masks->basis_terms[slot] = order[k].second;
+  }
+}
+
+// Sorts terms, merges duplicates and stores the result as groups in masks.
+// The identity_coeff of masks is left untouched.
+inline void GroupPauliMaskedTerms(std::vector<PauliMaskedTerm>* terms,
+                                  PauliSumMasks* masks) {
+  masks->x_masks.clear();
+  masks->group_offsets.clear();
+  masks->z_masks.clear();
+  masks->coeffs_real.clear();
+  masks->coeffs_imag.clear();
+  std::sort(terms->begin(), terms->end(),
+            [](const PauliMaskedTerm& a, const PauliMaskedTerm& b) {
+              return a.x_mask != b.x_mask ? a.x_mask < b.x_mask
+                                          : a.z_mask < b.z_mask;
+            });
+  for (const PauliMaskedTerm& term : *terms) {
+    const bool new_group =
+        masks->x_masks.empty() || masks->x_masks.back() != term.x_mask;
+    if (!new_group && masks->z_masks.back() == term.z_mask) {
+      masks->coeffs_real.back() += term.coeff_real;
+      masks->coeffs_imag.back() += term.coeff_imag;
+      continue;
+    }
+    if (new_group) {
+      masks->x_masks.push_back(term.x_mask);
+      masks->group_offsets.push_back(masks->z_masks.size());
+    }
+    masks->z_masks.push_back(term.z_mask);
+    masks->coeffs_real.push_back(term.coeff_real);
+    masks->coeffs_imag.push_back(term.coeff_imag);
+  }
+  masks->group_offsets.push_back(masks->z_masks.size());
+  GroupQubitWiseCommuting(masks);
+}
+
+// Converts p_sum into PauliSumMasks. Terms with identical paulis are merged.
+// Like the rest of the Pauli utilities only coefficient_real is used.
+inline tensorflow::Status PauliSumToMasks(const tfq::proto::PauliSum& p_sum,
+                                          const int num_qubits,
+                                          PauliSumMasks* masks) {
+  *masks = PauliSumMasks();
+  std::vector<PauliMaskedTerm> terms;
+  terms.reserve(p_sum.terms_size());
+  for (const tfq::proto::PauliTerm& term : p_sum.terms()) {
+    if (term.paulis_size() == 0) {
+      masks->identity_coeff += term.coefficient_real();
+      continue;
+    }
+    PauliMaskedTerm masked = {0, 0, 0, 0};
+    int num_y = 0;
+    for (const tfq::proto::PauliQubitPair& pair : term.paulis()) {
+      unsigned int location = 0;
+      // GridQubit id should be parsed down to integer at this upstream.
+      if (!absl::SimpleAtoi(pair.qubit_id(), &location)) {
+        return tensorflow::Status(
+            tensorflow::error::INVALID_ARGUMENT,
+            absl::StrCat("Could not parse qubit id: ", pair.qubit_id()));
+      }
+      if (location >= static_cast<unsigned int>(num_qubits)) {
+        return tensorflow::Status(
+            tensorflow::error::INVALID_ARGUMENT,
+            absl::StrCat("Qubit out of range in PauliSum: ", pair.qubit_id()));
+      }
+      const uint64_t bit = uint64_t(1) << (num_qubits - location - 1);
+      if (pair.pauli_type() == "X") {
+        masked.x_mask |= bit;
+      } else if (pair.pauli_type() == "Y") {
+        masked.x_mask |= bit;
+        masked.z_mask |= bit;
+        num_y++;
+      } else if (pair.pauli_type() == "Z") {
+        masked.z_mask |= bit;
+      } else {
+        return tensorflow::Status(
+            tensorflow::error::INVALID_ARGUMENT,
+            absl::StrCat("Could not parse pauli type: ", pair.pauli_type()));
+      }
+    }
+    const float coeff = term.coefficient_real();
+    switch (num_y % 4) {
+      case 0:
+        masked.coeff_real = coeff;
+        break;
+      case 1:
+        masked.coeff_imag = coeff;
+        break;
+      case 2:
+        masked.coeff_real = -coeff;
+        break;
+      default:
+        masked.coeff_imag = -coeff;
+        break;
+    }
+    terms.push_back(masked);
+  }
+  GroupPauliMaskedTerms(&terms, masks);
+  return tensorflow::Status::OK();
+}
+
+// Real coefficient of term t of masks as it appeared in the PauliSum, i.e.
+// with the i^(number of Y) phase removed again.
+inline float PauliMaskedTermCoefficient(const PauliSumMasks& masks,
+                                        const int group, const int t) {
+  const uint64_t y_mask = masks.x_masks[group] & masks.z_masks[t];
+  switch (std::bitset<64>(y_mask).count() % 4) {
+    case 0:
+      return masks.coeffs_real[t];
+    case 1:
+      return masks.coeffs_imag[t];
+    case 2:
+      return -masks.coeffs_real[t];
+    default:
+      return -masks.coeffs_imag[t];
+  }
+}
+
+// Computes the PauliSumMasks of sum_i weights[i] * sums[i]. Scaled terms
+// with a magnitude below 1e-5 are skipped since they only add rounding
+// errors.
+inline void CombinePauliSumMasks(const std::vector<PauliSumMasks>& sums,
+                                 const std::vector<float>& weights,
+                                 PauliSumMasks* combined) {
+  DCHECK_EQ(sums.size(), weights.size());
+  std::vector<PauliMaskedTerm> terms;
+  combined->identity_coeff = 0;
+  for (size_t i = 0; i < sums.size(); i++) {
+    const PauliSumMasks& masks = sums[i];
+    if (std::fabs(weights[i] * masks.identity_coeff) >= 1e-5) {
+      combined->identity_coeff += weights[i] * masks.identity_coeff;
+    }
+    for (size_t g = 0; g < masks.x_masks.size(); g++) {
+      for (int t = masks.group_offsets[g]; t < masks.group_offsets[g + 1];
+           t++) {
+        PauliMaskedTerm term = {masks.x_masks[g], masks.z_masks[t],
+                                weights[i] * masks.coeffs_real[t],
+                                weights[i] * masks.coeffs_imag[t]};
+        if (std::fabs(term.coeff_real) + std::fabs(term.coeff_imag) < 1e-5) {
+          continue;
+        }
+        terms.push_back(term);
+      }
+    }
+  }
+  GroupPauliMaskedTerms(&terms, combined);
+}
+
+// Position of the real part of amplitude i in the raw qsim state vector.
+// qsim stores amplitudes in blocks of `lanes` real parts followed by the
+// matching `lanes` imaginary parts.
+inline uint64_t RawAmplitudeIndex(uint64_t i, uint64_t lanes) {
+  return ((i & ~(lanes - 1)) << 1) | (i & (lanes - 1));
+}
+
+// computes the expectation value <state | p_sum | state > directly from the
+// amplitudes of state, where masks is the PauliSumMasks of p_sum. For each
+// term X^x Z^z: <psi|X^x Z^z|psi> = sum_b (-1)^|b & z| psi*[b ^ x] psi[b].
+// All terms are evaluated in a single pass over state parallelized with
+// for_, state itself is not modified and no scratch state is needed.
+// The result is added onto expectation_value.
+template <typename ForT, typename StateSpaceT, typename StateT>
+tensorflow::Status ComputeExpectationMasks(const PauliSumMasks& masks,
+                                           const ForT& for_,
+                                           const StateSpaceT& ss,
+                                           const StateT& state,
+                                           float* expectation_value) {
+  *expectation_value += masks.identity_coeff;
+  if (masks.x_masks.empty()) {
+    return tensorflow::Status::OK();
+  }
+
+  typedef typename StateSpaceT::fp_type fp_type;
+  const uint64_t lanes = ss.MinSize(0) / 2;
+  const uint64_t size = uint64_t(1) << state.num_qubits();
+  const uint64_t block_size = std::min(lanes, size);
+  const fp_type* p = state.get();
+
+  auto f = [&masks, p, lanes, block_size](unsigned n, unsigned m,
+                                          uint64_t i) -> double {
+    double sum = 0;
+    for (uint64_t j = 0; j < block_size; j++) {
+      const uint64_t b = i * block_size + j;
+      const uint64_t k = RawAmplitudeIndex(b, lanes);
+      const double br = p[k];
+      const double bi = p[k + lanes];
+      for (size_t g = 0; g < masks.x_masks.size(); g++) {
+        const uint64_t k2 = RawAmplitudeIndex(b ^ masks.x_masks[g], lanes);
+        const double ar = p[k2];
+        const double ai = p[k2 + lanes];
+        // psi*[b ^ x] psi[b]
+        const double re = ar * br + ai * bi;
+        const double im = ar * bi - ai * br;
+        for (int t = masks.group_offsets[g]; t < masks.group_offsets[g + 1];
+             t++) {
+          const double v =
+              masks.coeffs_real[t] * re - masks.coeffs_imag[t] * im;
+          sum += (std::bitset<64>(b & masks.z_masks[t]).count() & 1) ? -v : v;
+        }
+      }
+    }
+    return sum;
+  };
+
+  *expectation_value += static_cast<float>(
+      for_.RunReduce(size / block_size, f, std::plus<double>()));
+  return tensorflow::Status::OK();
+}
+
+// ComputeExpectationMasks for state k of states.
+template <typename fp_type>
+void ComputeBatchedExpectationMasks(const PauliSumMasks& masks,
+                                    const BatchedStates<fp_type>& states,
+                                    const unsigned k,
+                                    float* expectation_value) {
+  *expectation_value += masks.identity_coeff;
+  if (masks.x_masks.empty()) {
+    return;
+  }
+
+  const uint64_t n = states.num_states();
+  const uint64_t size = uint64_t(1) << states.num_qubits();
+  double sum = 0;
+  for (uint64_t b = 0; b < size; b++) {
+    const fp_type* pb = states.amplitude(b);
+    const double br = pb[k];
+    const double bi = pb[n + k];
+    for (size_t g = 0; g < masks.x_masks.size(); g++) {
+      const fp_type* pa = states.amplitude(b ^ masks.x_masks[g]);
+      const double ar = pa[k];
+      const double ai = pa[n + k];
+      // psi*[b ^ x] psi[b]
+      const double re = ar * br + ai * bi;
+      const double im = ar * bi - ai * br;
+      for (int t = masks.group_offsets[g]; t < masks.group_offsets[g + 1];
+           t++) {
+        const double v = masks.coeffs_real[t] * re - masks.coeffs_imag[t] * im;
+        sum += (std::bitset<64>(b & masks.z_masks[t]).count() & 1) ? -v : v;
+      }
+    }
+  }
+  *expectation_value += static_cast<float>(sum);
+}
+
+// Computes Re <bra | G P | ket> in a single pass over both states, where G
+// is the (uncontrolled) matrix of gate and P projects onto the basis states
+// with (b & cmask) == cbits. This is what applying P and gate to a copy of
+// ket and taking the real inner product with bra gives, without the copy
+// and the extra passes. The qubits in cmask must not be acted on by gate,
+// which may act on at most 6 qubits.
+template <typename ForT, typename StateSpaceT, typename StateT,
+          typename GateT>
+double GradientGateInnerProduct(const GateT& gate, const uint64_t cmask,
+                                const uint64_t cbits, const ForT& for_,
+                                const StateSpaceT& ss, const StateT& bra,
+                                const StateT& ket) {
+  typedef typename StateSpaceT::fp_type fp_type;
+  const unsigned num_targets = gate.qubits.size();
+  const unsigned dim = 1 << num_targets;
+  const uint64_t lanes = ss.MinSize(0) / 2;
+  const uint64_t num_groups = uint64_t(1) << (ket.num_qubits() - num_targets);
+  const uint64_t block_size = std::min<uint64_t>(num_groups, 64);
+
+  std::vector<unsigned> targets(gate.qubits.begin(), gate.qubits.end());
+  std::sort(targets.begin(), targets.end());
+  // offsets[r] sets the target bits of row r of the matrix, whose bit k
+  // belongs to gate.qubits[k].
+  std::vector<uint64_t> offsets(dim, 0);
+  for (unsigned r = 0; r < dim; r++) {
+    for (unsigned k = 0; k < num_targets; k++) {
+      offsets[r] |= uint64_t((r >> k) & 1) << gate.qubits[k];
+    }
+  }
+
+  const fp_type* pb = bra.get();
+  const fp_type* pk = ket.get();
+  const auto& matrix = gate.matrix;
+  auto f = [&](unsigned n, unsigned m, uint64_t i) -> double {
+    double sum = 0;
+    double kr[64];
+    double ki[64];
+    for (uint64_t j = 0; j < block_size; j++) {
+      // Spread the group index over the qubits that the gate leaves alone.
+      uint64_t base = i * block_size + j;
+      for (const unsigned q : targets) {
+        const uint64_t low = base & ((uint64_t(1) << q) - 1);
+        base = ((base >> q) << (q + 1)) | low;
+      }
+      if ((base & cmask) != cbits) {
+        continue;
+      }
+      for (unsigned c = 0; c < dim; c++) {
+        const uint64_t k = RawAmplitudeIndex(base | offsets[c], lanes);
+        kr[c] = pk[k];
+        ki[c] = pk[k + lanes];
+      }
+      for (unsigned r = 0; r < dim; r++) {
+        double gr = 0;
+        double gi = 0;
+        for (unsigned c = 0; c < dim; c++) {
+          const double mr = matrix[2 * (r * dim + c)];
+          const double mi = matrix[2 * (r * dim + c) + 1];
+          gr += mr * kr[c] - mi * ki[c];
+          gi += mr * ki[c] + mi * kr[c];
+        }
+        const uint64_t k = RawAmplitudeIndex(base | offsets[r], lanes);
+        sum += pb[k] * gr + pb[k + lanes] * gi;
+      }
+    }
+    return sum;
+  };
+
+  return for_.RunReduce(num_groups / block_size, f, std::plus<double>());
+}
+
 // bad style standards here that we are forced to follow from qsim.
 // computes the expectation value <state | p_sum | state > using
 // scratch to save on memory. Implementation does this:
@@ -260,6 +731,138 @@ tensorflow::Status ComputeSampledExpectationQsim(
   return status;
 }
 
+// Adds the estimates of the terms of measurement basis m of masks from
+// samples drawn in that basis: the mean parity of every term over its
+// support, times its coefficient.
+inline void AddBasisParities(const PauliSumMasks& masks, const size_t m,
+                             const std::vector<uint64_t>& samples,
+                             float* expectation_value) {
+  for (int k = masks.basis_offsets[m]; k < masks.basis_offsets[m + 1]; k++) {
+    const int g = masks.basis_groups[k];
+    const int t = masks.basis_terms[k];
+    const uint64_t mask = masks.x_masks[g] | masks.z_masks[t];
+    int parity_total(0);
+    for (const uint64_t sample : samples) {
+      parity_total += (std::bitset<64>(sample & mask).count() & 1) ? -1 : 1;
+    }
+    *expectation_value += static_cast<float>(parity_total) *
+                          PauliMaskedTermCoefficient(masks, g, t) /
+                          static_cast<float>(samples.size());
+  }
+}
+
+// computes the sampled expectation value of the PauliSum with PauliSumMasks
+// masks. Every term is estimated from num_samples shots like in
+// ComputeSampledExpectationQsim, but qubit-wise commuting terms share their
+// shots: each measurement basis of masks is rotated into the Z basis with
+// single qubit gates on scratch and sampled once. state is left unchanged.
+// scratch is required to have memory initialized, but does not require
+// values in memory to be set.
+template <typename SimT, typename StateSpaceT, typename StateT>
+tensorflow::Status ComputeSampledExpectationMasks(
+    const PauliSumMasks& masks, const SimT& sim, const StateSpaceT& ss,
+    StateT& state, StateT& scratch, const int num_samples,
+    tensorflow::random::SimplePhilox& random_source, float* expectation_value) {
+  if (num_samples == 0) {
+    return tensorflow::Status::OK();
+  }
+  *expectation_value += masks.identity_coeff;
+
+  const unsigned int num_qubits = state.num_qubits();
+  for (size_t m = 0; m < masks.basis_x_masks.size(); m++) {
+    // copy from src to scratch and rotate X into Y^-0.5 and Y into X^0.5.
+    ss.Copy(state, scratch);
+    for (unsigned int q = 0; q < num_qubits; q++) {
+      const uint64_t bit = uint64_t(1) << q;
+      if ((masks.basis_x_masks[m] & bit) == 0) {
+        continue;
+      }
+      if (masks.basis_z_masks[m] & bit) {
+        qsim::ApplyGate(sim,
+                        qsim::Cirq::XPowGate<float>::Create(0, q, 0.5, 0.0),
+                        scratch);
+      } else {
+        qsim::ApplyGate(sim,
+                        qsim::Cirq::YPowGate<float>::Create(0, q, -0.5, 0.0),
+                        scratch);
+      }
+    }
+    std::vector<uint64_t> state_samples =
+        ss.Sample(scratch, num_samples, random_source.Rand32());
+    AddBasisParities(masks, m, state_samples, expectation_value);
+  }
+  return tensorflow::Status::OK();
+}
+
+// computes the expectation value tr(p_sum rho) of the density matrix rho of
+// num_qubits qubits (see density_matrix.h), where masks is the PauliSumMasks
+// of p_sum. For each term X^x Z^z:
+// tr(X^x Z^z rho) = sum_b (-1)^|b & z| rho[b][b ^ x].
+// The result is added onto expectation_value.
+template <typename StateSpaceT, typename StateT>
+void ComputeDensityMatrixExpectationMasks(const PauliSumMasks& masks,
+                                          const StateSpaceT& ss,
+                                          const unsigned num_qubits,
+                                          const StateT& rho,
+                                          float* expectation_value) {
+  double sum = masks.identity_coeff;
+  const uint64_t dim = uint64_t(1) << num_qubits;
+  for (uint64_t b = 0; b < dim; b++) {
+    for (size_t g = 0; g < masks.x_masks.size(); g++) {
+      const auto entry =
+          ss.GetAmpl(rho, b | ((b ^ masks.x_masks[g]) << num_qubits));
+      const double re = entry.real();
+      const double im = entry.imag();
+      for (int t = masks.group_offsets[g]; t < masks.group_offsets[g + 1];
+           t++) {
+        const double v = masks.coeffs_real[t] * re - masks.coeffs_imag[t] * im;
+        sum += (std::bitset<64>(b & masks.z_masks[t]).count() & 1) ? -v : v;
+      }
+    }
+  }
+  *expectation_value += static_cast<float>(sum);
+}
+
+// ComputeSampledExpectationMasks for the density matrix rho of num_qubits
+// qubits: every measurement basis is rotated into the Z basis on a copy of
+// rho in scratch and num_samples samples are drawn from its diagonal.
+template <typename SimT, typename StateSpaceT, typename StateT>
+void ComputeDensityMatrixSampledExpectationMasks(
+    const PauliSumMasks& masks, const SimT& sim, const StateSpaceT& ss,
+    const unsigned num_qubits, const StateT& rho, StateT& scratch,
+    const int num_samples, tensorflow::random::SimplePhilox& random_source,
+    float* expectation_value) {
+  if (num_samples == 0) {
+    return;
+  }
+  *expectation_value += masks.identity_coeff;
+
+  std::vector<double> probabilities;
+  std::vector<uint64_t> samples;
+  for (size_t m = 0; m < masks.basis_x_masks.size(); m++) {
+    // rotate X into Y^-0.5 and Y into X^0.5, as for state vectors.
+    ss.Copy(rho, scratch);
+    for (unsigned int q = 0; q < num_qubits; q++) {
+      const uint64_t bit = uint64_t(1) << q;
+      if ((masks.basis_x_masks[m] & bit) == 0) {
+        continue;
+      }
+      if (masks.basis_z_masks[m] & bit) {
+        ApplyDensityMatrixGate(
+            sim, num_qubits,
+            qsim::Cirq::XPowGate<float>::Create(0, q, 0.5, 0.0), scratch);
+      } else {
+        ApplyDensityMatrixGate(
+            sim, num_qubits,
+            qsim::Cirq::YPowGate<float>::Create(0, q, -0.5, 0.0), scratch);
+      }
+    }
+    DensityMatrixDiagonal(ss, num_qubits, scratch, &probabilities);
+    SampleProbabilities(probabilities, num_samples, &random_source, &samples);
+    AddBasisParities(masks, m, samples, expectation_value);
+  }
+}
+
 // Assumes p_sums.size() == op_coeffs.size()
 // state stores |psi>. scratch has been created, but does not
 // require initialization. dest has been created, but does not require
@@ -319,6 +922,65 @@ tensorflow::Status AccumulateOperators(
   return status;
 }
 
+// computes dest = (sum_i op_coeffs[i] * p_sums[i]) |source> from the
+// PauliSumMasks of the sums, without the per term state copies of
+// AccumulateOperators. Every amplitude of dest is written exactly once, so
+// the loop is parallelized with for_ over dest. source is left unchanged.
+// dest has been created, but does not require initialization.
+template <typename ForT, typename StateSpaceT, typename StateT>
+tensorflow::Status AccumulateOperatorMasks(
+    const std::vector<PauliSumMasks>& p_sums,
+    const std::vector<float>& op_coeffs, const ForT& for_,
+    const StateSpaceT& ss, const StateT& source, StateT& dest) {
+  PauliSumMasks masks;
+  CombinePauliSumMasks(p_sums, op_coeffs, &masks);
+
+  typedef typename StateSpaceT::fp_type fp_type;
+  const uint64_t lanes = ss.MinSize(0) / 2;
+  const uint64_t size = uint64_t(1) << source.num_qubits();
+  const uint64_t block_size = std::min(lanes, size);
+  if (block_size < lanes) {
+    // keep the padding of small states zero.
+    ss.SetAllZeros(dest);
+  }
+  const fp_type* p = source.get();
+  fp_type* out = dest.get();
+
+  auto f = [&masks, p, out, lanes, block_size](unsigned n, unsigned m,
+                                               uint64_t i) {
+    for (uint64_t j = 0; j < block_size; j++) {
+      const uint64_t d = i * block_size + j;
+      const uint64_t k = RawAmplitudeIndex(d, lanes);
+      double re = masks.identity_coeff * p[k];
+      double im = masks.identity_coeff * p[k + lanes];
+      for (size_t g = 0; g < masks.x_masks.size(); g++) {
+        // X^x Z^z maps amplitude b = d ^ x onto d with sign (-1)^|b & z|.
+        const uint64_t b = d ^ masks.x_masks[g];
+        double wr = 0;
+        double wi = 0;
+        for (int t = masks.group_offsets[g]; t < masks.group_offsets[g + 1];
+             t++) {
+          if (std::bitset<64>(b & masks.z_masks[t]).count() & 1) {
+            wr -= masks.coeffs_real[t];
+            wi -= masks.coeffs_imag[t];
+          } else {
+            wr += masks.coeffs_real[t];
+            wi += masks.coeffs_imag[t];
+          }
+        }
+        const uint64_t k2 = RawAmplitudeIndex(b, lanes);
+        re += wr * p[k2] - wi * p[k2 + lanes];
+        im += wr * p[k2 + lanes] + wi * p[k2];
+      }
+      out[k] = re;
+      out[k + lanes] = im;
+    }
+  };
+
+  for_.Run(size / block_size, f);
+  return tensorflow::Status::OK();
+}
+
 // Assumes coefficients.size() == fused_circuits.size().
 // These are checked at the upstream.
 // scratch has been created, but does not require initialization.
@@ -347,95 +1009,649 @@ tensorflow::Status AccumulateFusedCircuits(
   return status;
 }
 
-// Balance the number of trajectory computations done between
-// threads. num_samples is a 2d vector containing the number of reps
-// requested for each pauli_sum[i,j]. After running thread_offsets
-// contains 0/-1 values that will offset the work for each thread.
-// to make it as close to uniform as possible. **Assumes circuits
-// have rouhgly equal simulation cost**
-static void BalanceTrajectory(const std::vector<std::vector<int>>& num_samples,
-                              const int& num_threads,
-                              std::vector<std::vector<int>>* thread_offsets) {
-  std::vector<int> rep_limits(num_samples.size(), -1);
-  std::vector<int> height(num_threads, 0);
-
-  for (int i = 0; i < num_samples.size(); i++) {
-    for (int j = 0; j < num_samples[i].size(); j++) {
-      rep_limits[i] = std::max(rep_limits[i], num_samples[i][j]);
-    }
-  }
-  int prev_max_height = -1;
-  for (int j = 0; j < num_samples.size(); j++) {
-    int run_ceiling = ((rep_limits[j] + num_threads - 1) / num_threads);
-    int num_lo = num_threads * run_ceiling - rep_limits[j];
-    int num_hi = num_threads - num_lo;
-    int cur_max = prev_max_height;
-    for (int i = 0; i < num_threads; i++) {
-      if (height[i] == cur_max && num_lo) {
-        // previously had extra work on this thread and
-        // have remaining low budget to give.
-        height[i]++;
-        (*thread_offsets)[i][j] = -1;
-        num_lo--;
-      } else if (height[i] == cur_max - 1 && num_hi) {
-        // previously had less work on this thread and
-        // remaining high budget to give.
-        height[i] += 2;
-        (*thread_offsets)[i][j] = 0;
-        num_hi--;
-      } else if (num_hi) {
-        height[i] += 2;
-        (*thread_offsets)[i][j] = 0;
-        num_hi--;
-      } else {
-        height[i]++;
-        (*thread_offsets)[i][j] = -1;
-        num_lo--;
+// Circuits with fewer qubits than this are never spread over the whole
+// threadpool since the per gate scheduling overhead would dominate.
+static const int kMinWideQubits = 12;
+
+// Estimate of the number of amplitude updates needed to simulate a circuit:
+// every fused gate (plus a final pass to read the output) sweeps the state.
+inline uint64_t EstimateCircuitCost(const int num_qubits,
+                                    const uint64_t num_gates) {
+  return (num_gates + 1) << num_qubits;
+}
+
+// Assignment of the circuits of a batch to threads.
+struct CircuitSchedule {
+  // Circuits simulated one after another, each spread over all threads with
+  // QsimFor. Kept in batch order.
+  std::vector<int> wide;
+  // Circuits simulated concurrently with one thread each, sorted by
+  // decreasing cost so that the most expensive ones are picked up first.
+  std::vector<int> narrow;
+};
+
+// Largest state ScheduleCircuits considers keeping on every thread at once.
+// Such a state already exceeds any realistic memory budget.
+static const int kMaxNarrowQubits = 40;
+
+// Largest number of qubits, at least kMinWideQubits, for which each of
+// num_threads threads can hold states_per_circuit states of ss at the same
+// time within memory_budget bytes.
+template <typename StateSpaceT>
+int MaxNarrowQubits(const StateSpaceT& ss, const int num_threads,
+                    const int states_per_circuit,
+                    const uint64_t memory_budget) {
+  int max_narrow_qubits = kMinWideQubits;
+  while (max_narrow_qubits < kMaxNarrowQubits &&
+         uint64_t(num_threads) * states_per_circuit *
+                 sizeof(typename StateSpaceT::fp_type) *
+                 ss.MinSize(max_narrow_qubits + 1) <=
+             memory_budget) {
+    max_narrow_qubits++;
+  }
+  return max_narrow_qubits;
+}
+
+// MaxNarrowQubits for single precision states of the vectorized simulator.
+inline int MaxNarrowQubits(const int num_threads, const int states_per_circuit,
+                           const uint64_t memory_budget) {
+  const auto seq_for = qsim::SequentialFor(1);
+  using StateSpace = typename QsimSimulator<const qsim::SequentialFor&,
+                                            float>::type::StateSpace;
+  return MaxNarrowQubits(StateSpace(seq_for), num_threads, states_per_circuit,
+                         memory_budget);
+}
+
+// Splits a batch into wide and narrow circuits from the per circuit cost
+// estimate. A circuit is simulated wide when every thread holding
+// states_per_circuit of its states in ss at once would exceed memory_budget
+// bytes, or when its cost alone exceeds an even share of the remaining
+// narrow work, in which case it would otherwise keep a single thread busy
+// long after the others have run out of circuits.
+template <typename StateSpaceT>
+void ScheduleCircuits(const StateSpaceT& ss,
+                      const std::vector<int>& num_qubits,
+                      const std::vector<uint64_t>& costs,
+                      const int num_threads, const int states_per_circuit,
+                      const uint64_t memory_budget,
+                      CircuitSchedule* schedule) {
+  DCHECK_EQ(num_qubits.size(), costs.size());
+  schedule->wide.clear();
+  schedule->narrow.clear();
+
+  const int max_narrow_qubits =
+      MaxNarrowQubits(ss, num_threads, states_per_circuit, memory_budget);
+
+  std::vector<int> candidates;
+  std::vector<bool> is_wide(num_qubits.size(), false);
+  uint64_t narrow_cost = 0;
+  for (size_t i = 0; i < num_qubits.size(); i++) {
+    if (num_threads > 1 && num_qubits[i] > max_narrow_qubits) {
+      is_wide[i] = true;
+      continue;
+    }
+    candidates.push_back(i);
+    narrow_cost += costs[i];
+  }
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [&costs](const int a, const int b) {
+                     return costs[a] > costs[b];
+                   });
+
+  size_t first_narrow = 0;
+  if (num_threads > 1) {
+    for (; first_narrow < candidates.size(); first_narrow++) {
+      const int i = candidates[first_narrow];
+      if (num_qubits[i] < kMinWideQubits ||
+          costs[i] * num_threads <= narrow_cost) {
+        break;
       }
-      prev_max_height = std::max(height[i], prev_max_height);
-    }
-  }
-}
-
-// Simpler case of TrajectoryBalance where num_samples is fixed
-// across all circuits.
-static void BalanceTrajectory(const int& num_samples, const int& num_threads,
-                              std::vector<std::vector<int>>* thread_offsets) {
-  std::vector<int> height(num_threads, 0);
-
-  int prev_max_height = -1;
-  for (int j = 0; j < (*thread_offsets)[0].size(); j++) {
-    int run_ceiling = ((num_samples + num_threads - 1) / num_threads);
-    int num_lo = num_threads * run_ceiling - num_samples;
-    int num_hi = num_threads - num_lo;
-    int cur_max = prev_max_height;
-    for (int i = 0; i < num_threads; i++) {
-      if (height[i] == cur_max && num_lo) {
-        // previously had extra work on this thread and
-        // have remaining low budget to give.
-        height[i]++;
-        (*thread_offsets)[i][j] = -1;
-        num_lo--;
-      } else if (height[i] == cur_max - 1 && num_hi) {
-        // previously had less work on this thread and
-        // remaining high budget to give.
-        height[i] += 2;
-        (*thread_offsets)[i][j] = 0;
-        num_hi--;
-      } else if (num_hi) {
-        height[i] += 2;
-        (*thread_offsets)[i][j] = 0;
-        num_hi--;
-      } else {
-        height[i]++;
-        (*thread_offsets)[i][j] = -1;
-        num_lo--;
+      is_wide[i] = true;
+      narrow_cost -= costs[i];
+    }
+  }
+
+  for (size_t i = 0; i < num_qubits.size(); i++) {
+    if (is_wide[i]) {
+      schedule->wide.push_back(i);
+    }
+  }
+  schedule->narrow.assign(candidates.begin() + first_narrow,
+                          candidates.end());
+}
+
+// ScheduleCircuits with states_per_circuit counting single precision states
+// of the vectorized simulator.
+inline void ScheduleCircuits(const std::vector<int>& num_qubits,
+                             const std::vector<uint64_t>& costs,
+                             const int num_threads,
+                             const int states_per_circuit,
+                             const uint64_t memory_budget,
+                             CircuitSchedule* schedule) {
+  const auto seq_for = qsim::SequentialFor(1);
+  using StateSpace = typename QsimSimulator<const qsim::SequentialFor&,
+                                            float>::type::StateSpace;
+  ScheduleCircuits(StateSpace(seq_for), num_qubits, costs, num_threads,
+                   states_per_circuit, memory_budget, schedule);
+}
+
+// ScheduleCircuits for a batch of fused circuits on the threadpool of
+// context, with costs taken from EstimateCircuitCost and the memory budget
+// of the global StatePool. states_per_circuit counts single precision
+// states, double precision circuits need twice the memory.
+template <typename Gate>
+void ScheduleFusedCircuits(
+    tensorflow::OpKernelContext* context, const std::vector<int>& num_qubits,
+    const std::vector<std::vector<qsim::GateFused<Gate>>>& fused_circuits,
+    const int states_per_circuit, CircuitSchedule* schedule) {
+  std::vector<uint64_t> costs(fused_circuits.size());
+  for (size_t i = 0; i < fused_circuits.size(); i++) {
+    costs[i] = EstimateCircuitCost(num_qubits[i], fused_circuits[i].size());
+  }
+  const int num_threads = context->device()
+                              ->tensorflow_cpu_worker_threads()
+                              ->workers->NumThreads();
+  const int float_states = states_per_circuit *
+                           sizeof(typename Gate::fp_type) / sizeof(float);
+  ScheduleCircuits(num_qubits, costs, num_threads, float_states,
+                   StatePool::Global()->budget(), schedule);
+}
+
+// Removes the batch rows that repeat an earlier row (first_row[i] != i,
+// see GetDuplicateRows) from schedule.
+inline void SkipDuplicateRows(const std::vector<int>& first_row,
+                              CircuitSchedule* schedule) {
+  auto is_duplicate = [&first_row](const int i) {
+    return first_row[i] != i;
+  };
+  schedule->wide.erase(std::remove_if(schedule->wide.begin(),
+                                      schedule->wide.end(), is_duplicate),
+                       schedule->wide.end());
+  schedule->narrow.erase(std::remove_if(schedule->narrow.begin(),
+                                        schedule->narrow.end(), is_duplicate),
+                         schedule->narrow.end());
+}
+
+// Fills the output rows of repeated batch rows from the row they repeat.
+template <typename MatrixT>
+void CopyDuplicateRows(const std::vector<int>& first_row, MatrixT* output) {
+  for (size_t i = 0; i < first_row.size(); i++) {
+    if (first_row[i] == static_cast<int>(i)) {
+      continue;
+    }
+    for (int j = 0; j < output->dimension(1); j++) {
+      (*output)(i, j) = (*output)(first_row[i], j);
+    }
+  }
+}
+
+// Thread safe queue of batch indices shared by the workers of
+// RunWorkQueue.
+class WorkQueue {
+ public:
+  explicit WorkQueue(const std::vector<int>& tasks) : tasks_(tasks), next_(0) {}
+
+  // Fetches the next task. Returns false once every task has been handed out.
+  bool Next(int* task) {
+    const size_t i = next_.fetch_add(1, std::memory_order_relaxed);
+    if (i >= tasks_.size()) {
+      return false;
+    }
+    *task = tasks_[i];
+    return true;
+  }
+
+ private:
+  const std::vector<int>& tasks_;
+  std::atomic<size_t> next_;
+};
+
+// Runs worker(queue) once on every thread of the op's threadpool (but no more
+// often than there are tasks or max_workers). Workers keep pulling tasks from
+// the shared queue until it is empty, so a thread that finishes a cheap
+// circuit takes the next one instead of idling behind a fixed partition of
+// the batch.
+template <typename Function>
+void RunWorkQueue(tensorflow::OpKernelContext* context,
+                  const std::vector<int>& tasks, const int max_workers,
+                  Function&& worker) {
+  if (tasks.empty()) {
+    return;
+  }
+  WorkQueue queue(tasks);
+  auto* workers = context->device()->tensorflow_cpu_worker_threads()->workers;
+  const int num_workers = std::max(
+      1, std::min({static_cast<int>(tasks.size()), workers->NumThreads(),
+                   max_workers}));
+
+  auto fn = [&queue, &worker](int64_t start, int64_t end) {
+    for (int64_t i = start; i < end; i++) {
+      worker(queue);
+    }
+  };
+
+  // block_size = 1, one shard per worker.
+  tensorflow::thread::ThreadPool::SchedulingParams scheduling_params(
+      tensorflow::thread::ThreadPool::SchedulingStrategy::kFixedBlockSize,
+      absl::nullopt, 1);
+  workers->ParallelFor(num_workers, scheduling_params, fn);
+}
+
+// RunWorkQueue on every thread of the op's threadpool.
+template <typename Function>
+void RunWorkQueue(tensorflow::OpKernelContext* context,
+                  const std::vector<int>& tasks, Function&& worker) {
+  RunWorkQueue(context, tasks,
+               context->device()->tensorflow_cpu_worker_threads()->workers
+                   ->NumThreads(),
+               std::forward<Function>(worker));
+}
+
+// Number of consecutive shots, or trajectories, of a circuit drawn from one
+// random stream.
+static const int kShotsPerStream = 64;
+
+// Random streams of a sampling op. The shots of circuit i in call c of the
+// op are drawn in blocks of kShotsPerStream, block b from Stream(c, i, b).
+// Streams are counter based Philox streams, so every block can be drawn by
+// any thread and the results only depend on the seeds, not on how the work
+// is split between threads.
+class RandomStreams {
+ public:
+  RandomStreams() : seed_(0), seed2_(0), calls_(0) {}
+
+  // Seeds from the "seed" and "seed2" attrs of the op. Like the TensorFlow
+  // random ops, a fresh random seed is used when both are 0.
+  tensorflow::Status Init(tensorflow::OpKernelConstruction* context) {
+    tensorflow::int64 seed;
+    tensorflow::int64 seed2;
+    TF_RETURN_IF_ERROR(context->GetAttr("seed", &seed));
+    TF_RETURN_IF_ERROR(context->GetAttr("seed2", &seed2));
+    if (seed == 0 && seed2 == 0) {
+      Seed(tensorflow::random::New64(), tensorflow::random::New64());
+    } else {
+      Seed(seed, seed2);
+    }
+    return tensorflow::Status::OK();
+  }
+
+  void Seed(const uint64_t seed, const uint64_t seed2) {
+    seed_ = seed;
+    seed2_ = seed2;
+    calls_ = 0;
+  }
+
+  // Number of the next call, to be taken once per Compute.
+  uint64_t NextCall() {
+    return calls_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  tensorflow::random::PhiloxRandom Stream(const uint64_t call,
+                                          const uint64_t circuit,
+                                          const uint64_t block) const {
+    // The key holds seed, the high counter words the stream name.
+    return tensorflow::random::PhiloxRandom(
+        seed_, tensorflow::FingerprintCat64(
+                   tensorflow::FingerprintCat64(seed2_, call),
+                   (circuit << 32) | block));
+  }
+
+ private:
+  uint64_t seed_;
+  uint64_t seed2_;
+  std::atomic<uint64_t> calls_;
+};
+
+// The num_shots[i] shots of every circuit i of a batch in blocks of
+// kShotsPerStream. Block t is block blocks[t] of circuit circuits[t] and
+// covers its shots [blocks[t] * kShotsPerStream, (blocks[t] + 1) *
+// kShotsPerStream), or up to num_shots for the last block. The blocks of
+// circuit i are [offsets[i], offsets[i + 1]).
+struct ShotBlocks {
+  std::vector<int> num_shots;
+  std::vector<int> circuits;
+  std::vector<int> blocks;
+  std::vector<int> offsets;
+};
+
+// Splits the num_shots[i] shots of every circuit i into blocks.
+inline void PlanShotBlocks(const std::vector<int>& num_shots,
+                           ShotBlocks* plan) {
+  plan->num_shots = num_shots;
+  plan->circuits.clear();
+  plan->blocks.clear();
+  plan->offsets.assign(1, 0);
+  for (size_t i = 0; i < num_shots.size(); i++) {
+    const int num_blocks =
+        (num_shots[i] + kShotsPerStream - 1) / kShotsPerStream;
+    for (int b = 0; b < num_blocks; b++) {
+      plan->circuits.push_back(i);
+      plan->blocks.push_back(b);
+    }
+    plan->offsets.push_back(plan->circuits.size());
+  }
+}
+
+// Estimate of the cost of one trajectory of a noisy circuit: each of the
+// num_channels channels left after its noiseless prefix (plus a final pass
+// to read the output) sweeps the state.
+inline uint64_t EstimateTrajectoryCost(const int num_qubits,
+                                       const uint64_t num_channels) {
+  return (num_channels + 1) << num_qubits;
+}
+
+// EstimateTrajectoryCost of every circuit of a batch of noisy circuits.
+template <typename NoisyCircuit>
+void EstimateTrajectoryCosts(const std::vector<int>& num_qubits,
+                             const std::vector<NoisyCircuit>& ncircuits,
+                             std::vector<uint64_t>* costs) {
+  costs->resize(ncircuits.size());
+  for (size_t i = 0; i < ncircuits.size(); i++) {
+    (*costs)[i] =
+        EstimateTrajectoryCost(num_qubits[i], ncircuits[i].channels.size());
+  }
+}
+
+// Sorts tasks, indices of blocks of plan, by decreasing cost: the number of
+// shots of the block times costs[i] of its circuit. A work queue then hands
+// out the most expensive blocks first and the cheap ones fill up the threads
+// at the end of the call. Blocks of equal cost keep their order, so the
+// blocks of a circuit stay in order.
+inline void SortShotBlocksByCost(const ShotBlocks& plan,
+                                 const std::vector<uint64_t>& costs,
+                                 std::vector<int>* tasks) {
+  auto block_cost = [&plan, &costs](const int t) {
+    const int i = plan.circuits[t];
+    const int shots = std::min(
+        kShotsPerStream, plan.num_shots[i] - plan.blocks[t] * kShotsPerStream);
+    return costs[i] * shots;
+  };
+  std::stable_sort(tasks->begin(), tasks->end(),
+                   [&block_cost](const int a, const int b) {
+                     return block_cost(a) > block_cost(b);
+                   });
+}
+
+// Number of states every thread of the narrow noisy trajectory path holds:
+// the trajectory state, the scratch state of the trajectory simulator and
+// the state after the noiseless prefix.
+static const int kNoisyStatesPerThread = 3;
+
+// The state after the noiseless prefix of a noisy circuit, which every
+// trajectory starts from. It is kept in a state of its own only when the
+// prefix has more than one fused gate, since otherwise copying it costs as
+// much as simulating it, and when that third state fits the StatePool
+// budget next to the two working states. Otherwise every trajectory
+// simulates the prefix again.
+template <typename SimT, typename StateSpaceT>
+class NoiselessPrefix {
+ public:
+  typedef typename StateSpaceT::State State;
+
+  NoiselessPrefix(const SimT& sim, const StateSpaceT& ss,
+                  StateArena<StateSpaceT>* arena)
+      : sim_(sim),
+        ss_(ss),
+        arena_(arena),
+        state_(arena->Create(1)),
+        prefix_(nullptr),
+        cached_(false) {}
+
+  // Switches to prefix, for trajectories on states of num_qubits qubits.
+  void Set(const std::vector<qsim::GateFused<QsimGate>>& prefix,
+           const unsigned num_qubits) {
+    prefix_ = &prefix;
+    const uint64_t state_bytes =
+        sizeof(typename StateSpaceT::fp_type) * ss_.MinSize(num_qubits);
+    cached_ = prefix.size() > 1 && kNoisyStatesPerThread * state_bytes <=
+                                       StatePool::Global()->budget();
+    if (!cached_) {
+      return;
+    }
+    if (state_.num_qubits() != num_qubits) {
+      arena_->Resize(num_qubits, &state_);
+    }
+    ss_.SetStateZero(state_);
+    for (const auto& fused_gate : prefix) {
+      qsim::ApplyFusedGate(sim_, fused_gate, state_);
+    }
+  }
+
+  // Sets sv, on the num_qubits passed to Set, to the prefix state.
+  void Start(State& sv) const {
+    if (cached_) {
+      ss_.Copy(state_, sv);
+      return;
+    }
+    ss_.SetStateZero(sv);
+    for (const auto& fused_gate : *prefix_) {
+      qsim::ApplyFusedGate(sim_, fused_gate, sv);
+    }
+  }
+
+ private:
+  const SimT& sim_;
+  const StateSpaceT& ss_;
+  StateArena<StateSpaceT>* arena_;
+  State state_;
+  const std::vector<qsim::GateFused<QsimGate>>* prefix_;
+  bool cached_;
+};
+
+// Reads the "backend" attr of the noisy ops.
+inline tensorflow::Status GetNoisyBackend(
+    tensorflow::OpKernelConstruction* context, NoisyBackend* backend) {
+  std::string name;
+  tensorflow::Status status = context->GetAttr("backend", &name);
+  if (!status.ok()) {
+    return status;
+  }
+  if (name == "trajectory") {
+    *backend = NoisyBackend::kTrajectory;
+  } else if (name == "density_matrix") {
+    *backend = NoisyBackend::kDensityMatrix;
+  } else if (name == "auto") {
+    *backend = NoisyBackend::kAuto;
+  } else {
+    return tensorflow::Status(
+        tensorflow::error::INVALID_ARGUMENT,
+        absl::StrCat("Unknown backend: ", name,
+                     ". Expected trajectory, density_matrix or auto."));
+  }
+  return tensorflow::Status::OK();
+}
+
+// Picks the noisy circuits of a batch that backend simulates on density
+// matrices instead of with their num_trajectories[i] trajectories. Their
+// indices are stored in density_matrices and their num_trajectories are set
+// to 0. Circuits without qubits or trajectories are left alone.
+template <typename NoisyCircuit>
+tensorflow::Status PlanDensityMatrices(
+    const NoisyBackend backend, const std::vector<int>& num_qubits,
+    const std::vector<NoisyCircuit>& ncircuits,
+    std::vector<int>* num_trajectories, std::vector<int>* density_matrices) {
+  density_matrices->clear();
+  for (size_t i = 0; i < ncircuits.size(); i++) {
+    if (num_qubits[i] == 0 || (*num_trajectories)[i] == 0) {
+      continue;
+    }
+    const uint64_t trajectory_cost =
+        EstimateTrajectoryCost(num_qubits[i], ncircuits[i].channels.size()) *
+        (*num_trajectories)[i];
+    const uint64_t density_matrix_cost =
+        num_qubits[i] > kMaxDensityMatrixQubits
+            ? 0
+            : EstimateDensityMatrixCost(num_qubits[i],
+                                        CountDensityMatrixSweeps(ncircuits[i]));
+    if (!UseDensityMatrix(backend, num_qubits[i], density_matrix_cost,
+                          trajectory_cost)) {
+      continue;
+    }
+    if (num_qubits[i] > kMaxDensityMatrixQubits) {
+      return tensorflow::Status(
+          tensorflow::error::INVALID_ARGUMENT,
+          absl::StrCat("The density_matrix backend supports at most ",
+                       kMaxDensityMatrixQubits, " qubits, got a circuit on ",
+                       num_qubits[i], " qubits."));
+    }
+    density_matrices->push_back(i);
+    (*num_trajectories)[i] = 0;
+  }
+  return tensorflow::Status::OK();
+}
+
+// Density matrices are simulated with one thread each.
+typedef qsim::Simulator<const qsim::SequentialFor&> DensityMatrixSimulator;
+typedef DensityMatrixSimulator::StateSpace DensityMatrixStateSpace;
+typedef DensityMatrixStateSpace::State DensityMatrixState;
+
+// Number of density matrices every worker of RunDensityMatrices holds: rho,
+// the scratch matrix of the channels and the sum of their Kraus operators.
+// The state vector of the noiseless prefix is negligible next to them.
+static const int kDensityMatrixStatesPerThread = 3;
+
+// Simulates the density matrices of the noisy circuits tasks, one circuit per
+// thread of the op's threadpool, and calls
+// f(i, sim, ss, num_qubits[i], rho, scratch) with the final density matrix
+// rho of circuit i. The noiseless prefix fused_prefixes[i] runs on a state
+// vector first. f returns a tensorflow::Status, the first error is returned.
+//
+// The circuits are split by ScheduleCircuits on their 2n qubit density
+// matrices. Those whose matrices every thread can hold at once within the
+// StatePool budget run on all threads, the others afterwards on only as many
+// threads as the budget allows.
+template <typename NoisyCircuit, typename Function>
+tensorflow::Status RunDensityMatrices(
+    tensorflow::OpKernelContext* context, const std::vector<int>& tasks,
+    const std::vector<int>& num_qubits,
+    const std::vector<NoisyCircuit>& ncircuits,
+    const std::vector<QsimFusedCircuit>& fused_prefixes, Function&& f) {
+  using Simulator = DensityMatrixSimulator;
+  using StateSpace = DensityMatrixStateSpace;
+
+  if (tasks.empty()) {
+    return tensorflow::Status::OK();
+  }
+
+  std::vector<int> rho_qubits;
+  std::vector<uint64_t> costs;
+  rho_qubits.reserve(tasks.size());
+  costs.reserve(tasks.size());
+  for (const int i : tasks) {
+    rho_qubits.push_back(2 * num_qubits[i]);
+    costs.push_back(EstimateDensityMatrixCost(
+        num_qubits[i], CountDensityMatrixSweeps(ncircuits[i])));
+  }
+  const int num_threads = context->device()
+                              ->tensorflow_cpu_worker_threads()
+                              ->workers->NumThreads();
+  const uint64_t budget = StatePool::Global()->budget();
+  const auto schedule_for = qsim::SequentialFor(1);
+  const StateSpace schedule_ss(schedule_for);
+  CircuitSchedule schedule;
+  ScheduleCircuits(schedule_ss, rho_qubits, costs, num_threads,
+                   kDensityMatrixStatesPerThread, budget, &schedule);
+
+  std::vector<int> narrow_tasks;
+  for (const int t : schedule.narrow) {
+    narrow_tasks.push_back(tasks[t]);
+  }
+  std::vector<int> wide_tasks;
+  uint64_t wide_bytes = 0;
+  for (const int t : schedule.wide) {
+    wide_tasks.push_back(tasks[t]);
+    wide_bytes = std::max(wide_bytes, uint64_t(kDensityMatrixStatesPerThread) *
+                                          sizeof(StateSpace::fp_type) *
+                                          schedule_ss.MinSize(rho_qubits[t]));
+  }
+
+  tensorflow::Status status = tensorflow::Status::OK();
+  tensorflow::mutex status_lock;
+  auto DoWork = [&](WorkQueue& queue) {
+    const auto seq_for = qsim::SequentialFor(1);
+    Simulator sim = Simulator(seq_for);
+    StateSpace ss = StateSpace(seq_for);
+    StateArena<StateSpace> arena(ss);
+    int current_nq = 1;
+    auto sv = arena.Create(current_nq);
+    auto rho = arena.Create(2 * current_nq);
+    auto scratch = arena.Create(2 * current_nq);
+    auto sum = arena.Create(2 * current_nq);
+
+    int i;
+    while (queue.Next(&i)) {
+      const int nq = num_qubits[i];
+      if (nq != current_nq) {
+        current_nq = nq;
+        arena.Resize(nq, &sv);
+        arena.Resize(2 * nq, &rho);
+        arena.Resize(2 * nq, &scratch);
+        arena.Resize(2 * nq, &sum);
+      }
+      ss.SetStateZero(sv);
+      for (const auto& fused_gate : fused_prefixes[i]) {
+        qsim::ApplyFusedGate(sim, fused_gate, sv);
+      }
+      SetDensityMatrixPure(ss, sv, rho);
+      RunDensityMatrixChannels(sim, ss, nq, ncircuits[i], rho, scratch, sum);
+
+      tensorflow::Status local = f(i, sim, ss, nq, rho, scratch);
+      if (!local.ok()) {
+        tensorflow::mutex_lock lock(status_lock);
+        status = local;
+        return;
       }
-      prev_max_height = std::max(height[i], prev_max_height);
     }
+  };
+
+  RunWorkQueue(context, narrow_tasks, DoWork);
+  if (status.ok() && !wide_tasks.empty()) {
+    RunWorkQueue(context, wide_tasks,
+                 static_cast<int>(std::min<uint64_t>(
+                     num_threads, budget / wide_bytes)),
+                 DoWork);
   }
+  return status;
 }
 
+// Running count, mean and sum of squared deviations of a sequence of values
+// (Welford's algorithm). The statistics of two parts of a sequence are
+// combined with Merge, so blocks of shots can be reduced in any grouping.
+struct RunningStats {
+  RunningStats() : count(0), mean(0.0), m2(0.0) {}
+
+  void Add(const double x) {
+    count++;
+    const double delta = x - mean;
+    mean += delta / count;
+    m2 += delta * (x - mean);
+  }
+
+  // Appends the values summarized by other.
+  void Merge(const RunningStats& other) {
+    if (other.count == 0) {
+      return;
+    }
+    const double n = count + other.count;
+    const double delta = other.mean - mean;
+    mean += delta * other.count / n;
+    m2 += other.m2 + delta * delta * count * other.count / n;
+    count += other.count;
+  }
+
+  // Unbiased variance of the values, 0 for fewer than two.
+  double Variance() const { return count < 2 ? 0.0 : m2 / (count - 1); }
+
+  // Squared standard error of the mean.
+  double SquaredError() const {
+    return count == 0 ? 0.0 : Variance() / count;
+  }
+
+  int count;
+  double mean;
+  double m2;
+};
+
 }  // namespace tfq
 
 #endif  // UTIL_QSIM_H_
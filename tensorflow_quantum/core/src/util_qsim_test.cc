@@ -15,6 +15,8 @@ limitations under the License.
 
 #include "tensorflow_quantum/core/src/util_qsim.h"
 
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "../qsim/lib/circuit.h"
@@ -165,6 +167,15 @@ TEST_P(TwoTermExpectationFixture, CorrectnessTest) {
   Status s = tfq::ComputeExpectationQsim(p_sum, sim, ss, sv, scratch, &exp_v);
 
   EXPECT_NEAR(exp_v, std::get<1>(GetParam()), 1e-5);
+
+  // Same value from the bitmask kernel.
+  PauliSumMasks masks;
+  ASSERT_EQ(PauliSumToMasks(p_sum, 2, &masks), Status::OK());
+  float mask_exp_v = 0;
+  ASSERT_EQ(ComputeExpectationMasks(masks, qsim::SequentialFor(1), ss, sv,
+                                    &mask_exp_v),
+            Status::OK());
+  EXPECT_NEAR(mask_exp_v, std::get<1>(GetParam()), 1e-5);
 }
 
 // clang-format off
@@ -354,6 +365,375 @@ TEST(UtilQsimTest, CompoundCase) {
   EXPECT_NEAR(exp_v, 4.1234, 1e-5);
 }
 
+void AddPauliTerm(const float coeff, const std::string& paulis,
+                  PauliSum* p_sum) {
+  PauliTerm* term = p_sum->add_terms();
+  term->set_coefficient_real(coeff);
+  for (int q = 0; q < paulis.size(); q++) {
+    if (paulis[q] == 'I') {
+      continue;
+    }
+    PauliQubitPair* pair_proto = term->add_paulis();
+    pair_proto->set_qubit_id(std::to_string(q));
+    pair_proto->set_pauli_type(paulis.substr(q, 1));
+  }
+}
+
+TEST(UtilQsimTest, PauliSumToMasksGrouping) {
+  PauliSum p_sum;
+  AddPauliTerm(1.0, "ZI", &p_sum);
+  AddPauliTerm(2.0, "XY", &p_sum);
+  AddPauliTerm(3.0, "IZ", &p_sum);
+  AddPauliTerm(4.0, "XY", &p_sum);
+  AddPauliTerm(5.0, "XX", &p_sum);
+  AddPauliTerm(6.0, "II", &p_sum);
+
+  PauliSumMasks masks;
+  ASSERT_EQ(PauliSumToMasks(p_sum, 2, &masks), Status::OK());
+  EXPECT_NEAR(masks.identity_coeff, 6.0, 1e-5);
+
+  // Qubit 0 is the high bit. Groups: x = 0 {IZ, ZI}, x = 3 {XX, XY}.
+  ASSERT_EQ(masks.x_masks, std::vector<uint64_t>({0, 3}));
+  ASSERT_EQ(masks.group_offsets, std::vector<int>({0, 2, 4}));
+  ASSERT_EQ(masks.z_masks, std::vector<uint64_t>({1, 2, 0, 1}));
+  EXPECT_NEAR(masks.coeffs_real[0], 3.0, 1e-5);
+  EXPECT_NEAR(masks.coeffs_real[1], 1.0, 1e-5);
+  EXPECT_NEAR(masks.coeffs_real[2], 5.0, 1e-5);
+  EXPECT_NEAR(masks.coeffs_imag[2], 0.0, 1e-5);
+  // Duplicate XY terms are merged, Y contributes a phase of i.
+  EXPECT_NEAR(masks.coeffs_real[3], 0.0, 1e-5);
+  EXPECT_NEAR(masks.coeffs_imag[3], 6.0, 1e-5);
+}
+
+TEST(UtilQsimTest, PauliSumToMasksMeasurementBases) {
+  PauliSum p_sum;
+  AddPauliTerm(1.0, "ZZ", &p_sum);
+  AddPauliTerm(1.0, "ZI", &p_sum);
+  AddPauliTerm(1.0, "IZ", &p_sum);
+  AddPauliTerm(1.0, "XX", &p_sum);
+  AddPauliTerm(1.0, "XI", &p_sum);
+  AddPauliTerm(1.0, "YY", &p_sum);
+
+  PauliSumMasks masks;
+  ASSERT_EQ(PauliSumToMasks(p_sum, 2, &masks), Status::OK());
+  // Terms: 0 IZ, 1 ZI, 2 ZZ (x = 0), 3 XI (x = 2), 4 XX, 5 YY (x = 3).
+  ASSERT_EQ(masks.group_offsets, std::vector<int>({0, 3, 4, 6}));
+
+  // Bases ZZ {IZ, ZI, ZZ}, XX {XI, XX} and YY {YY}.
+  EXPECT_EQ(masks.basis_x_masks, std::vector<uint64_t>({0, 3, 3}));
+  EXPECT_EQ(masks.basis_z_masks, std::vector<uint64_t>({3, 0, 3}));
+  EXPECT_EQ(masks.basis_offsets, std::vector<int>({0, 3, 5, 6}));
+  EXPECT_EQ(masks.basis_groups, std::vector<int>({0, 0, 0, 1, 2, 2}));
+  EXPECT_EQ(masks.basis_terms, std::vector<int>({0, 1, 2, 3, 4, 5}));
+}
+
+TEST(UtilQsimTest, PauliSumToMasksBadPauli) {
+  PauliSum p_sum;
+  AddPauliTerm(1.0, "ZW", &p_sum);
+  PauliSumMasks masks;
+  EXPECT_EQ(PauliSumToMasks(p_sum, 2, &masks),
+            Status(tensorflow::error::INVALID_ARGUMENT,
+                   "Could not parse pauli type: W"));
+}
+
+TEST(UtilQsimTest, PauliSumToMasksBadQubitId) {
+  PauliSum p_sum;
+  AddPauliTerm(1.0, "Z", &p_sum);
+  p_sum.mutable_terms(0)->mutable_paulis(0)->set_qubit_id("0_0");
+  PauliSumMasks masks;
+  EXPECT_EQ(PauliSumToMasks(p_sum, 2, &masks),
+            Status(tensorflow::error::INVALID_ARGUMENT,
+                   "Could not parse qubit id: 0_0"));
+}
+
+TEST(UtilQsimTest, ComputeExpectationMasksMatchesCircuits) {
+  // Enough qubits to span several SIMD blocks of the state vector.
+  const int num_qubits = 6;
+  QsimCircuit simple_circuit;
+  simple_circuit.num_qubits = num_qubits;
+  for (int q = 0; q < num_qubits; q++) {
+    simple_circuit.gates.push_back(
+        qsim::Cirq::XPowGate<float>::Create(0, q, 0.1 + 0.13 * q, 0.0));
+    simple_circuit.gates.push_back(
+        qsim::Cirq::ZPowGate<float>::Create(1, q, 0.3 - 0.07 * q, 0.0));
+  }
+  for (int q = 0; q + 1 < num_qubits; q++) {
+    simple_circuit.gates.push_back(
+        qsim::Cirq::CXPowGate<float>::Create(2 + q, q, q + 1, 0.6, 0.0));
+  }
+  auto fused_circuit = qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+      qsim::BasicGateFuser<qsim::IO, QsimGate>::Parameter(),
+      simple_circuit.num_qubits, simple_circuit.gates);
+
+  qsim::Simulator<qsim::SequentialFor> sim(1);
+  qsim::Simulator<qsim::SequentialFor>::StateSpace ss(1);
+  auto sv = ss.Create(num_qubits);
+  auto scratch = ss.Create(num_qubits);
+  ss.SetStateZero(sv);
+  for (const qsim::GateFused<QsimGate>& fused_gate : fused_circuit) {
+    qsim::ApplyFusedGate(sim, fused_gate, sv);
+  }
+
+  PauliSum p_sum;
+  AddPauliTerm(0.5, "XYZIII", &p_sum);
+  AddPauliTerm(-1.25, "IIIZZI", &p_sum);
+  AddPauliTerm(0.75, "YIIIIY", &p_sum);
+  AddPauliTerm(2.0, "YYYYYY", &p_sum);
+  AddPauliTerm(-0.3, "IXXIIX", &p_sum);
+  AddPauliTerm(0.9, "IYXIIZ", &p_sum);
+  AddPauliTerm(1.1, "ZZZZZZ", &p_sum);
+  AddPauliTerm(0.2, "IIIIII", &p_sum);
+
+  float ref_exp_v = 0;
+  ASSERT_EQ(ComputeExpectationQsim(p_sum, sim, ss, sv, scratch, &ref_exp_v),
+            Status::OK());
+
+  PauliSumMasks masks;
+  ASSERT_EQ(PauliSumToMasks(p_sum, num_qubits, &masks), Status::OK());
+  float exp_v = 0;
+  ASSERT_EQ(
+      ComputeExpectationMasks(masks, qsim::SequentialFor(1), ss, sv, &exp_v),
+      Status::OK());
+  EXPECT_NEAR(exp_v, ref_exp_v, 1e-5);
+}
+
+TEST(UtilQsimTest, ComputeBatchedExpectationMasksMatchesUnbatched) {
+  const int num_qubits = 5;
+  const int num_states = 4;
+  std::vector<QsimCircuit> circuits(num_states);
+  std::vector<QsimFusedCircuit> fused_circuits;
+  for (int k = 0; k < num_states; k++) {
+    circuits[k].num_qubits = num_qubits;
+    for (int q = 0; q < num_qubits; q++) {
+      circuits[k].gates.push_back(qsim::Cirq::XPowGate<float>::Create(
+          0, q, 0.1 + 0.13 * q + 0.2 * k, 0.0));
+      circuits[k].gates.push_back(qsim::Cirq::ZPowGate<float>::Create(
+          1, q, 0.3 - 0.07 * q, 0.0));
+    }
+    for (int q = 0; q + 1 < num_qubits; q++) {
+      circuits[k].gates.push_back(qsim::Cirq::CXPowGate<float>::Create(
+          2 + q, q, q + 1, 0.6 - 0.1 * k, 0.0));
+    }
+    fused_circuits.push_back(
+        qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+            qsim::BasicGateFuser<qsim::IO, QsimGate>::Parameter(),
+            num_qubits, circuits[k].gates));
+  }
+
+  BatchedStates<float> states;
+  std::vector<float> batch_scratch;
+  RunBatchedCircuits({0, 1, 2, 3}, std::vector<int>(num_states, num_qubits),
+                     fused_circuits, &states, &batch_scratch);
+
+  PauliSum p_sum;
+  AddPauliTerm(0.5, "XYZII", &p_sum);
+  AddPauliTerm(-1.25, "IIIZZ", &p_sum);
+  AddPauliTerm(0.75, "YIIIY", &p_sum);
+  AddPauliTerm(0.2, "IIIII", &p_sum);
+  PauliSumMasks masks;
+  ASSERT_EQ(PauliSumToMasks(p_sum, num_qubits, &masks), Status::OK());
+
+  qsim::Simulator<qsim::SequentialFor> sim(1);
+  qsim::Simulator<qsim::SequentialFor>::StateSpace ss(1);
+  auto sv = ss.Create(num_qubits);
+  for (int k = 0; k < num_states; k++) {
+    ss.SetStateZero(sv);
+    for (const qsim::GateFused<QsimGate>& fused_gate : fused_circuits[k]) {
+      qsim::ApplyFusedGate(sim, fused_gate, sv);
+    }
+    float ref_exp_v = 0;
+    ASSERT_EQ(ComputeExpectationMasks(masks, qsim::SequentialFor(1), ss, sv,
+                                      &ref_exp_v),
+              Status::OK());
+    float exp_v = 0;
+    ComputeBatchedExpectationMasks(masks, states, k, &exp_v);
+    EXPECT_NEAR(exp_v, ref_exp_v, 1e-5);
+  }
+}
+
+TEST(UtilQsimTest, GradientGateInnerProductMatchesCopy) {
+  // Enough qubits to span several SIMD blocks of the state vector.
+  const int num_qubits = 6;
+  qsim::Simulator<qsim::SequentialFor> sim(1);
+  qsim::Simulator<qsim::SequentialFor>::StateSpace ss(1);
+  auto ket = ss.Create(num_qubits);
+  auto bra = ss.Create(num_qubits);
+  auto scratch = ss.Create(num_qubits);
+  ss.SetStateZero(ket);
+  ss.SetStateZero(bra);
+  for (int q = 0; q < num_qubits; q++) {
+    qsim::ApplyGate(
+        sim, qsim::Cirq::XPowGate<float>::Create(0, q, 0.2 + 0.1 * q, 0.0),
+        ket);
+    qsim::ApplyGate(
+        sim, qsim::Cirq::YPowGate<float>::Create(0, q, 0.7 - 0.1 * q, 0.0),
+        bra);
+  }
+  for (int q = 0; q + 1 < num_qubits; q++) {
+    qsim::ApplyGate(
+        sim, qsim::Cirq::CZPowGate<float>::Create(1, q, q + 1, 0.3, 0.0), ket);
+    qsim::ApplyGate(
+        sim, qsim::Cirq::FSimGate<float>::Create(1, q, q + 1, 0.4, 0.9), bra);
+  }
+
+  std::vector<QsimGate> gates = {
+      qsim::Cirq::YPowGate<float>::Create(0, 3, 0.3, 0.0),
+      qsim::Cirq::XPowGate<float>::Create(0, 0, 0.8, 0.25),
+      qsim::Cirq::FSimGate<float>::Create(0, 1, 4, 0.6, 0.2),
+      qsim::Cirq::CXPowGate<float>::Create(0, 5, 2, 0.7, 0.0),
+  };
+  // (mask, bits) pairs: no controls, qubit 0 set, qubit 1 set and 5 unset.
+  std::vector<std::pair<uint64_t, uint64_t>> controls = {
+      {0, 0}, {1, 1}, {0b100010, 0b000010}};
+  for (const auto& gate : gates) {
+    for (const auto& control : controls) {
+      if (control.first & (uint64_t(1) << gate.qubits[0])) {
+        continue;
+      }
+      if (gate.qubits.size() > 1 &&
+          control.first & (uint64_t(1) << gate.qubits[1])) {
+        continue;
+      }
+      ss.Copy(ket, scratch);
+      if (control.first != 0) {
+        ss.BulkSetAmpl(scratch, control.first, control.second, 0, 0, true);
+      }
+      qsim::ApplyGate(sim, gate, scratch);
+      const double expected = ss.RealInnerProduct(bra, scratch);
+
+      const double result =
+          GradientGateInnerProduct(gate, control.first, control.second,
+                                   qsim::SequentialFor(1), ss, bra, ket);
+      EXPECT_NEAR(result, expected, 1e-5);
+    }
+  }
+}
+
+TEST(UtilQsimTest, CombinePauliSumMasksWeights) {
+  PauliSum p_sum_a;
+  AddPauliTerm(1.0, "ZI", &p_sum_a);
+  AddPauliTerm(2.0, "XY", &p_sum_a);
+  AddPauliTerm(3.0, "II", &p_sum_a);
+  PauliSum p_sum_b;
+  AddPauliTerm(4.0, "XY", &p_sum_b);
+  AddPauliTerm(1e-6, "IZ", &p_sum_b);
+
+  std::vector<PauliSumMasks> sums(2);
+  ASSERT_EQ(PauliSumToMasks(p_sum_a, 2, &sums[0]), Status::OK());
+  ASSERT_EQ(PauliSumToMasks(p_sum_b, 2, &sums[1]), Status::OK());
+
+  // 0.5 * (ZI + 2XY + 3II) + 0.25 * (4XY + 1e-6IZ), the IZ term is dropped.
+  PauliSumMasks combined;
+  CombinePauliSumMasks(sums, {0.5, 0.25}, &combined);
+  EXPECT_NEAR(combined.identity_coeff, 1.5, 1e-5);
+  ASSERT_EQ(combined.x_masks, std::vector<uint64_t>({0, 3}));
+  ASSERT_EQ(combined.group_offsets, std::vector<int>({0, 1, 2}));
+  EXPECT_EQ(combined.z_masks, std::vector<uint64_t>({2, 1}));
+  EXPECT_NEAR(PauliMaskedTermCoefficient(combined, 0, 0), 0.5, 1e-5);
+  EXPECT_NEAR(PauliMaskedTermCoefficient(combined, 1, 1), 2.0, 1e-5);
+}
+
+TEST(UtilQsimTest, AccumulateOperatorMasksMatchesAccumulateOperators) {
+  const int num_qubits = 6;
+  QsimCircuit simple_circuit;
+  simple_circuit.num_qubits = num_qubits;
+  for (int q = 0; q < num_qubits; q++) {
+    simple_circuit.gates.push_back(
+        qsim::Cirq::XPowGate<float>::Create(0, q, 0.2 + 0.11 * q, 0.0));
+    simple_circuit.gates.push_back(
+        qsim::Cirq::ZPowGate<float>::Create(1, q, 0.4 - 0.05 * q, 0.0));
+  }
+  for (int q = 0; q + 1 < num_qubits; q++) {
+    simple_circuit.gates.push_back(
+        qsim::Cirq::CXPowGate<float>::Create(2 + q, q, q + 1, 0.7, 0.0));
+  }
+  auto fused_circuit = qsim::BasicGateFuser<qsim::IO, QsimGate>().FuseGates(
+      qsim::BasicGateFuser<qsim::IO, QsimGate>::Parameter(),
+      simple_circuit.num_qubits, simple_circuit.gates);
+
+  qsim::Simulator<qsim::SequentialFor> sim(1);
+  qsim::Simulator<qsim::SequentialFor>::StateSpace ss(1);
+  auto sv = ss.Create(num_qubits);
+  auto scratch = ss.Create(num_qubits);
+  auto ref_dest = ss.Create(num_qubits);
+  auto dest = ss.Create(num_qubits);
+  ss.SetStateZero(sv);
+  for (const qsim::GateFused<QsimGate>& fused_gate : fused_circuit) {
+    qsim::ApplyFusedGate(sim, fused_gate, sv);
+  }
+
+  PauliSum p_sum_a;
+  AddPauliTerm(0.5, "XYZIII", &p_sum_a);
+  AddPauliTerm(-1.25, "IIIZZI", &p_sum_a);
+  AddPauliTerm(2.0, "YYYYYY", &p_sum_a);
+  AddPauliTerm(0.2, "IIIIII", &p_sum_a);
+  PauliSum p_sum_b;
+  AddPauliTerm(-0.3, "IXXIIX", &p_sum_b);
+  AddPauliTerm(0.9, "IYXIIZ", &p_sum_b);
+  AddPauliTerm(1.1, "ZZZZZZ", &p_sum_b);
+
+  ASSERT_EQ(AccumulateOperators({p_sum_a, p_sum_b}, {0.5, -2.0}, sim, ss, sv,
+                                scratch, ref_dest),
+            Status::OK());
+
+  std::vector<PauliSumMasks> sums(2);
+  ASSERT_EQ(PauliSumToMasks(p_sum_a, num_qubits, &sums[0]), Status::OK());
+  ASSERT_EQ(PauliSumToMasks(p_sum_b, num_qubits, &sums[1]), Status::OK());
+  ASSERT_EQ(AccumulateOperatorMasks(sums, {0.5, -2.0}, qsim::SequentialFor(1),
+                                    ss, sv, dest),
+            Status::OK());
+
+  for (int i = 0; i < (1 << num_qubits); i++) {
+    EXPECT_NEAR(ss.GetAmpl(dest, i).real(), ss.GetAmpl(ref_dest, i).real(),
+                1e-5);
+    EXPECT_NEAR(ss.GetAmpl(dest, i).imag(), ss.GetAmpl(ref_dest, i).imag(),
+                1e-5);
+  }
+}
+
+TEST(UtilQsimTest, SampledExpectationMasksCompoundCase) {
+  // Prepare |+0> so that X on qubit 0 and Z on qubit 1 are deterministic.
+  // XZ and XI are sampled from the same shots.
+  QsimCircuit simple_circuit;
+  simple_circuit.num_qubits = 2;
+  simple_circuit.gates.push_back(
+      qsim::Cirq::YPowGate<float>::Create(0, 1, 0.5, 0.0));
+
+  qsim::Simulator<qsim::SequentialFor> sim(1);
+  qsim::Simulator<qsim::SequentialFor>::StateSpace ss(1);
+  auto sv = ss.Create(2);
+  auto scratch = ss.Create(2);
+  ss.SetStateZero(sv);
+  for (const QsimGate& gate : simple_circuit.gates) {
+    qsim::ApplyGate(sim, gate, sv);
+  }
+
+  PauliSum p_sum;
+  AddPauliTerm(0.5, "XZ", &p_sum);
+  AddPauliTerm(-2.0, "XI", &p_sum);
+  AddPauliTerm(3.0, "II", &p_sum);
+  PauliSumMasks masks;
+  ASSERT_EQ(PauliSumToMasks(p_sum, 2, &masks), Status::OK());
+  ASSERT_EQ(masks.basis_x_masks.size(), 1);
+
+  float exp_v = 0;
+  tensorflow::GuardedPhiloxRandom random_gen;
+  random_gen.Init(tensorflow::random::New64(), tensorflow::random::New64());
+  auto local_gen = random_gen.ReserveSamples32(100);
+  tensorflow::random::SimplePhilox rand_source(&local_gen);
+  ASSERT_EQ(ComputeSampledExpectationMasks(masks, sim, ss, sv, scratch, 100,
+                                           rand_source, &exp_v),
+            Status::OK());
+  EXPECT_NEAR(exp_v, 1.5, 1e-5);
+
+  // No samples leaves the estimate untouched.
+  exp_v = 0;
+  ASSERT_EQ(ComputeSampledExpectationMasks(masks, sim, ss, sv, scratch, 0,
+                                           rand_source, &exp_v),
+            Status::OK());
+  EXPECT_NEAR(exp_v, 0.0, 1e-5);
+}
+
 TEST(UtilQsimTest, ApplyGateDagger) {
   // Create circuit to prepare initial state.
   QsimCircuit simple_circuit;
@@ -642,124 +1022,170 @@ TEST(UtilQsimTest, AccumulateFusedCircuitsEmpty) {
   EXPECT_NEAR(ss.GetAmpl(dest, 3).real(), 0.0, 1e-5);
 }
 
-static void AssertWellBalanced(const std::vector<std::vector<int>>& n_reps,
-                               const int& num_threads,
-                               const std::vector<std::vector<int>>& offsets) {
-  auto max_work = std::vector<int>(n_reps.size(), -1);
-  for (int i = 0; i < n_reps.size(); i++) {
-    for (int j = 0; j < n_reps[0].size(); j++) {
-      max_work[i] = std::max(max_work[i], n_reps[i][j]);
-    }
+const uint64_t kBudget = uint64_t(4) << 30;
+
+TEST(UtilQsimTest, ScheduleCircuitsUniformSmall) {
+  std::vector<int> num_qubits(10, 8);
+  std::vector<uint64_t> costs(10, EstimateCircuitCost(8, 20));
+  CircuitSchedule schedule;
+  ScheduleCircuits(num_qubits, costs, 4, 1, kBudget, &schedule);
+  EXPECT_TRUE(schedule.wide.empty());
+  EXPECT_EQ(schedule.narrow, std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+}
+
+TEST(UtilQsimTest, ScheduleCircuitsMixed) {
+  // One 20 qubit circuit among many small ones runs over the whole pool.
+  std::vector<int> num_qubits = {8, 20, 8, 10, 8};
+  std::vector<uint64_t> costs;
+  for (const int nq : num_qubits) {
+    costs.push_back(EstimateCircuitCost(nq, 50));
   }
+  CircuitSchedule schedule;
+  ScheduleCircuits(num_qubits, costs, 4, 1, kBudget, &schedule);
+  EXPECT_EQ(schedule.wide, std::vector<int>({1}));
+  // Remaining circuits in decreasing order of cost.
+  EXPECT_EQ(schedule.narrow, std::vector<int>({3, 0, 2, 4}));
+}
 
-  for (int i = 0; i < n_reps.size(); i++) {
-    int sum = 0;
-    int prev_local_work = 0;
-    for (int k = 0; k < num_threads; k++) {
-      int local_work = (max_work[i] + num_threads - 1) / num_threads;
-      local_work += offsets[k][i];
-      sum += local_work;
-      if (k > 0) {
-        EXPECT_LT(abs(local_work - prev_local_work), 2);
-      }
-      prev_local_work = local_work;
+TEST(UtilQsimTest, ScheduleCircuitsSingleCircuit) {
+  CircuitSchedule schedule;
+  ScheduleCircuits({16}, {EstimateCircuitCost(16, 10)}, 4, 1, kBudget,
+                   &schedule);
+  EXPECT_EQ(schedule.wide, std::vector<int>({0}));
+  EXPECT_TRUE(schedule.narrow.empty());
+
+  // Too small to be worth spreading over threads.
+  ScheduleCircuits({4}, {EstimateCircuitCost(4, 10)}, 4, 1, kBudget,
+                   &schedule);
+  EXPECT_TRUE(schedule.wide.empty());
+  EXPECT_EQ(schedule.narrow, std::vector<int>({0}));
+}
+
+TEST(UtilQsimTest, ScheduleCircuitsMemory) {
+  // Cheap circuits too large to hold one state per thread run wide.
+  std::vector<int> num_qubits = {27, 27, 27, 27};
+  std::vector<uint64_t> costs(4, 1);
+  CircuitSchedule schedule;
+  ScheduleCircuits(num_qubits, costs, 2, 1, uint64_t(1) << 30, &schedule);
+  EXPECT_EQ(schedule.wide, std::vector<int>({0, 1, 2, 3}));
+  EXPECT_TRUE(schedule.narrow.empty());
+
+  // A larger budget lets them share the pool.
+  ScheduleCircuits(num_qubits, costs, 2, 1, kBudget, &schedule);
+  EXPECT_TRUE(schedule.wide.empty());
+
+  // The per thread limit shrinks with the number of threads and states.
+  num_qubits = {22, 22, 22, 22};
+  ScheduleCircuits(num_qubits, costs, 64, 3, kBudget, &schedule);
+  EXPECT_EQ(schedule.wide, std::vector<int>({0, 1, 2, 3}));
+  ScheduleCircuits(num_qubits, costs, 4, 3, kBudget, &schedule);
+  EXPECT_TRUE(schedule.wide.empty());
+
+  // A 26 qubit float state takes 512 MB, so two of them fit in 1 GB.
+  num_qubits = {26, 26, 26, 26};
+  ScheduleCircuits(num_qubits, costs, 2, 1, uint64_t(1) << 30, &schedule);
+  EXPECT_TRUE(schedule.wide.empty());
+
+  // With a single thread there is nothing to share.
+  num_qubits = {27, 27, 27, 27};
+  ScheduleCircuits(num_qubits, costs, 1, 1, uint64_t(1) << 30, &schedule);
+  EXPECT_TRUE(schedule.wide.empty());
+  EXPECT_EQ(schedule.narrow.size(), 4);
+}
+
+TEST(UtilQsimTest, WorkQueueHandsOutEveryTaskOnce) {
+  std::vector<int> tasks = {3, 1, 2};
+  WorkQueue queue(tasks);
+  int task;
+  ASSERT_TRUE(queue.Next(&task));
+  EXPECT_EQ(task, 3);
+  ASSERT_TRUE(queue.Next(&task));
+  EXPECT_EQ(task, 1);
+  ASSERT_TRUE(queue.Next(&task));
+  EXPECT_EQ(task, 2);
+  EXPECT_FALSE(queue.Next(&task));
+  EXPECT_FALSE(queue.Next(&task));
+}
+
+TEST(UtilQsimTest, RandomStreamsAreReproducible) {
+  RandomStreams streams;
+  streams.Seed(1234, 5678);
+  EXPECT_EQ(streams.NextCall(), 0);
+  EXPECT_EQ(streams.NextCall(), 1);
+
+  auto draw = [&streams](uint64_t call, uint64_t circuit, uint64_t block) {
+    auto gen = streams.Stream(call, circuit, block);
+    tensorflow::random::SimplePhilox rng(&gen);
+    return rng.Rand64();
+  };
+  const uint64_t first = draw(0, 3, 1);
+  EXPECT_EQ(draw(0, 3, 1), first);
+  EXPECT_NE(draw(1, 3, 1), first);
+  EXPECT_NE(draw(0, 4, 1), first);
+  EXPECT_NE(draw(0, 3, 2), first);
+
+  // Reseeding starts over from the first call.
+  streams.Seed(1234, 5678);
+  EXPECT_EQ(streams.NextCall(), 0);
+  EXPECT_EQ(draw(0, 3, 1), first);
+  streams.Seed(1234, 5679);
+  EXPECT_NE(draw(0, 3, 1), first);
+}
+
+TEST(UtilQsimTest, PlanShotBlocks) {
+  ShotBlocks plan;
+  PlanShotBlocks({kShotsPerStream + 1, 0, kShotsPerStream}, &plan);
+  EXPECT_EQ(plan.circuits, std::vector<int>({0, 0, 2}));
+  EXPECT_EQ(plan.blocks, std::vector<int>({0, 1, 0}));
+  EXPECT_EQ(plan.offsets, std::vector<int>({0, 2, 2, 3}));
+}
+
+TEST(UtilQsimTest, SortShotBlocksByCost) {
+  ShotBlocks plan;
+  PlanShotBlocks({2 * kShotsPerStream + 1, 0, kShotsPerStream, 3}, &plan);
+  // Trajectories of circuit 2 cost more than those of circuit 0.
+  std::vector<uint64_t> costs = {EstimateTrajectoryCost(6, 3),
+                                 EstimateTrajectoryCost(0, 0),
+                                 EstimateTrajectoryCost(8, 1),
+                                 EstimateTrajectoryCost(8, 1)};
+  EXPECT_EQ(costs[0], 4 << 6);
+  EXPECT_EQ(costs[2], 2 << 8);
+
+  std::vector<int> tasks = {0, 1, 2, 3, 4};
+  SortShotBlocksByCost(plan, costs, &tasks);
+  // The blocks of circuit 0 stay in order, its last one only has one shot.
+  EXPECT_EQ(tasks, std::vector<int>({3, 0, 1, 4, 2}));
+}
+
+TEST(UtilQsimTest, RunningStatsMerge) {
+  const std::vector<double> values = {0.5, -1.0, 2.0, 0.25, 3.0, -0.75};
+  RunningStats all;
+  RunningStats first;
+  RunningStats second;
+  for (size_t k = 0; k < values.size(); k++) {
+    all.Add(values[k]);
+    if (k < 2) {
+      first.Add(values[k]);
+    } else {
+      second.Add(values[k]);
     }
-    EXPECT_EQ(sum, max_work[i]);
   }
-}
 
-TEST(UtilQsimTest, BalanceTrajectorySimple) {
-  std::vector<std::vector<int>> n_reps = {{1, 3, 5, 10, 15},
-                                          {1, 10, 20, 30, 40},
-                                          {50, 70, 100, 100, 100},
-                                          {100, 200, 200, 200, 200}};
-  const int num_threads = 3;
-  // [num_threads, n_reps.size()]
-  std::vector<std::vector<int>> offsets = {
-      {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}};
-
-  BalanceTrajectory(n_reps, num_threads, &offsets);
-  AssertWellBalanced(n_reps, num_threads, offsets);
-}
-
-TEST(UtilQsimTest, BalanceTrajectoryPreventIdle) {
-  std::vector<std::vector<int>> n_reps = {{1, 1, 1, 1, 11},
-                                          {1, 1, 1, 11, 1},
-                                          {1, 1, 11, 1, 1},
-                                          {1, 11, 1, 1, 1},
-                                          {11, 1, 1, 1, 1}};
-  const int num_threads = 10;
-  // [num_threads, n_reps.size()]
-  std::vector<std::vector<int>> offsets = {
-      {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0},
-      {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0},
-      {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}};
-
-  BalanceTrajectory(n_reps, num_threads, &offsets);
-  AssertWellBalanced(n_reps, num_threads, offsets);
-}
-
-TEST(UtilQsimTest, BalanceTrajectoryLowRep) {
-  std::vector<std::vector<int>> n_reps = {
-      {1, 1, 1, 1, 1}, {1, 1, 1, 1, 1}, {1, 1, 1, 1, 1}, {1, 1, 1, 1, 1},
-      {1, 1, 1, 1, 1}, {1, 1, 1, 1, 1}, {1, 1, 1, 1, 1}};
-  const int num_threads = 5;
-  // [num_threads, n_reps.size()]
-  std::vector<std::vector<int>> offsets = {{0, 0, 0, 0, 0, 0, 0},
-                                           {0, 0, 0, 0, 0, 0, 0},
-                                           {0, 0, 0, 0, 0, 0, 0},
-                                           {0, 0, 0, 0, 0, 0, 0},
-                                           {0, 0, 0, 0, 0, 0, 0}};
-
-  BalanceTrajectory(n_reps, num_threads, &offsets);
-  AssertWellBalanced(n_reps, num_threads, offsets);
-}
-
-TEST(UtilQsimTest, BalanceTrajectoryFewHigh) {
-  std::vector<std::vector<int>> n_reps = {
-      {1, 100, 1, 1, 1}, {1, 1, 1, 1, 1000}, {1, 1, 1, 1, 1},   {1, 1, 1, 1, 1},
-      {1, 1, 1, 1, 1},   {1, 10, 1, 1, 1},   {1, 1, 1, 1, 1000}};
-  const int num_threads = 5;
-  // [num_threads, n_reps.size()]
-  std::vector<std::vector<int>> offsets = {{0, 0, 0, 0, 0, 0, 0},
-                                           {0, 0, 0, 0, 0, 0, 0},
-                                           {0, 0, 0, 0, 0, 0, 0},
-                                           {0, 0, 0, 0, 0, 0, 0},
-                                           {0, 0, 0, 0, 0, 0, 0}};
-
-  BalanceTrajectory(n_reps, num_threads, &offsets);
-  AssertWellBalanced(n_reps, num_threads, offsets);
-}
-
-TEST(UtilQsimTest, BalanceTrajectory1D) {
-  const int n_reps = 100;
-  const int num_threads = 5;
-  // [num_threads, batch_size]
-  std::vector<std::vector<int>> offsets = {{0, 0, 0, 0, 0, 0, 0},
-                                           {0, 0, 0, 0, 0, 0, 0},
-                                           {0, 0, 0, 0, 0, 0, 0},
-                                           {0, 0, 0, 0, 0, 0, 0},
-                                           {0, 0, 0, 0, 0, 0, 0}};
-
-  std::vector<std::vector<int>> tmp(offsets[0].size(),
-                                    std::vector<int>(2, n_reps));
-  BalanceTrajectory(n_reps, num_threads, &offsets);
-  AssertWellBalanced(tmp, num_threads, offsets);
-}
-
-TEST(UtilQsimTest, BalanceTrajectory1D_2) {
-  const int n_reps = 11;
-  const int num_threads = 10;
-  // [num_threads, batch_size]
-  std::vector<std::vector<int>> offsets = {
-      {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0},
-      {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0},
-      {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}};
-
-  std::vector<std::vector<int>> tmp(offsets[0].size(),
-                                    std::vector<int>(2, n_reps));
-  BalanceTrajectory(n_reps, num_threads, &offsets);
-  AssertWellBalanced(tmp, num_threads, offsets);
+  // The values sum to 4 and their squares to 14.875.
+  EXPECT_EQ(all.count, 6);
+  EXPECT_NEAR(all.mean, 4.0 / 6.0, 1e-12);
+  EXPECT_NEAR(all.Variance(), (14.875 - 16.0 / 6.0) / 5.0, 1e-12);
+  EXPECT_NEAR(all.SquaredError(), all.Variance() / 6.0, 1e-12);
+
+  first.Merge(second);
+  first.Merge(RunningStats());
+  EXPECT_EQ(first.count, all.count);
+  EXPECT_NEAR(first.mean, all.mean, 1e-12);
+  EXPECT_NEAR(first.m2, all.m2, 1e-12);
+
+  RunningStats one;
+  one.Add(1.5);
+  EXPECT_EQ(one.Variance(), 0.0);
 }
 
 }  // namespace
@@ -67,7 +67,11 @@ class Adjoint(differentiator.Differentiator):
 
         See `tfq.differentiators.Differentiator`. This has been partially
         re-implemented by the Adjoint differentiator to disallow the
-        `sampled_op` input.
+        `sampled_op` input. When `analytic_op` is the native C++ expectation
+        op and there is a single op per circuit, the forward pass computes
+        the Jacobian together with the expectations and the backward pass
+        only contracts it with the downstream gradients, instead of parsing
+        and simulating the circuits again.
 
 
         Args:
@@ -86,7 +90,38 @@ class Adjoint(differentiator.Differentiator):
                              "Adjoint method, please use analytic expectation"
                              " or choose another differentiator.")
 
-        return super().generate_differentiable_op(analytic_op=analytic_op)
+        op_wrapper_analytic = super().generate_differentiable_op(
+            analytic_op=analytic_op)
+        if not getattr(analytic_op, 'native_simulator', False):
+            return op_wrapper_analytic
+
+        @tf.custom_gradient
+        def op_wrapper_fused(programs, symbol_names, symbol_values,
+                             pauli_sums):
+            forward_pass_vals, jacobian = \
+                tfq_adj_grad_op.tfq_expectation_and_jacobian(
+                    programs, symbol_names, symbol_values, pauli_sums)
+
+            def gradient(grad):
+                return None, None, tf.einsum('bo,bos->bs', grad,
+                                             jacobian), None
+
+            return forward_pass_vals, gradient
+
+        def op_wrapper(programs, symbol_names, symbol_values, pauli_sums):
+            # The fused op runs one backward pass per op on every call, while
+            # tfq_adj_grad contracts all of them in a single weighted pass.
+            # It only pays off with a single op per circuit.
+            pauli_sums = tf.convert_to_tensor(pauli_sums,
+                                              dtype=tf.dtypes.string)
+            if pauli_sums.shape[-1] == 1:
+                return op_wrapper_fused(programs, symbol_names,
+                                        tf.cast(symbol_values, tf.float32),
+                                        pauli_sums)
+            return op_wrapper_analytic(programs, symbol_names, symbol_values,
+                                       pauli_sums)
+
+        return op_wrapper
 
     @tf.function
     def get_gradient_circuits(self, programs, symbol_names, symbol_values):
@@ -13,13 +13,20 @@
 # limitations under the License.
 # ==============================================================================
 """Tests for the differentiator abstract class."""
+import numpy as np
+from absl.testing import parameterized
 import tensorflow as tf
+import cirq
+import sympy
 
+from tensorflow_quantum.python import util
 from tensorflow_quantum.python.differentiators import adjoint
 from tensorflow_quantum.core.ops import circuit_execution_ops
+from tensorflow_quantum.core.ops import tfq_adj_grad_op
+from tensorflow_quantum.core.ops import tfq_simulate_ops
 
 
-class AdjointTest(tf.test.TestCase):
+class AdjointTest(tf.test.TestCase, parameterized.TestCase):
     """Test that we can properly subclass differentiator."""
 
     def test_instantiation(self):
@@ -42,6 +49,64 @@ class AdjointTest(tf.test.TestCase):
                                     "gradient circuits"):
             _ = dif.get_gradient_circuits(None, None, None)
 
+    @parameterized.parameters([{'n_ops': 1}, {'n_ops': 2}])
+    def test_native_op_matches_adj_grad(self, n_ops):
+        """The native op gives the same values with and without fusion."""
+        n_qubits = 4
+        batch_size = 3
+        symbol_names = ['alpha', 'beta']
+        qubits = cirq.GridQubit.rect(1, n_qubits)
+        circuit_batch, resolver_batch = \
+            util.random_symbol_circuit_resolver_batch(
+                qubits, symbol_names, batch_size)
+        symbol_values_array = np.array(
+            [[resolver[symbol]
+              for symbol in symbol_names]
+             for resolver in resolver_batch],
+            dtype=np.float32)
+        pauli_sums = [
+            util.random_pauli_sums(qubits, 3, n_ops) for _ in circuit_batch
+        ]
+
+        symbol_values = tf.convert_to_tensor(symbol_values_array)
+        programs = util.convert_to_tensor(circuit_batch)
+        names = tf.convert_to_tensor(symbol_names)
+        ops = util.convert_to_tensor(pauli_sums)
+        upstream = tf.convert_to_tensor(
+            np.random.uniform(size=(batch_size, n_ops)).astype(np.float32))
+
+        op = adjoint.Adjoint().generate_differentiable_op(
+            analytic_op=circuit_execution_ops.get_expectation_op())
+        with tf.GradientTape() as g:
+            g.watch(symbol_values)
+            expectations = op(programs, names, symbol_values, ops)
+            loss = tf.reduce_sum(expectations * upstream)
+        grads = g.gradient(loss, symbol_values)
+
+        expected = tfq_simulate_ops.tfq_simulate_expectation(
+            programs, names, symbol_values, ops)
+        expected_grads = tfq_adj_grad_op.tfq_adj_grad(programs, names,
+                                                      symbol_values, ops,
+                                                      upstream)
+        self.assertAllClose(expectations, expected, atol=1e-5)
+        self.assertAllClose(grads, expected_grads, atol=1e-4)
+
+    def test_other_backend_keeps_analytic_op(self):
+        """Only the native op is replaced by the fused op."""
+        qubit = cirq.GridQubit(0, 0)
+        circuit = util.convert_to_tensor(
+            [cirq.Circuit(cirq.X(qubit)**sympy.Symbol('alpha'))])
+        psums = util.convert_to_tensor([[cirq.Z(qubit)]])
+        values = tf.convert_to_tensor([[0.123]])
+
+        def analytic_op(programs, symbol_names, symbol_values, pauli_sums):
+            del programs, symbol_names, pauli_sums  # Unused.
+            return tf.ones_like(symbol_values)
+
+        op = adjoint.Adjoint().generate_differentiable_op(
+            analytic_op=analytic_op)
+        self.assertAllClose(op(circuit, ['alpha'], values, psums), [[1.0]])
+
 
 if __name__ == '__main__':
     tf.test.main()